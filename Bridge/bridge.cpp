@@ -0,0 +1,606 @@
+/*
+ * Bridge from the MQTT uplink to the shelter database, for MainBoards
+ * built with UPLINK_MQTT.
+ *
+ *   bridge [options]
+ *
+ * Subscribes to dogs/scan/+ on the broker (mosquitto on the server, or
+ * Tools/mqttbroker for a test). A scan is "<rfid> <action>[ <version>]"
+ * from the board named in the topic and changes the record the way the
+ * web server's /add/<rfid>/<action>[/<version>] does, version check and
+ * 409 included. The answer goes back on dogs/reply/<board> as
+ * "<rfid> <code> <status> <version>". Scans that came in during one pass
+ * of the loop are written in one transaction, as in Gateway/, and
+ * acknowledged to the broker once committed.
+ *
+ * Every -p ms the change counter the web server keeps in the database
+ * (changes.n) is read; when it has moved, every record whose version
+ * changed is published on dogs/status as "<rfid> <status> <version>", so
+ * the boards hear about adoptions on the web site, admin edits and other
+ * readers' scans.
+ *
+ * Counters are printed every -s seconds and on SIGUSR1.
+ */
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#define MQTT_MAX_PACKET 1024
+#include "../Common/mqtt.h"
+
+namespace {
+
+typedef uint64_t ns_t;
+
+const ns_t US = 1000;
+const ns_t MS = 1000 * US;
+const ns_t SEC = 1000 * MS;
+
+/******************************************************************* Options ********************************************************************/
+
+struct Options {
+	std::string database = "/data/dogs.db";
+	std::string broker = "127.0.0.1";
+	std::string port = "1883";
+	std::string client = "bridge";
+	unsigned batch = 256;                   // most scans in one transaction
+	unsigned busy_ms = 20;                  // wait for the web server's lock, then retry on the next pass
+	unsigned poll_ms = 250;                 // change counter checks
+	unsigned keepalive_s = 60;
+	unsigned stats_s = 0;                   // 0 = only on SIGUSR1
+	bool verbose = false;
+};
+
+Options opt;
+
+ns_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ns_t)ts.tv_sec * SEC + ts.tv_nsec;
+}
+
+/******************************************************************* Broker ********************************************************************/
+
+int sock = -1;
+bool up;                                    // CONNACK received
+mqtt_parser parser;
+ns_t sent_at;                               // last packet out, for the keep-alive
+int epfd = -1;
+
+uint64_t connects;
+uint64_t lost;                              // connections that broke
+
+void broker_close()
+{
+	if (sock < 0) return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+	close(sock);
+	sock = -1;
+	up = false;
+	lost++;
+	std::fprintf(stderr, "bridge: lost %s:%s, retrying\n", opt.broker.c_str(), opt.port.c_str());
+}
+
+/* The packets are small and the broker is on the same machine or the
+   LAN, so a blocking write is fine */
+void broker_send(const uint8_t *p, size_t n)
+{
+	while (sock >= 0 && n > 0) {
+		ssize_t w = send(sock, p, n, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) {
+			broker_close();
+			return;
+		}
+		p += w;
+		n -= w;
+	}
+	sent_at = now_ns();
+}
+
+void publish(const std::string &topic, const std::string &payload)
+{
+	std::vector<uint8_t> out(5 + 2 + topic.size() + payload.size());
+	size_t n = mqtt_publish(out.data(), 0, 0, topic.c_str(), (const uint8_t *)payload.data(), payload.size());
+	broker_send(out.data(), n);
+}
+
+/* Connects and sends CONNECT and the subscription, the CONNACK comes
+   through the loop. Retried every second while it fails. */
+bool broker_open()
+{
+	addrinfo hints = {}, *res = nullptr;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(opt.broker.c_str(), opt.port.c_str(), &hints, &res) != 0) return false;
+
+	int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) return false;
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	sock = fd;
+	parser = mqtt_parser{};
+
+	uint8_t out[128];
+	size_t n = mqtt_connect(out, opt.client.c_str(), opt.keepalive_s);
+	n += mqtt_subscribe(out + n, 1, "dogs/scan/+", 1);
+	broker_send(out, n);
+	return sock >= 0;
+}
+
+/******************************************************************* Database ********************************************************************/
+
+sqlite3 *db;
+sqlite3_stmt *select_dog;
+sqlite3_stmt *update_dog;
+sqlite3_stmt *select_changes;
+sqlite3_stmt *select_all;
+
+struct Scan {
+	std::string board;
+	std::string rfid;
+	char action;                            // 'a', 's' or 't'
+	long version;                           // -1 without
+	uint16_t packet_id;                     // acknowledged after the commit, 0 at QoS 0
+	ns_t read_at;
+};
+
+std::vector<Scan> pending;
+
+uint64_t scans;                             // by answer
+uint64_t conflicts;
+uint64_t unknown;
+uint64_t malformed;
+uint64_t transactions;
+uint64_t busy;                              // passes that found the database locked
+uint64_t pushes;
+ns_t latency_max, latency_sum;
+uint64_t latency_count;
+uint64_t scans_reported;
+ns_t last_report;
+
+bool exec(const char *sql)
+{
+	char *err = NULL;
+	if (sqlite3_exec(db, sql, NULL, NULL, &err) == SQLITE_OK) return true;
+	std::fprintf(stderr, "bridge: %s: %s\n", sql, err ? err : sqlite3_errmsg(db));
+	sqlite3_free(err);
+	return false;
+}
+
+/* Same as the web server's upgrade_schema(): the version column, WAL, the
+   rfid index and the change counter its triggers keep */
+void upgrade_schema()
+{
+	sqlite3_stmt *s;
+	bool found = false;
+	if (sqlite3_prepare_v2(db, "PRAGMA table_info(dogs)", -1, &s, NULL) == SQLITE_OK) {
+		while (sqlite3_step(s) == SQLITE_ROW) {
+			if (std::strcmp((const char *)sqlite3_column_text(s, 1), "version") == 0) found = true;
+		}
+		sqlite3_finalize(s);
+	}
+	if (!found) exec("ALTER TABLE dogs ADD COLUMN version INTEGER NOT NULL DEFAULT 0");
+	exec("PRAGMA journal_mode=WAL");
+	exec("PRAGMA synchronous=NORMAL");
+	exec("CREATE INDEX IF NOT EXISTS dogs_rfid ON dogs (rfid);"
+		"CREATE TABLE IF NOT EXISTS changes (n INTEGER NOT NULL);"
+		"INSERT INTO changes (n) SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM changes);"
+		"CREATE TRIGGER IF NOT EXISTS dogs_updated AFTER UPDATE ON dogs BEGIN UPDATE changes SET n = n + 1; END;"
+		"CREATE TRIGGER IF NOT EXISTS dogs_inserted AFTER INSERT ON dogs BEGIN UPDATE changes SET n = n + 1; END;"
+		"CREATE TRIGGER IF NOT EXISTS dogs_deleted AFTER DELETE ON dogs BEGIN UPDATE changes SET n = n + 1; END;");
+}
+
+bool open_database()
+{
+	if (sqlite3_open_v2(opt.database.c_str(), &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		std::fprintf(stderr, "bridge: %s: %s\n", opt.database.c_str(), sqlite3_errmsg(db));
+		return false;
+	}
+	sqlite3_busy_timeout(db, opt.busy_ms);
+	upgrade_schema();
+
+	if (sqlite3_prepare_v2(db, "SELECT adopted, version FROM dogs WHERE rfid = ?1", -1, &select_dog, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "UPDATE dogs SET adopted = ?2, version = version + 1 WHERE rfid = ?1 AND version = ?3", -1, &update_dog, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "SELECT n FROM changes", -1, &select_changes, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "SELECT rfid, adopted, version FROM dogs", -1, &select_all, NULL) != SQLITE_OK) {
+		std::fprintf(stderr, "bridge: %s: %s\n", opt.database.c_str(), sqlite3_errmsg(db));
+		return false;
+	}
+	return true;
+}
+
+/* Reads the record, false on a database error */
+bool read_dog(const std::string &rfid, bool *found, int *adopted, long *version)
+{
+	sqlite3_bind_text(select_dog, 1, rfid.c_str(), -1, SQLITE_TRANSIENT);
+	int rc = sqlite3_step(select_dog);
+	*found = rc == SQLITE_ROW;
+	if (*found) {
+		*adopted = sqlite3_column_int(select_dog, 0);
+		*version = sqlite3_column_int64(select_dog, 1);
+	}
+	sqlite3_reset(select_dog);
+	return rc == SQLITE_ROW || rc == SQLITE_DONE;
+}
+
+/* One scan inside the transaction, like apply_scan() in Webserver/flaskapp.py.
+   Returns the reply payload, empty on a database error. */
+std::string apply(const Scan &sc)
+{
+	bool found;
+	int adopted = 0;
+	long version = 0;
+	if (!read_dog(sc.rfid, &found, &adopted, &version)) return "";
+	if (!found) {
+		unknown++;
+		return sc.rfid + " 404 - 0";
+	}
+
+	int code = 200;
+	if (sc.version >= 0 && sc.version != version) {
+		code = 409;
+	} else {
+		int to = (sc.action == 't') ? !adopted : (sc.action == 'a');
+		sqlite3_bind_text(update_dog, 1, sc.rfid.c_str(), -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(update_dog, 2, to);
+		sqlite3_bind_int64(update_dog, 3, version);
+		int rc = sqlite3_step(update_dog);
+		sqlite3_reset(update_dog);
+		if (rc != SQLITE_DONE) return "";
+		if (sqlite3_changes(db) > 0) {
+			adopted = to;
+			version++;
+		} else {                            // can't happen inside BEGIN IMMEDIATE, but answer what is there
+			code = 409;
+			if (!read_dog(sc.rfid, &found, &adopted, &version)) return "";
+		}
+	}
+	if (code == 409) conflicts++;
+	else scans++;
+	return sc.rfid + " " + std::to_string(code) + " " + (adopted ? "a" : "s") + " " + std::to_string(version);
+}
+
+/* Writes up to opt.batch pending scans in one transaction, then answers
+   and acknowledges them. If the web server holds the lock they stay
+   pending for the next pass. Scans read before the broker went away are
+   still written; the board gets no answer to them, as for a GET that
+   timed out. */
+void commit_pending()
+{
+	if (pending.empty()) return;
+
+	size_t n = std::min<size_t>(pending.size(), opt.batch);
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+		busy++;
+		return;
+	}
+
+	std::vector<std::string> replies(n);
+	for (size_t i = 0; i < n; i++) {
+		replies[i] = apply(pending[i]);
+		if (replies[i].empty()) {
+			std::fprintf(stderr, "bridge: scan %s: %s\n", pending[i].rfid.c_str(), sqlite3_errmsg(db));
+			exec("ROLLBACK");
+			busy++;
+			return;
+		}
+	}
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		exec("ROLLBACK");
+		busy++;
+		return;
+	}
+	transactions++;
+
+	ns_t t = now_ns();
+	for (size_t i = 0; i < n; i++) {
+		const Scan &sc = pending[i];
+		publish("dogs/reply/" + sc.board, replies[i]);
+		if (sc.packet_id) {
+			uint8_t out[4];
+			broker_send(out, mqtt_ack(out, MQTT_PUBACK, sc.packet_id));
+		}
+		ns_t latency = t - sc.read_at;
+		latency_max = std::max(latency_max, latency);
+		latency_sum += latency;
+		latency_count++;
+		if (opt.verbose) std::printf("%s: %s -> %s, %.2f ms\n", sc.board.c_str(), sc.rfid.c_str(), replies[i].c_str(), latency / (double)MS);
+	}
+	pending.erase(pending.begin(), pending.begin() + n);
+}
+
+/******************************************************************* Status pushes ********************************************************************/
+
+long long changes_seen = -1;
+std::map<std::string, long long> versions;  // of every record as last published
+
+/* Publishes the records whose version moved since the last look. The
+   first look only takes note. */
+void push_changes()
+{
+	if (!up) return;
+
+	long long n = -1;
+	if (sqlite3_step(select_changes) == SQLITE_ROW) n = sqlite3_column_int64(select_changes, 0);
+	sqlite3_reset(select_changes);
+	if (n < 0 || n == changes_seen) return;
+
+	bool first = changes_seen < 0;
+	changes_seen = n;
+	while (sqlite3_step(select_all) == SQLITE_ROW) {
+		const char *rfid = (const char *)sqlite3_column_text(select_all, 0);
+		if (rfid == NULL) continue;
+		int adopted = sqlite3_column_int(select_all, 1);
+		long long version = sqlite3_column_int64(select_all, 2);
+
+		auto v = versions.find(rfid);
+		if (v != versions.end() && v->second == version) continue;
+		versions[rfid] = version;
+		if (first) continue;
+
+		publish("dogs/status", std::string(rfid) + " " + (adopted ? "a" : "s") + " " + std::to_string(version));
+		pushes++;
+		if (opt.verbose) std::printf("status: %s %s %lld\n", rfid, adopted ? "adopted" : "surrendered", version);
+	}
+	sqlite3_reset(select_all);
+}
+
+/******************************************************************* Packets ********************************************************************/
+
+/* dogs/scan/<board>: "<rfid> <action>[ <version>]" */
+void scan_received(const std::string &topic, const std::string &payload, uint16_t packet_id)
+{
+	char rfid[16] = "", action = 0;
+	long version = -1;
+	Scan sc;
+	sc.board = topic.substr(std::strlen("dogs/scan/"));
+	int n = std::sscanf(payload.c_str(), "%15s %c %ld", rfid, &action, &version);
+	if (n < 2 || std::strchr("ast", action) == NULL || sc.board.empty() || sc.board.find('/') != std::string::npos) {
+		malformed++;
+		if (packet_id) {                    // nothing to retry
+			uint8_t out[4];
+			broker_send(out, mqtt_ack(out, MQTT_PUBACK, packet_id));
+		}
+		return;
+	}
+	sc.rfid = rfid;
+	sc.action = action;
+	sc.version = (n == 3) ? version : -1;
+	sc.packet_id = packet_id;
+	sc.read_at = now_ns();
+	pending.push_back(sc);
+}
+
+void packet()
+{
+	switch (parser.header & 0xF0) {
+		case MQTT_CONNACK:
+		if (parser.len >= 2 && parser.body[1] == 0) {
+			up = true;
+			connects++;
+			std::fprintf(stderr, "bridge: connected to %s:%s\n", opt.broker.c_str(), opt.port.c_str());
+		} else {
+			std::fprintf(stderr, "bridge: broker refused the connection (%u)\n", parser.len >= 2 ? parser.body[1] : 0);
+			broker_close();
+		}
+		break;
+
+		case MQTT_PUBLISH: {
+			const char *topic;
+			const uint8_t *payload;
+			uint16_t topic_len, len, id;
+			if (!mqtt_publish_parts(&parser, &topic, &topic_len, &payload, &len, &id)) break;
+			std::string t(topic, topic_len);
+			if (t.compare(0, 10, "dogs/scan/") == 0) scan_received(t, std::string((const char *)payload, len), id);
+			break;
+		}
+	}
+}
+
+void broker_readable()
+{
+	uint8_t buf[4096];
+	ssize_t n = read(sock, buf, sizeof buf);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (n <= 0) {
+		broker_close();
+		return;
+	}
+	for (ssize_t i = 0; i < n && sock >= 0; i++) {
+		if (mqtt_parse(&parser, buf[i])) packet();
+	}
+}
+
+/******************************************************************* Counters ********************************************************************/
+
+void report()
+{
+	ns_t t = now_ns();
+	double s = (t - last_report) / (double)SEC;
+	last_report = t;
+
+	uint64_t answered = scans + conflicts + unknown;
+	std::printf("%s  scans %llu (%.1f/s), 409 %llu, 404 %llu, malformed %llu, commit avg %.2f ms max %.2f ms\n",
+		up ? "up" : "down", (unsigned long long)scans, (answered - scans_reported) / s, (unsigned long long)conflicts,
+		(unsigned long long)unknown, (unsigned long long)malformed,
+		latency_count ? latency_sum / (double)latency_count / MS : 0.0, latency_max / (double)MS);
+	std::printf("%llu transactions, %llu passes found the database locked, %zu pending, %llu status pushes, "
+		"%llu connects, %llu lost, %u skipped\n\n",
+		(unsigned long long)transactions, (unsigned long long)busy, pending.size(), (unsigned long long)pushes,
+		(unsigned long long)connects, (unsigned long long)lost, parser.oversize);
+	std::fflush(stdout);
+	scans_reported = answered;
+	latency_sum = 0;
+	latency_count = 0;
+}
+
+/******************************************************************* Main ********************************************************************/
+
+[[noreturn]] void usage()
+{
+	std::fprintf(stderr,
+		"usage: bridge [options]\n"
+		"  -d FILE        database (/data/dogs.db)\n"
+		"  -m HOST[:PORT] broker (127.0.0.1:1883)\n"
+		"  -i ID          client ID at the broker (bridge)\n"
+		"  -n N           most scans per transaction (256)\n"
+		"  -l MS          wait this long for the web server's lock (20)\n"
+		"  -p MS          check for changes to publish this often (250)\n"
+		"  -s SEC         print the counters this often, also on SIGUSR1\n"
+		"  -v             print every scan and status change\n");
+	std::exit(2);
+}
+
+void parse(int argc, char **argv)
+{
+	int c;
+	while ((c = getopt(argc, argv, "d:m:i:n:l:p:s:vh")) != -1) {
+		switch (c) {
+			case 'd': opt.database = optarg; break;
+			case 'm': {
+				std::string m = optarg;
+				size_t colon = m.rfind(':');
+				opt.broker = m.substr(0, colon);
+				if (colon != std::string::npos) opt.port = m.substr(colon + 1);
+				break;
+			}
+			case 'i': opt.client = optarg; break;
+			case 'n': opt.batch = std::max(1, std::atoi(optarg)); break;
+			case 'l': opt.busy_ms = std::atoi(optarg); break;
+			case 'p': opt.poll_ms = std::max(10, std::atoi(optarg)); break;
+			case 's': opt.stats_s = std::atoi(optarg); break;
+			case 'v': opt.verbose = true; break;
+			default: usage();
+		}
+	}
+	if (optind != argc || opt.broker.empty()) usage();
+}
+
+enum { EV_BROKER = 0, EV_SIGNAL = 1, EV_TICK = 2 };
+
+void watch(int fd, int id)
+{
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = id;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	parse(argc, argv);
+	if (!open_database()) return 2;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	watch(sigfd, EV_SIGNAL);
+
+	/* every -p ms: changes to publish; about once a second: reconnect,
+	   keep-alive, counters */
+	int tick = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	itimerspec period = { { opt.poll_ms / 1000, (long)(opt.poll_ms % 1000) * 1000000 }, { 0, 1 } };
+	timerfd_settime(tick, 0, &period, NULL);
+	watch(tick, EV_TICK);
+
+	if (!broker_open()) std::fprintf(stderr, "bridge: %s:%s: %s, retrying\n", opt.broker.c_str(), opt.port.c_str(), std::strerror(errno));
+
+	last_report = now_ns();
+	ns_t last_second = last_report;
+	unsigned seconds = 0;
+	bool running = true;
+
+	while (running) {
+		epoll_event events[8];
+		int n = epoll_wait(epfd, events, 8, pending.empty() ? -1 : (int)opt.busy_ms);
+		if (n < 0 && errno != EINTR) {
+			std::perror("bridge: epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			uint64_t id = events[i].data.u64;
+
+			if (id == EV_BROKER) {
+				if (sock >= 0) broker_readable();
+				if (pending.size() >= opt.batch) commit_pending();
+			} else if (id == EV_SIGNAL) {
+				signalfd_siginfo si;
+				if (read(sigfd, &si, sizeof si) != sizeof si) continue;
+				if (si.ssi_signo == SIGUSR1) report();
+				else running = false;
+			} else if (id == EV_TICK) {
+				uint64_t expirations;
+				if (read(tick, &expirations, sizeof expirations) != sizeof expirations) continue;
+				push_changes();
+
+				ns_t t = now_ns();
+				if (t - last_second < SEC) continue;
+				last_second = t;
+				if (sock < 0) broker_open();
+				else if (up && t - sent_at >= opt.keepalive_s * SEC / 2) {
+					uint8_t out[2];
+					broker_send(out, mqtt_empty(out, MQTT_PINGREQ));
+				}
+				if (opt.stats_s && ++seconds % opt.stats_s == 0) report();
+			}
+		}
+
+		/* everything read in this pass goes out in one transaction */
+		commit_pending();
+	}
+
+	while (!pending.empty()) {
+		size_t before = pending.size();
+		commit_pending();
+		if (pending.size() == before) break;
+	}
+	report();
+
+	if (sock >= 0) {
+		uint8_t out[2];
+		broker_send(out, mqtt_empty(out, MQTT_DISCONNECT));
+		close(sock);
+	}
+	sqlite3_finalize(select_dog);
+	sqlite3_finalize(update_dog);
+	sqlite3_finalize(select_changes);
+	sqlite3_finalize(select_all);
+	sqlite3_close(db);
+	return 0;
+}
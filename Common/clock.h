@@ -0,0 +1,137 @@
+/*
+ * CPU clock and every timer, baud and ADC setting derived from it.
+ *
+ * The boards run on the 8 MHz internal oscillator. For a crystal, set the
+ * fuses and build with -DF_CPU=16000000UL (or 20000000UL); the numbers
+ * below follow, and a target the clock can't reach closely enough stops
+ * the build with #error instead of running off-frequency.
+ *
+ * Include it before any AVR header, <util/delay.h> needs F_CPU.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+/* |actual - target| in 1/1000 of target */
+#define CLOCK_ERROR_PERMILLE(actual, target) \
+	(((actual) > (target) ? (actual) - (target) : (target) - (actual)) * 1000 / (target))
+
+/****** Scheduler tick: timer0 CTC, 1 ms ******/
+
+#define TICK_HZ             1000UL
+#define TICK_TOL_PERMILLE   5           // the tick is the time base of every timeout
+
+#if F_CPU / 8 / TICK_HZ <= 256
+#define TIMER0_PRESCALE     8UL
+#define TIMER0_CS           2           // CS02..CS00
+#elif F_CPU / 64 / TICK_HZ <= 256
+#define TIMER0_PRESCALE     64UL
+#define TIMER0_CS           3
+#elif F_CPU / 256 / TICK_HZ <= 256
+#define TIMER0_PRESCALE     256UL
+#define TIMER0_CS           4
+#else
+#error "clock.h: F_CPU too fast for a 1 ms timer0 tick"
+#endif
+
+#define TIMER0_TOP          ((F_CPU + TIMER0_PRESCALE * TICK_HZ / 2) / (TIMER0_PRESCALE * TICK_HZ) - 1)
+
+#if CLOCK_ERROR_PERMILLE((TIMER0_TOP + 1) * TIMER0_PRESCALE, F_CPU / TICK_HZ) > TICK_TOL_PERMILLE
+#error "clock.h: no timer0 setting gives a 1 ms tick within 0.5% at this F_CPU"
+#endif
+
+/****** USARTs ******/
+
+/* Divisor for baud with 16 (normal) or 8 (U2X) samples per bit, rounded */
+#define UBRR_FOR(baud, samples)     ((F_CPU + (baud) * (samples) / 2) / ((baud) * (samples)) - 1)
+#define BAUD_ACTUAL(baud, samples)  (F_CPU / ((samples) * (UBRR_FOR(baud, samples) + 1)))
+#define BAUD_ERROR(baud, samples)   CLOCK_ERROR_PERMILLE(BAUD_ACTUAL(baud, samples), baud)
+#define BAUD_TOL_PERMILLE   20          // 2%, both ends of the line add up
+
+/* Reader link (UART0 on every board, XBee or wire) */
+#ifndef LINK_BAUD
+#define LINK_BAUD           9600UL
+#endif
+
+#if BAUD_ERROR(LINK_BAUD, 16) <= BAUD_TOL_PERMILLE && UBRR_FOR(LINK_BAUD, 16) <= 4095
+#define LINK_U2X            0
+#define LINK_UBRR           UBRR_FOR(LINK_BAUD, 16)
+#elif BAUD_ERROR(LINK_BAUD, 8) <= BAUD_TOL_PERMILLE && UBRR_FOR(LINK_BAUD, 8) <= 4095
+#define LINK_U2X            1
+#define LINK_UBRR           UBRR_FOR(LINK_BAUD, 8)
+#else
+#error "clock.h: LINK_BAUD is more than 2% off at this F_CPU, with or without U2X"
+#endif
+
+/* ESP8266 AT port (MainBoard UART1) */
+#ifndef WIFI_BAUD
+#define WIFI_BAUD           9600UL
+#endif
+
+#if BAUD_ERROR(WIFI_BAUD, 16) <= BAUD_TOL_PERMILLE && UBRR_FOR(WIFI_BAUD, 16) <= 4095
+#define WIFI_U2X            0
+#define WIFI_UBRR           UBRR_FOR(WIFI_BAUD, 16)
+#elif BAUD_ERROR(WIFI_BAUD, 8) <= BAUD_TOL_PERMILLE && UBRR_FOR(WIFI_BAUD, 8) <= 4095
+#define WIFI_U2X            1
+#define WIFI_UBRR           UBRR_FOR(WIFI_BAUD, 8)
+#else
+#error "clock.h: WIFI_BAUD is more than 2% off at this F_CPU, with or without U2X"
+#endif
+
+/****** RFReceiver: 125 kHz carrier on OC2A ******/
+
+/* Timer2 fast PWM, TOP = OCR2A, toggling OC2A: two matches per period */
+#define CARRIER_HZ          125000UL
+#define CARRIER_TOL_PERMILLE 20         // well inside the tag's resonance
+
+#define CARRIER_TOP         ((F_CPU + CARRIER_HZ) / (2 * CARRIER_HZ) - 1)
+
+#if CARRIER_TOP > 255
+#error "clock.h: F_CPU too fast for the carrier on timer2 without a prescaler"
+#endif
+#if CLOCK_ERROR_PERMILLE(F_CPU / (2 * (CARRIER_TOP + 1)), CARRIER_HZ) > CARRIER_TOL_PERMILLE
+#error "clock.h: the 125 kHz carrier is more than 2% off at this F_CPU"
+#endif
+
+/****** RFReceiver: tag bit sampling on timer1 CTC ******/
+
+/* A little under the 512 us EM4100 bit (RF/64), so a bit is never skipped */
+#define SAMPLE_US           501UL
+#define SAMPLE_CYCLES       (F_CPU / 1000 * SAMPLE_US / 1000)
+
+#if SAMPLE_CYCLES <= 65536
+#define SAMPLE_PRESCALE     1UL
+#define SAMPLE_CS           1           // CS12..CS10
+#elif SAMPLE_CYCLES / 8 <= 65536
+#define SAMPLE_PRESCALE     8UL
+#define SAMPLE_CS           2
+#else
+#error "clock.h: F_CPU too fast for the sample period on timer1"
+#endif
+
+#define SAMPLE_TOP          ((SAMPLE_CYCLES + SAMPLE_PRESCALE / 2) / SAMPLE_PRESCALE - 1)
+
+/****** RFReceiver: ADC clock ******/
+
+/* ADPS bits for the fastest ADC clock at or under hz, 0 if even /128 is
+   too fast */
+#define ADC_PS_FOR(hz) \
+	(F_CPU / 2 <= (hz) ? 1 : F_CPU / 4 <= (hz) ? 2 : F_CPU / 8 <= (hz) ? 3 : \
+	 F_CPU / 16 <= (hz) ? 4 : F_CPU / 32 <= (hz) ? 5 : F_CPU / 64 <= (hz) ? 6 : \
+	 F_CPU / 128 <= (hz) ? 7 : 0)
+
+#define ADC_HZ              200000UL    // single conversions, full 10 bit resolution
+#define ADC_FAST_HZ         250000UL    // free running for the slicer, ~52 us per sample at 8 MHz
+
+#define ADC_PS              ADC_PS_FOR(ADC_HZ)
+#define ADC_FAST_PS         ADC_PS_FOR(ADC_FAST_HZ)
+
+#if ADC_PS == 0 || ADC_FAST_PS == 0
+#error "clock.h: F_CPU too fast for the ADC even at /128"
+#endif
+
+#endif /* CLOCK_H */
@@ -0,0 +1,432 @@
+/*
+ * EM4100 reader front end and decoder: the 125 kHz carrier, the adaptive
+ * slicer on the antenna envelope, sampling and the Manchester decode.
+ * Used by RFReceiver and by MainBoard built with LOCAL_READER, which has
+ * its own coil instead of a reader on the link.
+ *
+ * Timer 2 drives the carrier on OC2A (PD7). Timer 1 takes a sample every
+ * sample_top counts (SAMPLE_US); the board's TIMER1_COMPA ISR calls
+ * read_value() and releases its decode task when that returns true, and
+ * the task calls em4100_decode().
+ *
+ * A window is EM4100_WINDOW samples, about a second, kept one bit per
+ * sample (250 bytes each). read_value() notes where 9 ones in a row end, the
+ * header candidates. There are two windows: while a full one is decoded
+ * sampling goes on into the other, so a window that doesn't decode costs
+ * nothing but itself, and a frame that runs over the end of one is read
+ * on into the next. manchester_done() tries the candidates until one
+ * passes the row and column parity and the stop bit.
+ *
+ * The first window after em4100_start() is also tried early, once it
+ * holds EM4100_EARLY samples (two frames, so one whole frame follows a
+ * header wherever the tag's frame started). A tag that has just come into
+ * the field is then read about 65 ms after the carrier goes on instead
+ * of a window later.
+ */
+
+#ifndef EM4100_H
+#define EM4100_H
+
+#include "clock.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "frame.h"
+#include "memstat.h"
+
+#define ANTENNA_ADC			7		// PA7, antenna envelope before the slicer
+#define EM4100_WINDOW		2000	// samples per window, a multiple of 8
+
+/****************************************************************** 125kHz wave ******************************************************************/
+
+static inline void frequency_init(void)
+{
+	DDRD |= (1 << PORTD7);
+	TCCR2A |= (1<<WGM20 | 1<<WGM21 | 1<<COM2A0);
+	TCCR2B |= (1<<WGM22 | 1<<CS20); //Fast PWM
+	OCR2A = CARRIER_TOP;		// toggles every other match, F_CPU / (2 * (CARRIER_TOP + 1)) = 125 kHz
+}
+
+static inline void carrier_on(void)
+{
+	TCCR2A |= (1 << COM2A0);		//OC2A toggles on compare match
+}
+
+static inline void carrier_off(void)
+{
+	TCCR2A &= ~(1 << COM2A0);		//release OC2A and hold the pin low
+	PORTD &= ~(1 << PORTD7);
+}
+
+/**************************************************************** Adaptive Slicer ****************************************************************/
+
+/* The digital input on PD2 slices the demodulated signal at a fixed
+   threshold, so a weak tag at the edge of range comes out as garbage.
+   With SLICER_ADC the envelope on ANTENNA_ADC is sampled by the free
+   running ADC instead. Two peak followers track its top and bottom (jump
+   to a new extreme, decay towards each other over about 256 samples) and
+   the sample is sliced against their mid-level with hysteresis of 1/8 of
+   the swing. The decoder reads the sliced level in place of PD2. */
+
+#ifndef SLICER_ADC
+#define SLICER_ADC			1		// 0 = digital input on PD2
+#endif
+#define SLICER_DECAY		8		// peak follower window, 2^n samples
+#define SLICER_MIN_SWING	8		// ADC counts below which there is no signal
+
+struct {
+	volatile uint8_t level;			// sliced signal, 0 or 1
+	uint16_t top;					// envelope peaks, 10.6 fixed point
+	uint16_t bottom;
+	uint16_t noise;					// mean distance from the current peak, 10.2
+	uint8_t min_swing;				// SLICER_MIN_SWING, tunable
+} slicer = { .min_swing = SLICER_MIN_SWING };
+
+#if SLICER_ADC
+
+static inline void slicer_start(void)
+{
+	slicer.top = 0;
+	slicer.bottom = 0xFFFF;			//first sample sets both
+	slicer.noise = 0;
+	slicer.level = 0;
+
+	ADMUX = (1 << REFS0) | ANTENNA_ADC;
+	ADCSRB = 0;												//free running
+	ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE) | (ADC_FAST_PS << ADPS0);	//ADC_FAST_HZ, 13 clocks per sample
+}
+
+static inline void slicer_stop(void)
+{
+	ADCSRA = (1 << ADEN) | (ADC_PS << ADPS0);				//back to single conversions
+	ADMUX = (1 << REFS0) | ANTENNA_ADC;
+}
+
+ISR(ADC_vect)
+{
+	uint16_t sample = ADC << 6;
+
+	if (slicer.top > slicer.bottom) {						//peaks decay towards each other
+		uint16_t step = (slicer.top - slicer.bottom) >> SLICER_DECAY;
+		slicer.top -= step;
+		slicer.bottom += step;
+	}
+	if (sample > slicer.top) slicer.top = sample;
+	if (sample < slicer.bottom) slicer.bottom = sample;
+
+	uint16_t swing = slicer.top - slicer.bottom;
+	uint16_t mid = slicer.bottom + swing / 2;
+
+	if (sample > mid + swing / 8) slicer.level = 1;
+	else if (sample < mid - swing / 8) slicer.level = 0;
+
+	uint16_t deviation = (slicer.level ? slicer.top - sample : sample - slicer.bottom) >> 4;
+	slicer.noise += (int16_t)(deviation - slicer.noise) >> 4;
+}
+
+#endif
+
+/* Peak to peak swing of the envelope, ADC counts */
+static inline uint16_t slicer_strength(void)
+{
+	uint16_t top, bottom;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		top = slicer.top;
+		bottom = slicer.bottom;
+	}
+	return (top > bottom) ? (top - bottom) >> 6 : 0;
+}
+
+/* Swing over the mean noise on the peaks, 255 = no measurable noise */
+static inline uint8_t slicer_snr(void)
+{
+	uint16_t top, bottom, noise;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		top = slicer.top;
+		bottom = slicer.bottom;
+		noise = slicer.noise;
+	}
+
+	if (top <= bottom) return 0;
+	uint16_t snr = ((top - bottom) >> 4) / (noise + 1);	//both 10.2
+	return (snr > 255) ? 255 : snr;
+}
+
+static inline uint8_t sliced_input(void)
+{
+#if SLICER_ADC
+	return slicer.level;
+#else
+	return (PIND & 0x04) >> 2;
+#endif
+}
+
+/************************************************************** Manchester Decoding **************************************************************/
+
+#define EM4100_CANDIDATES		20		// header candidates kept per window
+#define EM4100_MIN_CANDIDATES	8		// fewer is no tag, noise makes about 4 a window
+#define EM4100_TAIL				55		// samples after a header: 10 rows of 5 bits, 4 column parity, stop
+#define EM4100_EARLY			128		// samples of the first window tried as soon as they are in
+
+volatile uint16_t z;
+volatile uint8_t count;
+volatile uint8_t windows;			// windows filled since em4100_start()
+volatile bool parity_error;
+uint16_t ones_peak;					// most 9-ones header candidates in one window
+uint16_t sample_top = SAMPLE_TOP;	// timer 1 TOP, tunable: the sample period against the tag's bit clock
+
+/* What became of the sample windows, for tuning against real tags */
+struct {
+	uint16_t captures;					// windows filled
+	uint16_t noise;						// dropped by the slicer, swing under min_swing
+	uint16_t headers;					// 9-ones header candidates decoded
+	uint16_t parity_fails;				// candidates with a row or column parity error
+	uint16_t stop_fails;				// parity good, stop bit set
+	uint16_t rescans;					// windows with no good candidate
+	uint16_t reads;						// tags decoded
+	uint16_t overruns;					// windows sampled over before they were decoded
+} Decoder;
+
+/* Two windows, one filling while the other waits for the decoder */
+struct {
+	uint8_t data[2][EM4100_WINDOW / 8];	// sample i in bit i % 8 of data[w][i / 8]
+	unsigned int index[2][EM4100_CANDIDATES];	// first sample after each 9-ones header
+	uint8_t candidates[2];
+	uint16_t swing[2];					// largest slicer swing in the window, 10.6
+	volatile uint8_t fill;				// window being sampled into
+	volatile bool waiting;				// ready is ready for em4100_decode()
+	volatile uint8_t ready;				// the other one, or the first one early
+	volatile unsigned int ready_len;	// samples of it in, headers past that can't be read yet
+	int8_t cardID[10];
+	uint16_t strength;			//slicer figures for the last read
+	uint8_t snr;
+	
+}RFID;
+
+/* Sample i of window w. Past its end are the first EM4100_TAIL samples of
+   the other window, which followed it, so a frame that starts near the
+   end still decodes. Further on reads 1s, which fail the stop bit. */
+static inline int8_t em4100_sample(uint8_t w, unsigned int i)
+{
+	if (i >= EM4100_WINDOW) {
+		if (i >= EM4100_WINDOW + EM4100_TAIL) return 1;
+		i -= EM4100_WINDOW;
+		w ^= 1;
+	}
+	return (RFID.data[w][i / 8] >> (i % 8)) & 1;
+}
+
+static inline void timer1_init(void)
+{
+#if !SLICER_ADC
+	DDRD &= ~(1 << PIND2);		//Receiver input
+	PORTD |= 1 << PIND2;		// pull up resistor
+#endif
+	TCCR1B |= (1<<WGM12) | (SAMPLE_CS<<CS10);	//Timer 1 CTC
+	TCNT1 = 0;	// initialize counter
+	OCR1A = sample_top;		//Clear timer when it reaches this value, SAMPLE_US per sample
+}
+
+/* From the TIMER1_COMPA ISR. Sampling never stops for the decoder: a full
+   window is handed over EM4100_TAIL samples into the next one, true then
+   if it has enough header candidates. The first window is also handed
+   over at EM4100_EARLY if a header has turned up. */
+static inline bool read_value(void)
+{
+	uint8_t w = RFID.fill;
+	uint16_t i = z;
+	uint8_t mask = 1 << (i % 8);
+	
+	if (sliced_input()) {
+		RFID.data[w][i / 8] |= mask;
+		
+		if (++count == 9 && RFID.candidates[w] < EM4100_CANDIDATES) {	//9 consecutive 1s
+			RFID.index[w][RFID.candidates[w]++] = i + 1;
+			MEMSTAT_PEAK(ones_peak, RFID.candidates[w]);
+		}
+	}
+	else {
+		RFID.data[w][i / 8] &= ~mask;
+		count = 0;
+	}
+	
+#if SLICER_ADC
+	if (slicer.top > slicer.bottom && slicer.top - slicer.bottom > RFID.swing[w]) RFID.swing[w] = slicer.top - slicer.bottom;
+#endif
+	
+	if (++i == EM4100_WINDOW) {
+		if (RFID.waiting) {						//decoder a whole window behind
+			RFID.waiting = false;
+			Decoder.overruns++;
+		}
+		w ^= 1;
+		RFID.fill = w;
+		RFID.candidates[w] = 0;
+		RFID.swing[w] = 0;
+		i = 0;
+		windows++;
+		Decoder.captures++;
+	}
+	z = i;
+	
+	if (i == EM4100_TAIL && RFID.candidates[w ^ 1] >= EM4100_MIN_CANDIDATES) {
+		RFID.ready = w ^ 1;
+		RFID.ready_len = EM4100_WINDOW + EM4100_TAIL;
+		RFID.waiting = true;
+		return true;
+	}
+	if (windows == 0 && i == EM4100_EARLY && RFID.candidates[w] > 0) {
+		RFID.ready = w;
+		RFID.ready_len = EM4100_EARLY;
+		RFID.waiting = true;
+		return true;
+	}
+	return false;
+}
+
+/* One candidate: 10 rows of 4 bits and row parity, 4 column parity bits
+   and the stop bit from index on. The digits go to RFID.cardID. */
+static inline bool em4100_frame(uint8_t w, unsigned int index) {
+	
+	parity_error = false;
+	Decoder.headers++;
+	
+	volatile int row_parity[10] = {0};
+	volatile int col_parity[4] = {0};
+	volatile int row_check[10] = {0};
+	volatile int col_check[4] = {0};
+	
+	
+	for (int8_t i = 0; i < 10; i++) {					//10 parity bits = 50 total iterations
+		
+		volatile int8_t rfid_char = 0;
+		
+		for (int8_t j = 3; j >= 0; j--) {
+			int8_t decoded_data = em4100_sample(w, index);	//save each bit
+			rfid_char += decoded_data << j;				//shift 4 times to create 8 bit int
+			
+			row_check[i] += decoded_data;  //Miguel
+			row_check[i] = row_check[i] & 0x01;
+			col_check[j] += decoded_data;
+			col_check[j] = col_check[j] & 0x01;
+			
+			index++;                                    //increment the index 4 times
+			
+		}
+		
+		RFID.cardID[i] = rfid_char;				//save each character
+		
+		row_parity[i] = em4100_sample(w, index);	//save the row parity bit
+		index++;								//increment the index to the parity bit (5x)
+		
+	}
+	
+	
+	for (int8_t j = 3; j >= 0; j--) {
+		col_parity[j] = em4100_sample(w, index);
+		index++;
+	}
+	
+	volatile int stopbit = em4100_sample(w, index);
+	
+	for (int8_t i = 0; i < 10; i++) {
+		for (int8_t j = 3; j >= 0; j--) {
+	if(row_parity[i] != row_check[i] ) parity_error = true; //checking the row parity
+	if(col_parity[j] != col_check[j] ) parity_error = true; //checking the row parity
+		}
+	}
+	
+	if (parity_error) {
+		Decoder.parity_fails++;
+		return false;
+	}
+	if (stopbit != 0) {
+		Decoder.stop_fails++;
+		return false;
+	}
+	return true;
+}
+
+/* Tries the candidates of window w, len samples of it in, in order until
+   one decodes */
+static inline bool manchester_done(uint8_t w, unsigned int len) {
+#if SLICER_ADC
+	if ((RFID.swing[w] >> 6) < slicer.min_swing) {		//window of sliced noise
+		Decoder.noise++;
+		return false;
+	}
+#endif
+	
+	for (uint8_t k = 0; k < RFID.candidates[w]; k++) {
+		if (RFID.index[w][k] + EM4100_TAIL > len) break;
+		if (em4100_frame(w, RFID.index[w][k])) return true;
+	}
+	Decoder.rescans++;
+	return false;
+}
+
+/* Carrier, slicer and sampling on, from empty windows */
+static inline void em4100_start(void)
+{
+	RFID.fill = 0;
+	RFID.waiting = false;
+	RFID.candidates[0] = RFID.candidates[1] = 0;
+	RFID.swing[0] = RFID.swing[1] = 0;
+	count = 0;
+	z = 0;
+	windows = 0;
+	
+	carrier_on();
+#if SLICER_ADC
+	slicer_start();
+#endif
+	OCR1A = sample_top;
+	TCNT1 = 0;
+	TIFR1 = (1 << OCF1A);
+	TIMSK1 |= (1 << OCIE1A);		//sampling on
+}
+
+static inline void em4100_stop(void)
+{
+	TIMSK1 &= ~(1 << OCIE1A);
+#if SLICER_ADC
+	slicer_stop();
+#endif
+	carrier_off();
+}
+
+/* The last full window has been handed to the decoder and taken, for
+   stopping after a number of windows */
+static inline bool em4100_decoded(void)
+{
+	uint16_t i;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		i = z;
+	}
+	return i > EM4100_TAIL && !RFID.waiting;
+}
+
+/* From the decode task, while sampling goes on into the other window. On
+   a read the tag is in tag[]. The window is taken once: if sampling runs
+   past it meanwhile (an overrun), ready points elsewhere by the end. */
+static inline bool em4100_decode(uint8_t tag[TAG_BYTES])
+{
+	uint8_t w = RFID.ready;
+	bool read = RFID.waiting && manchester_done(w, RFID.ready_len);
+	
+	RFID.waiting = false;
+	if (!read) return false;
+	
+#if SLICER_ADC
+	RFID.strength = RFID.swing[w] >> 6;
+	RFID.snr = slicer_snr();
+#endif
+	
+	tag_pack_nibbles(RFID.cardID, tag);
+	Decoder.reads++;
+	return true;
+}
+
+#endif /* EM4100_H */
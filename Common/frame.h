@@ -0,0 +1,211 @@
+/*
+ * Binary framing for the reader -> MainBoard link (UART or XBee).
+ *
+ *   SYNC | LEN | ADDR | TYPE | SEQ | PAYLOAD[LEN] | CRC hi | CRC lo
+ *
+ * LEN counts payload bytes only. ADDR is the sending reader, so several
+ * readers can share one link (XBee network or an RS-485 bus on UART0).
+ * Command frames go the other way and carry the address of the board they
+ * are meant for.
+ * The CRC is CRC-16/CCITT (poly 0x1021, init 0xFFFF) over everything
+ * between SYNC and the CRC. A scan frame carries
+ * the 5 raw bytes of the EM4100 ID instead of 10 ASCII hex characters.
+ *
+ * Every firmware is built as a single translation unit, so this header
+ * carries the code as well as the declarations.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/* Address of this reader on the link, set per board at build time.
+   0 is the MainBoard. */
+#ifndef READER_ADDR
+#define READER_ADDR 1
+#endif
+
+#define FRAME_SYNC          0xA5
+#define FRAME_MAX_PAYLOAD   16
+#define FRAME_OVERHEAD      7           // sync, len, addr, type, seq, 2 crc bytes
+#define FRAME_MAX_SIZE      (FRAME_MAX_PAYLOAD + FRAME_OVERHEAD)
+
+#define TAG_BYTES           5           // 10 hex digits of an EM4100 ID
+
+typedef enum {
+	FRAME_SCAN      = 0x01,             // payload: raw tag ID
+	FRAME_TELEMETRY = 0x02,             // payload: free-form status bytes
+	FRAME_COMMAND   = 0x03,             // to the board at ADDR, payload: command byte
+	FRAME_CAPTURE   = 0x04              // payload: raw receiver samples, see RFReceiver
+} frame_type;
+
+static inline uint16_t frame_crc_update(uint16_t crc, uint8_t data)
+{
+	crc ^= (uint16_t)data << 8;
+	for (uint8_t i = 0; i < 8; i++) {
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
+/* Builds a frame into out[] (at least FRAME_MAX_SIZE bytes), returns its length */
+static inline uint8_t frame_encode(uint8_t out[], uint8_t addr, uint8_t type, uint8_t seq, const uint8_t payload[], uint8_t len)
+{
+	if (len > FRAME_MAX_PAYLOAD) len = FRAME_MAX_PAYLOAD;
+
+	uint8_t n = 0;
+	out[n++] = FRAME_SYNC;
+	out[n++] = len;
+	out[n++] = addr;
+	out[n++] = type;
+	out[n++] = seq;
+	for (uint8_t i = 0; i < len; i++) {
+		out[n++] = payload[i];
+	}
+
+	uint16_t crc = 0xFFFF;
+	for (uint8_t i = 1; i < n; i++) {
+		crc = frame_crc_update(crc, out[i]);
+	}
+	out[n++] = crc >> 8;
+	out[n++] = crc & 0xFF;
+	return n;
+}
+
+/* Receive side, fed one byte at a time from the USART ISR */
+
+typedef enum {
+	FRAME_WAIT_SYNC,
+	FRAME_WAIT_LEN,
+	FRAME_WAIT_ADDR,
+	FRAME_WAIT_TYPE,
+	FRAME_WAIT_SEQ,
+	FRAME_WAIT_PAYLOAD,
+	FRAME_WAIT_CRC_HI,
+	FRAME_WAIT_CRC_LO
+} frame_state;
+
+struct frame_parser {
+	uint8_t state;
+	uint8_t len;
+	uint8_t addr;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t pos;
+	uint16_t crc;
+	uint16_t rx_crc;
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	uint16_t crc_errors;                // frames rejected by the CRC check
+};
+
+/* Returns true once a complete frame with a good CRC has been received.
+   The frame stays in the parser until the next byte is fed in. */
+static inline bool frame_parse(struct frame_parser *p, uint8_t c)
+{
+	switch (p->state) {
+
+		case FRAME_WAIT_SYNC:
+		if (c == FRAME_SYNC) {
+			p->crc = 0xFFFF;
+			p->state = FRAME_WAIT_LEN;
+		}
+		return false;
+
+		case FRAME_WAIT_LEN:
+		if (c > FRAME_MAX_PAYLOAD) {    // can't be a frame, resync
+			p->state = (c == FRAME_SYNC) ? FRAME_WAIT_LEN : FRAME_WAIT_SYNC;
+			return false;
+		}
+		p->len = c;
+		p->pos = 0;
+		p->state = FRAME_WAIT_ADDR;
+		break;
+
+		case FRAME_WAIT_ADDR:
+		p->addr = c;
+		p->state = FRAME_WAIT_TYPE;
+		break;
+
+		case FRAME_WAIT_TYPE:
+		p->type = c;
+		p->state = FRAME_WAIT_SEQ;
+		break;
+
+		case FRAME_WAIT_SEQ:
+		p->seq = c;
+		p->state = (p->len > 0) ? FRAME_WAIT_PAYLOAD : FRAME_WAIT_CRC_HI;
+		break;
+
+		case FRAME_WAIT_PAYLOAD:
+		p->payload[p->pos++] = c;
+		if (p->pos >= p->len) p->state = FRAME_WAIT_CRC_HI;
+		break;
+
+		case FRAME_WAIT_CRC_HI:
+		p->rx_crc = (uint16_t)c << 8;
+		p->state = FRAME_WAIT_CRC_LO;
+		return false;
+
+		case FRAME_WAIT_CRC_LO:
+		p->rx_crc |= c;
+		p->state = FRAME_WAIT_SYNC;
+		if (p->rx_crc == p->crc) return true;
+		p->crc_errors++;
+		return false;
+
+		default:
+		p->state = FRAME_WAIT_SYNC;
+		return false;
+	}
+
+	p->crc = frame_crc_update(p->crc, c);
+	return false;
+}
+
+/* Tag ID conversions: 10 nibbles / hex characters <-> 5 raw bytes */
+
+static inline void tag_pack_nibbles(const int8_t nibbles[10], uint8_t tag[TAG_BYTES])
+{
+	for (uint8_t i = 0; i < TAG_BYTES; i++) {
+		tag[i] = (nibbles[2 * i] << 4) | (nibbles[2 * i + 1] & 0x0F);
+	}
+}
+
+static inline int8_t hex_value(char c)
+{
+	if ('0' <= c && c <= '9') return c - '0';
+	if ('A' <= c && c <= 'F') return c - 'A' + 10;
+	if ('a' <= c && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/* Returns false if hex[] holds anything but 10 hex digits */
+static inline bool tag_from_hex(const char hex[10], uint8_t tag[TAG_BYTES])
+{
+	for (uint8_t i = 0; i < TAG_BYTES; i++) {
+		int8_t hi = hex_value(hex[2 * i]);
+		int8_t lo = hex_value(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0) return false;
+		tag[i] = (hi << 4) | lo;
+	}
+	return true;
+}
+
+static inline char hex_digit(uint8_t n)
+{
+	return (n < 10) ? '0' + n : 'A' + n - 10;
+}
+
+/* Writes 10 upper case hex characters, no terminator. No lookup table, it
+   would sit in SRAM on the AVR. */
+static inline void tag_to_hex(const uint8_t tag[TAG_BYTES], char hex[10])
+{
+	for (uint8_t i = 0; i < TAG_BYTES; i++) {
+		hex[2 * i] = hex_digit(tag[i] >> 4);
+		hex[2 * i + 1] = hex_digit(tag[i] & 0x0F);
+	}
+}
+
+#endif /* FRAME_H */
@@ -0,0 +1,159 @@
+/*
+ * HD44780 character LCD in 4 bit mode, the same wiring on every board:
+ * D7..D4 on PA0..PA3, E on PA4, RS on PA5. Write only, so every
+ * instruction waits out its execution time instead of polling the busy
+ * flag: 1.52 ms for clear and home, 37 us for the rest.
+ *
+ * The instruction names (clear, home, on, setCursor | lineTwo, ...) are
+ * the boards' own and stay macros.
+ */
+
+#ifndef LCD_H
+#define LCD_H
+
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#define lcdDdr		DDRA		//Data direction
+#define lcdPort		PORTA
+#define lcdD7Bit	PORTA0		//LCD D7 (pin 14)
+#define lcdD6Bit	PORTA1		//LCD D6 (pin 13)
+#define lcdD5Bit	PORTA2		//LCD D5 (pin 12)
+#define lcdD4Bit	PORTA3		//LCD D4 (pin 11)
+#define lcdEBit		PORTA4		//LCD E (pin 6)
+#define lcdRSBit	PORTA5		//LCD RS (pin 4)
+
+#define lineOne			0x00                // Line 1
+#define lineTwo			0x40                // Line 2
+#define clear           0b00000001          // clears all characters
+#define home            0b00000010          // returns cursor to home
+#define entryMode       0b00000110          // moves cursor from left to right
+#define off      		0b00001000          // LCD off
+#define on       		0b00001100          // LCD on
+#define reset   		0b00110000          // reset the LCD
+#define bit4Mode 		0b00101000          // we are using 4 bits of data
+#define setCursor       0b10000000          //sets the position of cursor
+
+static inline void lcd_write(uint8_t byte)
+{
+	lcdPort &= ~(1 << lcdD7Bit);                        // assume that data is '0'
+	if (byte & 1 << 7) lcdPort |= (1 << lcdD7Bit);     // make data = '1' if necessary
+
+	lcdPort &= ~(1 << lcdD6Bit);                        // repeat for each data bit
+	if (byte & 1 << 6) lcdPort |= (1 << lcdD6Bit);
+
+	lcdPort &= ~(1 << lcdD5Bit);
+	if (byte & 1 << 5) lcdPort |= (1 << lcdD5Bit);
+
+	lcdPort &= ~(1 << lcdD4Bit);
+	if (byte & 1 << 4) lcdPort |= (1 << lcdD4Bit);
+
+	// write the data
+
+	lcdPort |= (1 << lcdEBit);                   // E high
+	_delay_us(1);                               // data setup
+	lcdPort &= ~(1 << lcdEBit);                // E low
+	_delay_us(1);                             // hold data
+}
+
+static inline void lcd_instruction(uint8_t instruction)
+{
+	lcdPort &= ~(1 << lcdRSBit);                // RS low
+	lcdPort &= ~(1 << lcdEBit);                // E low
+	lcd_write(instruction);                   // write the upper 4 bits of data
+	_delay_us(10);
+	lcd_write(instruction << 4);             // write the lower 4 bits of data
+	if (instruction <= home) _delay_ms(2);  // clear and home take 1.52 ms
+	else _delay_us(50);                     // the rest 37 us
+}
+
+static inline void lcd_char(uint8_t data)
+{
+	lcdPort |= (1 << lcdRSBit);                 // RS high
+	lcdPort &= ~(1 << lcdEBit);                // E low
+	lcd_write(data);                          // write the upper four bits of data
+	lcd_write(data << 4);                    // write the lower 4 bits of data
+}
+
+static inline void lcd_string(uint8_t string[])
+{
+	int i = 0;                             //while the string is not empty
+	while (string[i] != 0)
+	{
+		lcd_char(string[i]);
+		i++;
+		_delay_us(50);                              //40 us delay min
+	}
+}
+
+/* lcd_string() for a string in flash */
+static inline void lcd_string_P(const char *string)
+{
+	char c;
+	while ((c = pgm_read_byte(string++)) != 0)
+	{
+		lcd_char(c);
+		_delay_us(50);                              //40 us delay min
+	}
+}
+
+static inline void lcd_number(uint16_t n)
+{
+	char digits[5];
+	uint8_t i = 0;
+
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+
+	while (i > 0) {
+		lcd_char(digits[--i]);
+		_delay_us(50);                              //40 us delay min
+	}
+}
+
+static inline void lcd_init(void)
+{
+	lcdDdr |= (1 << lcdD7Bit) | (1 << lcdD6Bit) | (1 << lcdD5Bit) | (1 << lcdD4Bit) | (1 << lcdEBit) | (1 << lcdRSBit);
+	_delay_ms(40);                          // 40 ms min after power-up
+
+	lcdPort &= ~(1 << lcdRSBit);                 // RS low
+	lcdPort &= ~(1 << lcdEBit);                 // E low
+
+	// LCD resets
+	lcd_write(reset);
+	_delay_ms(8);                           // 5 ms delay min
+
+	lcd_write(reset);
+	_delay_us(200);                       // 100 us delay min
+
+	lcd_write(reset);
+	_delay_us(200);
+
+	lcd_write(bit4Mode);               	//set to 4 bit mode
+	_delay_us(50);                     // 40us delay min
+
+	lcd_instruction(bit4Mode);   	 // set 4 bit mode
+	_delay_us(50);                  // 40 us delay min
+
+	// display off
+	lcd_instruction(off);        	// turn off display
+	_delay_us(50);
+
+	// Clear display
+	lcd_instruction(clear);              // clear display
+	_delay_ms(3);                       // 1.64 ms delay min
+
+	// entry mode
+	lcd_instruction(entryMode);          // this instruction shifts the cursor
+	_delay_us(40);                      // 40 us delay min
+
+	// Display on
+	lcd_instruction(on);          // turn on the display
+	_delay_us(50);               // same delay as off
+}
+
+#endif /* LCD_H */
@@ -0,0 +1,114 @@
+/*
+ * RAM usage at run time: free memory, stack high-water mark and the peak
+ * fill of the fixed buffers.
+ *
+ * At reset, before the C runtime copies .data and clears .bss, everything
+ * from the end of the static data (_end) up to the top of RAM is painted
+ * with STACK_CANARY. The stack only grows down into that area, so the
+ * canary bytes still left just above _end are RAM the stack has never
+ * touched since reset.
+ *
+ * A board answers FRAME_COMMAND MEMSTAT_CMD with a FRAME_TELEMETRY frame:
+ *
+ *   'm' | static | free now | never touched | peak 0 .. peak 3
+ *
+ * all 16 bit, high byte first. The peaks are board specific (queue depth,
+ * longest Wi-Fi line, ...). The build's own numbers come from `make size`
+ * in Tools/isrbench.
+ */
+
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+
+#include <inttypes.h>
+
+#define STACK_CANARY        0xC5
+#define MEMSTAT_CMD         'm'
+#define MEMSTAT_MAX_PEAKS   4
+
+/* Record the largest value seen, for buffer fill levels */
+#define MEMSTAT_PEAK(peak, value)	do { if ((value) > (peak)) (peak) = (value); } while (0)
+
+#ifndef SIMULATOR
+
+extern uint8_t _end;                    // first byte after .data and .bss
+extern uint8_t __stack;                 // top of RAM
+extern uint8_t __heap_start;
+extern char *__brkval;                  // end of the malloc heap, 0 until the first malloc
+
+/* Runs from .init1: no stack and no r1 yet, so plain registers only */
+static void __attribute__((naked, used, section(".init1"))) memstat_paint(void)
+{
+	__asm__ volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_CANARY));
+}
+
+/* .data + .bss */
+static inline uint16_t memstat_static(void)
+{
+	return (uint16_t)(uintptr_t)&_end - RAMSTART;
+}
+
+/* Between the heap (or the static data) and the stack pointer, right now */
+static inline uint16_t memstat_free(void)
+{
+	uint8_t *heap_end = (__brkval != 0) ? (uint8_t *)__brkval : &__heap_start;
+	return SP - (uint16_t)(uintptr_t)heap_end;
+}
+
+/* Bytes above the heap the stack has never reached since reset */
+static inline uint16_t memstat_untouched(void)
+{
+	const uint8_t *p = (__brkval != 0) ? (const uint8_t *)__brkval : &_end;
+	uint16_t n = 0;
+
+	while (p <= &__stack && *p == STACK_CANARY) {
+		p++;
+		n++;
+	}
+	return n;
+}
+
+#else
+
+/* Host build: the simulator has no linker RAM layout to look at */
+static inline uint16_t memstat_static(void) { return 0; }
+static inline uint16_t memstat_free(void) { return 0; }
+static inline uint16_t memstat_untouched(void) { return 0; }
+
+#endif /* SIMULATOR */
+
+/* Builds the telemetry payload into out[] (at least FRAME_MAX_PAYLOAD bytes), returns its length */
+static inline uint8_t memstat_report(uint8_t out[], const uint16_t peaks[], uint8_t npeaks)
+{
+	uint16_t v[3 + MEMSTAT_MAX_PEAKS];
+	uint8_t n = 0;
+
+	if (npeaks > MEMSTAT_MAX_PEAKS) npeaks = MEMSTAT_MAX_PEAKS;
+
+	v[0] = memstat_static();
+	v[1] = memstat_free();
+	v[2] = memstat_untouched();
+	for (uint8_t i = 0; i < npeaks; i++) {
+		v[3 + i] = peaks[i];
+	}
+
+	out[n++] = MEMSTAT_CMD;
+	for (uint8_t i = 0; i < 3 + npeaks; i++) {
+		out[n++] = v[i] >> 8;
+		out[n++] = v[i] & 0xFF;
+	}
+	return n;
+}
+
+#endif /* MEMSTAT_H */
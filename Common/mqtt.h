@@ -0,0 +1,229 @@
+/*
+ * MQTT 3.1.1, the part the shelter uses: CONNECT, PUBLISH at QoS 0 and 1,
+ * PUBACK, SUBSCRIBE, PINGREQ and their answers. Enough for MainBoard's
+ * uplink (built with UPLINK_MQTT), the bridge to dogs.db (Bridge/) and the
+ * test broker (Tools/mqttbroker).
+ *
+ * Every packet is a fixed header, the remaining length (1 to 4 bytes, 7
+ * bits each, low first) and a body:
+ *
+ *   CONNECT    "MQTT" 4 | flags | keep-alive | client ID
+ *   CONNACK    session present | return code
+ *   PUBLISH    topic | packet ID (QoS 1 only) | payload
+ *   PUBACK     packet ID
+ *   SUBSCRIBE  packet ID | topic filter | QoS
+ *   SUBACK     packet ID | granted QoS
+ *
+ * Strings go out as a 16 bit length, high byte first, and the text. The
+ * encoders write into out[] and return the length; the caller makes sure
+ * it fits (MQTT_PUBLISH_SIZE and friends). The parser is fed one byte at
+ * a time like frame_parse().
+ *
+ * Every firmware is built as a single translation unit, so this header
+ * carries the code as well as the declarations.
+ */
+
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MQTT_PORT           1883
+
+/* Longest body the parser keeps, longer packets are skipped and counted */
+#ifndef MQTT_MAX_PACKET
+#define MQTT_MAX_PACKET     64
+#endif
+
+typedef enum {
+	MQTT_CONNECT     = 0x10,
+	MQTT_CONNACK     = 0x20,
+	MQTT_PUBLISH     = 0x30,
+	MQTT_PUBACK      = 0x40,
+	MQTT_SUBSCRIBE   = 0x82,            // flags 0010 are part of the type
+	MQTT_SUBACK      = 0x90,
+	MQTT_PINGREQ     = 0xC0,
+	MQTT_PINGRESP    = 0xD0,
+	MQTT_DISCONNECT  = 0xE0
+} mqtt_type;
+
+#define MQTT_DUP            0x08        // PUBLISH flags: sent before
+#define MQTT_QOS1           0x02        //                acknowledged with PUBACK
+#define MQTT_RETAIN         0x01
+
+/* Size of a PUBLISH with a body under 128 bytes (one length byte) */
+#define MQTT_PUBLISH_SIZE(topic_len, payload_len, qos)  (2 + 2 + (topic_len) + ((qos) ? 2 : 0) + (payload_len))
+
+/* Fixed header, returns its length */
+static inline uint8_t mqtt_header(uint8_t out[], uint8_t type, uint32_t len)
+{
+	uint8_t n = 0;
+	out[n++] = type;
+	do {
+		uint8_t b = len & 0x7F;
+		len >>= 7;
+		out[n++] = len ? (b | 0x80) : b;
+	} while (len && n < 5);
+	return n;
+}
+
+static inline uint16_t mqtt_string(uint8_t out[], const char *s, uint16_t len)
+{
+	out[0] = len >> 8;
+	out[1] = len & 0xFF;
+	memcpy(out + 2, s, len);
+	return len + 2;
+}
+
+/* Clean session, no will, no user name */
+static inline uint16_t mqtt_connect(uint8_t out[], const char *client, uint16_t keepalive_s)
+{
+	uint16_t id_len = strlen(client);
+	uint16_t n = mqtt_header(out, MQTT_CONNECT, 10 + 2 + id_len);
+	n += mqtt_string(out + n, "MQTT", 4);
+	out[n++] = 4;                       // protocol level 3.1.1
+	out[n++] = 0x02;                    // clean session
+	out[n++] = keepalive_s >> 8;
+	out[n++] = keepalive_s & 0xFF;
+	n += mqtt_string(out + n, client, id_len);
+	return n;
+}
+
+static inline uint16_t mqtt_connack(uint8_t out[], uint8_t code)
+{
+	uint16_t n = mqtt_header(out, MQTT_CONNACK, 2);
+	out[n++] = 0;
+	out[n++] = code;
+	return n;
+}
+
+/* flags are MQTT_QOS1, MQTT_DUP and MQTT_RETAIN, id is only sent with QoS 1 */
+static inline uint16_t mqtt_publish(uint8_t out[], uint8_t flags, uint16_t id, const char *topic,
+	const uint8_t payload[], uint16_t len)
+{
+	uint16_t topic_len = strlen(topic);
+	uint16_t n = mqtt_header(out, MQTT_PUBLISH | flags, 2 + topic_len + ((flags & MQTT_QOS1) ? 2 : 0) + len);
+	n += mqtt_string(out + n, topic, topic_len);
+	if (flags & MQTT_QOS1) {
+		out[n++] = id >> 8;
+		out[n++] = id & 0xFF;
+	}
+	memcpy(out + n, payload, len);
+	return n + len;
+}
+
+/* PUBACK, or any other answer that is just a packet ID */
+static inline uint16_t mqtt_ack(uint8_t out[], uint8_t type, uint16_t id)
+{
+	uint16_t n = mqtt_header(out, type, 2);
+	out[n++] = id >> 8;
+	out[n++] = id & 0xFF;
+	return n;
+}
+
+/* One topic filter */
+static inline uint16_t mqtt_subscribe(uint8_t out[], uint16_t id, const char *filter, uint8_t qos)
+{
+	uint16_t filter_len = strlen(filter);
+	uint16_t n = mqtt_header(out, MQTT_SUBSCRIBE, 2 + 2 + filter_len + 1);
+	out[n++] = id >> 8;
+	out[n++] = id & 0xFF;
+	n += mqtt_string(out + n, filter, filter_len);
+	out[n++] = qos;
+	return n;
+}
+
+/* PINGREQ, PINGRESP and DISCONNECT have no body */
+static inline uint16_t mqtt_empty(uint8_t out[], uint8_t type)
+{
+	return mqtt_header(out, type, 0);
+}
+
+/* Receive side */
+
+typedef enum {
+	MQTT_WAIT_TYPE,
+	MQTT_WAIT_LEN,
+	MQTT_WAIT_BODY
+} mqtt_state;
+
+struct mqtt_parser {
+	uint8_t state;
+	uint8_t header;                     // type and flags
+	uint8_t shift;
+	uint32_t len;                       // remaining length
+	uint32_t pos;
+	uint16_t oversize;                  // packets skipped, body longer than MQTT_MAX_PACKET
+	uint8_t body[MQTT_MAX_PACKET];
+};
+
+/* Returns true once a whole packet is in header and body[len]. It stays
+   there until the next byte is fed in. */
+static inline bool mqtt_parse(struct mqtt_parser *p, uint8_t c)
+{
+	switch (p->state) {
+
+		case MQTT_WAIT_TYPE:
+		p->header = c;
+		p->len = 0;
+		p->pos = 0;
+		p->shift = 0;
+		p->state = MQTT_WAIT_LEN;
+		return false;
+
+		case MQTT_WAIT_LEN:
+		p->len |= (uint32_t)(c & 0x7F) << p->shift;
+		p->shift += 7;
+		if (c & 0x80) {
+			if (p->shift >= 28) p->state = MQTT_WAIT_TYPE;     // malformed, the caller has lost the stream anyway
+			return false;
+		}
+		if (p->len > MQTT_MAX_PACKET) p->oversize++;
+		if (p->len > 0) {
+			p->state = MQTT_WAIT_BODY;
+			return false;
+		}
+		p->state = MQTT_WAIT_TYPE;
+		return true;
+
+		case MQTT_WAIT_BODY:
+		if (p->pos < MQTT_MAX_PACKET) p->body[p->pos] = c;
+		if (++p->pos < p->len) return false;
+		p->state = MQTT_WAIT_TYPE;
+		return p->len <= MQTT_MAX_PACKET;
+	}
+	p->state = MQTT_WAIT_TYPE;
+	return false;
+}
+
+/* Packet ID of a PUBACK or SUBACK */
+static inline uint16_t mqtt_packet_id(const struct mqtt_parser *p)
+{
+	return (p->len >= 2) ? ((uint16_t)p->body[0] << 8) | p->body[1] : 0;
+}
+
+/* Splits the PUBLISH in p. topic is not terminated. id is 0 at QoS 0.
+   False if the packet is too short for what its header says. */
+static inline bool mqtt_publish_parts(const struct mqtt_parser *p, const char **topic, uint16_t *topic_len,
+	const uint8_t **payload, uint16_t *len, uint16_t *id)
+{
+	if (p->len < 2) return false;
+	uint16_t tl = ((uint16_t)p->body[0] << 8) | p->body[1];
+	uint32_t n = 2 + tl;
+	*id = 0;
+	if (p->header & MQTT_QOS1) {
+		if (n + 2 > p->len) return false;
+		*id = ((uint16_t)p->body[n] << 8) | p->body[n + 1];
+		n += 2;
+	}
+	if (n > p->len) return false;
+	*topic = (const char *)p->body + 2;
+	*topic_len = tl;
+	*payload = p->body + n;
+	*len = p->len - n;
+	return true;
+}
+
+#endif /* MQTT_H */
@@ -0,0 +1,204 @@
+/*
+ * Sampling profiler: where the CPU spends its time, per function.
+ *
+ * Built only with -DPROFILE. Timer0's compare B, next to the 1 ms tick on
+ * compare A, interrupts about once a millisecond and counts the address it
+ * interrupted in a histogram over the program: PROFILE_BINS 16 bit bins,
+ * each 2^shift words wide, shift chosen at start so the bins cover .text.
+ * Every sample moves OCR0B back PROFILE_STEP counts, so the samples are
+ * 1 - PROFILE_STEP / (TIMER0_TOP + 1) ms apart and drift across the tick
+ * instead of landing on the same point of every task. A sample costs
+ * about 105 cycles with shift 7 (a 16 KB program over 128 bins), 1.4% at
+ * 8 MHz. A bin stops at 65535.
+ *
+ * Time with interrupts disabled is counted where they come back on, and
+ * other ISRs' time where they return to; the sleep in idle() is the time
+ * left over. Timer0 stops in power down, so RFReceiver's sleep between
+ * tags isn't sampled.
+ *
+ * A board answers FRAME_COMMAND PROFILE_CMD with a FRAME_TELEMETRY frame:
+ *
+ *   'p' '+'              clear and start  -> 'p' 's' | running | shift | bins
+ *   'p' '-'              stop             -> the same
+ *   'p' 's'              state            -> the same
+ *   'p' 'r' | index      read             -> 'p' 'r' | index | count x PROFILE_READ
+ *
+ * bins and the counts are 16 bit, high byte first. Bin i covers the byte
+ * addresses from (i << shift) * 2 up to ((i + 1) << shift) * 2, for
+ * Tools/linkshell to look up in the firmware's ELF file. Sampling starts
+ * at reset, so boot (lcd_init() and the ESP8266's warm-up) is in the first
+ * read; 'p' '+' starts again from zero.
+ *
+ * Without PROFILE (and in the simulator, which has no return address to
+ * look at) the functions are empty and the board doesn't answer.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <inttypes.h>
+#include <string.h>
+
+#define PROFILE_CMD         'p'
+#define PROFILE_START       '+'
+#define PROFILE_STOP        '-'
+#define PROFILE_STATE       's'
+#define PROFILE_READ_CMD    'r'
+#define PROFILE_READ        6               // counts per answer, what fits in FRAME_MAX_PAYLOAD
+
+#ifndef PROFILE_BINS
+#define PROFILE_BINS        128             // 256 bytes of RAM
+#endif
+
+#define PROFILE_STEP        7               // OCR0B counts per sample
+
+#if defined(PROFILE) && !defined(SIMULATOR)
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#if PROFILE_BINS > 256
+#error "PROFILE_BINS is read with an 8 bit index"
+#endif
+#if FLASHEND > 0x1FFFF
+#error "three byte return addresses are not handled"
+#endif
+#if PROFILE_STEP > TIMER0_TOP
+#error "PROFILE_STEP must be less than a tick"
+#endif
+
+extern uint8_t _etext;                      // end of the program in flash
+
+struct {
+	uint16_t bins[PROFILE_BINS];
+	uint8_t shift;                          // words per bin, as a power of two
+	uint8_t running;
+} Profile;
+
+/* The return address is the instruction that was about to run. The ISR
+   is written out so that only the registers it uses are saved and their
+   number is known: after five pushes the address is at SP+6 (high byte)
+   and SP+7. Nothing here changes SREG before it's saved or after it's
+   restored. */
+ISR(TIMER0_COMPB_vect, ISR_NAKED)
+{
+	__asm__ volatile (
+		"	push r24\n"
+		"	in r24, __SREG__\n"
+		"	push r24\n"
+		"	push r25\n"
+		"	push r30\n"
+		"	push r31\n"
+		"	in r30, __SP_L__\n"
+		"	in r31, __SP_H__\n"
+		"	ldd r25, Z+6\n"
+		"	ldd r24, Z+7\n"
+		"	lds r30, %[shift]\n"            // word address >> shift
+		"	rjmp 2f\n"
+		"1:	lsr r25\n"
+		"	ror r24\n"
+		"2:	dec r30\n"
+		"	brpl 1b\n"
+		"	cpi r24, lo8(%[nbins])\n"       // past the last bin (bootloader)
+		"	ldi r30, hi8(%[nbins])\n"
+		"	cpc r25, r30\n"
+		"	brsh 3f\n"
+		"	lsl r24\n"
+		"	rol r25\n"
+		"	subi r24, lo8(-(%[bins]))\n"
+		"	sbci r25, hi8(-(%[bins]))\n"
+		"	movw r30, r24\n"
+		"	ld r24, Z\n"
+		"	ldd r25, Z+1\n"
+		"	adiw r24, 1\n"
+		"	breq 3f\n"                      // full, keep 65535
+		"	st Z, r24\n"
+		"	std Z+1, r25\n"
+		"3:	in r24, %[ocr]\n"               // next sample PROFILE_STEP counts earlier in the tick
+		"	subi r24, %[step]\n"
+		"	brcc 4f\n"
+		"	subi r24, %[wrap]\n"
+		"4:	out %[ocr], r24\n"
+		"	pop r31\n"
+		"	pop r30\n"
+		"	pop r25\n"
+		"	pop r24\n"
+		"	out __SREG__, r24\n"
+		"	pop r24\n"
+		"	reti\n"
+		:: [shift] "i" (&Profile.shift), [bins] "i" (Profile.bins), [nbins] "i" (PROFILE_BINS),
+		   [ocr] "I" (_SFR_IO_ADDR(OCR0B)), [step] "M" (PROFILE_STEP),
+		   [wrap] "M" ((uint8_t)-(TIMER0_TOP + 1)));
+}
+
+/* Clears the histogram and samples from the next tick on. Timer0 must be
+   running (timer0_init()). */
+static inline void profile_start(void)
+{
+	uint16_t words = (uint16_t)(uintptr_t)&_etext / 2;
+	uint8_t shift = 0;
+
+	while ((uint16_t)(words - 1) >> shift >= PROFILE_BINS) shift++;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memset(Profile.bins, 0, sizeof Profile.bins);
+		Profile.shift = shift;
+		Profile.running = 1;
+		OCR0B = 0;
+		TIFR0 = (1 << OCF0B);
+		TIMSK0 |= (1 << OCIE0B);
+	}
+}
+
+static inline void profile_stop(void)
+{
+	TIMSK0 &= ~(1 << OCIE0B);
+	Profile.running = 0;
+}
+
+/* Handles PROFILE_CMD with its arguments, builds the answer into out[] (at
+   least FRAME_MAX_PAYLOAD bytes) and returns its length, 0 if the
+   arguments are short or unknown */
+static inline uint8_t profile_command(const uint8_t args[], uint8_t args_len, uint8_t out[])
+{
+	uint8_t n = 0;
+
+	if (args_len < 1) return 0;
+
+	out[n++] = PROFILE_CMD;
+	if (args[0] == PROFILE_READ_CMD) {
+		if (args_len < 2) return 0;
+		out[n++] = PROFILE_READ_CMD;
+		out[n++] = args[1];
+		for (uint16_t i = args[1]; i < PROFILE_BINS && i < args[1] + PROFILE_READ; i++) {
+			uint16_t count;
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				count = Profile.bins[i];
+			}
+			out[n++] = count >> 8;
+			out[n++] = count & 0xFF;
+		}
+		return n;
+	}
+
+	if (args[0] == PROFILE_START) profile_start();
+	else if (args[0] == PROFILE_STOP) profile_stop();
+	else if (args[0] != PROFILE_STATE) return 0;
+
+	out[n++] = PROFILE_STATE;
+	out[n++] = Profile.running;
+	out[n++] = Profile.shift;
+	out[n++] = PROFILE_BINS >> 8;
+	out[n++] = PROFILE_BINS & 0xFF;
+	return n;
+}
+
+#else
+
+static inline void profile_start(void) {}
+static inline uint8_t profile_command(const uint8_t args[], uint8_t args_len, uint8_t out[]) { return 0; }
+
+#endif /* PROFILE */
+
+#endif /* PROFILE_H */
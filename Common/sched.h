@@ -0,0 +1,174 @@
+/*
+ * Cooperative run-to-completion scheduler driven by a 1 ms tick.
+ *
+ * A board keeps its tasks in an array, highest priority first, and hands
+ * it to sched_run(), which never returns. A task is released
+ *   - every period ms if it has a period,
+ *   - once at a time set with task_delay(),
+ *   - when an ISR (or another task) calls task_signal() on it.
+ * Released tasks run one at a time in array order and must return
+ * quickly; anything that used to wait in a _delay_ms() becomes a state
+ * and a task_delay(). A release that has waited longer than the task's
+ * deadline is counted in late, and the longest wait is kept in max_lag.
+ *
+ * When nothing is released the idle hook is called with interrupts
+ * disabled. It has to enable them together with going to sleep
+ * (sei(); sleep_cpu();), so that an interrupt can't slip in between the
+ * check and the sleep.
+ *
+ * timer0_init() starts the 1 ms compare match on timer 0, and the
+ * board's TIMER0_COMPA ISR calls sched_tick() from it.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "clock.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#define EV_TIMER    0x80                // released by period or task_delay()
+
+struct task {
+	void (*run)(uint8_t events);
+	uint16_t period;                    // ms, 0 = only on events and task_delay()
+	uint16_t deadline;                  // ms a release may wait, 0 = not checked
+
+	volatile uint8_t events;            // pending task_signal() bits
+	volatile uint32_t signalled;        // time of the first pending signal
+	bool timed;                         // due is set
+	uint32_t due;                       // next timed release
+
+	uint16_t late;                      // releases that waited past the deadline
+	uint16_t max_lag;                   // longest wait from release to run, ms
+};
+
+#define TASK(fn, period_ms, deadline_ms)	{ .run = (fn), .period = (period_ms), .deadline = (deadline_ms) }
+
+volatile uint32_t sched_ms;
+
+static inline void timer0_init(void)
+{
+	TCCR0A = (1 << WGM01);              // CTC mode
+	TCCR0B = TIMER0_CS << CS00;         // clk/TIMER0_PRESCALE
+	OCR0A = TIMER0_TOP;                 // 1 ms period
+	TIMSK0 = (1 << OCIE0A);
+}
+
+static inline void sched_tick(void)
+{
+	sched_ms++;
+}
+
+static inline uint32_t sched_now(void)
+{
+	uint32_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = sched_ms;
+	}
+	return now;
+}
+
+/* From ISRs or tasks; several bits can be pending at once */
+static inline void task_signal(struct task *t, uint8_t events)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (t->events == 0) t->signalled = sched_ms;
+		t->events |= events;
+	}
+}
+
+/* One timed release ms from now, replacing any earlier one */
+static inline void task_delay(struct task *t, uint16_t ms)
+{
+	t->due = sched_now() + ms;
+	t->timed = true;
+}
+
+static inline void task_cancel(struct task *t)
+{
+	t->timed = (t->period != 0);
+}
+
+static inline bool task_due(const struct task *t, uint32_t now)
+{
+	return t->events != 0 || (t->timed && (int32_t)(now - t->due) >= 0);
+}
+
+static inline void sched_account(struct task *t, uint32_t released, uint32_t now)
+{
+	uint32_t lag = now - released;
+
+	if (lag > t->max_lag) t->max_lag = (lag > 0xFFFF) ? 0xFFFF : lag;
+	if (t->deadline != 0 && lag > t->deadline) t->late++;
+}
+
+/* Runs the first released task, returns false if there was none */
+static inline bool sched_step(struct task tasks[], uint8_t n)
+{
+	uint32_t now = sched_now();
+
+	for (uint8_t i = 0; i < n; i++) {
+		struct task *t = &tasks[i];
+		if (!task_due(t, now)) continue;
+
+		uint8_t events;
+		uint32_t released;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			events = t->events;
+			released = t->signalled;
+			t->events = 0;
+		}
+
+		if (t->timed && (int32_t)(now - t->due) >= 0) {
+			if (events == 0) released = t->due;
+			events |= EV_TIMER;
+
+			if (t->period == 0) t->timed = false;
+			else {
+				t->due += t->period;
+				if ((int32_t)(now - t->due) >= 0) t->due = now + t->period;     // fell behind, don't catch up in a burst
+			}
+		}
+
+		sched_account(t, released, now);
+		t->run(events);
+		return true;
+	}
+	return false;
+}
+
+static inline void sched_init(struct task tasks[], uint8_t n)
+{
+	uint32_t now = sched_now();
+
+	for (uint8_t i = 0; i < n; i++) {
+		if (tasks[i].period != 0) {
+			tasks[i].due = now + tasks[i].period;
+			tasks[i].timed = true;
+		}
+	}
+}
+
+/* Never returns */
+static inline void sched_run(struct task tasks[], uint8_t n, void (*idle)(void))
+{
+	sched_init(tasks, n);
+
+	while (1) {
+		if (sched_step(tasks, n)) continue;
+
+		cli();
+		uint32_t now = sched_ms;
+		bool released = false;
+		for (uint8_t i = 0; i < n && !released; i++) {
+			released = task_due(&tasks[i], now);
+		}
+		if (released) sei();
+		else idle();                    // returns with interrupts enabled
+	}
+}
+
+#endif /* SCHED_H */
@@ -0,0 +1,119 @@
+/*
+ * Named counters and run-time tunables, read and set over the link.
+ *
+ * A board lists them in a table in flash, counters and tunables mixed:
+ *
+ *   const struct telemetry_var telemetry_vars[] PROGMEM = {
+ *       TELEMETRY_COUNTER("headers", Decoder.headers),
+ *       TELEMETRY_TUNABLE("swing", Tune.min_swing, 1, 255),
+ *   };
+ *
+ * and passes FRAME_COMMAND TELEMETRY_GET and TELEMETRY_SET to
+ * telemetry_command(), which builds the FRAME_TELEMETRY answer:
+ *
+ *   'g' | index                  -> 'g' | index | flags | value | name
+ *   's' | index | value          -> the same, with the value after the write
+ *
+ * value is 32 bit, high byte first, name up to TELEMETRY_NAME bytes and
+ * not terminated. An index past the end of the table answers 'g' | index
+ * | TELEMETRY_END, so a host walks the table from 0 and needs no copy of
+ * it (Tools/linkshell). A write to a counter or outside [min, max] is
+ * refused and answered with TELEMETRY_REFUSED set and the old value.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#define TELEMETRY_GET       'g'
+#define TELEMETRY_SET       's'
+#define TELEMETRY_NAME      9               // what fits beside the value in one payload
+
+#define TELEMETRY_WRITABLE  0x01            // flags: may be written
+#define TELEMETRY_REFUSED   0x80            // flags: the write was not done
+#define TELEMETRY_END       0xFF            // no variable at this index
+
+struct telemetry_var {
+	char name[TELEMETRY_NAME + 1];
+	void *ptr;
+	uint8_t size;                           // 1, 2 or 4 bytes, unsigned
+	uint8_t flags;
+	uint32_t min;                           // tunables only
+	uint32_t max;
+};
+
+#define TELEMETRY_COUNTER(name, var)            { name, (void *)&(var), sizeof(var), 0, 0, 0 }
+#define TELEMETRY_TUNABLE(name, var, lo, hi)    { name, (void *)&(var), sizeof(var), TELEMETRY_WRITABLE, (lo), (hi) }
+
+/* ISRs update most of the counters, so reads and writes are atomic */
+static inline uint32_t telemetry_read(const struct telemetry_var *v)
+{
+	uint32_t value = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (v->size == 1) value = *(volatile uint8_t *)v->ptr;
+		else if (v->size == 2) value = *(volatile uint16_t *)v->ptr;
+		else value = *(volatile uint32_t *)v->ptr;
+	}
+	return value;
+}
+
+static inline void telemetry_write(const struct telemetry_var *v, uint32_t value)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (v->size == 1) *(volatile uint8_t *)v->ptr = value;
+		else if (v->size == 2) *(volatile uint16_t *)v->ptr = value;
+		else *(volatile uint32_t *)v->ptr = value;
+	}
+}
+
+/* Handles command with its arguments, builds the answer into out[] (at
+   least FRAME_MAX_PAYLOAD bytes) and returns its length, 0 if the
+   arguments are short. *written is set when a tunable changed, so the
+   board can apply what isn't read on every use. */
+static inline uint8_t telemetry_command(uint8_t command, const uint8_t args[], uint8_t args_len,
+	const struct telemetry_var vars[], uint8_t nvars, uint8_t out[], bool *written)
+{
+	uint8_t n = 0;
+	*written = false;
+
+	if (args_len < 1 || (command == TELEMETRY_SET && args_len < 5)) return 0;
+
+	uint8_t index = args[0];
+	out[n++] = TELEMETRY_GET;
+	out[n++] = index;
+	if (index >= nvars) {
+		out[n++] = TELEMETRY_END;
+		return n;
+	}
+
+	struct telemetry_var v;
+	memcpy_P(&v, &vars[index], sizeof v);
+
+	if (command == TELEMETRY_SET) {
+		uint32_t value = ((uint32_t)args[1] << 24) | ((uint32_t)args[2] << 16) | ((uint16_t)args[3] << 8) | args[4];
+		if ((v.flags & TELEMETRY_WRITABLE) && value >= v.min && value <= v.max) {
+			telemetry_write(&v, value);
+			*written = true;
+		} else {
+			v.flags |= TELEMETRY_REFUSED;
+		}
+	}
+
+	uint32_t value = telemetry_read(&v);
+	out[n++] = v.flags;
+	out[n++] = value >> 24;
+	out[n++] = (value >> 16) & 0xFF;
+	out[n++] = (value >> 8) & 0xFF;
+	out[n++] = value & 0xFF;
+	for (uint8_t i = 0; i < TELEMETRY_NAME && v.name[i] != 0; i++) {
+		out[n++] = v.name[i];
+	}
+	return n;
+}
+
+#endif /* TELEMETRY_H */
@@ -0,0 +1,98 @@
+/*
+ * Polled USART driver, 8 data bits, 1 stop bit, no parity, receive
+ * interrupt on. USART0 is the reader link on every board, USART1 the
+ * ESP8266 on MainBoard. ubrr and u2x come from Common/clock.h (LINK_UBRR,
+ * LINK_U2X, WIFI_UBRR, WIFI_U2X).
+ *
+ * usart0_flush() waits until the last byte has left the shift register,
+ * for RFReceiver to power down after a frame.
+ *
+ * usart0_send_frame() puts a Common/frame.h frame on the link. The readers
+ * use send_frame(), which sends from READER_ADDR and numbers the frames.
+ */
+
+#ifndef USART_H
+#define USART_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <avr/io.h>
+#include "frame.h"
+
+static bool usart0_sending;             // TXC0 not seen since the last byte
+
+static inline void usart0_init(uint16_t ubrr, uint8_t u2x)
+{
+	UBRR0H = ubrr >> 8;
+	UBRR0L = ubrr;
+	UCSR0A = u2x << U2X0;
+	UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+	UCSR0C = (3 << UCSZ00);
+}
+
+static inline void usart0_send(uint8_t data)
+{
+	while (!(UCSR0A & (1 << UDRE0)));
+	// TXC0 is cleared by writing 1 and set again once this byte is out;
+	// FE0, DOR0 and UPE0 must be written 0, U2X0 kept
+	UCSR0A = (UCSR0A & (1 << U2X0)) | (1 << TXC0);
+	UDR0 = data;
+	usart0_sending = true;
+}
+
+static inline uint8_t usart0_receive(void)
+{
+	while (!(UCSR0A & (1 << RXC0)));
+	return UDR0;
+}
+
+static inline void usart0_flush(void)
+{
+	if (!usart0_sending) return;
+	while (!(UCSR0A & (1 << TXC0)));
+	usart0_sending = false;
+}
+
+static inline void usart0_send_frame(uint8_t addr, uint8_t type, uint8_t seq, const uint8_t payload[], uint8_t len)
+{
+	uint8_t frame[FRAME_MAX_SIZE];
+	uint8_t n = frame_encode(frame, addr, type, seq, payload, len);
+	
+	for (uint8_t i = 0; i < n; i++) {
+		usart0_send(frame[i]);
+	}
+}
+
+static uint8_t frame_seq;
+
+static inline void send_frame(uint8_t type, const uint8_t payload[], uint8_t len)
+{
+	usart0_send_frame(READER_ADDR, type, frame_seq++, payload, len);
+}
+
+#ifdef UDR1
+
+static inline void usart1_init(uint16_t ubrr, uint8_t u2x)
+{
+	UBRR1H = ubrr >> 8;
+	UBRR1L = ubrr;
+	UCSR1A = u2x << U2X1;
+	UCSR1B = (1 << RXEN1) | (1 << TXEN1) | (1 << RXCIE1);
+	UCSR1C = (3 << UCSZ10);
+}
+
+static inline void usart1_send(uint8_t data)
+{
+	while (!(UCSR1A & (1 << UDRE1)));
+	UDR1 = data;
+}
+
+static inline uint8_t usart1_receive(void)
+{
+	while (!(UCSR1A & (1 << RXC1)));
+	return UDR1;
+}
+
+#endif /* UDR1 */
+
+#endif /* USART_H */
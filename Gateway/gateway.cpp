@@ -0,0 +1,503 @@
+/*
+ * Gateway from serial readers straight to the shelter database, for fixed
+ * desks where a reader is plugged into a small Linux box instead of
+ * talking to MainBoard and the ESP8266.
+ *
+ *   gateway [options] /dev/ttyUSB0 [/dev/ttyUSB1 ...]
+ *
+ * Each port carries the readers' link frames (Common/frame.h), one reader
+ * or several sharing a bus. All ports are read from one thread through
+ * epoll with non-blocking I/O. Scans are deduplicated like MainBoard does
+ * (resent frames, a tag held in front of the reader) and every scan that
+ * came in during one pass of the loop is written to dogs.db in a single
+ * transaction, so a burst from many readers costs one commit, and a lone
+ * scan is committed as soon as it has been read.
+ *
+ * A scan changes the record the way the web server's /add/<rfid>/t does:
+ * the status flips and the version goes up, so readers working through
+ * MainBoard see the change as a newer version.
+ *
+ * Per port counters (bytes and scans per second, repeats, CRC errors,
+ * scan-to-commit latency) are printed every -s seconds and on SIGUSR1.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../Common/frame.h"
+
+namespace {
+
+typedef uint64_t ns_t;
+
+const ns_t US = 1000;
+const ns_t MS = 1000 * US;
+const ns_t SEC = 1000 * MS;
+
+/******************************************************************* Options ********************************************************************/
+
+struct Options {
+	std::string database = "/data/dogs.db";
+	long baud = 9600;
+	char action = 't';                      // what a scan does to the record, like MainBoard's INTAKE_ACTION
+	unsigned dedupe_ms = 1500;              // same tag from the same reader inside this window is a repeat
+	unsigned batch = 256;                   // most scans in one transaction
+	unsigned busy_ms = 20;                  // wait for the web server's lock, then retry on the next pass
+	unsigned stats_s = 0;                   // 0 = only on SIGUSR1
+	bool verbose = false;
+	std::vector<std::string> ports;
+};
+
+Options opt;
+
+ns_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ns_t)ts.tv_sec * SEC + ts.tv_nsec;
+}
+
+/******************************************************************* Ports ********************************************************************/
+
+/* A reader on a port, by its link address */
+struct Reader {
+	uint8_t seq;                            // last sequence number accepted
+	uint8_t last_tag[TAG_BYTES];
+	ns_t last_seen = 0;
+};
+
+struct Port {
+	std::string path;
+	int fd = -1;
+	frame_parser parser = {};
+	std::map<uint8_t, Reader> readers;
+
+	uint64_t bytes = 0;
+	uint64_t scans = 0;                     // committed to the database
+	uint64_t repeats = 0;                   // tag held in front of the reader
+	uint64_t resent = 0;                    // same frame sent twice
+	uint64_t unknown = 0;                   // no record with that rfid
+
+	ns_t latency = 0;                       // last scan, read to commit
+	ns_t latency_max = 0;
+	ns_t latency_sum = 0;                   // since the last report
+	uint64_t latency_count = 0;
+	uint64_t bytes_reported = 0;
+	uint64_t scans_reported = 0;
+};
+
+std::vector<Port> ports;
+int epfd = -1;
+
+speed_t baud_constant(long baud)
+{
+	switch (baud) {
+		case 2400: return B2400;
+		case 4800: return B4800;
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		default: return 0;
+	}
+}
+
+/* Opens the port raw and non-blocking and adds it to epoll. A port that
+   isn't there (USB adapter unplugged) is retried every second. */
+bool open_port(Port &p)
+{
+	int fd = open(p.path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	termios t;
+	if (tcgetattr(fd, &t) == 0) {           // a FIFO or pipe has no line settings, fine for testing
+		cfmakeraw(&t);                      // 8N1, like the boards' UCSRnC
+		t.c_cflag |= CLOCAL | CREAD;
+		t.c_cc[VMIN] = 0;
+		t.c_cc[VTIME] = 0;
+		cfsetispeed(&t, baud_constant(opt.baud));
+		cfsetospeed(&t, baud_constant(opt.baud));
+		tcsetattr(fd, TCSANOW, &t);
+		tcflush(fd, TCIFLUSH);
+	}
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = &p - ports.data();
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		close(fd);
+		return false;
+	}
+
+	p.fd = fd;
+	p.parser = frame_parser{};
+	std::fprintf(stderr, "gateway: %s open\n", p.path.c_str());
+	return true;
+}
+
+void close_port(Port &p)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, p.fd, NULL);
+	close(p.fd);
+	p.fd = -1;
+	std::fprintf(stderr, "gateway: %s closed, retrying\n", p.path.c_str());
+}
+
+/******************************************************************* Scans ********************************************************************/
+
+struct Scan {
+	Port *port;
+	uint8_t addr;
+	char rfid[2 * TAG_BYTES + 1];
+	ns_t read_at;                           // when the last byte of its frame came in
+};
+
+std::vector<Scan> pending;
+
+/* Same checks as MainBoard's link ISR */
+void frame_received(Port &p, ns_t t)
+{
+	if (p.parser.type != FRAME_SCAN || p.parser.len != TAG_BYTES) return;
+
+	auto found = p.readers.find(p.parser.addr);
+	if (found == p.readers.end()) {         // first frame from this reader
+		found = p.readers.emplace(p.parser.addr, Reader{}).first;
+		found->second.seq = p.parser.seq - 1;
+	}
+	Reader &r = found->second;
+
+	if (p.parser.seq == r.seq) {
+		p.resent++;
+		return;
+	}
+	r.seq = p.parser.seq;
+
+	if (r.last_seen != 0 && std::memcmp(r.last_tag, p.parser.payload, TAG_BYTES) == 0 && t - r.last_seen < opt.dedupe_ms * MS) {
+		r.last_seen = t;
+		p.repeats++;
+		return;
+	}
+	std::memcpy(r.last_tag, p.parser.payload, TAG_BYTES);
+	r.last_seen = t;
+
+	Scan s;
+	s.port = &p;
+	s.addr = p.parser.addr;
+	tag_to_hex(p.parser.payload, s.rfid);
+	s.rfid[2 * TAG_BYTES] = 0;
+	s.read_at = t;
+	pending.push_back(s);
+}
+
+/* One read per wakeup, so a chatty port can't hold up the others; epoll
+   reports it again if there is more */
+void port_readable(Port &p)
+{
+	uint8_t buf[4096];
+	ssize_t n = read(p.fd, buf, sizeof buf);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+	if (n <= 0) {                           // hangup: USB adapter pulled
+		close_port(p);
+		return;
+	}
+
+	ns_t t = now_ns();
+	p.bytes += n;
+	for (ssize_t i = 0; i < n; i++) {
+		if (frame_parse(&p.parser, buf[i])) frame_received(p, t);
+	}
+}
+
+/******************************************************************* Database ********************************************************************/
+
+sqlite3 *db;
+sqlite3_stmt *update_toggle;
+sqlite3_stmt *update_set;
+
+uint64_t transactions;
+uint64_t batched;                           // scans in those transactions
+uint64_t busy;                              // passes that found the database locked
+
+bool exec(const char *sql)
+{
+	char *err = NULL;
+	if (sqlite3_exec(db, sql, NULL, NULL, &err) == SQLITE_OK) return true;
+	std::fprintf(stderr, "gateway: %s: %s\n", sql, err ? err : sqlite3_errmsg(db));
+	sqlite3_free(err);
+	return false;
+}
+
+/* Databases made before records had a version get the column, as the web
+   server does on its first request */
+void add_version_column()
+{
+	sqlite3_stmt *s;
+	bool found = false;
+	if (sqlite3_prepare_v2(db, "PRAGMA table_info(dogs)", -1, &s, NULL) != SQLITE_OK) return;
+	while (sqlite3_step(s) == SQLITE_ROW) {
+		if (std::strcmp((const char *)sqlite3_column_text(s, 1), "version") == 0) found = true;
+	}
+	sqlite3_finalize(s);
+	if (!found) exec("ALTER TABLE dogs ADD COLUMN version INTEGER NOT NULL DEFAULT 0");
+}
+
+bool open_database()
+{
+	if (sqlite3_open_v2(opt.database.c_str(), &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		std::fprintf(stderr, "gateway: %s: %s\n", opt.database.c_str(), sqlite3_errmsg(db));
+		return false;
+	}
+	sqlite3_busy_timeout(db, opt.busy_ms);
+	add_version_column();
+
+	/* rfid is bound as the hex text MainBoard sends to /add, so it matches
+	   the same rows the web server would */
+	const char *toggle = "UPDATE dogs SET adopted = NOT adopted, version = version + 1 WHERE rfid = ?1";
+	const char *set = "UPDATE dogs SET adopted = ?2, version = version + 1 WHERE rfid = ?1";
+	if (sqlite3_prepare_v2(db, toggle, -1, &update_toggle, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, set, -1, &update_set, NULL) != SQLITE_OK) {
+		std::fprintf(stderr, "gateway: %s: %s\n", opt.database.c_str(), sqlite3_errmsg(db));
+		return false;
+	}
+	return true;
+}
+
+/* Writes up to opt.batch pending scans in one transaction. If the web
+   server holds the lock they stay pending for the next pass. */
+void commit_pending()
+{
+	if (pending.empty()) return;
+
+	size_t n = std::min<size_t>(pending.size(), opt.batch);
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+		busy++;
+		return;
+	}
+
+	sqlite3_stmt *s = (opt.action == 't') ? update_toggle : update_set;
+	std::vector<bool> found(n);
+	for (size_t i = 0; i < n; i++) {
+		sqlite3_bind_text(s, 1, pending[i].rfid, -1, SQLITE_STATIC);
+		if (opt.action != 't') sqlite3_bind_int(s, 2, opt.action == 'a');
+		int rc = sqlite3_step(s);
+		sqlite3_reset(s);
+		if (rc != SQLITE_DONE) {
+			std::fprintf(stderr, "gateway: update %s: %s\n", pending[i].rfid, sqlite3_errmsg(db));
+			exec("ROLLBACK");
+			busy++;
+			return;
+		}
+		found[i] = sqlite3_changes(db) > 0;
+	}
+
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		exec("ROLLBACK");
+		busy++;
+		return;
+	}
+
+	ns_t t = now_ns();
+	transactions++;
+	batched += n;
+	for (size_t i = 0; i < n; i++) {
+		Scan &sc = pending[i];
+		Port &p = *sc.port;
+		if (!found[i]) {
+			p.unknown++;
+		} else {
+			p.scans++;
+		}
+		p.latency = t - sc.read_at;
+		p.latency_max = std::max(p.latency_max, p.latency);
+		p.latency_sum += p.latency;
+		p.latency_count++;
+		if (opt.verbose) {
+			std::printf("%s reader %u %s%s, %.2f ms\n", p.path.c_str(), sc.addr, sc.rfid,
+				found[i] ? "" : " not in the database", p.latency / (double)MS);
+		}
+	}
+	pending.erase(pending.begin(), pending.begin() + n);
+}
+
+/******************************************************************* Counters ********************************************************************/
+
+ns_t last_report;
+
+void report()
+{
+	ns_t t = now_ns();
+	double s = (t - last_report) / (double)SEC;
+	last_report = t;
+
+	std::printf("%-16s %4s %8s %7s %8s %7s %6s %5s %7s %8s %8s %8s\n", "port", "up", "bytes/s", "scans/s",
+		"scans", "repeats", "resent", "crc", "unknown", "last_ms", "avg_ms", "max_ms");
+	for (Port &p : ports) {
+		double avg = p.latency_count ? p.latency_sum / (double)p.latency_count / MS : 0;
+		std::printf("%-16s %4s %8.0f %7.1f %8llu %7llu %6llu %5u %7llu %8.2f %8.2f %8.2f\n", p.path.c_str(),
+			p.fd >= 0 ? "yes" : "no", (p.bytes - p.bytes_reported) / s, (p.scans - p.scans_reported) / s,
+			(unsigned long long)p.scans, (unsigned long long)p.repeats, (unsigned long long)p.resent,
+			p.parser.crc_errors, (unsigned long long)p.unknown,
+			p.latency / (double)MS, avg, p.latency_max / (double)MS);
+		p.bytes_reported = p.bytes;
+		p.scans_reported = p.scans;
+		p.latency_sum = 0;
+		p.latency_count = 0;
+	}
+	std::printf("%llu transactions, %.1f scans each, %llu passes found the database locked, %zu pending\n\n",
+		(unsigned long long)transactions, transactions ? batched / (double)transactions : 0.0,
+		(unsigned long long)busy, pending.size());
+	std::fflush(stdout);
+}
+
+/******************************************************************* Main ********************************************************************/
+
+[[noreturn]] void usage()
+{
+	std::fprintf(stderr,
+		"usage: gateway [options] port...\n"
+		"  -d FILE   database (/data/dogs.db)\n"
+		"  -b BAUD   link baud rate of every port (9600)\n"
+		"  -a a|s|t  what a scan does: adopted, surrendered, toggle (t)\n"
+		"  -w MS     dedupe window per reader (1500)\n"
+		"  -n N      most scans per transaction (256)\n"
+		"  -l MS     wait this long for the web server's lock (20)\n"
+		"  -s SEC    print the counters this often, also on SIGUSR1\n"
+		"  -v        print every scan\n");
+	std::exit(2);
+}
+
+void parse(int argc, char **argv)
+{
+	int c;
+	while ((c = getopt(argc, argv, "d:b:a:w:n:l:s:vh")) != -1) {
+		switch (c) {
+			case 'd': opt.database = optarg; break;
+			case 'b': opt.baud = std::atol(optarg); break;
+			case 'a': opt.action = optarg[0]; break;
+			case 'w': opt.dedupe_ms = std::atoi(optarg); break;
+			case 'n': opt.batch = std::max(1, std::atoi(optarg)); break;
+			case 'l': opt.busy_ms = std::atoi(optarg); break;
+			case 's': opt.stats_s = std::atoi(optarg); break;
+			case 'v': opt.verbose = true; break;
+			default: usage();
+		}
+	}
+	for (int i = optind; i < argc; i++) opt.ports.push_back(argv[i]);
+
+	if (opt.ports.empty()) usage();
+	if (opt.action == 0 || std::strchr("ast", opt.action) == NULL) usage();
+	if (baud_constant(opt.baud) == 0) {
+		std::fprintf(stderr, "gateway: unsupported baud rate %ld\n", opt.baud);
+		std::exit(2);
+	}
+}
+
+enum { EV_SIGNAL = -1, EV_TICK = -2 };
+
+void watch(int fd, int id)
+{
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)(int64_t)id;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	parse(argc, argv);
+	if (!open_database()) return 2;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	watch(sigfd, EV_SIGNAL);
+
+	/* once a second: reopen lost ports, counters */
+	int tick = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	itimerspec period = { { 1, 0 }, { 1, 0 } };
+	timerfd_settime(tick, 0, &period, NULL);
+	watch(tick, EV_TICK);
+
+	ports.resize(opt.ports.size());       // no reallocation after this, epoll holds indexes
+	for (size_t i = 0; i < ports.size(); i++) {
+		ports[i].path = opt.ports[i];
+		if (!open_port(ports[i])) std::fprintf(stderr, "gateway: %s: %s, retrying\n", opt.ports[i].c_str(), std::strerror(errno));
+	}
+
+	last_report = now_ns();
+	unsigned ticks = 0;
+	bool running = true;
+
+	while (running) {
+		epoll_event events[64];
+		int n = epoll_wait(epfd, events, 64, pending.empty() ? -1 : (int)opt.busy_ms);
+		if (n < 0 && errno != EINTR) {
+			std::perror("gateway: epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			int64_t id = (int64_t)events[i].data.u64;
+
+			if (id >= 0) {
+				Port &p = ports[id];
+				if (p.fd >= 0) port_readable(p);
+				if (pending.size() >= opt.batch) commit_pending();
+			} else if (id == EV_SIGNAL) {
+				signalfd_siginfo si;
+				if (read(sigfd, &si, sizeof si) != sizeof si) continue;
+				if (si.ssi_signo == SIGUSR1) report();
+				else running = false;
+			} else if (id == EV_TICK) {
+				uint64_t expirations;
+				if (read(tick, &expirations, sizeof expirations) != sizeof expirations) continue;
+				for (Port &p : ports) {
+					if (p.fd < 0) open_port(p);
+				}
+				if (opt.stats_s && ++ticks % opt.stats_s == 0) report();
+			}
+		}
+
+		/* everything read in this pass goes out in one transaction */
+		commit_pending();
+	}
+
+	while (!pending.empty()) {
+		size_t before = pending.size();
+		commit_pending();
+		if (pending.size() == before) break;
+	}
+	report();
+
+	sqlite3_finalize(update_toggle);
+	sqlite3_finalize(update_set);
+	sqlite3_close(db);
+	return 0;
+}
@@ -1,453 +1,1683 @@
-#define F_CPU 8000000UL
+#include "../../Common/clock.h"		// F_CPU, ahead of the AVR headers
 #include <avr/io.h>
 #include <inttypes.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <util/delay.h>
 #include <string.h>
+#ifdef LOCAL_READER
+#include "../../Common/em4100.h"
+#endif
+#include "../../Common/frame.h"
+#include "../../Common/lcd.h"
+#include "../../Common/memstat.h"
+#include "../../Common/mqtt.h"
+#include "../../Common/profile.h"
+#include "../../Common/sched.h"
+#include "../../Common/telemetry.h"
+#include "../../Common/usart.h"
 
-#define BAUD 9600
-#define BAUDRATE (((F_CPU / (BAUD * 16UL))) - 1)
 #define ICP PIND6
 #define IP     "35.162.87.20" 
 
 
 /********************************************************************** LCD Configuration ********************************************************************/
 
-#define lcdDdr		DDRA		//Data direction
-#define lcdPort		PORTA		//PortD
-#define lcdD7Bit	PORTA0		//LCD D7 (pin 14) -> PORTD7
-#define lcdD6Bit	PORTA1		//LCD D6 (pin 13) -> PORTD6
-#define lcdD5Bit	PORTA2		//LCD D5 (pin 12) -> PORTD5
-#define lcdD4Bit	PORTA3		//LCD D4 (pin 11) -> PORTD4
-#define lcdEBit		PORTA4		//LCD E (pin 6)   -> PORTD3
-#define lcdRSBit	PORTA5		//LCD RS (pin 4)  -> PORTD2
-
-#define lineOne			0x00                // Line 1
-#define lineTwo			0x40                // Line 2
-#define clear           0b00000001          // clears all characters
-#define home            0b00000010          // returns cursor to home
-#define entryMode       0b00000110          // moves cursor from left to right
-#define off      		0b00001000          // LCD off
-#define on       		0b00001100          // LCD on
-#define reset   		0b00110000          // reset the LCD
-#define bit4Mode 		0b00101000          // we are using 4 bits of data
-#define setCursor       0b10000000          //sets the position of cursor
-
-void lcd_write(uint8_t);
-void lcd_instruction(uint8_t);
-void lcd_char(uint8_t);
-void lcd_string(uint8_t string[]);
-void lcd_init(void);
-
-
-void lcd_init(void)
-{
-	lcdDdr |= (1 << lcdD7Bit) | (1 << lcdD6Bit) | (1 << lcdD5Bit) | (1 << lcdD4Bit) | (1 << lcdEBit) | (1 << lcdRSBit);
-	_delay_ms(100);
+#define LCD_COLS		20			// driver in Common/lcd.h
 
-	lcdPort &= ~(1 << lcdRSBit);                 // RS low
-	lcdPort &= ~(1 << lcdEBit);                 // E low
+/******************************************************************* Millisecond Timer *********************************************************************/
 
-	// LCD resets
-	lcd_write(reset);
-	_delay_ms(8);                           // 5 ms delay min
+ISR(TIMER0_COMPA_vect) {
+	sched_tick();
+}
 
-	lcd_write(reset);
-	_delay_us(200);                       // 100 us delay min
+/************************************************************************ Tasks ***************************************************************************/
 
-	lcd_write(reset);
-	_delay_us(200);
-	
-	lcd_write(bit4Mode);               	//set to 4 bit mode
-	_delay_us(50);                     // 40us delay min
+void command_task(uint8_t events);
+void scan_task(uint8_t events);
+void display_task(uint8_t events);
+void wifi_task(uint8_t events);
+void decode_task(uint8_t events);
 
-	lcd_instruction(bit4Mode);   	 // set 4 bit mode
-	_delay_us(50);                  // 40 us delay min
+enum {
+#ifdef LOCAL_READER
+	TASK_DECODE,
+#endif
+	TASK_COMMAND, TASK_SCAN, TASK_DISPLAY, TASK_WIFI, TASKS
+};
 
-	// display off
-	lcd_instruction(off);        	// turn off display
-	_delay_us(50);
+struct task tasks[TASKS] = {
+#ifdef LOCAL_READER
+	[TASK_DECODE]	= TASK(decode_task, 0, 20),			// a sample window is complete
+#endif
+	[TASK_COMMAND]	= TASK(command_task, 0, 0),
+	[TASK_SCAN]		= TASK(scan_task, 0, 20),			// frame from a reader or room in the upload queue
+	[TASK_DISPLAY]	= TASK(display_task, 0, 20),
+	[TASK_WIFI]		= TASK(wifi_task, 0, 50),			// next AT step or a new upload
+};
 
-	// Clear display
-	lcd_instruction(clear);              // clear display
-	_delay_ms(3);                       // 1.64 ms delay min
+/* Nothing released, sleep until the next interrupt (ms tick at the latest) */
+void idle(void) {
+	sleep_enable();
+	sei();									// sleep_cpu() runs before any pending interrupt
+	sleep_cpu();
+	sleep_disable();
+}
 
-	// entry mode
-	lcd_instruction(entryMode);          // this instruction shifts the cursor
-	_delay_us(40);                      // 40 us delay min
+/******************************************************************* RFID Configuration ********************************************************************/
+
+#define MAX_READERS		4			// addressed readers served by this board
+#define READER_QUEUE	4			// pending scans per reader, power of 2
+#define DEDUPE_MS		1500		// same tag from the same reader inside this window is a repeat
+
+uint16_t dedupe_ms = DEDUPE_MS;		// tunable over the link, see Telemetry
+
+struct reader {
+	uint8_t addr;
+	bool active;
+	uint8_t seq;							// last sequence number accepted
+	uint8_t last_tag[TAG_BYTES];
+	uint32_t last_seen;						// time of the last read of last_tag
+	uint8_t queue[READER_QUEUE][TAG_BYTES];
+	volatile uint8_t head;					// written by the ISR
+	volatile uint8_t tail;					// written by scan_task()
+	uint16_t repeats;						// reads dropped by the dedupe window
+	uint16_t overflows;						// reads dropped because the queue was full
+};
+
+struct {
+	/* scan being handled, ID[1..10] hex characters */
+	char ID[12 + 1];
+	uint8_t tag[TAG_BYTES];
+	uint8_t reader;
+	
+	struct reader readers[MAX_READERS];
+	uint8_t next;							// round robin position
+	struct frame_parser parser;
+	uint16_t unknown;						// frames from readers past MAX_READERS
+	uint16_t resent;						// frames received twice, same sequence number
+	uint16_t repeats;						// all readers, see struct reader
+	uint16_t overflows;
+	uint16_t commands_dropped;				// arrived while the last one was still pending
+	volatile uint8_t command;				// FRAME_COMMAND for this board, 0 = none
+	uint8_t args[FRAME_MAX_PAYLOAD - 1];	// rest of its payload
+	uint8_t args_len;
+	uint8_t queue_peak;						// deepest any reader queue has been
+}RF;
 
-	// Display on
-	lcd_instruction(on);          // turn on the display
-	_delay_us(50);               // same delay as off
+struct reader * find_reader(uint8_t addr) {
+	for (uint8_t i = 0; i < MAX_READERS; i++) {
+		struct reader *r = &RF.readers[i];
+		if (r->active && r->addr == addr) return r;
+		if (!r->active) {					// first frame from this reader
+			r->active = true;
+			r->addr = addr;
+			r->seq = RF.parser.seq - 1;
+			return r;
+		}
+	}
+	return NULL;
 }
 
+/* What became of a scan, for the simulator's per scan latency: 'q'
+   queued, 'r' repeat, 'o' queue full, 'u' uploaded, 'p' dropped while
+   its tag's upload is pending, 'i' intake repeat, and 'f' when the upload
+   for the tag has finished */
+#ifdef SIMULATOR
+void scan_note(char what, uint8_t addr, const uint8_t tag[TAG_BYTES]) {
+	char note[4 + 3 + 10 + 1];
+	uint8_t n = snprintf_P(note, sizeof note, PSTR("%c %u "), what, addr);
+	tag_to_hex(tag, note + n);
+	note[n + 10] = 0;
+	hal_note(note);
+}
+#else
+#define scan_note(what, addr, tag)
+#endif
+
+/* Copies the next pending scan into RF.ID, one reader at a time so a busy
+   reader can't starve the others */
+bool next_scan(void) {
+	for (uint8_t n = 0; n < MAX_READERS; n++) {
+		struct reader *r = &RF.readers[RF.next];
+		RF.next = (RF.next + 1) % MAX_READERS;
+		
+		if (r->head == r->tail) continue;
+		
+		memcpy(RF.tag, r->queue[r->tail % READER_QUEUE], TAG_BYTES);
+		tag_to_hex(RF.tag, RF.ID + 1);
+		RF.ID[12 - 1] = RF.ID[0] = 0;
+		RF.reader = r->addr;
+		r->tail++;
+		return true;
+	}
+	return false;
+}
 
-void lcd_string(uint8_t string[])
-{
-	int i = 0;                             //while the string is not empty
-	while (string[i] != 0)
-	{
-		lcd_char(string[i]);
-		i++;
-		_delay_us(50);                              //40 us delay min
+/* A read from reader r, from the link ISR or with interrupts off: queued
+   for scan_task() unless it is a repeat or the queue is full */
+void reader_scan(struct reader *r, const uint8_t tag[TAG_BYTES]) {
+	/* tag held in front of the reader */
+	if (memcmp(r->last_tag, tag, TAG_BYTES) == 0 && sched_ms - r->last_seen < dedupe_ms) {
+		r->last_seen = sched_ms;
+		r->repeats++;
+		RF.repeats++;
+		scan_note('r', r->addr, tag);
+		return;
+	}
+	
+	if ((uint8_t)(r->head - r->tail) >= READER_QUEUE) {
+		r->overflows++;
+		RF.overflows++;
+		scan_note('o', r->addr, tag);
+		return;
 	}
+	
+	memcpy(r->queue[r->head % READER_QUEUE], tag, TAG_BYTES);
+	memcpy(r->last_tag, tag, TAG_BYTES);
+	r->last_seen = sched_ms;
+	r->head++;
+	MEMSTAT_PEAK(RF.queue_peak, (uint8_t)(r->head - r->tail));
+	scan_note('q', r->addr, tag);
+	task_signal(&tasks[TASK_SCAN], 1);
 }
 
+ISR(USART0_RX_vect) {
+	char num = usart0_receive();
+	
+	if (!frame_parse(&RF.parser, num)) return;
+	
+	if (RF.parser.type == FRAME_COMMAND) {
+		if (RF.parser.addr == 0 && RF.parser.len > 0) {
+			if (RF.command != 0) RF.commands_dropped++;
+			else {
+				RF.args_len = RF.parser.len - 1;
+				memcpy(RF.args, RF.parser.payload + 1, RF.args_len);
+				RF.command = RF.parser.payload[0];
+				task_signal(&tasks[TASK_COMMAND], 1);
+			}
+		}
+		return;
+	}
+	
+	if (RF.parser.type != FRAME_SCAN || RF.parser.len != TAG_BYTES) return;
+	
+	struct reader *r = find_reader(RF.parser.addr);
+	if (r == NULL) {
+		RF.unknown++;
+		return;
+	}
+	
+	if (RF.parser.seq == r->seq) {			// same frame sent twice
+		RF.resent++;
+		return;
+	}
+	r->seq = RF.parser.seq;
+	
+	reader_scan(r, RF.parser.payload);
+}
 
-void lcd_char(uint8_t data)
-{
-	lcdPort |= (1 << lcdRSBit);                 // RS high
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	lcd_write(data);                          // write the upper four bits of data
-	lcd_write(data << 4);                    // write the lower 4 bits of data
+
+/******************************************************************* Local Reader ********************************************************************/
+
+/* Built with LOCAL_READER, MainBoard reads tags itself: the RFReceiver
+   front end (coil driver on PD7, envelope on PA7) wired to this board and
+   decoded with the same code, Common/em4100.h. A read goes into the queue
+   of reader LOCAL_READER_ADDR like a FRAME_SCAN from the link, so dedupe,
+   the status cache and the upload are the same, without the frame, the
+   XBee hop and the reader's own display and beep. Readers on the link
+   still work alongside.
+   
+   The carrier and sampling stay on: RFReceiver's presence detection
+   sleeps in power down, which would stop the ESP8266's USART. The slicer's
+   ADC interrupt every 52 us is short enough for USART1 at WIFI_BAUD, which
+   has a byte of buffer behind the one being received. */
+
+#ifdef LOCAL_READER
+
+#if !SLICER_ADC
+#error "PD2 is USART1 on MainBoard, LOCAL_READER needs SLICER_ADC"
+#endif
+
+#define LOCAL_READER_ADDR	0			// MainBoard's own address, R0 on the display
+
+struct reader *local_reader;
+
+ISR(TIMER1_COMPA_vect) {
+	if (read_value()) task_signal(&tasks[TASK_DECODE], 1);
 }
 
+void local_reader_init(void) {
+	local_reader = find_reader(LOCAL_READER_ADDR);	// first slot, before any frame arrives
+	frequency_init();
+	timer1_init();
+	em4100_start();
+}
 
-void lcd_instruction(uint8_t instruction)
-{
-	lcdPort &= ~(1 << lcdRSBit);                // RS low
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	lcd_write(instruction);                   // write the upper 4 bits of data
-	 _delay_us(10);
-	lcd_write(instruction << 4);             // write the lower 4 bits of data
-	  _delay_ms(5);
+void decode_task(uint8_t events) {
+	uint8_t tag[TAG_BYTES];
+	
+	if (!em4100_decode(tag)) return;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {		// shared with the link ISR
+		reader_scan(local_reader, tag);
+	}
 }
 
+#else
 
-void lcd_write(uint8_t byte)
-{
-	lcdPort &= ~(1 << lcdD7Bit);                        // assume that data is '0'
-	if (byte & 1 << 7) lcdPort |= (1 << lcdD7Bit);     // make data = '1' if necessary
+static inline void local_reader_init(void) {}
+
+#endif /* LOCAL_READER */
+
+
+/******************************************************************* Status Cache *****************************************************************/
+
+/* The server owns each dog's status. Every /add reply carries it with the
+   version of the record ("a 18"), and the last few are kept here.
+   
+   A scan of a tag confirmed within STATUS_TTL_S sends the opposite status
+   straight away, together with the version it was based on. An older or
+   unknown one asks the server to toggle ('t'), with the version if there
+   is one. Either way, if the record has moved on (admin edit, another
+   reader) the server answers 409 with its status instead of changing it,
+   and the entry is corrected from that. */
 
-	lcdPort &= ~(1 << lcdD6Bit);                        // repeat for each data bit
-	if (byte & 1 << 6) lcdPort |= (1 << lcdD6Bit);
+#define STATUS_CACHE	8
+#define STATUS_TTL_S	120
+#define NO_VERSION		0xFFFF
 
-	lcdPort &= ~(1 << lcdD5Bit);
-	if (byte & 1 << 5) lcdPort |= (1 << lcdD5Bit);
+uint16_t status_ttl_s = STATUS_TTL_S;	// tunable
 
-	lcdPort &= ~(1 << lcdD4Bit);
-	if (byte & 1 << 4) lcdPort |= (1 << lcdD4Bit);
+struct status {
+	uint8_t tag[TAG_BYTES];
+	char status;							// 'a' or 's' as last confirmed, 0 = not known
+	uint16_t version;						// NO_VERSION until the server has answered
+	uint32_t checked;						// time of that answer
+	bool pending;							// upload out, more reads of it are repeats
+	bool used;
+};
+
+struct {
+	struct status entries[STATUS_CACHE];
+	uint16_t hits;							// scans decided from the cache
+	uint16_t misses;						// scans the server had to decide
+	uint16_t conflicts;						// 409 replies, the cache was behind
+	uint16_t pending_drops;					// scans of a tag whose upload was still out
+	uint16_t pushes;						// entries brought up to date unasked, UPLINK_MQTT only
+} Status;
+
+/* Entry for tag, NULL if it isn't cached */
+struct status * status_find(const uint8_t tag[TAG_BYTES]) {
+	for (uint8_t i = 0; i < STATUS_CACHE; i++) {
+		struct status *e = &Status.entries[i];
+		if (e->used && memcmp(e->tag, tag, TAG_BYTES) == 0) return e;
+	}
+	return NULL;
+}
 
-	// write the data
+/* Entry for tag, or the least recently confirmed one cleared for it */
+struct status * status_entry(const uint8_t tag[TAG_BYTES]) {
+	struct status *oldest = status_find(tag);
+	if (oldest != NULL) return oldest;
 	
-	lcdPort |= (1 << lcdEBit);                   // E high
-	_delay_us(1);                               // data setup
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	_delay_us(1);                             // hold data
+	for (uint8_t i = 0; i < STATUS_CACHE; i++) {
+		struct status *e = &Status.entries[i];
+		if (oldest != NULL && !oldest->used) continue;
+		if (!e->used) oldest = e;
+		else if (!e->pending && (oldest == NULL || (int32_t)(e->checked - oldest->checked) < 0)) oldest = e;
+	}
+	if (oldest == NULL) oldest = &Status.entries[0];	// all pending, can't happen with the upload queue longer than the cache
+	
+	memset(oldest, 0, sizeof *oldest);
+	memcpy(oldest->tag, tag, TAG_BYTES);
+	oldest->version = NO_VERSION;
+	oldest->used = true;
+	return oldest;
 }
 
-/******************************************************************* RFID Configuration ********************************************************************/
+bool status_fresh(const struct status *e) {
+	return e->status != 0 && e->version != NO_VERSION && sched_now() - e->checked < status_ttl_s * 1000UL;
+}
 
-typedef enum {adopted, surrendered} dog_status;
 
-struct {
-	char tag[12 + 1];
-	dog_status status;
-}
-cards[3] = {
-	[0].tag = {0x00, 0x32, 0x43, 0x30, 0x30, 0x41, 0x43, 0x36, 0x39, 0x33, 0x45, 0x00, 0x00}, //2C00AC693E
-	[0].status = surrendered,
-	[1].tag = {0x00, 0x33, 0x31, 0x30, 0x30, 0x33, 0x37, 0x44, 0x39, 0x33, 0x44, 0x00, 0x00}, //310037D93D
-	[1].status = surrendered,
-	[2].tag = {0x00, 0x36, 0x46, 0x30, 0x30, 0x35, 0x43, 0x41, 0x44, 0x36, 0x30, 0x00, 0x00}, //6F005CAD60
-	[2].status = surrendered
+/******************************************************************* Wifi Configuration *****************************************************************/
+
+#define ROWS 15
+#define COLS 52
+#define UPLOAD_QUEUE	8			// uploads waiting for the ESP8266, power of 2
+
+#define WIFI_LINE		0x01		// event: the ISR finished a response line
+#define WIFI_UPLOAD		0x02		// event: queue_upload() added an upload
+
+#define WIFI_PROBE_MS	100			// per "AT" while looking for a running module
+#define WIFI_PROBE_TRIES 10			// ~1 s, long enough for the module's own power-up
+#define WIFI_REPLY_MS	500			// longest wait for OK to a local command
+#define WIFI_RESET_MS	2000		// AT+RST until "ready"
+#define WIFI_ASSOC_MS	500			// between AT+CIPSTATUS polls while not associated
+#define WIFI_LINK_MS	1000		// longest wait for the server side of an upload
+#define WIFI_BUSY_MS	10			// before a command the module answered "busy s..." goes again
+
+#ifndef WIFI_LINKS
+#define WIFI_LINKS		3			// uploads in flight at once, 1..5 (the module's link IDs)
+#endif
+#define WIFI_TRIES		3			// attempts per upload, see upload_repeatable()
+
+#ifdef UPLINK_MQTT
+#undef WIFI_LINKS
+#define WIFI_LINKS		1			// the connection to the broker, see mqtt_session()
+#endif
+
+uint16_t wifi_link_ms = WIFI_LINK_MS;	// tunable
+
+/* Steps of bringing the ESP8266 up and of one upload. Each step sends its
+   command and moves on as soon as the answer line comes in (WIFI_LINE),
+   the task_delay() is only the timeout.
+   
+   At power-up the module is probed with "AT" first. A module that
+   answers has already booted (MainBoard alone was reset, or both came up
+   together) and keeps its association, so AT+RST and the seconds it costs
+   are only used when the probe gets no answer.
+   
+   Uploads go out over up to WIFI_LINKS connections at once (AT+CIPMUX=1).
+   The AT commands still go one at a time: a link is opened and its request
+   written, then the command steps are free for the next upload while the
+   module sends it and the server works on it. Until its SEND OK the module
+   answers "busy s..." to a command, which then goes again WIFI_BUSY_MS
+   later (link_command()). Answers come back tagged with the link ID
+   (+IPD,<id>,<len>: and <id>,CLOSED) and the receive ISR files them under
+   that link, so a slow reply holds up only its own upload. */
+typedef enum {
+	WIFI_PROBE,				// "AT" sent
+	WIFI_RESET,				// AT+RST sent, waiting for "ready"
+	WIFI_ECHO,				// ATE0 sent
+	WIFI_MUX,				// AT+CIPMUX=1 sent
+	WIFI_STATUS,			// AT+CIPSTATUS sent
+	WIFI_ASSOCIATE,			// not associated yet, asking again in a moment
+	WIFI_IDLE,				// connected, no command out
+	WIFI_OPEN,				// AT+CIPSTART=<id> sent
+	WIFI_SEND,				// AT+CIPSEND=<id> sent, waiting for the '>' prompt
+	WIFI_CLOSE				// AT+CIPCLOSE=<id> sent for a link that timed out
+} wifi_state;
+
+struct upload {
+	char rfid[10];
+	char action;							// 'a', 's' or 't'
+	uint16_t version;						// record version it is based on, or NO_VERSION
+	uint32_t queued;						// time of queue_upload()
+	uint8_t tries;							// attempts started
+	bool busy;								// on a link now
+	bool done;								// answered or given up, leaves the queue when the ones before it have
+#ifdef UPLINK_MQTT
+	bool acked;								// the broker has it, waiting for the bridge's reply
+	uint32_t deadline;						// sched_now() by which that reply has to be in
+#endif
 };
 
-void USART_RF_init(void)
-{
-	/*Set baud rate */
-	UBRR0H = (BAUDRATE>>8);
-	UBRR0L = BAUDRATE;
-	
-	/* Enable receiver and transmitter */
-	UCSR0B = (1<<RXEN0)|(1<<TXEN0);
+typedef enum {
+	LINK_FREE,
+	LINK_OPEN,								// CIPSTART or CIPSEND in progress
+	LINK_WAIT,								// request out, waiting for <id>,CLOSED
+	LINK_STALE								// timed out, to be closed
+} link_state;
+
+/* A connection to the server. The fields marked ISR are filled from the
+   +IPD data and the <id>,CONNECT / <id>,CLOSED lines. */
+struct link {
+	uint8_t state;
+	uint8_t upload;							// position in the queue (upload_tail..upload_head)
+	bool sent;								// the request went out, the server may have acted on it
+	uint32_t deadline;						// sched_now() by which the reply has to be in
+	volatile bool connected;				// ISR
+	volatile bool closed;					// ISR
+	volatile uint16_t code;					// ISR, HTTP status, 0 until the status line is in
+	volatile char status;					// ISR, 'a' or 's' from the body
+	volatile uint16_t version;				// ISR
+	volatile char line[12];					// ISR, start of the +IPD line being received
+	volatile uint8_t line_len;
+};
 
-	/* Set frame format: 8data, 1stop bit, no parity */
-	UCSR0C = (3<<UCSZ00);
+struct {
+	volatile char response[ROWS][COLS];
+	volatile uint8_t row_index;
+	volatile uint8_t col_index;
+	uint8_t col_peak;						// longest line received
+	uint8_t row_peak;						// most lines held between clear_response() calls
 	
-	/* Enable interrupt */
-	UCSR0B |= (1 << RXCIE0);
+	uint8_t state;
+	uint8_t tries;							// of the current step: probes without an answer, CIPMUX refused
+	bool online;							// associated, scans are taken
+	uint32_t ready_ms;						// reset to online, shown once on the LCD
+	char request[COLS];						// HTTP request line of the upload being sent
+	uint8_t request_len;
+	bool resend;							// the command got "busy s...", goes again on the timer
+	
+	struct link links[WIFI_LINKS];
+	uint8_t link;							// the one the command steps are working on
+	volatile uint8_t ipd_link;				// ISR: +IPD data goes to this link
+	volatile uint16_t ipd_left;				// ISR: bytes of it still to come
+	
+	struct upload uploads[UPLOAD_QUEUE];
+	uint8_t upload_head;
+	uint8_t upload_tail;
+	uint8_t upload_peak;					// most uploads waiting
+	uint16_t upload_drops;					// scans not uploaded because the queue was full
+	
+	uint16_t timeouts;						// AT commands and upload steps that got no answer
+	uint16_t resets;						// AT+RST sent, at power-up or to recover
+	uint16_t truncated;						// response lines cut at COLS
+	uint16_t answered;						// requests that got an HTTP reply
+	uint16_t failed;						// requests that got none
+	uint16_t retries;						// uploads started again on a new link
+	uint16_t busy;							// commands the module answered "busy s..."
+	uint8_t links_peak;						// most links in use at once
+	uint16_t latency;						// queue_upload() to reply of the last upload, ms
+	uint16_t latency_max;
+	uint16_t latency_avg;					// moving average over about 8 uploads
+} Wifi;
+
+void USART_Wifi_cmd(char string[]);
+void USART_Wifi_cmd_P(const char *string);
+void USART_Wifi_printf_P(const char *format, ...);
+bool Wifi_response_P(const char *string);
+void clear_response(void);
+void wifi_command_P(uint8_t state, const char *command, uint16_t timeout);
+void upload_done(const struct upload *u, uint16_t code, char status, uint16_t version);
 
+/* Called before the LCD is set up, so the module can answer the first
+   probe while lcd_init() waits for the display */
+void USART_Wifi_init(void) {
+	
+	usart1_init(WIFI_UBRR, WIFI_U2X);
+	
+	wifi_command_P(WIFI_PROBE, PSTR("AT"), WIFI_PROBE_MS);
 }
 
-unsigned char USART_RF_receive(void)
-{
-	/* Wait for data to be received */
-	while(~(UCSR0A) & (1<<RXC0));
+void USART_Wifi_cmd(char string[]) {
+	for (int i = 0; string[i] != 0; i++) {
+		usart1_send(string[i]);
+	}
+	usart1_send(0x0D);
+	usart1_send(0x0A);
+}
 
-	/* Get and return received data from buffer */
-	return UDR0;
+void USART_Wifi_cmd_P(const char *string) {
+	char c;
+	while ((c = pgm_read_byte(string++)) != 0) {
+		usart1_send(c);
+	}
+	usart1_send(0x0D);
+	usart1_send(0x0A);
 }
 
-void USART_RF_send(unsigned char data)
-{
-	/* Wait for data to be received */
-	while (!( UCSR0A & (1<<UDRE0)));
-	UDR0 = data;
+/* Command with arguments, format string in flash */
+void USART_Wifi_printf_P(const char *format, ...) {
+	char line[COLS];
+	va_list args;
+	
+	va_start(args, format);
+	vsnprintf_P(line, sizeof line, format, args);
+	va_end(args);
+	USART_Wifi_cmd(line);
 }
 
-struct {
-	/* RFID buffer */
-	volatile char ID[12 + 1];
-	volatile uint8_t index;
-	volatile bool done;
-}RF;
+bool Wifi_response_P(const char *string) {
+	for (int i = 0; i < ROWS - 1; i++) {
+		if(strcmp_P((char *)Wifi.response[i], string) == 0) {
+			Wifi.response[i][0] = 0; 
+			return true;
+		}
+	}
+	return false;
+}
 
-inline void RFID_done(void) {
-	while(!RF.done);
+/* A line coming in meanwhile (<id>,CLOSED or +IPD of another link) is
+   moved to the first row instead of cut off */
+void clear_response(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t row = Wifi.row_index, col = Wifi.col_index;
+		for (uint8_t i = 0; i < col && row != 0; i++) {
+			Wifi.response[0][i] = Wifi.response[row][i];
+		}
+		for (int i = (col > 0) ? 1 : 0; i < ROWS - 1; i++) {
+			Wifi.response[i][0] = 0;
+		}
+		Wifi.row_index = 0;
+	}
 }
 
-inline void RFID_ready(void) {
-	/* RFID buffer is ready to be refilled*/
-	RF.done = false;
+/* Whether queue_upload() has room for one more */
+bool upload_room(void) {
+	return (uint8_t)(Wifi.upload_head - Wifi.upload_tail) < UPLOAD_QUEUE;
 }
 
-char * get_card_id(int8_t index) {
-	char * rfid = (index == -1)? (char *) RF.ID : cards[index].tag;
-	return  (rfid + 1); 
+/* Queues a status change for the server, rfid is 10 hex characters */
+bool queue_upload(const char *rfid, char action, uint16_t version) {
+	if (!upload_room()) {
+		Wifi.upload_drops++;
+		return false;
+	}
+	
+	struct upload *u = &Wifi.uploads[Wifi.upload_head % UPLOAD_QUEUE];
+	memcpy(u->rfid, rfid, sizeof u->rfid);
+	u->action = action;
+	u->version = version;
+	u->queued = sched_now();
+	u->tries = 0;
+	u->busy = false;
+	u->done = false;
+	Wifi.upload_head++;
+	MEMSTAT_PEAK(Wifi.upload_peak, (uint8_t)(Wifi.upload_head - Wifi.upload_tail));
+	
+	task_signal(&tasks[TASK_WIFI], WIFI_UPLOAD);
+	return true;
 }
 
-int find_card(void) {
-	for (int i = 0; i < 3; i++) {
-		if (strcmp(cards[i].tag + 1, (char *)(RF.ID + 1)) == 0) {
-			return i;
+/* One line of a link's +IPD data, in the ISR: the status line gives the
+   HTTP code, the body of an /add reply the status ("a 18") */
+void link_line(struct link *l) {
+	volatile char *line = l->line;
+	uint8_t len = l->line_len;
+	l->line_len = 0;
+	
+	if (len >= 12 && strncmp_P((char *)line, PSTR("HTTP/1."), 7) == 0) {
+		l->code = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+	} else if (len >= 3 && (line[0] == 'a' || line[0] == 's') && line[1] == ' ') {
+		uint16_t version = 0;
+		for (uint8_t i = 2; i < len && line[i] >= '0' && line[i] <= '9'; i++) {
+			version = version * 10 + (line[i] - '0');
 		}
+		l->status = line[0];
+		l->version = version;
 	}
-	return -1;
 }
 
-ISR(USART0_RX_vect) {
-	char num = USART_RF_receive();
-	
-	if (!RF.done) {
+void link_data(struct link *l, char c) {
+	if (c == 0x0A) link_line(l);
+	else if (c != 0x0D && l->line_len < sizeof l->line) l->line[l->line_len++] = c;
+}
 
-	RF.ID[RF.index++] = num;
-	if (RF.index >= 12) { 
-		RF.index = 0;
-		RF.ID[12 - 1] = RF.ID[0] = 0; 
-		RF.done = true; 
+/* "+IPD,<id>,<len>:" complete in row, the data follows */
+void link_ipd(volatile char *row) {
+	uint8_t id = row[5] - '0';
+	uint16_t len = 0;
+	for (uint8_t i = 7; row[i] >= '0' && row[i] <= '9'; i++) {
+		len = len * 10 + (row[i] - '0');
 	}
+	Wifi.ipd_link = (row[6] == ',' && id < WIFI_LINKS) ? id : 0xFF;
+	Wifi.ipd_left = len;
+}
+
+/* "<id>,CONNECT" and "<id>,CLOSED" */
+void link_event(volatile char *row) {
+	uint8_t id = row[0] - '0';
+	if (row[1] != ',' || id >= WIFI_LINKS) return;
+	
+	struct link *l = &Wifi.links[id];
+	if (strcmp_P((char *)row + 2, PSTR("CONNECT")) == 0) {
+		l->connected = true;
+	} else if (strcmp_P((char *)row + 2, PSTR("CLOSED")) == 0) {
+		if (l->line_len > 0) link_line(l);	// body without a line end
+		l->closed = true;
 	}
 }
 
+/* Time from the scan being queued to the server's answer */
+void upload_latency(const struct upload *u, uint16_t code) {
+	if (code == 0) {
+		Wifi.failed++;
+		return;
+	}
+	
+	uint32_t ms = sched_now() - u->queued;
+	Wifi.latency = (ms > 0xFFFF) ? 0xFFFF : ms;
+	MEMSTAT_PEAK(Wifi.latency_max, Wifi.latency);
+	if (Wifi.answered++ == 0) Wifi.latency_avg = Wifi.latency;
+	else Wifi.latency_avg += ((int32_t)Wifi.latency - Wifi.latency_avg) / 8;
+}
 
-/******************************************************************* Wifi Configuration *****************************************************************/
+void link_open(uint8_t id, uint8_t upload) {
+	struct link *l = &Wifi.links[id];
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memset(l, 0, sizeof *l);
+	}
+	l->state = LINK_OPEN;
+	l->upload = upload;
+	
+	struct upload *u = &Wifi.uploads[upload % UPLOAD_QUEUE];
+	u->busy = true;
+	if (u->tries++ > 0) Wifi.retries++;
+	
+	uint8_t in_use = 0;
+	for (uint8_t i = 0; i < WIFI_LINKS; i++) {
+		if (Wifi.links[i].state != LINK_FREE) in_use++;
+	}
+	MEMSTAT_PEAK(Wifi.links_peak, in_use);
+}
 
-#define ROWS 15
-#define COLS 52
+/* The upload leaves the queue once every one queued before it has too,
+   so upload_tail..upload_head stays the range of slots in use */
+void upload_finish(struct upload *u, uint16_t code, char status, uint16_t version) {
+	u->busy = false;
+	u->done = true;
+	upload_latency(u, code);
+	upload_done(u, code, status, version);
+	
+	while (Wifi.upload_tail != Wifi.upload_head && Wifi.uploads[Wifi.upload_tail % UPLOAD_QUEUE].done) {
+		Wifi.upload_tail++;
+	}
+	task_signal(&tasks[TASK_SCAN], 1);		// scans waiting for room in the queue
+}
 
-struct {
-	volatile char response[ROWS][COLS];
-	volatile uint8_t row_index;
-	volatile uint8_t col_index;
-} Wifi;
+/* Whether an upload that got no answer may go out again: always if the
+   server can't have acted on it yet (sent false), otherwise if doing it
+   twice is harmless: 'a' and 's' set a status, and with a version the
+   server answers a second toggle with 409. A 't' without a version that
+   may have reached the server is given up, like before. */
+bool upload_repeatable(const struct upload *u, bool sent) {
+	bool harmless = !sent || u->action != 't' || u->version != NO_VERSION;
+	return harmless && u->tries < WIFI_TRIES && u->action != 'b';
+}
 
-void USART_Wifi_init(void) {
+/* The link broke without an answer */
+void link_failed(struct link *l) {
+	struct upload *u = &Wifi.uploads[l->upload % UPLOAD_QUEUE];
 	
-	UBRR1H = (BAUDRATE>>8);
-	UBRR1L = BAUDRATE;
-	UCSR1B = (1<<TXEN1) | (1<<RXEN1);
-	UCSR1C = (3<<UCSZ10);
-	UCSR1B |= (1 << RXCIE1);
+	if (upload_repeatable(u, l->sent)) {
+		u->busy = false;					// picked up again from the queue, on a new link
+	} else {
+		upload_finish(u, 0, 0, NO_VERSION);
+	}
+}
+
+/* Links that have closed or run out of time, checked whenever the task runs */
+void links_poll(void) {
+	uint32_t now = sched_now();
 	
-	while(1){
-		clear_response();
-		USART_Wifi_cmd("AT+RST");
+	for (uint8_t i = 0; i < WIFI_LINKS; i++) {
+		struct link *l = &Wifi.links[i];
+		if (l->state != LINK_WAIT) continue;
 		
-		lcd_instruction(clear);
-		lcd_string((uint8_t *)"Configuring Wifi...");
-		_delay_ms(1000);
-		
-		if (!Wifi_response("ready")) {
-			lcd_instruction(clear);
-			lcd_string((uint8_t *)"Hardware error"); //USART not connected
-			lcd_instruction(setCursor | lineTwo);
-			lcd_string((uint8_t *)"Restarting...");
-			_delay_ms(1000);
-			continue;
+		if (l->closed) {
+			l->state = LINK_FREE;
+			if (l->code == 0) {				// closed without an answer
+				link_failed(l);
+			} else {
+				upload_finish(&Wifi.uploads[l->upload % UPLOAD_QUEUE], l->code, l->status, l->version);
+			}
+		} else if ((int32_t)(now - l->deadline) >= 0) {
+			/* the server has it and is slow, sending it again would only
+			   add to its load */
+			Wifi.timeouts++;
+			l->state = LINK_STALE;
+			upload_finish(&Wifi.uploads[l->upload % UPLOAD_QUEUE], 0, 0, NO_VERSION);
 		}
-		
-		USART_Wifi_cmd("ATE0");
-		_delay_ms(500);
-		
-		if (!connected()) continue;       // restarting if wifi is not responding
-		upload_to_server("----------",'b');
-		break;
 	}
 }
 
+/* Oldest upload not on a link yet, or -1 */
+int16_t next_upload(void) {
+	for (uint8_t i = Wifi.upload_tail; i != Wifi.upload_head; i++) {
+		struct upload *u = &Wifi.uploads[i % UPLOAD_QUEUE];
+		if (!u->busy && !u->done) return i;
+	}
+	return -1;
+}
 
-void USART_Wifi_send(unsigned char data) {
-	while (!( UCSR1A & (1<<UDRE1)));
-	UDR1 = data;
+/* Time until the first link in flight runs out, for the idle timeout */
+int32_t links_next_deadline(void) {
+	int32_t next = INT32_MAX;
+	uint32_t now = sched_now();
+	
+	for (uint8_t i = 0; i < WIFI_LINKS; i++) {
+		if (Wifi.links[i].state != LINK_WAIT) continue;
+		int32_t left = Wifi.links[i].deadline - now;
+		if (left < next) next = left;
+	}
+	return next;
 }
 
-unsigned char USART_Wifi_receive(void) {
-	while(~(UCSR1A) & (1<<RXC1));
-	return UDR1;
+/* Built with UPLINK_MQTT, uploads are published to a broker over one
+   connection that stays open instead of a GET each, and Bridge/ on the
+   server takes them into dogs.db (Common/mqtt.h):
+   
+     dogs/scan/<client>    "<rfid> <action>[ <version>]"        board to bridge, QoS 1
+     dogs/reply/<client>   "<rfid> <code> <status> <version>"   bridge to board
+     dogs/status           "<rfid> <status> <version>"          bridge to every board
+   
+   code is what /add would have answered (200, 409, 404; status '-' with
+   404). A scan costs about 40 bytes each way instead of a TCP connect,
+   the request line and a reply with headers, and scans that queue up
+   behind each other go out in one AT+CIPSEND.
+   
+   The broker's PUBACK means it has the scan, which then only waits for
+   its reply. A scan not acknowledged when the connection drops is
+   published again on the next one if upload_repeatable() allows it.
+   
+   dogs/status carries every change to the table, from the web site or
+   another reader, and keeps the status cache current, so that dog's next
+   scan here doesn't end in a 409. Those and the replies come at QoS 0 and
+   the board never has to acknowledge anything: a lost reply is a timed
+   out upload as with HTTP, and a missed status is caught by the version
+   like any stale cache entry. */
+
+#ifdef UPLINK_MQTT
+
+#ifndef MQTT_CLIENT
+#define MQTT_CLIENT		"mainboard"	// client ID and own topics, unique per board, up to 16 characters
+#endif
+#define MQTT_KEEPALIVE_S 60
+#define MQTT_PING_MS	30000		// quiet this long, PINGREQ
+#define MQTT_RX			64			// +IPD bytes waiting for the task, power of 2
+#define MQTT_OUT		96			// packets sent in one AT+CIPSEND
+
+/* Packet ID of the upload at queue position i, never 0 */
+#define MQTT_ID(i)		((uint16_t)(uint8_t)(i) + 1)
+
+struct {
+	volatile uint8_t rx[MQTT_RX];			// ISR
+	volatile uint8_t rx_head;				// ISR
+	volatile uint8_t rx_tail;
+	volatile bool rx_overrun;				// ISR, the task fell behind and the stream is lost
+	struct mqtt_parser parser;
+	uint8_t out[MQTT_OUT];					// what goes out at the next '>' prompt
+	uint8_t out_len;
+	bool up;								// CONNACK received
+	bool waiting;							// CONNECT or PINGREQ out, answer due by the link deadline
+	uint32_t sent_at;						// last packet out, for the keep-alive
+	
+	uint16_t sessions;						// CONNACKs
+	uint16_t published;						// scans published, again after a drop included
+	uint16_t lost;							// connections closed, timed out or overrun
+} Mqtt;
+
+/* ISR: +IPD data of the broker connection, parsed by the task. Signals
+   when half full as well as at the end, replies can come in a bunch. */
+void mqtt_rx(uint8_t c) {
+	uint8_t used = Mqtt.rx_head - Mqtt.rx_tail;
+	if (used >= MQTT_RX) {
+		Mqtt.rx_overrun = true;
+		return;
+	}
+	Mqtt.rx[Mqtt.rx_head % MQTT_RX] = c;
+	Mqtt.rx_head++;
+	if (used + 1 == MQTT_RX / 2) task_signal(&tasks[TASK_WIFI], WIFI_LINE);
 }
 
-void USART_Wifi_cmd(char string[]) {
-	for (int i = 0; string[i] != 0; i++) {
-		USART_Wifi_send(string[i]);
+/* The connection is gone or can't be trusted any more. Uploads the
+   broker has are given up, their replies would have come on it; the
+   others go out again on the next one if they may. */
+void mqtt_down(void) {
+	struct link *l = &Wifi.links[0];
+	if (l->state != LINK_FREE) l->state = l->closed ? LINK_FREE : LINK_STALE;
+	Mqtt.up = false;
+	Mqtt.waiting = false;
+	Mqtt.lost++;
+	
+	for (uint8_t i = Wifi.upload_tail; i != Wifi.upload_head; i++) {
+		struct upload *u = &Wifi.uploads[i % UPLOAD_QUEUE];
+		if (!u->busy || u->done) continue;
+		if (!u->acked && upload_repeatable(u, true)) u->busy = false;
+		else upload_finish(u, 0, 0, NO_VERSION);
 	}
-	USART_Wifi_send(0x0D);
-	USART_Wifi_send(0x0A);
 }
 
-bool Wifi_response(char string[]) {
-	for (int i = 0; i < ROWS - 1; i++) {
-		if(strcmp((char *)Wifi.response[i], string) == 0) {
-			Wifi.response[i][0] = 0; 
-			return true;
+/* Packets for a new connection: CONNECT and both subscriptions, in one
+   AT+CIPSEND. Returns their length. */
+uint8_t mqtt_session(void) {
+	char client[sizeof MQTT_CLIENT];
+	char reply[sizeof "dogs/reply/" MQTT_CLIENT];
+	char status[sizeof "dogs/status"];
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		Mqtt.rx_tail = Mqtt.rx_head;		// anything left from the last connection
+		Mqtt.rx_overrun = false;
+	}
+	memset(&Mqtt.parser, 0, sizeof Mqtt.parser);
+	Mqtt.waiting = true;					// for the CONNACK
+	
+	strcpy_P(client, PSTR(MQTT_CLIENT));
+	strcpy_P(reply, PSTR("dogs/reply/" MQTT_CLIENT));
+	strcpy_P(status, PSTR("dogs/status"));
+	uint8_t n = mqtt_connect(Mqtt.out, client, MQTT_KEEPALIVE_S);
+	n += mqtt_subscribe(Mqtt.out + n, 1, reply, 0);
+	n += mqtt_subscribe(Mqtt.out + n, 2, status, 0);
+	return n;
+}
+
+/* Packets while the session is up: the uploads not published yet, as
+   many as fit, or a PINGREQ when the connection has been quiet. Returns
+   their length, 0 if there is nothing to send. */
+uint8_t mqtt_next(void) {
+	char topic[sizeof "dogs/scan/" MQTT_CLIENT];
+	char payload[sizeof "0123456789 t 65535"];
+	uint8_t n = 0;
+	uint32_t now = sched_now();
+	
+	strcpy_P(topic, PSTR("dogs/scan/" MQTT_CLIENT));
+	for (uint8_t i = Wifi.upload_tail; i != Wifi.upload_head; i++) {
+		struct upload *u = &Wifi.uploads[i % UPLOAD_QUEUE];
+		if (u->busy || u->done) continue;
+		
+		uint8_t len;
+		if (u->version == NO_VERSION) {
+			len = snprintf_P(payload, sizeof payload, PSTR("%.10s %c"), u->rfid, u->action);
+		} else {
+			len = snprintf_P(payload, sizeof payload, PSTR("%.10s %c %u"), u->rfid, u->action, u->version);
 		}
+		if (n + MQTT_PUBLISH_SIZE(sizeof topic - 1, len, 1) > MQTT_OUT) break;
+		
+		n += mqtt_publish(Mqtt.out + n, MQTT_QOS1 | (u->tries ? MQTT_DUP : 0), MQTT_ID(i), topic, (uint8_t *)payload, len);
+		u->busy = true;
+		u->acked = false;
+		u->deadline = now + wifi_link_ms;
+		if (u->tries++ > 0) Wifi.retries++;
+		Mqtt.published++;
 	}
-	return false;
+	
+	if (n == 0 && !Mqtt.waiting && now - Mqtt.sent_at >= MQTT_PING_MS) {
+		n = mqtt_empty(Mqtt.out, MQTT_PINGREQ);
+		Mqtt.waiting = true;
+	}
+	return n;
 }
 
-void clear_response(void) {
-	for (int i = 0; i < ROWS - 1; i++) {
-		Wifi.response[i][0] = 0;
+/* At the '>' prompt */
+void mqtt_send(void) {
+	for (uint8_t i = 0; i < Mqtt.out_len; i++) {
+		usart1_send(Mqtt.out[i]);
+	}
+	Mqtt.sent_at = sched_now();
+	Wifi.links[0].deadline = Mqtt.sent_at + wifi_link_ms;	// for a CONNACK or PINGRESP
+}
+
+/* Decimal field at *f, moves past it and the space after it */
+uint16_t mqtt_field(const uint8_t **f, const uint8_t *end) {
+	uint16_t value = 0;
+	while (*f < end && **f >= '0' && **f <= '9') {
+		value = value * 10 + (*(*f)++ - '0');
 	}
-	Wifi.row_index = 0;
-	Wifi.col_index = 0;
+	if (*f < end) (*f)++;
+	return value;
 }
 
-bool connected(void) {
+/* A reply to one of ours, or a change on dogs/status. Both start with
+   the rfid and end with "<status> <version>". */
+void mqtt_message(void) {
+	const char *topic;
+	const uint8_t *payload;
+	uint16_t topic_len, len, id;
+	if (!mqtt_publish_parts(&Mqtt.parser, &topic, &topic_len, &payload, &len, &id)) return;
+	if (len < 12 || payload[10] != ' ') return;
 	
-	lcd_instruction(clear);
-	lcd_string((uint8_t *) "Wifi is...         ");
+	const uint8_t *f = payload + 11, *end = payload + len;
+	bool change = (topic_len == 11 && strncmp_P(topic, PSTR("dogs/status"), 11) == 0);
+	uint16_t code = change ? 200 : mqtt_field(&f, end);
+	if (end - f < 2) return;
+	char status = (f[0] == 'a' || f[0] == 's') ? f[0] : 0;
+	f += 2;
+	uint16_t version = mqtt_field(&f, end);
 	
-	while(1) {
-		lcd_instruction(setCursor | lineTwo);
-		USART_Wifi_cmd("AT+CIPSTATUS");
-		_delay_ms(500);
+	if (!change) {
+		for (uint8_t i = Wifi.upload_tail; i != Wifi.upload_head; i++) {
+			struct upload *u = &Wifi.uploads[i % UPLOAD_QUEUE];
+			if (u->busy && !u->done && memcmp(u->rfid, payload, sizeof u->rfid) == 0) {
+				upload_finish(u, code, status, version);
+				break;
+			}
+		}
+		return;
+	}
+	
+	/* only dogs scanned here lately are cached, the others aren't taken in */
+	uint8_t tag[TAG_BYTES];
+	if (status == 0 || !tag_from_hex((const char *)payload, tag)) return;
+	struct status *e = status_find(tag);
+	if (e == NULL || e->pending || (e->version != NO_VERSION && (int16_t)(version - e->version) <= 0)) return;
+	e->status = status;
+	e->version = version;
+	e->checked = sched_now();
+	Status.pushes++;
+}
+
+void mqtt_packet(void) {
+	struct mqtt_parser *p = &Mqtt.parser;
+	
+	switch (p->header & 0xF0) {
 		
-		if (Wifi_response("STATUS:2")) {
-			lcd_string((uint8_t *)"Connected!       ");
-			clear_response();
-			return true;
-		} 
-			
-		else if (Wifi_response("STATUS:5")) {
-			lcd_string((uint8_t *)"Not Connected.  ");
-			clear_response();
-		} 
-			
-		else {
-			lcd_string((uint8_t *)"Not Responding.   ");
-			return false;
+		case MQTT_CONNACK:					// refused: the broker closes the connection
+		Mqtt.waiting = false;
+		if (p->len >= 2 && p->body[1] == 0) {
+			Mqtt.up = true;
+			Mqtt.sessions++;
 		}
+		break;
+		
+		case MQTT_PUBACK: {
+			uint8_t i = mqtt_packet_id(p) - 1;
+			struct upload *u = &Wifi.uploads[i % UPLOAD_QUEUE];
+			if ((uint8_t)(i - Wifi.upload_tail) < (uint8_t)(Wifi.upload_head - Wifi.upload_tail) && u->busy) u->acked = true;
+			break;
+		}
+		
+		case MQTT_PUBLISH:
+		mqtt_message();
+		break;
+		
+		case MQTT_PINGRESP:
+		Mqtt.waiting = false;
+		break;
+	}
+}
+
+/* Packets the ISR put aside, whenever the task runs. Between commands,
+   also the deadlines: an upload the broker hasn't acknowledged in time
+   or a missing CONNACK or PINGRESP means the connection is dead, one the
+   bridge hasn't answered is given up like a GET that timed out. */
+void mqtt_poll(void) {
+	struct link *l = &Wifi.links[0];
+	if (l->state != LINK_WAIT) return;
+	
+	while (Mqtt.rx_tail != Mqtt.rx_head) {
+		uint8_t c = Mqtt.rx[Mqtt.rx_tail % MQTT_RX];
+		Mqtt.rx_tail++;
+		if (mqtt_parse(&Mqtt.parser, c)) mqtt_packet();
+	}
+	if (Wifi.state != WIFI_IDLE) return;	// the command steps are using the link
+	
+	uint32_t now = sched_now();
+	bool late = Mqtt.waiting && (int32_t)(now - l->deadline) >= 0;
+	for (uint8_t i = Wifi.upload_tail; i != Wifi.upload_head; i++) {
+		struct upload *u = &Wifi.uploads[i % UPLOAD_QUEUE];
+		if (!u->busy || u->done || (int32_t)(now - u->deadline) < 0) continue;
+		if (!u->acked) late = true;
+		else upload_finish(u, 0, 0, NO_VERSION);
+	}
+	
+	if (late) Wifi.timeouts++;
+	if (late || l->closed || Mqtt.rx_overrun) mqtt_down();
+}
 
+/* Time until the next deadline or keep-alive, for the idle timeout */
+int32_t mqtt_next_deadline(void) {
+	uint32_t now = sched_now();
+	int32_t next = Mqtt.up ? (int32_t)(Mqtt.sent_at + MQTT_PING_MS - now) : INT32_MAX;
+	
+	if (Mqtt.waiting && (int32_t)(Wifi.links[0].deadline - now) < next) next = Wifi.links[0].deadline - now;
+	for (uint8_t i = Wifi.upload_tail; i != Wifi.upload_head; i++) {
+		struct upload *u = &Wifi.uploads[i % UPLOAD_QUEUE];
+		if (u->busy && !u->done && (int32_t)(u->deadline - now) < next) next = u->deadline - now;
 	}
+	return next;
+}
+
+#endif /* UPLINK_MQTT */
+
+/* Clears the old answers, sends the command and arms its timeout */
+void wifi_command_P(uint8_t state, const char *command, uint16_t timeout) {
+	if (state == WIFI_RESET) Wifi.resets++;
+	clear_response();
+	USART_Wifi_cmd_P(command);
+	Wifi.state = state;
+	task_delay(&tasks[TASK_WIFI], timeout);
 }
 
+/* Sends the command of link step state for Wifi.link and arms its
+   timeout, also to send it again after "busy s..." */
+void link_command(uint8_t state) {
+	uint16_t timeout = WIFI_REPLY_MS;
+	
+	clear_response();
+	switch (state) {
+		case WIFI_OPEN:
+#ifdef UPLINK_MQTT
+		USART_Wifi_printf_P(PSTR("AT+CIPSTART=0,\"TCP\",\""IP"\",%u"), MQTT_PORT);
+#else
+		USART_Wifi_printf_P(PSTR("AT+CIPSTART=%u,\"TCP\",\""IP"\",80"), Wifi.link);
+#endif
+		timeout = wifi_link_ms;
+		break;
+		
+		case WIFI_SEND:
+#ifdef UPLINK_MQTT
+		USART_Wifi_printf_P(PSTR("AT+CIPSEND=0,%u"), Mqtt.out_len);
+#else
+		USART_Wifi_printf_P(PSTR("AT+CIPSEND=%u,%d"), Wifi.link, Wifi.request_len + 4);	// request line, CR LF, blank line
+#endif
+		break;
+		
+		case WIFI_CLOSE:
+		USART_Wifi_printf_P(PSTR("AT+CIPCLOSE=%u"), Wifi.link);
+		break;
+	}
+	Wifi.state = state;
+	task_delay(&tasks[TASK_WIFI], timeout);
+}
 
-void upload_to_server(char * rfid, char action) {
+/* Associated: scans are taken from here on, the warm-up upload goes out
+   in the background. With UPLINK_MQTT the broker connection is opened
+   instead, and opened again after a reset of the module. */
+void wifi_online(void) {
+	Wifi.state = WIFI_IDLE;
+	task_cancel(&tasks[TASK_WIFI]);
+#ifdef UPLINK_MQTT
+	if (Wifi.links[0].state != LINK_FREE) mqtt_down();
+	task_signal(&tasks[TASK_WIFI], WIFI_UPLOAD);
+#endif
+	if (Wifi.online) return;				// back after a reset of the module
+	
+	Wifi.online = true;
+	Wifi.ready_ms = sched_now();
+	task_delay(&tasks[TASK_DISPLAY], 0);	// "Ready to Scan"
 	
-	char HTTP_request_buffer[] = "GET /add/##########/& HTTP/1.0";
+#ifndef UPLINK_MQTT
+	char no_tag[10];
+	memset(no_tag, '-', sizeof no_tag);
+	queue_upload(no_tag, 'b', NO_VERSION);
+#endif
+}
+
+void wifi_task(uint8_t events) {
+	struct task *self = &tasks[TASK_WIFI];
+	bool timeout = events & EV_TIMER;
 	
-	for (int i = 0 ; i < 10; i++) { 
-		HTTP_request_buffer[9 + i] = rfid[i];
+	/* the module is still sending the last request */
+	if (Wifi.state >= WIFI_OPEN && Wifi_response_P(PSTR("busy s..."))) {
+		Wifi.busy++;
+		Wifi.resend = true;
+		task_delay(self, WIFI_BUSY_MS);
+		return;
 	}
+	if (Wifi.resend) {
+		if (!timeout) return;
+		Wifi.resend = false;
+		link_command(Wifi.state);
+		return;
+	}
+	
+	if (timeout && Wifi.state != WIFI_ASSOCIATE && Wifi.state != WIFI_IDLE) Wifi.timeouts++;	// those are waits
+#ifdef UPLINK_MQTT
+	if (Wifi.online) mqtt_poll();
+#else
+	if (Wifi.online) links_poll();
+#endif
 	
-	HTTP_request_buffer[20] = action; 
-	USART_Wifi_cmd("AT+CIPSTART=\"TCP\",\""IP"\",80");
-	_delay_ms(1000);
-	USART_Wifi_cmd("AT+CIPSEND=34");
-	_delay_ms(1000);
-	USART_Wifi_cmd(HTTP_request_buffer);
-	USART_Wifi_cmd("");
-	_delay_ms(1000);
+	switch (Wifi.state) {
+		
+		case WIFI_PROBE:
+		if (Wifi_response_P(PSTR("OK"))) {
+			Wifi.tries = 0;
+			wifi_command_P(WIFI_ECHO, PSTR("ATE0"), WIFI_REPLY_MS);
+			break;
+		}
+		if (!timeout) break;
+		if (++Wifi.tries < WIFI_PROBE_TRIES) {
+			wifi_command_P(WIFI_PROBE, PSTR("AT"), WIFI_PROBE_MS);
+			break;
+		}
+		lcd_instruction(clear);
+		lcd_string_P(PSTR("Configuring Wifi..."));
+		wifi_command_P(WIFI_RESET, PSTR("AT+RST"), WIFI_RESET_MS);
+		break;
+		
+		case WIFI_RESET:
+		if (Wifi_response_P(PSTR("ready"))) {
+			Wifi.tries = 0;
+			wifi_command_P(WIFI_ECHO, PSTR("ATE0"), WIFI_REPLY_MS);
+			break;
+		}
+		if (!timeout) break;
+		lcd_instruction(clear);
+		lcd_string_P(PSTR("Hardware error")); //USART not connected
+		lcd_instruction(setCursor | lineTwo);
+		lcd_string_P(PSTR("Restarting..."));
+		wifi_command_P(WIFI_RESET, PSTR("AT+RST"), WIFI_RESET_MS);
+		break;
+		
+		case WIFI_ECHO:
+		if (!Wifi_response_P(PSTR("OK")) && !timeout) break;
+		wifi_command_P(WIFI_MUX, PSTR("AT+CIPMUX=1"), WIFI_REPLY_MS);
+		break;
+		
+		/* Refused while a connection is open (MainBoard reset alone in the
+		   middle of an upload): that one is closed and ECHO asks again */
+		case WIFI_MUX:
+		if (Wifi_response_P(PSTR("OK"))) {
+			lcd_instruction(clear);
+			lcd_string_P(PSTR("Wifi is...         "));
+			lcd_instruction(setCursor | lineTwo);
+			wifi_command_P(WIFI_STATUS, PSTR("AT+CIPSTATUS"), WIFI_REPLY_MS);
+			break;
+		}
+		if (!Wifi_response_P(PSTR("ERROR")) && !timeout) break;
+		if (++Wifi.tries < WIFI_PROBE_TRIES) {
+			wifi_command_P(WIFI_ECHO, PSTR("AT+CIPCLOSE"), WIFI_REPLY_MS);
+			break;
+		}
+		wifi_command_P(WIFI_RESET, PSTR("AT+RST"), WIFI_RESET_MS);
+		break;
+		
+		case WIFI_STATUS:
+		if (Wifi_response_P(PSTR("STATUS:2")) || Wifi_response_P(PSTR("STATUS:3")) || Wifi_response_P(PSTR("STATUS:4"))) {
+			lcd_string_P(PSTR("Connected!       "));
+			wifi_online();
+			break;
+		}
+		if (Wifi_response_P(PSTR("STATUS:5"))) {
+			lcd_string_P(PSTR("Not Connected.  "));
+			lcd_instruction(setCursor | lineTwo);
+			Wifi.state = WIFI_ASSOCIATE;
+			task_delay(self, WIFI_ASSOC_MS);
+			break;
+		}
+		if (!timeout) break;
+		lcd_string_P(PSTR("Not Responding.   "));
+		wifi_command_P(WIFI_RESET, PSTR("AT+RST"), WIFI_RESET_MS);	// restarting if wifi is not responding
+		break;
+		
+		case WIFI_ASSOCIATE:
+		if (!timeout) break;
+		wifi_command_P(WIFI_STATUS, PSTR("AT+CIPSTATUS"), WIFI_REPLY_MS);
+		break;
+		
+		case WIFI_IDLE: {
+			/* a link that timed out is closed before it is used again */
+			for (uint8_t i = 0; i < WIFI_LINKS; i++) {
+				if (Wifi.links[i].state != LINK_STALE) continue;
+				Wifi.link = i;
+				link_command(WIFI_CLOSE);
+				return;
+			}
+			
+#ifdef UPLINK_MQTT
+			/* one connection, opened when there is none and kept */
+			if (Wifi.links[0].state == LINK_FREE) {
+				ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+					memset(&Wifi.links[0], 0, sizeof Wifi.links[0]);
+				}
+				Wifi.links[0].state = LINK_OPEN;
+				Wifi.link = 0;
+				link_command(WIFI_OPEN);
+				break;
+			}
+			if (Mqtt.up && (Mqtt.out_len = mqtt_next()) > 0) {
+				Wifi.link = 0;
+				link_command(WIFI_SEND);
+				break;
+			}
+			int32_t left = mqtt_next_deadline();
+			if (left != INT32_MAX) task_delay(self, (left > 0) ? left : 0);
+			else task_cancel(self);
+			break;
+#else
+			int16_t next = next_upload();
+			uint8_t id = 0;
+			while (id < WIFI_LINKS && Wifi.links[id].state != LINK_FREE) id++;
+			
+			if (next < 0 || id == WIFI_LINKS) {
+				int32_t left = links_next_deadline();
+				if (left != INT32_MAX) task_delay(self, (left > 0) ? left : 0);
+				else task_cancel(self);
+				break;
+			}
+			
+			link_open(id, next);
+			Wifi.link = id;
+			struct upload *u = &Wifi.uploads[next % UPLOAD_QUEUE];
+			if (u->version == NO_VERSION) {
+				Wifi.request_len = snprintf_P(Wifi.request, sizeof Wifi.request, PSTR("GET /add/%.10s/%c HTTP/1.0"), u->rfid, u->action);
+			} else {
+				Wifi.request_len = snprintf_P(Wifi.request, sizeof Wifi.request, PSTR("GET /add/%.10s/%c/%u HTTP/1.0"), u->rfid, u->action, u->version);
+			}
+			link_command(WIFI_OPEN);
+			break;
+#endif
+		}
+		
+		/* A failed step gives the upload back to the queue (link_failed)
+		   and the next command starts from WIFI_IDLE */
+		case WIFI_OPEN: {
+			struct link *l = &Wifi.links[Wifi.link];
+			if (l->connected || Wifi_response_P(PSTR("ALREADY CONNECTED"))) {
+#ifdef UPLINK_MQTT
+				Mqtt.out_len = mqtt_session();
+#endif
+				link_command(WIFI_SEND);
+				break;
+			}
+			if (!Wifi_response_P(PSTR("ERROR")) && !timeout) break;
+			l->state = LINK_STALE;			// may still connect, closed to be sure
+#ifdef UPLINK_MQTT
+			mqtt_down();
+#else
+			link_failed(l);
+#endif
+			Wifi.state = WIFI_IDLE;
+			task_signal(self, WIFI_UPLOAD);
+			break;
+		}
+		
+		case WIFI_SEND: {
+			struct link *l = &Wifi.links[Wifi.link];
+			if (Wifi_response_P(PSTR(">"))) {
+				clear_response();
+#ifdef UPLINK_MQTT
+				mqtt_send();
+#else
+				USART_Wifi_cmd(Wifi.request);
+				USART_Wifi_cmd_P(PSTR(""));
+				l->sent = true;
+				l->deadline = sched_now() + wifi_link_ms;
+#endif
+				l->state = LINK_WAIT;
+				Wifi.state = WIFI_IDLE;		// free for the next upload while the module sends this one
+				task_signal(self, WIFI_UPLOAD);
+				break;
+			}
+			if (!Wifi_response_P(PSTR("ERROR")) && !l->closed && !timeout) break;
+			l->state = LINK_STALE;
+#ifdef UPLINK_MQTT
+			mqtt_down();
+#else
+			link_failed(l);
+#endif
+			Wifi.state = WIFI_IDLE;
+			task_signal(self, WIFI_UPLOAD);
+			break;
+		}
+		
+		case WIFI_CLOSE:
+		if (!Wifi_response_P(PSTR("OK")) && !Wifi_response_P(PSTR("ERROR")) && !timeout) break;
+		Wifi.links[Wifi.link].state = LINK_FREE;
+		Wifi.state = WIFI_IDLE;
+		task_signal(self, WIFI_UPLOAD);
+		break;
+	}
 }
 
 
 ISR(USART1_RX_vect) {
-	char c = USART_Wifi_receive();
+	char c = usart1_receive();
+	
+	if (Wifi.ipd_left > 0) {				// server data for a link, not a response line
+#ifdef UPLINK_MQTT
+		if (Wifi.ipd_link < WIFI_LINKS) mqtt_rx(c);
+		if (--Wifi.ipd_left == 0) task_signal(&tasks[TASK_WIFI], WIFI_LINE);
+#else
+		if (Wifi.ipd_link < WIFI_LINKS) link_data(&Wifi.links[Wifi.ipd_link], c);
+		Wifi.ipd_left--;
+#endif
+		return;
+	}
+	
 	int row = Wifi.row_index, col = Wifi.col_index;
 	Wifi.response[row][col] = c;
 	
-	if ((col > 0 && Wifi.response[row][col - 1] == 0x0D && Wifi.response[row][col] == 0x0A) || (col == COLS - 1)) {
-		Wifi.response[row][col - 1] = 0; 
+	if (c == ':' && col >= 8 && strncmp_P((char *)Wifi.response[row], PSTR("+IPD,"), 5) == 0) {
+		link_ipd(Wifi.response[row]);
+		Wifi.response[row][0] = 0;
+		Wifi.col_index = 0;
+		return;
+	}
+	
+	bool prompt = (col == 0 && c == '>');	// AT+CIPSEND prompt, no line end follows
+	
+	if (col == 1 && Wifi.response[row][0] == 0x0D && c == 0x0A) {	// empty line, the reply to an upload needs the rows
+		Wifi.col_index = 0;
+		return;
+	}
+	if ((col > 0 && Wifi.response[row][col - 1] == 0x0D && Wifi.response[row][col] == 0x0A) || (col == COLS - 1) || prompt) {
+		if (col == COLS - 1 && c != 0x0A) Wifi.truncated++;
+		Wifi.response[row][prompt ? 1 : col - 1] = 0; 
+		link_event(Wifi.response[row]);
+		MEMSTAT_PEAK(Wifi.col_peak, col + 1);
+		MEMSTAT_PEAK(Wifi.row_peak, row + 1);
 		Wifi.row_index = (row == ROWS - 1)? 0: row + 1;
 		Wifi.col_index = 0;  
+		task_signal(&tasks[TASK_WIFI], WIFI_LINE);
 		return;
 	}
 	Wifi.col_index++;
 }
 
 
-void Scan_for_tag(void) {
+/******************************************************************* Bulk Intake *****************************************************************/
+
+/* For a transport arriving: every scan gets the same action instead of
+   toggling the dog's status, a result is up for INTAKE_HOLD_MS only, and
+   a tag read again within the cooldown is ignored (a dog walking past two
+   readers, or standing in front of one).
+   
+   Switched with FRAME_COMMAND INTAKE_CMD on the link:
+   
+     'i' | action | cooldown s hi | cooldown s lo
+   
+   action 'a' or 's' starts intake and clears the count, 0 ends it, no
+   arguments only asks. The cooldown is optional. The answer is a
+   FRAME_TELEMETRY 'i' | action | count hi | count lo | repeats hi | repeats lo. */
+
+#define INTAKE_CMD		'i'
+#define RECENT_TAGS		32			// tags remembered for the cooldown, one transport load
+
+#ifndef INTAKE_ACTION
+#define INTAKE_ACTION	0			// mode at power-up, 'a' or 's' to build a dedicated intake station
+#endif
+#ifndef INTAKE_COOLDOWN_S
+#define INTAKE_COOLDOWN_S	600
+#endif
+
+#define INTAKE_HOLD_MS	500			// a result is up at least this long, scans go on meanwhile
+
+struct recent {
+	uint8_t tag[TAG_BYTES];
+	uint32_t seen;							// last read, cooldown runs from here
+	bool used;
+};
+
+struct {
+	char action;							// 'a' or 's' for every scan, 0 = normal toggling
+	uint16_t cooldown_s;
+	uint16_t count;							// animals taken in since intake started
+	uint16_t repeats;						// reads ignored inside the cooldown
+	struct recent recent[RECENT_TAGS];
+} Intake = { .action = INTAKE_ACTION, .cooldown_s = INTAKE_COOLDOWN_S };
+
+void intake_start(char action) {
+	Intake.action = action;
+	Intake.count = 0;
+	Intake.repeats = 0;
+	memset(Intake.recent, 0, sizeof Intake.recent);
+}
+
+/* True if tag was read within the cooldown. Either way it is remembered
+   as seen now, the least recently seen tag making room. */
+bool intake_seen(const uint8_t tag[TAG_BYTES]) {
+	uint32_t now = sched_now();
+	struct recent *oldest = &Intake.recent[0];
 	
-	lcd_instruction(clear);
-	lcd_string((uint8_t *)"Ready to Scan");
-	_delay_ms(2000);
+	for (uint8_t i = 0; i < RECENT_TAGS; i++) {
+		struct recent *r = &Intake.recent[i];
+		
+		if (r->used && memcmp(r->tag, tag, TAG_BYTES) == 0) {
+			bool repeat = (now - r->seen < Intake.cooldown_s * 1000UL);
+			r->seen = now;
+			return repeat;
+		}
+		if (!oldest->used) continue;
+		if (!r->used || (int32_t)(r->seen - oldest->seen) < 0) oldest = r;
+	}
 	
-	RFID_done();
+	memcpy(oldest->tag, tag, TAG_BYTES);
+	oldest->seen = now;
+	oldest->used = true;
+	return false;
+}
+
+/* Line two of the idle screen while intake is on */
+void intake_status(void) {
+	char line[LCD_COLS + 1];
+	
+	snprintf_P(line, sizeof line, PSTR("Intake %c: %u"), Intake.action, Intake.count);
+	lcd_instruction(setCursor | lineTwo);
+	lcd_string((uint8_t *)line);
+}
+
+/******************************************************************* Display and Scans *****************************************************************/
+
+#define DISPLAY_HOLD_MS	2000		// a scan result stays up this long
+
+uint16_t display_hold_ms = DISPLAY_HOLD_MS;	// tunable
+
+#define DISPLAY_RESULT	0x01		// event: new result in Display.line, hold it
+#define DISPLAY_REFRESH	0x02		// event: same result updated, hold runs on
+
+struct {
+	char line[2][LCD_COLS + 1];
+	char rfid[10];							// tag of the result, its reply updates line two
+	bool busy;								// showing a scan result
+} Display;
+
+/* Shows Display.line and holds it, a newer result replacing it at once,
+   then goes back to "Ready to Scan" */
+void display_task(uint8_t events) {
+	struct task *self = &tasks[TASK_DISPLAY];
+	
+	if ((events & EV_TIMER) && !(events & DISPLAY_RESULT)) {
+		Display.busy = false;
+		lcd_instruction(clear);
+		lcd_string_P(PSTR("Ready to Scan"));
+		if (Intake.action) intake_status();
+		else if (Wifi.ready_ms != 0) {		// first time, how long the boot took
+			snprintf_P(Display.line[1], sizeof Display.line[1], PSTR("Up in %lu ms"), (unsigned long)Wifi.ready_ms);
+			lcd_instruction(setCursor | lineTwo);
+			lcd_string((uint8_t *)Display.line[1]);
+			Wifi.ready_ms = 0;
+		}
+		return;
+	}
 	
 	lcd_instruction(clear);
+	lcd_string((uint8_t *)Display.line[0]);
+	lcd_instruction(setCursor | lineTwo);
+	lcd_string((uint8_t *)Display.line[1]);
+	if (events & DISPLAY_RESULT) task_delay(self, Intake.action ? INTAKE_HOLD_MS : display_hold_ms);
+}
+
+/* Takes one scan per run and signals itself for the next, so every
+   reader's queue is emptied as fast as uploads can be queued. A scan
+   stays in its reader's queue while the upload queue is full. The LCD
+   shows the latest result, a scan never waits for the one before it to
+   be read off the display. */
+void scan_task(uint8_t events) {
+	if (!Wifi.online) return;
+	if (!upload_room()) return;				// signalled again by upload_finish()
+	if (!next_scan()) return;
+	task_signal(&tasks[TASK_SCAN], 1);
 	
-	int card_index = find_card();
+	if (Intake.action) {					// the same action for every scan
+		if (intake_seen(RF.tag)) {
+			Intake.repeats++;
+			scan_note('i', RF.reader, RF.tag);
+			return;
+		}
+		Intake.count++;
+		
+		queue_upload(RF.ID + 1, Intake.action, NO_VERSION);	// the reply updates the status cache
+		scan_note('u', RF.reader, RF.tag);
+		
+		snprintf_P(Display.line[0], sizeof Display.line[0], PSTR("%.10s R%u"), RF.ID + 1, RF.reader % 10);
+		uint8_t n = snprintf_P(Display.line[1], sizeof Display.line[1], PSTR("#%u "), Intake.count);
+		strcpy_P(Display.line[1] + n, (Intake.action == 'a') ? PSTR("adopted") : PSTR("surrendered"));
+		Display.busy = true;
+		task_signal(&tasks[TASK_DISPLAY], DISPLAY_RESULT);
+		return;
+	}
 	
-	if (card_index < 0) { 
-		lcd_string((uint8_t *)"This card is new"); 
-		_delay_ms(2000);
-		lcd_instruction(clear);
-		RFID_ready();
+	struct status *e = status_entry(RF.tag);
+	snprintf_P(Display.line[0], sizeof Display.line[0], PSTR("%.10s R%u"), RF.ID + 1, RF.reader % 10);	// which reader saw it
+	memcpy(Display.rfid, RF.ID + 1, sizeof Display.rfid);
+	
+	/* still waiting for the server about this one: not sent again, the
+	   answer to the upload out shows when it comes */
+	if (e->pending) {
+		Status.pending_drops++;
+		scan_note('p', RF.reader, RF.tag);
+		strcpy_P(Display.line[1], PSTR("Updating..."));
+		Display.busy = true;
+		task_signal(&tasks[TASK_DISPLAY], DISPLAY_RESULT);
 		return;
 	}
 	
+	char action = 't';
+	if (status_fresh(e)) {
+		Status.hits++;
+		action = (e->status == 'a') ? 's' : 'a';
+		strcpy_P(Display.line[1], (action == 'a') ? PSTR("Dog is adopted") : PSTR("Dog is surrendered"));
+	} else {
+		Status.misses++;
+		strcpy_P(Display.line[1], PSTR("Updating..."));
+	}
+	queue_upload(RF.ID + 1, action, e->version);
+	e->pending = true;
+	scan_note('u', RF.reader, RF.tag);
+	
+	Display.busy = true;
+	task_signal(&tasks[TASK_DISPLAY], DISPLAY_RESULT);
+}
 
-	lcd_string((uint8_t *)get_card_id(card_index));
-	lcd_instruction(setCursor | lineTwo);
+/* Server's answer to an upload: into the cache, and onto the LCD if its
+   result is still showing */
+void upload_done(const struct upload *u, uint16_t code, char status, uint16_t version) {
+	uint8_t tag[TAG_BYTES];
+	if (!tag_from_hex(u->rfid, tag)) return;	// warm-up
+	scan_note('f', 0, tag);
 	
-	lcd_string((uint8_t *)"Dog is");
+	struct status *e = status_entry(tag);
+	e->pending = false;
+	if ((code == 200 || code == 409) && status != 0) {
+		e->status = status;
+		e->version = version;
+		e->checked = sched_now();
+	}
+	if (code == 409) Status.conflicts++;
+	if (code == 404) e->used = false;		// not in the database
 	
-	RFID_ready();
+	if (Intake.action || !Display.busy || memcmp(Display.rfid, u->rfid, sizeof Display.rfid) != 0) return;
 	
-	dog_status current_status = cards[card_index].status;
-	char status_to_upload = '?';
-	switch(current_status) {
-		
-		case adopted:
-		cards[card_index].status = surrendered;
-		lcd_string((uint8_t *) " surrendered");
-		status_to_upload = 's';
-		break;
+	if (code == 200 && status != 0) {
+		strcpy_P(Display.line[1], (status == 'a') ? PSTR("Dog is adopted") : PSTR("Dog is surrendered"));
+	} else if (code == 409 && status != 0) {
+		strcpy_P(Display.line[1], (status == 'a') ? PSTR("Server: adopted") : PSTR("Server: surrendered"));
+	} else if (code == 404) {
+		strcpy_P(Display.line[1], PSTR("This card is new"));
+	} else {
+		strcpy_P(Display.line[1], PSTR("No answer, rescan"));
+	}
+	task_signal(&tasks[TASK_DISPLAY], DISPLAY_REFRESH);
+}
+
+
+/******************************************************************* Telemetry *****************************************************************/
+
+/* Read with TELEMETRY_GET, tunables set with TELEMETRY_SET (Common/telemetry.h,
+   Tools/linkshell). Every tunable is read where it is used, a new value
+   applies to the next scan or upload; LOCAL_READER's sample period at
+   once. */
+
+const struct telemetry_var telemetry_vars[] PROGMEM = {
+	TELEMETRY_COUNTER("crc", RF.parser.crc_errors),
+	TELEMETRY_COUNTER("unknown", RF.unknown),
+	TELEMETRY_COUNTER("resent", RF.resent),
+	TELEMETRY_COUNTER("repeats", RF.repeats),
+	TELEMETRY_COUNTER("overflows", RF.overflows),
+	TELEMETRY_COUNTER("cmd_drop", RF.commands_dropped),
+	TELEMETRY_COUNTER("at_tmo", Wifi.timeouts),
+	TELEMETRY_COUNTER("at_rst", Wifi.resets),
+	TELEMETRY_COUNTER("at_busy", Wifi.busy),
+	TELEMETRY_COUNTER("truncated", Wifi.truncated),
+	TELEMETRY_COUNTER("answered", Wifi.answered),
+	TELEMETRY_COUNTER("up_failed", Wifi.failed),
+	TELEMETRY_COUNTER("up_drops", Wifi.upload_drops),
+	TELEMETRY_COUNTER("up_retry", Wifi.retries),
+	TELEMETRY_COUNTER("links_max", Wifi.links_peak),
+	TELEMETRY_COUNTER("up_ms", Wifi.latency),
+	TELEMETRY_COUNTER("up_ms_max", Wifi.latency_max),
+	TELEMETRY_COUNTER("up_ms_avg", Wifi.latency_avg),
+	TELEMETRY_COUNTER("hits", Status.hits),
+	TELEMETRY_COUNTER("misses", Status.misses),
+	TELEMETRY_COUNTER("conflicts", Status.conflicts),
+	TELEMETRY_COUNTER("pend_drop", Status.pending_drops),
+#ifdef UPLINK_MQTT
+	TELEMETRY_COUNTER("pushes", Status.pushes),
+	TELEMETRY_COUNTER("mq_pub", Mqtt.published),
+	TELEMETRY_COUNTER("mq_conn", Mqtt.sessions),
+	TELEMETRY_COUNTER("mq_lost", Mqtt.lost),
+	TELEMETRY_COUNTER("mq_skip", Mqtt.parser.oversize),
+#endif
+	TELEMETRY_COUNTER("late", tasks[TASK_SCAN].late),
+#ifdef LOCAL_READER
+	TELEMETRY_COUNTER("captures", Decoder.captures),
+	TELEMETRY_COUNTER("noise", Decoder.noise),
+	TELEMETRY_COUNTER("headers", Decoder.headers),
+	TELEMETRY_COUNTER("parity", Decoder.parity_fails),
+	TELEMETRY_COUNTER("stopbit", Decoder.stop_fails),
+	TELEMETRY_COUNTER("rescans", Decoder.rescans),
+	TELEMETRY_COUNTER("reads", Decoder.reads),
+	TELEMETRY_COUNTER("dec_ovr", Decoder.overruns),
+	TELEMETRY_TUNABLE("sample", sample_top, SAMPLE_TOP - SAMPLE_TOP / 10, SAMPLE_TOP + SAMPLE_TOP / 10),
+	TELEMETRY_TUNABLE("swing", slicer.min_swing, 1, 255),
+#endif
+	TELEMETRY_TUNABLE("dedupe", dedupe_ms, 0, 60000),
+	TELEMETRY_TUNABLE("ttl", status_ttl_s, 0, 3600),
+	TELEMETRY_TUNABLE("hold", display_hold_ms, 100, 10000),
+	TELEMETRY_TUNABLE("link_ms", wifi_link_ms, 200, 10000),
+	TELEMETRY_TUNABLE("cooldown", Intake.cooldown_s, 1, 65535),
+};
+
+/* Commands from the link, answered on the link */
+void command_task(uint8_t events) {
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	uint8_t len = 0;
+	bool written;
+	
+	if (RF.command == TELEMETRY_GET || RF.command == TELEMETRY_SET) {
+		len = telemetry_command(RF.command, RF.args, RF.args_len, telemetry_vars,
+			sizeof telemetry_vars / sizeof telemetry_vars[0], payload, &written);
+#ifdef LOCAL_READER
+		if (written) {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				OCR1A = sample_top;			// a new sample period takes effect at once
+				TCNT1 = 0;
+			}
+		}
+#endif
+	}
+	if (RF.command == MEMSTAT_CMD) {
+		uint16_t peaks[] = {RF.queue_peak, Wifi.col_peak, Wifi.row_peak, Wifi.upload_peak};
+		len = memstat_report(payload, peaks, 4);
+	}
+	if (RF.command == PROFILE_CMD) {
+		len = profile_command(RF.args, RF.args_len, payload);
+	}
+	if (RF.command == INTAKE_CMD) {
+		if (RF.args_len >= 1 && (RF.args[0] == 'a' || RF.args[0] == 's' || RF.args[0] == 0)) intake_start(RF.args[0]);
+		if (RF.args_len >= 3 && (RF.args[1] | RF.args[2]) != 0) Intake.cooldown_s = ((uint16_t)RF.args[1] << 8) | RF.args[2];
+		if (RF.args_len >= 1) task_delay(&tasks[TASK_DISPLAY], 0);		// idle screen for the new mode
 		
-		case surrendered:
-		cards[card_index].status = adopted;
-		lcd_string((uint8_t *) " adopted");
-		status_to_upload = 'a';
-		break;
+		payload[len++] = INTAKE_CMD;
+		payload[len++] = Intake.action;
+		payload[len++] = Intake.count >> 8;
+		payload[len++] = Intake.count & 0xFF;
+		payload[len++] = Intake.repeats >> 8;
+		payload[len++] = Intake.repeats & 0xFF;
 	}
+	RF.command = 0;
+	if (len == 0) return;
 	
-	upload_to_server(get_card_id(card_index), status_to_upload);
-	lcd_instruction(clear);
-	RFID_ready();
+	usart0_send_frame(0, FRAME_TELEMETRY, 0, payload, len);
 }
 
 
 int main( void )
 {
 	
+	timer0_init();
+	profile_start();						// built with PROFILE only
+	usart0_init(LINK_UBRR, LINK_U2X);
+	USART_Wifi_init();						// first probe goes out while the LCD powers up
+	local_reader_init();					// built with LOCAL_READER only
+	sei();									// sched_ms counts from here, boot time includes lcd_init()
 	lcd_init();
-	USART_RF_init();
-	USART_Wifi_init();
 	lcd_instruction(clear);
 	
-	sei();
-	
-	
-	while(1)
-	{	
-		Scan_for_tag();
-	}
+	sched_run(tasks, TASKS, idle);
 	
 	return 0;
-
-
 }
\ No newline at end of file
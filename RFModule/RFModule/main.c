@@ -1,192 +1,107 @@
-#define F_CPU 8000000UL
+#include "../../Common/clock.h"		// F_CPU, ahead of the AVR headers
 
 #include <avr/io.h>
 #include <inttypes.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <util/delay.h>
 #include <string.h>
+#include "../../Common/frame.h"
+#include "../../Common/lcd.h"
+#include "../../Common/memstat.h"
+#include "../../Common/profile.h"
+#include "../../Common/sched.h"
+#include "../../Common/telemetry.h"
+#include "../../Common/usart.h"
 
-#define BAUD 9600
-#define BAUDRATE (((F_CPU / (BAUD * 16UL))) - 1)
 #define SIZE 16
 
-int16_t sine[50] = {576,639,700,758,812,862,906,943,974,998,1014,1022,1022,1014,998,974,943,906,862,812,758,700,639,576,512,447,384,323,265,211,161,117,80,49,25,9,1,1,9,25,49,80,117,161,211,265,323,384,447,511};
+const int16_t sine[50] PROGMEM = {576,639,700,758,812,862,906,943,974,998,1014,1022,1022,1014,998,974,943,906,862,812,758,700,639,576,512,447,384,323,265,211,161,117,80,49,25,9,1,1,9,25,49,80,117,161,211,265,323,384,447,511};
 
 
-/************************************************************************* LCD Configuration *************************************************************/
+/******************************************************************* Tasks *****************************************************************/
 
-#define lcdDdr		DDRA		//Data direction
-#define lcdPort		PORTA		//PortD
-#define lcdD7Bit	PORTA0		//LCD D7 (pin 14) -> PORTD7
-#define lcdD6Bit	PORTA1		//LCD D6 (pin 13) -> PORTD6
-#define lcdD5Bit	PORTA2		//LCD D5 (pin 12) -> PORTD5
-#define lcdD4Bit	PORTA3		//LCD D4 (pin 11) -> PORTD4
-#define lcdEBit		PORTA4		//LCD E (pin 6)   -> PORTD3
-#define lcdRSBit	PORTA5		//LCD RS (pin 4)  -> PORTD2
+void packet_task(uint8_t events);
+void command_task(uint8_t events);
 
-#define lineOne			0x00                // Line 1
-#define lineTwo			0x40                // Line 2
-#define clear           0b00000001          // clears all characters
-#define home            0b00000010          // returns cursor to home
-#define entryMode       0b00000110          // moves cursor from left to right
-#define off      		0b00001000          // LCD off
-#define on       		0b00001100          // LCD on
-#define reset   		0b00110000          // reset the LCD
-#define bit4Mode 		0b00101000          // we are using 4 bits of data
-#define setCursor       0b10000000          //sets the position of cursor
+#define HOLD_MS		2000		// a read stays on the LCD this long, later packets are ignored
 
+uint16_t hold_ms = HOLD_MS;		// tunable over the link
 
-void lcd_write(uint8_t);
-void lcd_instruction(uint8_t);
-void lcd_char(uint8_t);
-void lcd_string(uint8_t string[]);
-void lcd_init(void);
+enum {TASK_PACKET, TASK_COMMAND, TASKS};
 
+struct task tasks[TASKS] = {
+	[TASK_PACKET]	= TASK(packet_task, 0, 20),		// packet complete or hold over
+	[TASK_COMMAND]	= TASK(command_task, 0, 0),
+};
 
-void lcd_init(void)
+ISR(TIMER0_COMPA_vect)
 {
-	lcdDdr |= (1 << lcdD7Bit) | (1 << lcdD6Bit) | (1 << lcdD5Bit) | (1 << lcdD4Bit) | (1 << lcdEBit) | (1 << lcdRSBit);
-	_delay_ms(100);
-
-	lcdPort &= ~(1 << lcdRSBit);                 // RS low
-	lcdPort &= ~(1 << lcdEBit);                 // E low
-
-	// LCD resets
-	lcd_write(reset);
-	_delay_ms(8);                           // 5 ms delay min
-
-	lcd_write(reset);
-	_delay_us(200);                       // 100 us delay min
-
-	lcd_write(reset);
-	_delay_us(200);
-	
-	lcd_write(bit4Mode);               	//set to 4 bit mode
-	_delay_us(50);                     // 40us delay min
-
-	lcd_instruction(bit4Mode);   	 // set 4 bit mode
-	_delay_us(50);                  // 40 us delay min
-
-	// display off
-	lcd_instruction(off);        	// turn off display
-	_delay_us(50);
-
-	// Clear display
-	lcd_instruction(clear);              // clear display
-	_delay_ms(3);                       // 1.64 ms delay min
-
-	// entry mode
-	lcd_instruction(entryMode);          // this instruction shifts the cursor
-	_delay_us(40);                      // 40 us delay min
-
-	// Display on
-	lcd_instruction(on);          // turn on the display
-	_delay_us(50);               // same delay as off
-}
-
-
-void lcd_string(uint8_t string[])
-{
-	int i = 0;                             //while the string is not empty
-	while (string[i] != 0)
-	{
-		lcd_char(string[i]);
-		i++;
-		_delay_us(50);                              //40 us delay min
-	}
-}
-
-
-
-void lcd_char(uint8_t data)
-{
-	lcdPort |= (1 << lcdRSBit);                 // RS high
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	lcd_write(data);                          // write the upper four bits of data
-	lcd_write(data << 4);                    // write the lower 4 bits of data
+	sched_tick();
 }
 
-
-void lcd_instruction(uint8_t instruction)
+/* Nothing released, sleep until the next interrupt */
+void idle(void)
 {
-		lcdPort &= ~(1 << lcdRSBit);                // RS low
-		lcdPort &= ~(1 << lcdEBit);                // E low
-		lcd_write(instruction);                   // write the upper 4 bits of data
-		_delay_us(10);
-		lcd_write(instruction << 4);             // write the lower 4 bits of data
-		_delay_ms(5);
-}
-
-
-void lcd_write(uint8_t byte)
-{
-	lcdPort &= ~(1 << lcdD7Bit);                        // assume that data is '0'
-	if (byte & 1 << 7) lcdPort |= (1 << lcdD7Bit);     // make data = '1' if necessary
-
-	lcdPort &= ~(1 << lcdD6Bit);                        // repeat for each data bit
-	if (byte & 1 << 6) lcdPort |= (1 << lcdD6Bit);
-
-	lcdPort &= ~(1 << lcdD5Bit);
-	if (byte & 1 << 5) lcdPort |= (1 << lcdD5Bit);
-
-	lcdPort &= ~(1 << lcdD4Bit);
-	if (byte & 1 << 4) lcdPort |= (1 << lcdD4Bit);
-
-	// write the data
-	
-	lcdPort |= (1 << lcdEBit);                   // E high
-	_delay_us(1);                               // data setup
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	_delay_us(1);                             // hold data
+	sleep_enable();
+	sei();								// sleep_cpu() runs before any pending interrupt
+	sleep_cpu();
+	sleep_disable();
 }
 
 /*********************************************************** USART Configuration *****************************************************************/
 
-void USART_init(void)
-{
-	/*Set baud rate */
-	UBRR0H = (BAUDRATE>>8);
-	UBRR0L = BAUDRATE;
-	
-	/* Enable receiver and transmitter */
-	UCSR0B = (1<<RXEN0)|(1<<TXEN0);
-
-	/* Set frame format: 8data, 1stop bit, no parity */
-	UCSR0C = (3<<UCSZ00);
-	
-	/* Enable interrupt */
-	UCSR0B |= (1 << RXCIE0);
-
-}
-
-void USART_send(unsigned char data)
-{
-	/* Wait for data to be received */
-	while (!( UCSR0A & (1<<UDRE0)));
-	UDR0 = data;
-}
-
-
-unsigned char USART_receive(void)
-{
-	// Wait for data to be received
-	while(~(UCSR0A) & (1<<RXC0));
-	//Get and return received data from buffer 
-	return UDR0;
-}
-
 struct {
 	//RFID buffer 
 	volatile char ID[SIZE + 1];
 	volatile uint8_t index;
 	volatile bool done;
+	
+	/* Command frames share the receive line with the module. The module
+	   only sends STX, ASCII hex and CR LF, never FRAME_SYNC. */
+	struct frame_parser link;
+	volatile uint8_t command;
+	uint8_t args[FRAME_MAX_PAYLOAD - 1];	// rest of its payload
+	uint8_t args_len;
+	
+	uint16_t packets;						// complete packets from the module
+	uint16_t bad;							// packets without 10 hex digits
+	uint16_t held;							// module bytes dropped during the hold
+	uint16_t commands_dropped;				// arrived while the last one was still pending
 }RF;
 
-inline void RFID_done(void) {
-	while(!RF.done);
+/* Read with TELEMETRY_GET, tunables set with TELEMETRY_SET (Common/telemetry.h) */
+const struct telemetry_var telemetry_vars[] PROGMEM = {
+	TELEMETRY_COUNTER("packets", RF.packets),
+	TELEMETRY_COUNTER("bad", RF.bad),
+	TELEMETRY_COUNTER("held", RF.held),
+	TELEMETRY_COUNTER("crc", RF.link.crc_errors),
+	TELEMETRY_COUNTER("cmd_drop", RF.commands_dropped),
+	TELEMETRY_TUNABLE("hold", hold_ms, 100, 10000),
+};
+
+void command_task(uint8_t events)
+{
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	uint8_t len = 0;
+	bool written;
+	
+	if (RF.command == MEMSTAT_CMD) {
+		len = memstat_report(payload, NULL, 0);
+	}
+	if (RF.command == PROFILE_CMD) {
+		len = profile_command(RF.args, RF.args_len, payload);
+	}
+	if (RF.command == TELEMETRY_GET || RF.command == TELEMETRY_SET) {
+		len = telemetry_command(RF.command, RF.args, RF.args_len, telemetry_vars,
+			sizeof telemetry_vars / sizeof telemetry_vars[0], payload, &written);
+	}
+	RF.command = 0;
+	if (len != 0) send_frame(FRAME_TELEMETRY, payload, len);
 }
 
 inline void RFID_ready(void) {
@@ -196,15 +111,32 @@ inline void RFID_ready(void) {
 
 ISR(USART0_RX_vect){
 	//load RFID into buffer 
-	char num = USART_receive();
+	char num = usart0_receive();
+	bool framed = (RF.link.state != FRAME_WAIT_SYNC || num == (char)FRAME_SYNC);
+	
+	if (frame_parse(&RF.link, num)) {
+		if (RF.link.type == FRAME_COMMAND && RF.link.addr == READER_ADDR && RF.link.len > 0) {
+			if (RF.command != 0) RF.commands_dropped++;
+			else {
+				RF.args_len = RF.link.len - 1;
+				memcpy(RF.args, RF.link.payload + 1, RF.args_len);
+				RF.command = RF.link.payload[0];
+				task_signal(&tasks[TASK_COMMAND], 1);
+			}
+		}
+	}
+	if (framed) return;						// part of a frame, not module data
+	
 	if(!RF.done) {
 		RF.ID[RF.index++] = num;
 		if(RF.index == SIZE) {
 			RF.index = 0;
 			RF.done = true;
+			RF.packets++;
+			task_signal(&tasks[TASK_PACKET], 1);
 		}
 	}
-	USART_send(num);
+	else RF.held++;
 }
 
 
@@ -252,11 +184,11 @@ void frequency(uint32_t frequency)
 
 }
 
-void output_waveform(uint32_t value, uint16_t arr[])
+void output_waveform(uint32_t value, const int16_t arr[])
 {
-	for (int i = 0; i < 50; i++)		//iterating through wave lookup table
+	for (int i = 0; i < 50; i++)		//iterating through wave lookup table in flash
 	{
-		dac_write(arr[i]);
+		dac_write(pgm_read_word(&arr[i]));
 		frequency(value);
 	}
 }
@@ -264,7 +196,7 @@ void output_waveform(uint32_t value, uint16_t arr[])
 void beep(void) {
 	
 	for(uint8_t i = 0; i < 150; i++) {
-		output_waveform(freq, (uint16_t *)sine);
+		output_waveform(freq, sine);
 	}
 }
 */
@@ -407,61 +339,50 @@ char toChar(int8_t i) {
 
 */
 
+/* Shows a read and sends it on, then holds it for HOLD_MS before taking
+   the next packet */
+void packet_task(uint8_t events)
+{
+	if (events & EV_TIMER) {
+		lcd_instruction(clear);
+		lcd_string_P(PSTR("Ready to Scan"));
+		lcd_instruction(setCursor | lineTwo);
+		RFID_ready();
+		return;
+	}
+	
+	for(uint8_t i = 1; i < 11; i++) {
+	lcd_char(RF.ID[i]);
+	_delay_us(50);
+	}
+	
+	uint8_t tag[TAG_BYTES];
+	if (tag_from_hex((char *)RF.ID + 1, tag)) {
+		send_frame(FRAME_SCAN, tag, TAG_BYTES);
+	}
+	else RF.bad++;
+	//beep();
+	task_delay(&tasks[TASK_PACKET], hold_ms);
+}
+
 int main( void )
 {
  
 	lcd_init();
-	USART_init();
+	timer0_init();
+	profile_start();					// built with PROFILE only
+	usart0_init(LINK_UBRR, LINK_U2X);
 	//frequency_init();
 	//interr_init();
 	//SPI_init();
 	
 	lcd_instruction(clear);
-	lcd_string((uint8_t *)"Ready to Scan");
+	lcd_string_P(PSTR("Ready to Scan"));
+	lcd_instruction(setCursor | lineTwo);
 
 	sei();
 	
-	while (1) {	
-		/*
-		if(!manchester_done()) continue;
-
-		lcd_instruction(clear);
-		
-		for (int i = 0; i < 10; i++) {
-			lcd_char(toChar(RFID.buff[i]));
-			_delay_us(50);
-		}
-		
-		USART_send(0x0A);
-		for (int i = 0; i < 10; i++) {
-			USART_send(toChar(RFID.buff[i]));
-		}
-		USART_send(0x0D);
-		beep();
-		_delay_ms(1000);	
-		ones = 0;
-		z = 0;
-		sei();
-		*/
-		
-		lcd_instruction(clear);
-		lcd_string((uint8_t *)"Ready to Scan");
-		lcd_instruction(setCursor | lineTwo);
-		
-		RFID_done();
-		
-		for(uint8_t i = 1; i < 11; i++) {
-		lcd_char(RF.ID[i]);
-		_delay_us(50);
-		}
-		
-		USART_send('\n');
-		//beep();
-		_delay_ms(2000);
-		RFID_ready();
-		
-		
-	}
+	sched_run(tasks, TASKS, idle);
 	
 	return 0;
 
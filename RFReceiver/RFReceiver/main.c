@@ -1,172 +1,82 @@
-#define F_CPU 8000000UL
+#include "../../Common/clock.h"		// F_CPU, ahead of the AVR headers
 #include <avr/io.h>
 #include <inttypes.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <string.h>
+#include "../../Common/em4100.h"
+#include "../../Common/frame.h"
+#include "../../Common/lcd.h"
+#include "../../Common/memstat.h"
+#include "../../Common/profile.h"
+#include "../../Common/sched.h"
+#include "../../Common/telemetry.h"
+#include "../../Common/usart.h"
 
-#define BAUD 9600
-#define BAUDRATE (((F_CPU / (BAUD * 16UL))) - 1)
 #define ICP PIND6
 
-int16_t sine[50] = {576,639,700,758,812,862,906,943,974,998,1014,1022,1022,1014,998,974,943,906,862,812,758,700,639,576,512,447,384,323,265,211,161,117,80,49,25,9,1,1,9,25,49,80,117,161,211,265,323,384,447,511};
+const int16_t sine[50] PROGMEM = {576,639,700,758,812,862,906,943,974,998,1014,1022,1022,1014,998,974,943,906,862,812,758,700,639,576,512,447,384,323,265,211,161,117,80,49,25,9,1,1,9,25,49,80,117,161,211,265,323,384,447,511};
 
 
-/************************************************************************* LCD Configuration *************************************************************/
+/******************************************************************* Tasks *****************************************************************/
 
-#define lcdDdr		DDRA		//Data direction
-#define lcdPort		PORTA		//PortD
-#define lcdD7Bit	PORTA0		//LCD D7 (pin 14) -> PORTD7
-#define lcdD6Bit	PORTA1		//LCD D6 (pin 13) -> PORTD6
-#define lcdD5Bit	PORTA2		//LCD D5 (pin 12) -> PORTD5
-#define lcdD4Bit	PORTA3		//LCD D4 (pin 11) -> PORTD4
-#define lcdEBit		PORTA4		//LCD E (pin 6)   -> PORTD3
-#define lcdRSBit	PORTA5		//LCD RS (pin 4)  -> PORTD2
+/* Sampling runs in the timer 1 interrupt, everything else is a task */
 
-#define lineOne			0x00                // Line 1
-#define lineTwo			0x40                // Line 2
-#define clear           0b00000001          // clears all characters
-#define home            0b00000010          // returns cursor to home
-#define entryMode       0b00000110          // moves cursor from left to right
-#define off      		0b00001000          // LCD off
-#define on       		0b00001100          // LCD on
-#define reset   		0b00110000          // reset the LCD
-#define bit4Mode 		0b00101000          // we are using 4 bits of data
-#define setCursor       0b10000000          //sets the position of cursor
+void decode_task(uint8_t events);
+void presence_task(uint8_t events);
+void command_task(uint8_t events);
+void display_task(uint8_t events);
+void tone_task(uint8_t events);
+void capture_task(uint8_t events);
 
+#define PRESENCE_MS		16		// presence check period, also the watchdog wake-up
 
-void lcd_write(uint8_t);
-void lcd_instruction(uint8_t);
-void lcd_char(uint8_t);
-void lcd_string(uint8_t string[]);
-void lcd_init(void);
-int find_card(void);
+enum {TASK_DECODE, TASK_PRESENCE, TASK_COMMAND, TASK_DISPLAY, TASK_TONE, TASK_CAPTURE, TASKS};
 
+struct task tasks[TASKS] = {
+	[TASK_DECODE]	= TASK(decode_task, 0, 20),				// a sample window is ready, the next one is filling
+	[TASK_PRESENCE]	= TASK(presence_task, PRESENCE_MS, 20),
+	[TASK_COMMAND]	= TASK(command_task, 0, 0),
+	[TASK_DISPLAY]	= TASK(display_task, 0, 50),
+	[TASK_TONE]		= TASK(tone_task, 0, 10),				// next slice of the beep
+	[TASK_CAPTURE]	= TASK(capture_task, 0, 0),				// raw samples waiting for the link
+};
 
-void lcd_init(void)
+ISR(TIMER0_COMPA_vect)
 {
-	lcdDdr |= (1 << lcdD7Bit) | (1 << lcdD6Bit) | (1 << lcdD5Bit) | (1 << lcdD4Bit) | (1 << lcdEBit) | (1 << lcdRSBit);
-	_delay_ms(100);
-
-	lcdPort &= ~(1 << lcdRSBit);                 // RS low
-	lcdPort &= ~(1 << lcdEBit);                 // E low
-
-	// LCD resets
-	lcd_write(reset);
-	_delay_ms(8);                           // 5 ms delay min
-
-	lcd_write(reset);
-	_delay_us(200);                       // 100 us delay min
-
-	lcd_write(reset);
-	_delay_us(200);
-	
-	lcd_write(bit4Mode);               	//set to 4 bit mode
-	_delay_us(50);                     // 40us delay min
-
-	lcd_instruction(bit4Mode);   	 // set 4 bit mode
-	_delay_us(50);                  // 40 us delay min
-
-	// display off
-	lcd_instruction(off);        	// turn off display
-	_delay_us(50);
-
-	// Clear display
-	lcd_instruction(clear);              // clear display
-	_delay_ms(3);                       // 1.64 ms delay min
-
-	// entry mode
-	lcd_instruction(entryMode);          // this instruction shifts the cursor
-	_delay_us(40);                      // 40 us delay min
-
-	// Display on
-	lcd_instruction(on);          // turn on the display
-	_delay_us(50);               // same delay as off
-}
-
-
-void lcd_string(uint8_t string[])
-{
-	int i = 0;                             //while the string is not empty
-	while (string[i] != 0)
-	{
-		lcd_char(string[i]);
-		i++;
-		_delay_us(50);                              //40 us delay min
-	}
-}
-
-
-
-void lcd_char(uint8_t data)
-{
-	lcdPort |= (1 << lcdRSBit);                 // RS high
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	lcd_write(data);                          // write the upper four bits of data
-	lcd_write(data << 4);                    // write the lower 4 bits of data
-}
-
-
-void lcd_instruction(uint8_t instruction)
-{
-	lcdPort &= ~(1 << lcdRSBit);                // RS low
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	lcd_write(instruction);                   // write the upper 4 bits of data
-	_delay_us(10);
-	lcd_write(instruction << 4);             // write the lower 4 bits of data
-	_delay_ms(5);
-}
-
-
-void lcd_write(uint8_t byte)
-{
-	lcdPort &= ~(1 << lcdD7Bit);                        // assume that data is '0'
-	if (byte & 1 << 7) lcdPort |= (1 << lcdD7Bit);     // make data = '1' if necessary
-
-	lcdPort &= ~(1 << lcdD6Bit);                        // repeat for each data bit
-	if (byte & 1 << 6) lcdPort |= (1 << lcdD6Bit);
-
-	lcdPort &= ~(1 << lcdD5Bit);
-	if (byte & 1 << 5) lcdPort |= (1 << lcdD5Bit);
-
-	lcdPort &= ~(1 << lcdD4Bit);
-	if (byte & 1 << 4) lcdPort |= (1 << lcdD4Bit);
-
-	// write the data
-	
-	lcdPort |= (1 << lcdEBit);                   // E high
-	_delay_us(1);                               // data setup
-	lcdPort &= ~(1 << lcdEBit);                // E low
-	_delay_us(1);                             // hold data
+	sched_tick();
 }
 
 /*********************************************************** USART Configuration *****************************************************************/
 
-void USART_init(void)
-{
-	/*Set baud rate */
-	UBRR0H = (BAUDRATE>>8);
-	UBRR0L = BAUDRATE;
-	
-	/* Enable receiver and transmitter */
-	UCSR0B = (1<<RXEN0)|(1<<TXEN0);
-
-	/* Set frame format: 8data, 1stop bit, no parity */
-	UCSR0C = (3<<UCSZ00);
-	
-	/* Enable interrupt */
-	UCSR0B |= (1 << RXCIE0);
-
-}
+/* Command frames from MainBoard. The USART is stopped in power down, so a
+   command only gets through while the board is awake or decoding. */
+struct frame_parser link;
+volatile uint8_t command;
+uint8_t args[FRAME_MAX_PAYLOAD - 1];	// rest of its payload
+uint8_t args_len;
+uint16_t commands_dropped;				// arrived while the last one was still pending
 
-void USART_send(unsigned char data)
+ISR(USART0_RX_vect)
 {
-	/* Wait for data to be received */
-	while (!( UCSR0A & (1<<UDRE0)));
-	UDR0 = data;
+	if (!frame_parse(&link, UDR0)) return;
+	if (link.type == FRAME_COMMAND && link.addr == READER_ADDR && link.len > 0) {
+		if (command != 0) {
+			commands_dropped++;
+			return;
+		}
+		args_len = link.len - 1;
+		memcpy(args, link.payload + 1, args_len);
+		command = link.payload[0];
+		task_signal(&tasks[TASK_COMMAND], 1);
+	}
 }
 
 /*************************************************************** SPI to DAC **********************************************************/
@@ -199,186 +109,344 @@ void dac_write(uint16_t val)
 	PORTB |= 1<<PORTB4; 	//turn on ss
 }
 
+#define TONE_SAMPLES		50		// entries in sine[]
+#define DAC_WRITE_CYCLES	80		// dac_write(): 16 bits at F_CPU/2 plus the pin and loop overhead
+
+/* Rest of one sample period of a tone at hz once the DAC has been written */
+#define TONE_WAIT_US(hz)	(1e6 / ((hz) * TONE_SAMPLES) - DAC_WRITE_CYCLES * 1e6 / F_CPU)
+
 void frequency(uint32_t frequency)
 {
 	
 	if (frequency == 0) {
-		for(volatile uint16_t i = 0; i < 1; i++);	//800 Hz
+		_delay_us(TONE_WAIT_US(800));	//800 Hz
 	}
 	
 	else if (frequency == 1) {
-		for(volatile uint16_t i = 0; i < 2; i++);	//1 kHz
+		_delay_us(TONE_WAIT_US(1000));	//1 kHz
 	}
 	
 
 }
 
-void output_waveform(uint32_t value, uint16_t arr[])
+void output_waveform(uint32_t value, const int16_t arr[])
 {
-	for (int i = 0; i < 50; i++)		//iterating through wave lookup table
+	for (int i = 0; i < TONE_SAMPLES; i++)		//iterating through wave lookup table in flash
 	{
-		dac_write(arr[i]);
+		dac_write(pgm_read_word(&arr[i]));
 		frequency(value);
 	}
 }
 
+#define TONE_PERIODS	150		// sine periods in one beep
+#define TONE_SLICE		5		// periods played per run, 5 ms at 1 kHz
+
+uint8_t tone_left;
+
 void beep(void) {
+	task_signal(&tasks[TASK_TONE], 1);
+}
+
+/* Plays the beep a slice at a time so the other tasks get in between */
+void tone_task(uint8_t events) {
+	if (events & ~EV_TIMER) tone_left = TONE_PERIODS;
 	
-	for(uint8_t i = 0; i < 150; i++) {
-		output_waveform(freq, (uint16_t *)sine);
+	for(uint8_t i = 0; i < TONE_SLICE && tone_left > 0; i++, tone_left--) {
+		output_waveform(freq, sine);
 	}
+	if (tone_left > 0) task_delay(&tasks[TASK_TONE], 0);
 }
 
-/***************************************************************** 125kHz wave **********************************************************/
-void frequency_init(void) {
-	DDRD |= (1 << PORTD7);
-	TCCR2A |= (1<<WGM20 | 1<<WGM21 | 1<<COM2A0);
-	TCCR2B |= (1<<WGM22 | 1<<CS20); //Fast PWM
-	OCR2A = 31;		// 8000000/64 = 125k, but it's half with 50% duty cycle. 31 was value with least percent error at 126.6 kHz
+/****************************************************** Presence Detection **********************************************************/
+
+/* Instead of running the carrier all the time, pulse it every watchdog
+   period and look at the antenna envelope on the ADC. A tag in the field
+   loads the coil and moves the level away from the empty-field baseline.
+   Only then is the carrier left on for the full sampling and decode.
+   The watchdog period (16 ms) is shorter than one EM4100 frame (64 bits,
+   32.8 ms), so a tag is picked up within a frame of arriving. Its ID
+   follows two frames of samples later (EM4100_EARLY), the least that
+   holds a whole frame wherever it started.
+   Build with -DPRESENCE_DETECT=0 to keep the carrier on instead. */
+
+#ifndef PRESENCE_DETECT
+#define PRESENCE_DETECT		1		// 0 = carrier always on
+#endif
+#define CARRIER_SETTLE_US	500		// coil ring up before measuring
+#define PRESENCE_DELTA		12		// ADC counts away from baseline = tag
+#define DECODE_WINDOWS		2		// full sample buffers to try before sleeping again
+
+uint8_t presence_delta = PRESENCE_DELTA;	// tunable over the link, see Telemetry
+uint8_t decode_windows = DECODE_WINDOWS;
+uint16_t baseline;					// empty field level, x16
+bool decoding;
+
+void start_decoding(void);
+void stop_decoding(void);
+
+void adc_init(void)
+{
+	ADMUX = (1 << REFS0) | ANTENNA_ADC;						//AVcc reference
+	ADCSRA = (1 << ADEN) | (ADC_PS << ADPS0);				//ADC clock at most ADC_HZ
+	DIDR0 = (1 << ANTENNA_ADC);								//no digital input buffer on the sense pin
 }
 
-/****************************************************** Manchester Decoding **********************************************************/
-
-volatile uint16_t z;
-volatile uint16_t ones;
-volatile uint8_t count;
-volatile bool parity_error;
-volatile bool found_nine_ones;
+uint16_t adc_read(void)
+{
+	ADCSRA |= (1 << ADSC);
+	while (ADCSRA & (1 << ADSC));
+	return ADC;
+}
 
-struct {
-	int8_t data[2000];
-	volatile unsigned int index[20];
-	volatile bool ready;
-	volatile bool done;
-	int8_t cardID[10];
+uint16_t antenna_level(void)
+{
+	carrier_on();
+	_delay_us(CARRIER_SETTLE_US);
 	
-}RFID;
-
+	uint16_t sum = 0;
+	for (uint8_t i = 0; i < 4; i++) {
+		sum += adc_read();
+	}
+	
+	carrier_off();
+	return sum / 4;
+}
 
-void timer1_init()
+void presence_init(void)
 {
-	DDRD &= ~(1 << PIND2);		//Receiver input
-	PORTD |= 1 << PIND2;		// pull up resistor
-	TCCR1B |= (1<<CS10);	//Timer 1 no prescaler
-	TCNT1 = 0;	// initialize counter
-		
-	//(.375/.000125) - 1
+	adc_init();
+	carrier_off();
 	
-	//OCR1A = 3999;		//Clear timer when it reaches this value, 500us delay
+	baseline = 0;
+	for (uint8_t i = 0; i < 16; i++) {		//assumes no tag at power up
+		baseline += antenna_level();
+		_delay_ms(1);
+	}
+}
 
+bool tag_present(void)
+{
+	uint16_t level = antenna_level();
+	int16_t delta = (int16_t)level - (int16_t)(baseline / 16);
+	
+	if (delta > presence_delta || delta < -presence_delta) return true;
+	
+	baseline += level - baseline / 16;		//follow slow drift of the empty field
+	return false;
 }
 
-void read_value(void){
-	if (TCNT1 >= 4008){ //if 500us has passed
-	TCNT1 = 0;
+/* Power down until the next watchdog interrupt */
+void sleep_until_wdt(void)
+{
+	usart0_flush();
+	ADCSRA &= ~(1 << ADEN);
 	
-	RFID.data[z] = ((PIND & 0x04)>>2);
+	cli();
+	wdt_reset();
+	WDTCSR = (1 << WDCE) | (1 << WDE);
+	WDTCSR = (1 << WDIE);					//interrupt only, 16 ms
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+	wdt_disable();
 	
-	if (RFID.data[z] == 1) {
-		
-		count++;
+	ADCSRA |= (1 << ADEN);
+}
 
-		if(count == 9 && RFID.ready == false) {		//wait until 9 consecutive 1s
-			
-			RFID.index[ones] = z+1;		//store each index of each 9 1s
+ISR(WDT_vect)
+{
+	sched_ms += PRESENCE_MS;				//timer 0 stops in power down
+}
 
-			if (ones > 18){
-				RFID.ready = true;
-				found_nine_ones = true;
-				ones = 0;
-				count = 0;
-			}
-			
-			else ones++;
-		}
-		
+void presence_task(uint8_t events)
+{
+#if PRESENCE_DETECT
+	if (decoding) {
+		if (windows >= decode_windows && em4100_decoded()) stop_decoding();	//tag left or was a false trigger
+		return;
 	}
-	
-	else count = 0;
-	
-	if (z < 1998) z++;
-	else { z = 0; RFID.done = true;}
-			
-		
+	if (tag_present()) start_decoding();
+#endif
+}
+
+/* Nothing released: power down while no tag is being read, otherwise
+   idle so the sampling timer keeps running */
+void idle(void)
+{
+#if PRESENCE_DETECT
+	if (!decoding) {
+		sleep_until_wdt();
+		return;
 	}
+#endif
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sei();									// sleep_cpu() runs before any pending interrupt
+	sleep_cpu();
+	sleep_disable();
 }
 
+/****************************************************** Raw Capture **********************************************************/
+
+/* For misreads that can't be reproduced on the bench. With capture on,
+   every sample the decoder takes is also streamed to the link in
+   FRAME_CAPTURE frames, for Tools/rfcapture to record. Switched with
+   FRAME_COMMAND CAPTURE_CMD:
+   
+     'c' | mode            CAPTURE_BITS, CAPTURE_ADC or 0 = off, none only asks
+   
+   answered with what it takes to interpret the samples, 16 bit values
+   high byte first:
+   
+     'c' | mode | F_CPU kHz | timer 1 TOP | prescaler | carrier TOP | overruns
+   
+   Each FRAME_CAPTURE payload is
+   
+     kind | first sample (32 bit, counted from switching on) | data
+   
+   CAPTURE_BITS packs the sliced level 8 samples to a byte, first sample in
+   the top bit. CAPTURE_ADC is one envelope sample (ADC >> 2) per byte.
+   CAPTURE_START (data: sched_ms) and CAPTURE_STOP bracket every stretch
+   with the carrier on; the stop's index also ends a part filled byte.
+   
+   Bits take about 520 bytes/s of the link, fine at 9600 baud. ADC
+   samples take about 4.2 kB/s, which needs LINK_BAUD 76800 (the nearest
+   rate clock.h accepts at 8 MHz). A chunk the link can't take in time is
+   dropped and counted, the jump in the indexes shows where. */
+
+#define CAPTURE_CMD		'c'
+#define CAPTURE_BITS	'b'
+#define CAPTURE_ADC		'a'
+#define CAPTURE_START	'S'
+#define CAPTURE_STOP	'E'
+#define CAPTURE_SLOTS	8			// chunks waiting for the link, power of 2
+#define CAPTURE_DATA	(FRAME_MAX_PAYLOAD - 5)
+
+struct chunk {
+	uint8_t kind;
+	uint32_t index;					// first sample
+	uint8_t len;					// bytes of data
+	uint8_t data[CAPTURE_DATA];
+};
 
-bool manchester_done(void) {
+struct {
+	volatile uint8_t mode;			// 0 = off
+	uint32_t samples;				// taken since capture was switched on
+	uint8_t byte;					// bits being packed
+	uint8_t bits;
+	struct chunk chunks[CAPTURE_SLOTS];		// chunks[head] is being filled
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	uint16_t overruns;				// chunks dropped, the link was too slow
+} Capture;
+
+/* Hands the chunk being filled to capture_task() and starts the next one,
+   or starts it over if every slot is still waiting */
+void capture_publish(void)
+{
+	if ((uint8_t)(Capture.head + 1 - Capture.tail) < CAPTURE_SLOTS) {
+		Capture.head++;
+		task_signal(&tasks[TASK_CAPTURE], 1);
+	} else {
+		Capture.overruns++;
+	}
 	
-	if (RFID.done == true && found_nine_ones == true){
-		
-		parity_error = false;
-		
-		unsigned int index;
-		index = RFID.index[ones];
-		volatile int row_parity[10] = {0};
-		volatile int col_parity[4] = {0};	
-		volatile int row_check[10] = {0};
-		volatile int col_check[4] = {0};
-			
-		
-		for (int8_t i = 0; i < 10; i++) {					//10 parity bits = 50 total iterations
-			
-			volatile int8_t rfid_char = 0;
-			
-			for (int8_t j = 3; j >= 0; j--) {
-				int8_t decoded_data = RFID.data[index];		//save each bit
-				rfid_char += decoded_data << j;				//shift 4 times to create 8 bit int
-				
-				row_check[i] += RFID.data[index];  //Miguel
-				row_check[i] = row_check[i] & 0x01;
-				col_check[j] += RFID.data[index];
-				col_check[j] = col_check[j] & 0x01;
-				
-				index++;                                    //increment the index 4 times
-													
-			}
-			
-			RFID.cardID[i] = rfid_char;				//save each character
-			
-			row_parity[i] = RFID.data[index];//save the row parity bit
-			index++;								//increment the index to the parity bit (5x)
+	struct chunk *c = &Capture.chunks[Capture.head % CAPTURE_SLOTS];
+	c->kind = Capture.mode;
+	c->index = Capture.samples;
+	c->len = 0;
+}
 
+/* From the timer 1 interrupt, the same sample the decoder gets */
+static inline void capture_sample(void)
+{
+	struct chunk *c = &Capture.chunks[Capture.head % CAPTURE_SLOTS];
+	
+	if (Capture.mode == CAPTURE_BITS) {
+		Capture.byte = (Capture.byte << 1) | sliced_input();
+		if (++Capture.bits == 8) {
+			c->data[c->len++] = Capture.byte;
+			Capture.bits = 0;
 		}
-		
-		
-		for (int8_t j = 3; j >= 0; j--) {
-			col_parity[j] = RFID.data[index];
-			index++;
+	}
+#if SLICER_ADC
+	else c->data[c->len++] = ADC >> 2;
+#endif
+	
+	Capture.samples++;
+	if (c->len == CAPTURE_DATA) capture_publish();
+}
+
+/* Sends what has been sampled so far, then a START or STOP marker */
+void capture_mark(uint8_t kind)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		struct chunk *c = &Capture.chunks[Capture.head % CAPTURE_SLOTS];
+		if (Capture.bits != 0) {
+			c->data[c->len++] = Capture.byte << (8 - Capture.bits);
+			Capture.bits = 0;
 		}
+		if (c->len != 0) capture_publish();
 		
-		volatile int stopbit = RFID.data[index];
-		
-		for (int8_t i = 0; i < 10; i++) {
-			for (int8_t j = 3; j >= 0; j--) {			
-		if(row_parity[i] != row_check[i] ) parity_error = true; //checking the row parity
-		if(col_parity[j] != col_check[j] ) parity_error = true; //checking the row parity
-			}
+		c = &Capture.chunks[Capture.head % CAPTURE_SLOTS];
+		c->kind = kind;
+		if (kind == CAPTURE_START) {
+			uint32_t ms = sched_ms;
+			for (int8_t i = 3; i >= 0; i--, ms >>= 8) c->data[i] = ms & 0xFF;
+			c->len = 4;
 		}
-		
-		
-		if ((stopbit != 0) || (parity_error == true)){								//if the decoded rf id is noise
-			if(ones < 18) index = RFID.index[ones++];	//move on to the next index of 9 1s
-			else {										//if we run out of indexes, leave the function and rescan
-				RFID.done = false;
-				RFID.ready = false;
-				found_nine_ones = false;
-				index = 0;
-				ones = 0;
-				z = 0;
-			}
-			return false;
-		} 
-		
-		RFID.done = false;
-		RFID.ready = false;
-		found_nine_ones = false;
-		index = 0;
-		return true;
+		capture_publish();
 	}
+}
+
+void capture_switch(uint8_t mode)
+{
+	if (mode == Capture.mode) return;
+	if (Capture.mode != 0 && decoding) capture_mark(CAPTURE_STOP);
 	
-	return false;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		struct chunk *c = &Capture.chunks[Capture.head % CAPTURE_SLOTS];
+		Capture.mode = mode;
+		Capture.samples = 0;
+		Capture.bits = 0;
+		c->kind = mode;
+		c->index = 0;
+		c->len = 0;
+	}
+	if (mode != 0 && decoding) capture_mark(CAPTURE_START);
+}
+
+/* One frame per run, so decoding isn't held up behind a backlog */
+void capture_task(uint8_t events)
+{
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	
+	if (Capture.tail == Capture.head) return;
+	
+	struct chunk *c = &Capture.chunks[Capture.tail % CAPTURE_SLOTS];
+	payload[0] = c->kind;
+	payload[1] = c->index >> 24;
+	payload[2] = (c->index >> 16) & 0xFF;
+	payload[3] = (c->index >> 8) & 0xFF;
+	payload[4] = c->index & 0xFF;
+	memcpy(payload + 5, c->data, c->len);
+	send_frame(FRAME_CAPTURE, payload, 5 + c->len);
+	
+	Capture.tail++;
+	if (Capture.tail != Capture.head) task_signal(&tasks[TASK_CAPTURE], 1);
+}
+
+/****************************************************** Manchester Decoding **********************************************************/
+
+/* Carrier, slicer and decoder are in Common/em4100.h, shared with
+   MainBoard's LOCAL_READER build. Capture takes the same samples. */
+
+ISR(TIMER1_COMPA_vect)
+{
+	if (read_value()) task_signal(&tasks[TASK_DECODE], 1);
+	if (Capture.mode) capture_sample();
 }
 
 char toChar(int8_t i) {
@@ -390,53 +458,144 @@ char toChar(int8_t i) {
 }
 
 
+void start_decoding(void)
+{
+	if (Capture.mode) capture_mark(CAPTURE_START);
+	em4100_start();
+	decoding = true;
+}
+
+void stop_decoding(void)
+{
+	em4100_stop();
+	if (Capture.mode) capture_mark(CAPTURE_STOP);
+	decoding = false;
+}
+
+/****************************************************** Telemetry **********************************************************/
+
+/* Read with TELEMETRY_GET, tunables set with TELEMETRY_SET (Common/telemetry.h,
+   Tools/linkshell). A new sample period takes effect at once, the rest are
+   read where they are used. */
+
+const struct telemetry_var telemetry_vars[] PROGMEM = {
+	TELEMETRY_COUNTER("captures", Decoder.captures),
+	TELEMETRY_COUNTER("noise", Decoder.noise),
+	TELEMETRY_COUNTER("headers", Decoder.headers),
+	TELEMETRY_COUNTER("parity", Decoder.parity_fails),
+	TELEMETRY_COUNTER("stopbit", Decoder.stop_fails),
+	TELEMETRY_COUNTER("rescans", Decoder.rescans),
+	TELEMETRY_COUNTER("reads", Decoder.reads),
+	TELEMETRY_COUNTER("dec_ovr", Decoder.overruns),
+	TELEMETRY_COUNTER("crc", link.crc_errors),
+	TELEMETRY_COUNTER("cmd_drop", commands_dropped),
+	TELEMETRY_COUNTER("late", tasks[TASK_DECODE].late),
+	TELEMETRY_COUNTER("cap_ovr", Capture.overruns),
+	TELEMETRY_TUNABLE("sample", sample_top, SAMPLE_TOP - SAMPLE_TOP / 10, SAMPLE_TOP + SAMPLE_TOP / 10),
+	TELEMETRY_TUNABLE("swing", slicer.min_swing, 1, 255),
+	TELEMETRY_TUNABLE("presence", presence_delta, 1, 255),
+	TELEMETRY_TUNABLE("windows", decode_windows, 1, 255),
+};
+
+void command_task(uint8_t events)
+{
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	uint8_t len = 0;
+	bool written;
+	
+	if (command == MEMSTAT_CMD) {
+		uint16_t peaks[] = {ones_peak};
+		len = memstat_report(payload, peaks, 1);
+	}
+	if (command == PROFILE_CMD) {
+		len = profile_command(args, args_len, payload);
+	}
+	if (command == CAPTURE_CMD) {
+		if (args_len >= 1 && (args[0] == 0 || args[0] == CAPTURE_BITS || (SLICER_ADC && args[0] == CAPTURE_ADC))) capture_switch(args[0]);
+		
+		payload[len++] = CAPTURE_CMD;
+		payload[len++] = Capture.mode;
+		payload[len++] = (F_CPU / 1000) >> 8;
+		payload[len++] = (F_CPU / 1000) & 0xFF;
+		payload[len++] = sample_top >> 8;
+		payload[len++] = sample_top & 0xFF;
+		payload[len++] = SAMPLE_PRESCALE >> 8;
+		payload[len++] = SAMPLE_PRESCALE & 0xFF;
+		payload[len++] = CARRIER_TOP;
+		payload[len++] = Capture.overruns >> 8;
+		payload[len++] = Capture.overruns & 0xFF;
+	}
+	if (command == TELEMETRY_GET || command == TELEMETRY_SET) {
+		len = telemetry_command(command, args, args_len, telemetry_vars,
+			sizeof telemetry_vars / sizeof telemetry_vars[0], payload, &written);
+		if (written) {
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				OCR1A = sample_top;
+				TCNT1 = 0;					// in case it is already past the new TOP
+			}
+		}
+	}
+	command = 0;
+	if (len != 0) send_frame(FRAME_TELEMETRY, payload, len);
+}
+
+void decode_task(uint8_t events)
+{
+	uint8_t tag[TAG_BYTES];
+	
+	if (!em4100_decode(tag)) return;
+	
+	send_frame(FRAME_SCAN, tag, TAG_BYTES);
+	
+	task_signal(&tasks[TASK_DISPLAY], 1);
+	beep();
+	
+#if PRESENCE_DETECT
+	stop_decoding();					//next read starts from a fresh presence check
+#endif
+}
+
+void display_task(uint8_t events)
+{
+	lcd_instruction(clear);
+	
+	for (int i = 0; i < 10; i++) {
+		lcd_char(toChar(RFID.cardID[i]));
+		_delay_us(50);
+	}
+	
+#if SLICER_ADC
+	lcd_instruction(setCursor | lineTwo);
+	lcd_string_P(PSTR("Sig "));
+	lcd_number(RFID.strength);
+	lcd_string_P(PSTR(" SNR "));
+	lcd_number(RFID.snr);
+#endif
+}
+
 
 int main( void )
 {
 	
 	lcd_init();
-	USART_init();
+	timer0_init();
+	profile_start();					// built with PROFILE only
+	usart0_init(LINK_UBRR, LINK_U2X);
 	frequency_init();
 	timer1_init();
 	SPI_init();
 	
-	lcd_instruction(clear);
-	lcd_string((uint8_t *)"Ready to Scan");
-
+#if PRESENCE_DETECT
+	presence_init();
+#else
+	start_decoding();					//carrier and sampling stay on
+#endif
 	
-	while (1) {
-		
-		 read_value();
-		 
-		 
-		if(!manchester_done()) continue;
-
-		lcd_instruction(clear);
-		
-		for (int i = 0; i < 10; i++) {
-			lcd_char(toChar(RFID.cardID[i]));
-			_delay_us(50);
-		}
-		
-		USART_send(0x0A);
-		for (int i = 0; i < 10; i++) {
-			USART_send(toChar(RFID.cardID[i]));
-		}
-		USART_send(0x0D);
-		
-		beep();
-		
-		//_delay_ms(500);
-		
-		ones = 0;
-		z = 0;
-	
-		
+	lcd_instruction(clear);
+	lcd_string_P(PSTR("Ready to Scan"));
+	sei();
 	
-		
-	}
+	sched_run(tasks, TASKS, idle);
 	
 	return 0;
-
-
 }
\ No newline at end of file
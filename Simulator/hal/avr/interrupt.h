@@ -0,0 +1,38 @@
+/*
+ * Interrupt handling for the simulator build. ISR() registers the handler
+ * with the HAL when the firmware image is loaded.
+ */
+
+#ifndef HAL_AVR_INTERRUPT_H
+#define HAL_AVR_INTERRUPT_H
+
+#include "io.h"
+
+#define sei() hal_sei()
+#define cli() hal_cli()
+#define reti() return
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+
+#define ISR(vector, ...) \
+	static void hal_isr_##vector(void); \
+	__attribute__((constructor)) static void hal_isr_register_##vector(void) \
+	{ \
+		hal_register_isr(vector, hal_isr_##vector); \
+	} \
+	static void hal_isr_##vector(void)
+
+#define EMPTY_INTERRUPT(vector) ISR(vector) { }
+
+#define ISR_ALIAS(vector, target) \
+	__attribute__((constructor)) static void hal_isr_register_##vector(void) \
+	{ \
+		hal_register_isr(vector, hal_isr_##target); \
+	}
+
+#define ISR_ALIASOF(target)
+#define BADISR_vect 0
+
+#endif /* HAL_AVR_INTERRUPT_H */
@@ -0,0 +1,521 @@
+/*
+ * ATmega644PA register and bit names for the simulator build.
+ * See hal.h for how register accesses are turned into HAL calls.
+ */
+
+#ifndef HAL_AVR_IO_H
+#define HAL_AVR_IO_H
+
+#include <stdint.h>
+#include "../hal.h"
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+#define loop_until_bit_is_set(sfr, bit) do { } while (bit_is_clear(sfr, bit))
+#define loop_until_bit_is_clear(sfr, bit) do { } while (bit_is_set(sfr, bit))
+
+/* Registers */
+#define PINA     (*hal_io(HAL_PINA))
+#define DDRA     (*hal_io(HAL_DDRA))
+#define PORTA    (*hal_io(HAL_PORTA))
+#define PINB     (*hal_io(HAL_PINB))
+#define DDRB     (*hal_io(HAL_DDRB))
+#define PORTB    (*hal_io(HAL_PORTB))
+#define PINC     (*hal_io(HAL_PINC))
+#define DDRC     (*hal_io(HAL_DDRC))
+#define PORTC    (*hal_io(HAL_PORTC))
+#define PIND     (*hal_io(HAL_PIND))
+#define DDRD     (*hal_io(HAL_DDRD))
+#define PORTD    (*hal_io(HAL_PORTD))
+#define TIFR0    (*hal_io(HAL_TIFR0))
+#define TIFR1    (*hal_io(HAL_TIFR1))
+#define TIFR2    (*hal_io(HAL_TIFR2))
+#define PCIFR    (*hal_io(HAL_PCIFR))
+#define EIFR     (*hal_io(HAL_EIFR))
+#define EIMSK    (*hal_io(HAL_EIMSK))
+#define GPIOR0   (*hal_io(HAL_GPIOR0))
+#define GPIOR1   (*hal_io(HAL_GPIOR1))
+#define GPIOR2   (*hal_io(HAL_GPIOR2))
+#define EECR     (*hal_io(HAL_EECR))
+#define EEDR     (*hal_io(HAL_EEDR))
+#define EEAR     (*hal_io(HAL_EEAR))
+#define TCCR0A   (*hal_io(HAL_TCCR0A))
+#define TCCR0B   (*hal_io(HAL_TCCR0B))
+#define TCNT0    (*hal_io(HAL_TCNT0))
+#define OCR0A    (*hal_io(HAL_OCR0A))
+#define OCR0B    (*hal_io(HAL_OCR0B))
+#define SPCR     (*hal_io(HAL_SPCR))
+#define SPSR     (*hal_io(HAL_SPSR))
+#define SPDR     (*hal_io(HAL_SPDR))
+#define ACSR     (*hal_io(HAL_ACSR))
+#define SMCR     (*hal_io(HAL_SMCR))
+#define MCUSR    (*hal_io(HAL_MCUSR))
+#define MCUCR    (*hal_io(HAL_MCUCR))
+#define SP       (*hal_io(HAL_SP))
+#define SREG     (*hal_io(HAL_SREG))
+#define WDTCSR   (*hal_io(HAL_WDTCSR))
+#define CLKPR    (*hal_io(HAL_CLKPR))
+#define PRR0     (*hal_io(HAL_PRR0))
+#define OSCCAL   (*hal_io(HAL_OSCCAL))
+#define PCICR    (*hal_io(HAL_PCICR))
+#define EICRA    (*hal_io(HAL_EICRA))
+#define PCMSK0   (*hal_io(HAL_PCMSK0))
+#define PCMSK1   (*hal_io(HAL_PCMSK1))
+#define PCMSK2   (*hal_io(HAL_PCMSK2))
+#define PCMSK3   (*hal_io(HAL_PCMSK3))
+#define TIMSK0   (*hal_io(HAL_TIMSK0))
+#define TIMSK1   (*hal_io(HAL_TIMSK1))
+#define TIMSK2   (*hal_io(HAL_TIMSK2))
+#define ADC      (*hal_io(HAL_ADC))
+#define ADCSRA   (*hal_io(HAL_ADCSRA))
+#define ADCSRB   (*hal_io(HAL_ADCSRB))
+#define ADMUX    (*hal_io(HAL_ADMUX))
+#define DIDR0    (*hal_io(HAL_DIDR0))
+#define DIDR1    (*hal_io(HAL_DIDR1))
+#define TCCR1A   (*hal_io(HAL_TCCR1A))
+#define TCCR1B   (*hal_io(HAL_TCCR1B))
+#define TCCR1C   (*hal_io(HAL_TCCR1C))
+#define TCNT1    (*hal_io(HAL_TCNT1))
+#define ICR1     (*hal_io(HAL_ICR1))
+#define OCR1A    (*hal_io(HAL_OCR1A))
+#define OCR1B    (*hal_io(HAL_OCR1B))
+#define TCCR2A   (*hal_io(HAL_TCCR2A))
+#define TCCR2B   (*hal_io(HAL_TCCR2B))
+#define TCNT2    (*hal_io(HAL_TCNT2))
+#define OCR2A    (*hal_io(HAL_OCR2A))
+#define OCR2B    (*hal_io(HAL_OCR2B))
+#define ASSR     (*hal_io(HAL_ASSR))
+#define UCSR0A   (*hal_io(HAL_UCSR0A))
+#define UCSR0B   (*hal_io(HAL_UCSR0B))
+#define UCSR0C   (*hal_io(HAL_UCSR0C))
+#define UBRR0    (*hal_io(HAL_UBRR0))
+#define UDR0     (*hal_io(HAL_UDR0))
+#define UCSR1A   (*hal_io(HAL_UCSR1A))
+#define UCSR1B   (*hal_io(HAL_UCSR1B))
+#define UCSR1C   (*hal_io(HAL_UCSR1C))
+#define UBRR1    (*hal_io(HAL_UBRR1))
+#define UDR1     (*hal_io(HAL_UDR1))
+#define ADCW     ADC
+#define PRR      PRR0
+/* 8 bit halves of the 16 bit registers */
+#define ADCL    (*hal_io_lo(HAL_ADC))
+#define ADCH    (*hal_io_hi(HAL_ADC))
+#define TCNT1L  (*hal_io_lo(HAL_TCNT1))
+#define TCNT1H  (*hal_io_hi(HAL_TCNT1))
+#define ICR1L   (*hal_io_lo(HAL_ICR1))
+#define ICR1H   (*hal_io_hi(HAL_ICR1))
+#define OCR1AL  (*hal_io_lo(HAL_OCR1A))
+#define OCR1AH  (*hal_io_hi(HAL_OCR1A))
+#define OCR1BL  (*hal_io_lo(HAL_OCR1B))
+#define OCR1BH  (*hal_io_hi(HAL_OCR1B))
+#define UBRR0L  (*hal_io_lo(HAL_UBRR0))
+#define UBRR0H  (*hal_io_hi(HAL_UBRR0))
+#define UBRR1L  (*hal_io_lo(HAL_UBRR1))
+#define UBRR1H  (*hal_io_hi(HAL_UBRR1))
+#define SPL     (*hal_io_lo(HAL_SP))
+#define SPH     (*hal_io_hi(HAL_SP))
+#define EEARL   (*hal_io_lo(HAL_EEAR))
+#define EEARH   (*hal_io_hi(HAL_EEAR))
+
+/* Bits */
+
+#define RXC0    7
+#define TXC0    6
+#define UDRE0   5
+#define FE0     4
+#define DOR0    3
+#define UPE0    2
+#define U2X0    1
+#define MPCM0   0
+#define RXCIE0  7
+#define TXCIE0  6
+#define UDRIE0  5
+#define RXEN0   4
+#define TXEN0   3
+#define UCSZ02  2
+#define RXB80   1
+#define TXB80   0
+#define UMSEL01 7
+#define UMSEL00 6
+#define UPM01   5
+#define UPM00   4
+#define USBS0   3
+#define UCSZ01  2
+#define UCSZ00  1
+#define UCPOL0  0
+
+#define RXC1    7
+#define TXC1    6
+#define UDRE1   5
+#define FE1     4
+#define DOR1    3
+#define UPE1    2
+#define U2X1    1
+#define MPCM1   0
+#define RXCIE1  7
+#define TXCIE1  6
+#define UDRIE1  5
+#define RXEN1   4
+#define TXEN1   3
+#define UCSZ12  2
+#define RXB81   1
+#define TXB81   0
+#define UMSEL11 7
+#define UMSEL10 6
+#define UPM11   5
+#define UPM10   4
+#define USBS1   3
+#define UCSZ11  2
+#define UCSZ10  1
+#define UCPOL1  0
+
+#define COM0A1  7
+#define COM0A0  6
+#define COM0B1  5
+#define COM0B0  4
+#define WGM01   1
+#define WGM00   0
+#define FOC0A   7
+#define FOC0B   6
+#define WGM02   3
+#define CS02    2
+#define CS01    1
+#define CS00    0
+#define OCIE0B  2
+#define OCIE0A  1
+#define TOIE0   0
+#define OCF0B   2
+#define OCF0A   1
+#define TOV0    0
+
+#define COM1A1  7
+#define COM1A0  6
+#define COM1B1  5
+#define COM1B0  4
+#define WGM11   1
+#define WGM10   0
+#define ICNC1   7
+#define ICES1   6
+#define WGM13   4
+#define WGM12   3
+#define CS12    2
+#define CS11    1
+#define CS10    0
+#define ICIE1   5
+#define OCIE1B  2
+#define OCIE1A  1
+#define TOIE1   0
+#define ICF1    5
+#define OCF1B   2
+#define OCF1A   1
+#define TOV1    0
+
+#define COM2A1  7
+#define COM2A0  6
+#define COM2B1  5
+#define COM2B0  4
+#define WGM21   1
+#define WGM20   0
+#define FOC2A   7
+#define FOC2B   6
+#define WGM22   3
+#define CS22    2
+#define CS21    1
+#define CS20    0
+#define OCIE2B  2
+#define OCIE2A  1
+#define TOIE2   0
+#define OCF2B   2
+#define OCF2A   1
+#define TOV2    0
+#define AS2     5
+
+#define INT2    2
+#define INT1    1
+#define INT0    0
+#define INTF2   2
+#define INTF1   1
+#define INTF0   0
+#define ISC21   5
+#define ISC20   4
+#define ISC11   3
+#define ISC10   2
+#define ISC01   1
+#define ISC00   0
+
+#define SPIE    7
+#define SPE     6
+#define DORD    5
+#define MSTR    4
+#define CPOL    3
+#define CPHA    2
+#define SPR1    1
+#define SPR0    0
+#define SPIF    7
+#define WCOL    6
+#define SPI2X   0
+
+#define REFS1   7
+#define REFS0   6
+#define ADLAR   5
+#define MUX4    4
+#define MUX3    3
+#define MUX2    2
+#define MUX1    1
+#define MUX0    0
+#define ADEN    7
+#define ADSC    6
+#define ADATE   5
+#define ADIF    4
+#define ADIE    3
+#define ADPS2   2
+#define ADPS1   1
+#define ADPS0   0
+#define ACME    6
+#define ADTS2   2
+#define ADTS1   1
+#define ADTS0   0
+#define ADC7D   7
+#define ADC6D   6
+#define ADC5D   5
+#define ADC4D   4
+#define ADC3D   3
+#define ADC2D   2
+#define ADC1D   1
+#define ADC0D   0
+#define AIN1D   1
+#define AIN0D   0
+
+#define ACD     7
+#define ACBG    6
+#define ACO     5
+#define ACI     4
+#define ACIE    3
+#define ACIC    2
+#define ACIS1   1
+#define ACIS0   0
+
+#define SM2     3
+#define SM1     2
+#define SM0     1
+#define SE      0
+
+#define WDIF    7
+#define WDIE    6
+#define WDP3    5
+#define WDCE    4
+#define WDE     3
+#define WDP2    2
+#define WDP1    1
+#define WDP0    0
+
+#define JTRF    4
+#define WDRF    3
+#define BORF    2
+#define EXTRF   1
+#define PORF    0
+#define JTD     7
+#define PUD     4
+#define IVSEL   1
+#define IVCE    0
+
+#define PRTWI    7
+#define PRTIM2   6
+#define PRTIM0   5
+#define PRUSART1 4
+#define PRTIM1   3
+#define PRSPI    2
+#define PRUSART0 1
+#define PRADC    0
+
+#define EERIE   3
+#define EEMPE   2
+#define EEPE    1
+#define EERE    0
+
+#define SREG_I  7
+
+#define PORTA0 0
+#define PINA0  0
+#define DDA0   0
+#define PA0    0
+#define PORTA1 1
+#define PINA1  1
+#define DDA1   1
+#define PA1    1
+#define PORTA2 2
+#define PINA2  2
+#define DDA2   2
+#define PA2    2
+#define PORTA3 3
+#define PINA3  3
+#define DDA3   3
+#define PA3    3
+#define PORTA4 4
+#define PINA4  4
+#define DDA4   4
+#define PA4    4
+#define PORTA5 5
+#define PINA5  5
+#define DDA5   5
+#define PA5    5
+#define PORTA6 6
+#define PINA6  6
+#define DDA6   6
+#define PA6    6
+#define PORTA7 7
+#define PINA7  7
+#define DDA7   7
+#define PA7    7
+
+#define PORTB0 0
+#define PINB0  0
+#define DDB0   0
+#define PB0    0
+#define PORTB1 1
+#define PINB1  1
+#define DDB1   1
+#define PB1    1
+#define PORTB2 2
+#define PINB2  2
+#define DDB2   2
+#define PB2    2
+#define PORTB3 3
+#define PINB3  3
+#define DDB3   3
+#define PB3    3
+#define PORTB4 4
+#define PINB4  4
+#define DDB4   4
+#define PB4    4
+#define PORTB5 5
+#define PINB5  5
+#define DDB5   5
+#define PB5    5
+#define PORTB6 6
+#define PINB6  6
+#define DDB6   6
+#define PB6    6
+#define PORTB7 7
+#define PINB7  7
+#define DDB7   7
+#define PB7    7
+
+#define PORTC0 0
+#define PINC0  0
+#define DDC0   0
+#define PC0    0
+#define PORTC1 1
+#define PINC1  1
+#define DDC1   1
+#define PC1    1
+#define PORTC2 2
+#define PINC2  2
+#define DDC2   2
+#define PC2    2
+#define PORTC3 3
+#define PINC3  3
+#define DDC3   3
+#define PC3    3
+#define PORTC4 4
+#define PINC4  4
+#define DDC4   4
+#define PC4    4
+#define PORTC5 5
+#define PINC5  5
+#define DDC5   5
+#define PC5    5
+#define PORTC6 6
+#define PINC6  6
+#define DDC6   6
+#define PC6    6
+#define PORTC7 7
+#define PINC7  7
+#define DDC7   7
+#define PC7    7
+
+#define PORTD0 0
+#define PIND0  0
+#define DDD0   0
+#define PD0    0
+#define PORTD1 1
+#define PIND1  1
+#define DDD1   1
+#define PD1    1
+#define PORTD2 2
+#define PIND2  2
+#define DDD2   2
+#define PD2    2
+#define PORTD3 3
+#define PIND3  3
+#define DDD3   3
+#define PD3    3
+#define PORTD4 4
+#define PIND4  4
+#define DDD4   4
+#define PD4    4
+#define PORTD5 5
+#define PIND5  5
+#define DDD5   5
+#define PD5    5
+#define PORTD6 6
+#define PIND6  6
+#define DDD6   6
+#define PD6    6
+#define PORTD7 7
+#define PIND7  7
+#define DDD7   7
+#define PD7    7
+
+/* Memory layout */
+#define RAMSTART 0x100
+#define RAMEND   0x10FF
+#define RAMSIZE  4096
+#define E2END    0x7FF
+#define FLASHEND 0xFFFF
+
+/* Vectors, named the way ISR() expects them */
+#define INT0_vect            HAL_INT0_vect
+#define INT1_vect            HAL_INT1_vect
+#define INT2_vect            HAL_INT2_vect
+#define PCINT0_vect          HAL_PCINT0_vect
+#define PCINT1_vect          HAL_PCINT1_vect
+#define PCINT2_vect          HAL_PCINT2_vect
+#define PCINT3_vect          HAL_PCINT3_vect
+#define WDT_vect             HAL_WDT_vect
+#define TIMER2_COMPA_vect    HAL_TIMER2_COMPA_vect
+#define TIMER2_COMPB_vect    HAL_TIMER2_COMPB_vect
+#define TIMER2_OVF_vect      HAL_TIMER2_OVF_vect
+#define TIMER1_CAPT_vect     HAL_TIMER1_CAPT_vect
+#define TIMER1_COMPA_vect    HAL_TIMER1_COMPA_vect
+#define TIMER1_COMPB_vect    HAL_TIMER1_COMPB_vect
+#define TIMER1_OVF_vect      HAL_TIMER1_OVF_vect
+#define TIMER0_COMPA_vect    HAL_TIMER0_COMPA_vect
+#define TIMER0_COMPB_vect    HAL_TIMER0_COMPB_vect
+#define TIMER0_OVF_vect      HAL_TIMER0_OVF_vect
+#define SPI_STC_vect         HAL_SPI_STC_vect
+#define USART0_RX_vect       HAL_USART0_RX_vect
+#define USART0_UDRE_vect     HAL_USART0_UDRE_vect
+#define USART0_TX_vect       HAL_USART0_TX_vect
+#define ANALOG_COMP_vect     HAL_ANALOG_COMP_vect
+#define ADC_vect             HAL_ADC_vect
+#define EE_READY_vect        HAL_EE_READY_vect
+#define TWI_vect             HAL_TWI_vect
+#define SPM_READY_vect       HAL_SPM_READY_vect
+#define USART1_RX_vect       HAL_USART1_RX_vect
+#define USART1_UDRE_vect     HAL_USART1_UDRE_vect
+#define USART1_TX_vect       HAL_USART1_TX_vect
+
+/* The firmware defines F_CPU before including this header */
+#ifdef F_CPU
+__attribute__((constructor)) static void hal_f_cpu_init(void)
+{
+	hal_set_f_cpu(F_CPU);
+}
+#endif
+
+#endif /* HAL_AVR_IO_H */
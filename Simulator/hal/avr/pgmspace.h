@@ -0,0 +1,39 @@
+/*
+ * Program memory access for the simulator build. The host has a single
+ * address space, so flash data is ordinary const data.
+ */
+
+#ifndef HAL_AVR_PGMSPACE_H
+#define HAL_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#define PROGMEM
+#define PGM_P const char *
+#define PGM_VOID_P const void *
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr)   (*(const uint8_t *)(addr))
+#define pgm_read_word(addr)   (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr)  (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr)    (*(void * const *)(addr))
+
+#define memcpy_P    memcpy
+#define memcmp_P    memcmp
+#define strcpy_P    strcpy
+#define strncpy_P   strncpy
+#define strcmp_P    strcmp
+#define strncmp_P   strncmp
+#define strlen_P    strlen
+#define strstr_P    strstr
+#define strchr_P    strchr
+#define printf_P    printf
+#define sprintf_P   sprintf
+#define snprintf_P  snprintf
+#define vsnprintf_P vsnprintf
+#define fputs_P     fputs
+
+#endif /* HAL_AVR_PGMSPACE_H */
@@ -0,0 +1,32 @@
+/*
+ * Sleep modes for the simulator build. sleep_cpu() lets virtual time jump
+ * to the next event that can wake the chip.
+ */
+
+#ifndef HAL_AVR_SLEEP_H
+#define HAL_AVR_SLEEP_H
+
+#include "io.h"
+
+#define SLEEP_MODE_IDLE         (0)
+#define SLEEP_MODE_ADC          _BV(SM0)
+#define SLEEP_MODE_PWR_DOWN     _BV(SM1)
+#define SLEEP_MODE_PWR_SAVE     (_BV(SM0) | _BV(SM1))
+#define SLEEP_MODE_STANDBY      (_BV(SM1) | _BV(SM2))
+#define SLEEP_MODE_EXT_STANDBY  (_BV(SM0) | _BV(SM1) | _BV(SM2))
+
+#define set_sleep_mode(mode)    (SMCR = (SMCR & ~(_BV(SM0) | _BV(SM1) | _BV(SM2))) | (mode))
+#define sleep_enable()          (SMCR |= _BV(SE))
+#define sleep_disable()         (SMCR &= ~_BV(SE))
+#define sleep_cpu()             hal_sleep()
+
+#define sleep_mode() \
+	do { \
+		sleep_enable(); \
+		sleep_cpu(); \
+		sleep_disable(); \
+	} while (0)
+
+#define sleep_bod_disable()
+
+#endif /* HAL_AVR_SLEEP_H */
@@ -0,0 +1,32 @@
+/*
+ * Watchdog for the simulator build. Only the interrupt mode is modelled,
+ * a watchdog reset is reported by the HAL and otherwise ignored.
+ */
+
+#ifndef HAL_AVR_WDT_H
+#define HAL_AVR_WDT_H
+
+#include "io.h"
+
+#define WDTO_15MS   0
+#define WDTO_30MS   1
+#define WDTO_60MS   2
+#define WDTO_120MS  3
+#define WDTO_250MS  4
+#define WDTO_500MS  5
+#define WDTO_1S     6
+#define WDTO_2S     7
+#define WDTO_4S     8
+#define WDTO_8S     9
+
+#define wdt_reset() hal_wdt_reset()
+
+#define wdt_enable(value) \
+	(WDTCSR = _BV(WDCE) | _BV(WDE), \
+	 WDTCSR = _BV(WDE) | (((value) & 0x08) ? _BV(WDP3) : 0) | ((value) & 0x07))
+
+#define wdt_disable() \
+	(WDTCSR = _BV(WDCE) | _BV(WDE), \
+	 WDTCSR = 0)
+
+#endif /* HAL_AVR_WDT_H */
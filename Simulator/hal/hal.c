@@ -0,0 +1,956 @@
+/*
+ * On-chip peripherals of the ATmega644PA for the simulator.
+ *
+ * Built into every firmware image. Time is kept in CPU cycles and only
+ * moves when the firmware touches an I/O register (ACCESS_CYCLES each),
+ * enters an interrupt, delays or sleeps. Plain computation is free, so
+ * the simulator measures waiting and I/O, not instruction timing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hal.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#ifndef HAL_BOARD_NAME
+#define HAL_BOARD_NAME "board"
+#endif
+
+#define ACCESS_CYCLES   2               // one in/out/lds/sts plus loop overhead
+#define ISR_CYCLES      10              // vector jump, prologue, reti
+#define NEVER           UINT64_MAX
+#define UART_IN         4096            // bytes on the wire not yet received
+
+int firmware_main(void);
+
+static const struct hal_host *host;
+static uint32_t f_cpu = 8000000UL;
+static uint64_t now;                    // cycles since reset
+static uint64_t horizon;                // run until here, then yield
+static uint64_t next_due = NEVER;       // earliest pending peripheral event
+
+/* Full registers first, then a lo/hi pair for every register */
+static volatile uint32_t regs[HAL_NREGS * 3];
+static int last = -1;                   // register handed out by the last access
+static uint32_t last_given;
+static uint32_t last_stored;            // stored value behind the slot
+
+static bool ie;                         // I bit of SREG
+static bool irq_dirty;                  // a flag or an enable bit changed
+static void (*isr[HAL_NVECTORS])(void);
+
+static void commit(void);
+static void update(void);
+static bool dispatch(void);
+static void reschedule(void);
+
+/******************************************************************* Time ********************************************************************/
+
+static uint64_t to_ns(uint64_t cycles)
+{
+	return cycles / f_cpu * 1000000000ULL + cycles % f_cpu * 1000000000ULL / f_cpu;
+}
+
+static uint64_t to_cycles(uint64_t ns)
+{
+	return ns / 1000000000ULL * f_cpu + (ns % 1000000000ULL * f_cpu + 999999999ULL) / 1000000000ULL;
+}
+
+static uint64_t min64(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+static void log_msg(const char *fmt, const char *arg)
+{
+	char buf[160];
+	snprintf(buf, sizeof buf, fmt, arg);
+	if (host && host->log) host->log(host->ctx, buf);
+	else fprintf(stderr, "%s: %s\n", HAL_BOARD_NAME, buf);
+}
+
+static void yield(uint64_t wake)
+{
+	host->yield(host->ctx, to_ns(now), wake == NEVER ? UINT64_MAX : to_ns(wake));
+}
+
+/******************************************************************* USART ********************************************************************/
+
+struct uart {
+	int udr, ucsra, ucsrb, ucsrc, ubrr;
+	int rx_vect, udre_vect, tx_vect;
+	uint64_t bit_cycles;
+
+	struct { uint64_t at; uint8_t data; } in[UART_IN];
+	unsigned in_head, in_tail;
+
+	uint8_t fifo[2];                    // two level receive buffer
+	uint8_t fifo_n;
+	bool presented;                     // fifo[0] handed out through UDR
+	bool overrun;
+
+	uint64_t buf_free_at;               // UDR empty again
+	uint64_t shift_free_at;             // last bit on the wire
+	bool tx_active;
+	bool txc;
+};
+
+static struct uart uart[2] = {
+	{ HAL_UDR0, HAL_UCSR0A, HAL_UCSR0B, HAL_UCSR0C, HAL_UBRR0,
+	  HAL_USART0_RX_vect, HAL_USART0_UDRE_vect, HAL_USART0_TX_vect },
+	{ HAL_UDR1, HAL_UCSR1A, HAL_UCSR1B, HAL_UCSR1C, HAL_UBRR1,
+	  HAL_USART1_RX_vect, HAL_USART1_UDRE_vect, HAL_USART1_TX_vect },
+};
+
+static void uart_config(int port)
+{
+	struct uart *u = &uart[port];
+	uint8_t b = regs[u->ucsrb];
+	uint64_t bit = 0;
+
+	if (b & ((1 << 4) | (1 << 3))) {   // RXEN or TXEN
+		bit = (uint64_t)((regs[u->ucsra] & (1 << 1)) ? 8 : 16) * ((regs[u->ubrr] & 0x0FFF) + 1);
+	}
+	if (bit != u->bit_cycles) {
+		u->bit_cycles = bit;
+		if (host->uart_config) host->uart_config(host->ctx, port, bit ? to_ns(bit) : 0);
+	}
+}
+
+static uint64_t uart_byte_cycles(struct uart *u)
+{
+	uint8_t c = regs[u->ucsrc];
+	unsigned bits = 1 + 5 + ((c >> 1) & 3) + ((c & (1 << 3)) ? 2 : 1) + ((c & (1 << 5)) ? 1 : 0);
+	return bits * u->bit_cycles;
+}
+
+static void uart_tx(int port, uint8_t data)
+{
+	struct uart *u = &uart[port];
+
+	if (!(regs[u->ucsrb] & (1 << 3)) || !u->bit_cycles) return;    // TXEN
+
+	uint64_t start = u->shift_free_at > now ? u->shift_free_at : now;
+	u->buf_free_at = start;
+	u->shift_free_at = start + uart_byte_cycles(u);
+	u->tx_active = true;
+	host->uart_tx(host->ctx, port, data, to_ns(u->shift_free_at));
+	irq_dirty = true;
+}
+
+static void uart_update(struct uart *u)
+{
+	while (u->in_head != u->in_tail && u->in[u->in_head].at <= now) {
+		if (!(regs[u->ucsrb] & (1 << 4))) {                         // RXEN off, byte lost
+		} else if (u->fifo_n < 2) {
+			u->fifo[u->fifo_n++] = u->in[u->in_head].data;
+			irq_dirty = true;
+		} else {
+			u->overrun = true;
+		}
+		u->in_head = (u->in_head + 1) % UART_IN;
+	}
+	if (u->tx_active && now >= u->shift_free_at) {
+		u->tx_active = false;
+		u->txc = true;
+		irq_dirty = true;
+	}
+}
+
+/* Transmit progress only needs an event when its interrupt is enabled,
+   polled flags are brought up to date when UCSRnA is read */
+static uint64_t uart_next(struct uart *u)
+{
+	uint64_t t = NEVER;
+	uint8_t b = regs[u->ucsrb];
+	if (u->in_head != u->in_tail) t = u->in[u->in_head].at;
+	if (u->tx_active && (b & (1 << 6))) t = min64(t, u->shift_free_at);
+	if (u->buf_free_at > now && (b & (1 << 5))) t = min64(t, u->buf_free_at);
+	return t;
+}
+
+static uint8_t uart_status(struct uart *u)
+{
+	uart_update(u);
+	uint8_t a = regs[u->ucsra] & ((1 << 1) | (1 << 0));               // U2X, MPCM
+	if (u->fifo_n) a |= 1 << 7;
+	if (u->txc) a |= 1 << 6;
+	if (now >= u->buf_free_at) a |= 1 << 5;
+	if (u->overrun) a |= 1 << 3;
+	return a;
+}
+
+static void uart_read(struct uart *u)
+{
+	if (!u->presented) return;
+	u->presented = false;
+	u->fifo[0] = u->fifo[1];
+	u->fifo_n--;
+	u->overrun = false;
+}
+
+/******************************************************************* Timers ********************************************************************/
+
+struct timer {
+	int tccra, tccrb, tcnt, ocra, ocrb, timsk, tifr;
+	int compa_vect, compb_vect, ovf_vect;
+	bool wide;                          // Timer1
+	bool t2;                            // Timer2 prescaler table
+
+	uint32_t presc;                     // 0 = stopped
+	uint32_t top;
+	bool ctc;
+	uint64_t base;                      // cycle of tick 0
+	uint32_t frozen;                    // count while stopped
+	uint64_t next_a, next_b, next_ovf;
+};
+
+static struct timer timer[3] = {
+	{ HAL_TCCR0A, HAL_TCCR0B, HAL_TCNT0, HAL_OCR0A, HAL_OCR0B, HAL_TIMSK0, HAL_TIFR0,
+	  HAL_TIMER0_COMPA_vect, HAL_TIMER0_COMPB_vect, HAL_TIMER0_OVF_vect, false, false },
+	{ HAL_TCCR1A, HAL_TCCR1B, HAL_TCNT1, HAL_OCR1A, HAL_OCR1B, HAL_TIMSK1, HAL_TIFR1,
+	  HAL_TIMER1_COMPA_vect, HAL_TIMER1_COMPB_vect, HAL_TIMER1_OVF_vect, true, false },
+	{ HAL_TCCR2A, HAL_TCCR2B, HAL_TCNT2, HAL_OCR2A, HAL_OCR2B, HAL_TIMSK2, HAL_TIFR2,
+	  HAL_TIMER2_COMPA_vect, HAL_TIMER2_COMPB_vect, HAL_TIMER2_OVF_vect, false, true },
+};
+
+static uint32_t timer_count(struct timer *t)
+{
+	if (!t->presc) return t->frozen;
+	return ((now - t->base) / t->presc) % ((uint64_t)t->top + 1);
+}
+
+static uint64_t timer_next_match(struct timer *t, uint32_t value)
+{
+	if (!t->presc || value > t->top) return NEVER;
+	uint64_t period = (uint64_t)t->top + 1;
+	uint64_t ticks = (now - t->base) / t->presc;
+	uint64_t i = ticks / period * period + value;
+	if (i <= ticks) i += period;
+	return t->base + i * t->presc;
+}
+
+/* Called with the old settings still in effect, then picks up the new ones */
+static void timer_setup(struct timer *t, uint32_t count)
+{
+	static const uint32_t presc01[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	static const uint32_t presc2[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+
+	uint8_t cs = regs[t->tccrb] & 7;
+	uint8_t a = regs[t->tccra], b = regs[t->tccrb];
+	uint32_t ocra = regs[t->ocra];
+
+	t->presc = t->t2 ? presc2[cs] : presc01[cs];
+	t->ctc = false;
+
+	if (t->wide) {
+		static const uint32_t fixed[16] = { 0xFFFF, 0xFF, 0x1FF, 0x3FF, 0, 0xFF, 0x1FF, 0x3FF };
+		uint8_t wgm = ((b >> 3) & 3) << 2 | (a & 3);
+		switch (wgm) {
+			case 4: t->top = ocra; t->ctc = true; break;
+			case 9: case 11: case 15: t->top = ocra; break;
+			case 8: case 10: case 14: t->top = regs[HAL_ICR1]; break;
+			case 12: t->top = regs[HAL_ICR1]; t->ctc = true; break;
+			default: t->top = fixed[wgm]; break;
+		}
+	} else {
+		uint8_t wgm = ((b >> 3) & 1) << 2 | (a & 3);
+		switch (wgm) {
+			case 2: t->top = ocra; t->ctc = true; break;
+			case 5: case 7: t->top = ocra; break;
+			default: t->top = 0xFF; break;
+		}
+	}
+
+	if (count > t->top) count = 0;
+	t->frozen = count;
+	if (t->presc) t->base = now - (uint64_t)count * t->presc;
+
+	t->next_a = timer_next_match(t, ocra);
+	t->next_b = timer_next_match(t, regs[t->ocrb]);
+	t->next_ovf = t->ctc ? NEVER : timer_next_match(t, 0);
+}
+
+/* Same for the timers: only events with their interrupt enabled are
+   scheduled, TIFRn is caught up when it is read */
+static uint64_t timer_next(struct timer *t)
+{
+	uint8_t mask = regs[t->timsk];
+	uint64_t n = NEVER;
+	if (!t->presc) return NEVER;
+	if (mask & 1) n = min64(n, t->next_ovf);
+	if (mask & 2) n = min64(n, t->next_a);
+	if (mask & 4) n = min64(n, t->next_b);
+	return n;
+}
+
+static void timer_update(struct timer *t)
+{
+	if (!t->presc) return;
+
+	uint64_t period = ((uint64_t)t->top + 1) * t->presc;
+	uint64_t *next[3] = { &t->next_ovf, &t->next_a, &t->next_b };
+
+	for (int i = 0; i < 3; i++) {
+		if (*next[i] > now) continue;
+		regs[t->tifr] = (regs[t->tifr] & 0xFF) | (1 << i);          // TOV, OCFA, OCFB
+		*next[i] += ((now - *next[i]) / period + 1) * period;
+		irq_dirty = true;
+	}
+}
+
+/*************************************************************** ADC, SPI, WDT ****************************************************************/
+
+static uint64_t adc_done = NEVER;
+static bool adc_first = true;
+
+static uint32_t adc_clock(void)
+{
+	static const uint32_t div[8] = { 2, 2, 4, 8, 16, 32, 64, 128 };
+	return div[regs[HAL_ADCSRA] & 7];
+}
+
+static void adc_update(void)
+{
+	if (now < adc_done) return;
+
+	uint16_t value = host->adc_in(host->ctx, regs[HAL_ADMUX] & 0x07, to_ns(adc_done)) & 0x3FF;
+	if (regs[HAL_ADMUX] & (1 << 5)) value <<= 6;                    // ADLAR
+	regs[HAL_ADC] = value;
+	regs[HAL_ADCSRA] |= 1 << 4;                                     // ADIF
+	irq_dirty = true;
+
+	if ((regs[HAL_ADCSRA] & (1 << 5)) && (regs[HAL_ADCSRB] & 7) == 0) {   // free running
+		adc_done += 13 * adc_clock();
+		if (adc_done <= now) adc_done = now + 13 * adc_clock();
+	} else {
+		adc_done = NEVER;
+		regs[HAL_ADCSRA] &= ~(1 << 6);                              // ADSC
+	}
+}
+
+static void adc_write(uint32_t v)
+{
+	uint32_t old = regs[HAL_ADCSRA];
+	uint32_t flag = (old & (1 << 4)) & ~(v & (1 << 4));             // ADIF is cleared by writing 1
+
+	regs[HAL_ADCSRA] = (v & ~(1 << 4)) | flag;
+	irq_dirty = true;
+
+	if (!(v & (1 << 7))) {                                          // ADEN off aborts
+		adc_done = NEVER;
+		adc_first = true;
+		regs[HAL_ADCSRA] &= ~(1 << 6);
+		return;
+	}
+	if ((v & (1 << 6)) && adc_done == NEVER) {
+		adc_done = now + (adc_first ? 25 : 13) * adc_clock();
+		adc_first = false;
+	}
+	if (adc_done != NEVER) regs[HAL_ADCSRA] |= 1 << 6;
+}
+
+static uint64_t spi_done = NEVER;
+static bool spif_seen;                  // SPSR read with SPIF set
+
+static void spi_update(void)
+{
+	if (now < spi_done) return;
+	spi_done = NEVER;
+	regs[HAL_SPSR] |= 1 << 7;
+	irq_dirty = true;
+}
+
+static void spi_access(bool write)
+{
+	if (spif_seen) {
+		regs[HAL_SPSR] &= ~(1 << 7);
+		spif_seen = false;
+	}
+	if (!write) return;
+
+	uint8_t c = regs[HAL_SPCR];
+	if (!(c & (1 << 6)) || !(c & (1 << 4))) return;                 // SPE, MSTR
+	static const uint32_t div[4] = { 4, 16, 64, 128 };
+	uint32_t d = div[c & 3];
+	if (regs[HAL_SPSR] & 1) d /= 2;                                 // SPI2X
+	spi_done = now + 8 * d;
+}
+
+static uint64_t wdt_next = NEVER;
+static uint64_t wdt_period;
+
+static void wdt_write(uint32_t v)
+{
+	uint32_t flag = (regs[HAL_WDTCSR] & 0x80) & ~(v & 0x80);
+	regs[HAL_WDTCSR] = (v & 0x7F) | flag;
+
+	uint8_t wdp = (v & 7) | ((v >> 2) & 8);
+	wdt_period = to_cycles(16000000ULL << wdp);
+
+	if (v & (1 << 6)) {                                             // WDIE
+		wdt_next = now + wdt_period;
+	} else {
+		wdt_next = NEVER;
+		if ((v & (1 << 3)) && !(v & (1 << 4))) {
+			log_msg("%s", "watchdog reset mode is not modelled");
+		}
+	}
+	irq_dirty = true;
+}
+
+static void wdt_update(void)
+{
+	if (now < wdt_next) return;
+	regs[HAL_WDTCSR] |= 0x80;
+	wdt_next += ((now - wdt_next) / wdt_period + 1) * wdt_period;
+	irq_dirty = true;
+}
+
+void hal_wdt_reset(void)
+{
+	commit();
+	if (wdt_next != NEVER) wdt_next = now + wdt_period;
+	reschedule();
+}
+
+/****************************************************************** Registers *****************************************************************/
+
+static bool wide_reg(int reg)
+{
+	switch (reg) {
+		case HAL_TCNT1: case HAL_OCR1A: case HAL_OCR1B: case HAL_ICR1:
+		case HAL_ADC: case HAL_UBRR0: case HAL_UBRR1: case HAL_SP: case HAL_EEAR:
+		return true;
+	}
+	return false;
+}
+
+static int port_of(int reg)
+{
+	return (reg - HAL_PINA) / 3;
+}
+
+static struct timer *timer_of(int reg)
+{
+	for (int i = 0; i < 3; i++) {
+		struct timer *t = &timer[i];
+		if (reg == t->tccra || reg == t->tccrb || reg == t->tcnt || reg == t->ocra || reg == t->ocrb) return t;
+		if (i == 1 && reg == HAL_ICR1) return t;
+	}
+	return NULL;
+}
+
+static uint32_t read_value(int reg)
+{
+	switch (reg) {
+		case HAL_PINA: case HAL_PINB: case HAL_PINC: case HAL_PIND: {
+			int p = port_of(reg);
+			uint8_t ddr = regs[reg + 1], out = regs[reg + 2];
+			uint8_t in = host->pin_in ? host->pin_in(host->ctx, p, out, to_ns(now)) : out;
+			return (ddr & out) | (~ddr & in);
+		}
+		case HAL_TIFR0: timer_update(&timer[0]); break;
+		case HAL_TIFR1: timer_update(&timer[1]); break;
+		case HAL_TIFR2: timer_update(&timer[2]); break;
+		case HAL_TCNT0: return timer_count(&timer[0]);
+		case HAL_TCNT1: return timer_count(&timer[1]);
+		case HAL_TCNT2: return timer_count(&timer[2]);
+		case HAL_UCSR0A: return uart_status(&uart[0]);
+		case HAL_UCSR1A: return uart_status(&uart[1]);
+		case HAL_UDR0: case HAL_UDR1: {
+			struct uart *u = &uart[reg == HAL_UDR1];
+			if (!u->fifo_n) return regs[reg] & 0xFF;
+			u->presented = true;
+			return u->fifo[0];
+		}
+		case HAL_SPSR:
+		if (regs[HAL_SPSR] & (1 << 7)) spif_seen = true;
+		return regs[HAL_SPSR] & 0xFF;
+		case HAL_SREG: return ie ? 0x80 : 0;
+		case HAL_SP: return 0x10FF;                             // RAMEND, the stack is host memory
+	}
+	return regs[reg] & (wide_reg(reg) ? 0xFFFF : 0xFF);
+}
+
+static void write_value(int reg, uint32_t v)
+{
+	struct timer *t;
+
+	switch (reg) {
+		case HAL_PINA: case HAL_PINB: case HAL_PINC: case HAL_PIND:     // writing PINx toggles PORTx
+		write_value(reg + 2, (regs[reg + 2] ^ v) & 0xFF);
+		return;
+
+		case HAL_PORTA: case HAL_PORTB: case HAL_PORTC: case HAL_PORTD:
+		case HAL_DDRA: case HAL_DDRB: case HAL_DDRC: case HAL_DDRD:
+		regs[reg] = v;
+		if (host->pin_out) {
+			int p = port_of(reg);
+			host->pin_out(host->ctx, p, regs[HAL_PORTA + 3 * p], to_ns(now));
+		}
+		return;
+
+		case HAL_TIFR0: case HAL_TIFR1: case HAL_TIFR2: case HAL_EIFR: case HAL_PCIFR:
+		regs[reg] &= ~v;
+		return;
+
+		case HAL_TCNT0: case HAL_TCNT1: case HAL_TCNT2:
+		t = timer_of(reg);
+		timer_setup(t, v);
+		reschedule();
+		return;
+
+		case HAL_TCCR0A: case HAL_TCCR0B: case HAL_OCR0A: case HAL_OCR0B:
+		case HAL_TCCR1A: case HAL_TCCR1B: case HAL_OCR1A: case HAL_OCR1B: case HAL_ICR1:
+		case HAL_TCCR2A: case HAL_TCCR2B: case HAL_OCR2A: case HAL_OCR2B:
+		t = timer_of(reg);
+		{
+			uint32_t count = timer_count(t);
+			regs[reg] = v;
+			timer_setup(t, count);
+		}
+		reschedule();
+		return;
+
+		case HAL_TIMSK0: case HAL_TIMSK1: case HAL_TIMSK2: case HAL_EIMSK:
+		if (reg != HAL_EIMSK) timer_update(&timer[reg - HAL_TIMSK0]);
+		regs[reg] = v;
+		reschedule();
+		irq_dirty = true;
+		if (reg == HAL_EIMSK && v) log_msg("%s", "external interrupts are not modelled");
+		return;
+
+		case HAL_UCSR0A: case HAL_UCSR1A: {
+			struct uart *u = &uart[reg == HAL_UCSR1A];
+			if (v & (1 << 6)) u->txc = false;
+			regs[reg] = v & 3;
+			uart_config(reg == HAL_UCSR1A);
+			return;
+		}
+		case HAL_UCSR0B: case HAL_UCSR0C: case HAL_UBRR0:
+		case HAL_UCSR1B: case HAL_UCSR1C: case HAL_UBRR1:
+		uart_update(&uart[reg >= HAL_UCSR1A]);
+		regs[reg] = v;
+		uart_config(reg >= HAL_UCSR1A);
+		reschedule();
+		irq_dirty = true;
+		return;
+
+		case HAL_UDR0: uart_tx(0, v); reschedule(); return;
+		case HAL_UDR1: uart_tx(1, v); reschedule(); return;
+
+		case HAL_SPCR: regs[reg] = v; irq_dirty = true; return;
+		case HAL_SPSR: regs[reg] = (regs[reg] & ~1) | (v & 1); return;
+		case HAL_SPDR: regs[reg] = v; spi_access(true); reschedule(); return;
+
+		case HAL_ADCSRA: adc_write(v); reschedule(); return;
+		case HAL_ADC: return;
+
+		case HAL_WDTCSR: wdt_write(v); reschedule(); return;
+
+		case HAL_SREG:
+		ie = v & 0x80;
+		irq_dirty = true;
+		return;
+
+		case HAL_SP: return;
+	}
+	regs[reg] = v;
+}
+
+/* Registers where writing the value just read still does something, so
+   they are handed out with HAL_UNTOUCHED set */
+static bool marked_reg(int reg)
+{
+	switch (reg) {
+		case HAL_UDR0: case HAL_UDR1: case HAL_SPDR:
+		case HAL_TIFR0: case HAL_TIFR1: case HAL_TIFR2: case HAL_EIFR: case HAL_PCIFR:
+		case HAL_UCSR0A: case HAL_UCSR1A: case HAL_ADCSRA: case HAL_WDTCSR:
+		return true;
+	}
+	return false;
+}
+
+/* Settles the register handed out by the previous access */
+static void commit(void)
+{
+	if (last < 0) return;
+
+	int r = last;
+	last = -1;
+	uint32_t v = regs[r];
+	regs[r] = last_stored;
+	if (v == last_given) {
+		switch (r) {
+			case HAL_UDR0: uart_read(&uart[0]); reschedule(); break;
+			case HAL_UDR1: uart_read(&uart[1]); reschedule(); break;
+			case HAL_SPDR: spi_access(false); break;
+		}
+		return;
+	}
+
+	if (r >= HAL_NREGS) {                                           // lo or hi half
+		int full = (r - HAL_NREGS) / 2;
+		uint32_t cur = read_value(full) & 0xFFFF;
+		if ((r - HAL_NREGS) & 1) {
+			write_value(full, (cur & 0x00FF) | (v & 0xFF) << 8);
+		} else {
+			write_value(full, (cur & 0xFF00) | (v & 0xFF));
+		}
+		return;
+	}
+	write_value(r, v & (wide_reg(r) ? 0xFFFF : 0xFF));
+}
+
+/* Hands out the current value of reg for the firmware to read or overwrite */
+static volatile uint32_t *prepare(int reg, int slot, uint32_t value)
+{
+	last = slot;
+	last_stored = regs[slot];
+	last_given = value | (marked_reg(reg) ? HAL_UNTOUCHED : 0);
+	regs[slot] = last_given;
+	return &regs[slot];
+}
+
+/********************************************************** Events and interrupts *************************************************************/
+
+static void update(void)
+{
+	if (now < next_due) return;
+
+	uart_update(&uart[0]);
+	uart_update(&uart[1]);
+	for (int i = 0; i < 3; i++) {
+		timer_update(&timer[i]);
+	}
+	adc_update();
+	spi_update();
+	wdt_update();
+	reschedule();
+	irq_dirty = true;
+}
+
+static void reschedule(void)
+{
+	uint64_t t = min64(uart_next(&uart[0]), uart_next(&uart[1]));
+	for (int i = 0; i < 3; i++) {
+		t = min64(t, timer_next(&timer[i]));
+	}
+	t = min64(t, min64(adc_done, min64(spi_done, wdt_next)));
+	next_due = t;
+}
+
+static bool bit(int reg, int n)
+{
+	return regs[reg] >> n & 1;
+}
+
+/* Flag set and interrupt enabled */
+static bool raised(int vect)
+{
+	struct uart *u;
+
+	switch (vect) {
+		case HAL_WDT_vect:          return bit(HAL_WDTCSR, 7) && bit(HAL_WDTCSR, 6);
+		case HAL_TIMER2_COMPA_vect: return bit(HAL_TIFR2, 1) && bit(HAL_TIMSK2, 1);
+		case HAL_TIMER2_COMPB_vect: return bit(HAL_TIFR2, 2) && bit(HAL_TIMSK2, 2);
+		case HAL_TIMER2_OVF_vect:   return bit(HAL_TIFR2, 0) && bit(HAL_TIMSK2, 0);
+		case HAL_TIMER1_COMPA_vect: return bit(HAL_TIFR1, 1) && bit(HAL_TIMSK1, 1);
+		case HAL_TIMER1_COMPB_vect: return bit(HAL_TIFR1, 2) && bit(HAL_TIMSK1, 2);
+		case HAL_TIMER1_OVF_vect:   return bit(HAL_TIFR1, 0) && bit(HAL_TIMSK1, 0);
+		case HAL_TIMER0_COMPA_vect: return bit(HAL_TIFR0, 1) && bit(HAL_TIMSK0, 1);
+		case HAL_TIMER0_COMPB_vect: return bit(HAL_TIFR0, 2) && bit(HAL_TIMSK0, 2);
+		case HAL_TIMER0_OVF_vect:   return bit(HAL_TIFR0, 0) && bit(HAL_TIMSK0, 0);
+		case HAL_SPI_STC_vect:      return bit(HAL_SPSR, 7) && bit(HAL_SPCR, 7);
+		case HAL_ADC_vect:          return bit(HAL_ADCSRA, 4) && bit(HAL_ADCSRA, 3);
+
+		case HAL_USART0_RX_vect: case HAL_USART1_RX_vect:
+		u = &uart[vect == HAL_USART1_RX_vect];
+		return u->fifo_n && bit(u->ucsrb, 7);
+		case HAL_USART0_UDRE_vect: case HAL_USART1_UDRE_vect:
+		u = &uart[vect == HAL_USART1_UDRE_vect];
+		return now >= u->buf_free_at && bit(u->ucsrb, 5);
+		case HAL_USART0_TX_vect: case HAL_USART1_TX_vect:
+		u = &uart[vect == HAL_USART1_TX_vect];
+		return u->txc && bit(u->ucsrb, 6);
+	}
+	return false;
+}
+
+/* Hardware clears these flags when the vector is taken */
+static void acknowledge(int vect)
+{
+	switch (vect) {
+		case HAL_WDT_vect:          regs[HAL_WDTCSR] &= ~0x80; break;
+		case HAL_TIMER2_COMPA_vect: regs[HAL_TIFR2] &= ~2; break;
+		case HAL_TIMER2_COMPB_vect: regs[HAL_TIFR2] &= ~4; break;
+		case HAL_TIMER2_OVF_vect:   regs[HAL_TIFR2] &= ~1; break;
+		case HAL_TIMER1_COMPA_vect: regs[HAL_TIFR1] &= ~2; break;
+		case HAL_TIMER1_COMPB_vect: regs[HAL_TIFR1] &= ~4; break;
+		case HAL_TIMER1_OVF_vect:   regs[HAL_TIFR1] &= ~1; break;
+		case HAL_TIMER0_COMPA_vect: regs[HAL_TIFR0] &= ~2; break;
+		case HAL_TIMER0_COMPB_vect: regs[HAL_TIFR0] &= ~4; break;
+		case HAL_TIMER0_OVF_vect:   regs[HAL_TIFR0] &= ~1; break;
+		case HAL_SPI_STC_vect:      regs[HAL_SPSR] &= ~0x80; break;
+		case HAL_ADC_vect:          regs[HAL_ADCSRA] &= ~0x10; break;
+		case HAL_USART0_TX_vect:    uart[0].txc = false; break;
+		case HAL_USART1_TX_vect:    uart[1].txc = false; break;
+	}
+}
+
+/* Runs pending interrupts in priority order, returns true if any ran */
+static bool dispatch(void)
+{
+	bool ran = false;
+
+	while (ie && irq_dirty) {
+		int vect = 0;
+		for (int v = 1; v < HAL_NVECTORS; v++) {
+			if (raised(v)) {
+				vect = v;
+				break;
+			}
+		}
+		if (!vect) {
+			irq_dirty = false;
+			break;
+		}
+		if (!isr[vect]) {
+			char buf[16];
+			snprintf(buf, sizeof buf, "%d", vect);
+			log_msg("interrupt %s enabled without a handler", buf);
+			abort();
+		}
+
+		acknowledge(vect);
+		ie = false;
+		now += ISR_CYCLES;
+		update();
+		isr[vect]();
+		commit();
+		ie = true;
+		ran = true;
+	}
+	return ran;
+}
+
+/* Spends cycles of CPU time, then lets the peripherals and interrupts catch up */
+static void advance(uint64_t cycles)
+{
+	now += cycles;
+	update();
+	dispatch();
+	if (now >= horizon) {
+		yield(now);
+	}
+}
+
+/******************************************************************* Firmware side ********************************************************************/
+
+volatile uint32_t *hal_io(int reg)
+{
+	commit();
+	advance(ACCESS_CYCLES);
+	return prepare(reg, reg, read_value(reg));
+}
+
+volatile uint32_t *hal_io_lo(int reg)
+{
+	commit();
+	advance(ACCESS_CYCLES);
+	return prepare(reg, HAL_NREGS + 2 * reg, read_value(reg) & 0xFF);
+}
+
+volatile uint32_t *hal_io_hi(int reg)
+{
+	commit();
+	advance(ACCESS_CYCLES);
+	return prepare(reg, HAL_NREGS + 2 * reg + 1, read_value(reg) >> 8 & 0xFF);
+}
+
+void hal_set_f_cpu(uint32_t hz)
+{
+	f_cpu = hz;
+}
+
+void hal_register_isr(int vector, void (*handler)(void))
+{
+	if (vector > 0 && vector < HAL_NVECTORS) isr[vector] = handler;
+}
+
+/* Like the real sei, the next instruction runs before any pending
+   interrupt, so sei(); sleep_cpu(); cannot lose a wake-up */
+void hal_sei(void)
+{
+	commit();
+	ie = true;
+	irq_dirty = true;
+	now += 1;
+}
+
+void hal_cli(void)
+{
+	commit();
+	ie = false;
+	advance(1);
+}
+
+uint8_t hal_irq_save(void)
+{
+	uint8_t state = ie;
+	hal_cli();
+	return state;
+}
+
+void hal_irq_restore(uint8_t state)
+{
+	commit();
+	ie = state;
+	irq_dirty = true;
+	advance(1);
+}
+
+/* Busy wait: interrupts keep running, the host sees an idle board */
+void hal_delay_ns(uint64_t ns)
+{
+	commit();
+	uint64_t end = now + to_cycles(ns);
+
+	while (now < end) {
+		uint64_t step = min64(end, next_due);
+		if (step <= now) step = now + 1;
+		if (step > horizon) {
+			if (horizon > now) {
+				now = horizon;
+				update();
+				dispatch();
+			}
+			yield(min64(end, next_due));
+			continue;
+		}
+		now = step;
+		update();
+		dispatch();
+	}
+	advance(0);
+}
+
+/* Earliest event that can wake the chip in the current sleep mode */
+static uint64_t wake_time(void)
+{
+	uint8_t mode = regs[HAL_SMCR] >> 1 & 7;
+	uint64_t t = wdt_next;
+
+	if (mode == 0) return next_due;                                 // idle: anything
+	if (mode == 1) t = min64(t, adc_done);                          // ADC noise reduction
+	if (mode == 3 || mode == 7) {                                   // power save keeps Timer2
+		t = min64(t, min64(timer[2].next_ovf, min64(timer[2].next_a, timer[2].next_b)));
+	}
+	return t;
+}
+
+void hal_sleep(void)
+{
+	commit();
+	if (!(regs[HAL_SMCR] & 1)) return;                              // SE clear
+	if (!ie) {
+		log_msg("%s", "sleep with interrupts disabled never wakes");
+		abort();
+	}
+
+	update();
+	if (dispatch()) {                                               // already pending
+		now += 4;
+		return;
+	}
+	for (;;) {
+		uint64_t wake = wake_time();
+
+		if (wake > horizon) {
+			// Nothing due before the horizon, only the host can change that
+			if (horizon > now) now = horizon;
+			yield(wake);
+			continue;
+		}
+		if (wake > now) now = wake;
+		update();
+		if (dispatch()) break;
+	}
+	now += 4;                                                       // wake-up and return to main
+}
+
+void hal_note(const char *msg)
+{
+	commit();
+	if (host && host->note) host->note(host->ctx, msg, to_ns(now));
+}
+
+/******************************************************************* Host side ********************************************************************/
+
+static void board_attach(const struct hal_host *h)
+{
+	host = h;
+}
+
+static void board_run(void)
+{
+	firmware_main();
+	log_msg("%s", "main() returned");
+	for (;;) {
+		horizon = now;
+		yield(NEVER);
+	}
+}
+
+static void board_set_horizon(uint64_t ns)
+{
+	horizon = to_cycles(ns);
+}
+
+static void board_uart_rx(int port, uint8_t data, uint64_t at_ns)
+{
+	struct uart *u = &uart[port];
+	unsigned next = (u->in_tail + 1) % UART_IN;
+
+	if (next == u->in_head) {
+		log_msg("%s", "receive backlog full, byte dropped");
+		return;
+	}
+	uint64_t at = to_cycles(at_ns);
+	if (at < now) at = now;
+	u->in[u->in_tail].at = at;
+	u->in[u->in_tail].data = data;
+	u->in_tail = next;
+	next_due = min64(next_due, at);
+}
+
+static uint64_t board_now(void)
+{
+	return to_ns(now);
+}
+
+static uint32_t board_f_cpu(void)
+{
+	return f_cpu;
+}
+
+static uint16_t board_peek(int reg)
+{
+	if (reg < 0 || reg >= HAL_NREGS) return 0;
+	if (reg == HAL_UDR0 || reg == HAL_UDR1) return regs[reg] & 0xFF;      // reading would pop the FIFO
+	return read_value(reg);
+}
+
+EXPORT const struct hal_board_api hal_board = {
+	board_attach,
+	board_run,
+	board_set_horizon,
+	board_uart_rx,
+	board_now,
+	board_f_cpu,
+	board_peek,
+	HAL_BOARD_NAME
+};
@@ -0,0 +1,132 @@
+/*
+ * Interface between a firmware image built for the simulator and the
+ * host that runs it.
+ *
+ * Each firmware (MainBoard, RFReceiver, RFModule) is compiled together
+ * with hal.c into its own shared object. The AVR headers in this
+ * directory turn every I/O register access into a call to hal_io(), which
+ * advances the board's virtual clock, runs the on-chip peripherals
+ * (USARTs, timers, ADC, SPI, watchdog) and dispatches interrupts. Anything
+ * outside the chip - other boards, the ESP8266, tags in the field - is
+ * modelled by the host through struct hal_host.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Register file. hal_io() hands out a slot holding the current value and
+   looks at it again on the next access: a changed value was written.
+   Registers where writing back the same value matters (UDRn, SPDR, flag
+   registers) get HAL_UNTOUCHED or'ed in, which a plain store clears. */
+
+#define HAL_UNTOUCHED 0x10000UL
+
+enum hal_reg {
+	HAL_PINA, HAL_DDRA, HAL_PORTA,
+	HAL_PINB, HAL_DDRB, HAL_PORTB,
+	HAL_PINC, HAL_DDRC, HAL_PORTC,
+	HAL_PIND, HAL_DDRD, HAL_PORTD,
+	HAL_TIFR0, HAL_TIFR1, HAL_TIFR2, HAL_PCIFR, HAL_EIFR, HAL_EIMSK,
+	HAL_GPIOR0, HAL_GPIOR1, HAL_GPIOR2,
+	HAL_EECR, HAL_EEDR, HAL_EEAR,
+	HAL_TCCR0A, HAL_TCCR0B, HAL_TCNT0, HAL_OCR0A, HAL_OCR0B,
+	HAL_SPCR, HAL_SPSR, HAL_SPDR,
+	HAL_ACSR, HAL_SMCR, HAL_MCUSR, HAL_MCUCR,
+	HAL_SP, HAL_SREG,
+	HAL_WDTCSR, HAL_CLKPR, HAL_PRR0, HAL_OSCCAL,
+	HAL_PCICR, HAL_EICRA, HAL_PCMSK0, HAL_PCMSK1, HAL_PCMSK2, HAL_PCMSK3,
+	HAL_TIMSK0, HAL_TIMSK1, HAL_TIMSK2,
+	HAL_ADC, HAL_ADCSRA, HAL_ADCSRB, HAL_ADMUX, HAL_DIDR0, HAL_DIDR1,
+	HAL_TCCR1A, HAL_TCCR1B, HAL_TCCR1C, HAL_TCNT1, HAL_ICR1, HAL_OCR1A, HAL_OCR1B,
+	HAL_TCCR2A, HAL_TCCR2B, HAL_TCNT2, HAL_OCR2A, HAL_OCR2B, HAL_ASSR,
+	HAL_UCSR0A, HAL_UCSR0B, HAL_UCSR0C, HAL_UBRR0, HAL_UDR0,
+	HAL_UCSR1A, HAL_UCSR1B, HAL_UCSR1C, HAL_UBRR1, HAL_UDR1,
+	HAL_NREGS
+};
+
+/* Interrupt vector numbers of the ATmega644PA */
+enum hal_vector {
+	HAL_INT0_vect = 1, HAL_INT1_vect, HAL_INT2_vect,
+	HAL_PCINT0_vect, HAL_PCINT1_vect, HAL_PCINT2_vect, HAL_PCINT3_vect,
+	HAL_WDT_vect,
+	HAL_TIMER2_COMPA_vect, HAL_TIMER2_COMPB_vect, HAL_TIMER2_OVF_vect,
+	HAL_TIMER1_CAPT_vect, HAL_TIMER1_COMPA_vect, HAL_TIMER1_COMPB_vect, HAL_TIMER1_OVF_vect,
+	HAL_TIMER0_COMPA_vect, HAL_TIMER0_COMPB_vect, HAL_TIMER0_OVF_vect,
+	HAL_SPI_STC_vect,
+	HAL_USART0_RX_vect, HAL_USART0_UDRE_vect, HAL_USART0_TX_vect,
+	HAL_ANALOG_COMP_vect, HAL_ADC_vect, HAL_EE_READY_vect, HAL_TWI_vect, HAL_SPM_READY_vect,
+	HAL_USART1_RX_vect, HAL_USART1_UDRE_vect, HAL_USART1_TX_vect,
+	HAL_NVECTORS
+};
+
+/* Host side, one per board */
+struct hal_host {
+	void *ctx;
+
+	/* Byte fully shifted out of USART port at time done_ns */
+	void (*uart_tx)(void *ctx, int port, uint8_t data, uint64_t done_ns);
+
+	/* USART port now runs at one bit per bit_ns (0 = disabled) */
+	void (*uart_config)(void *ctx, int port, uint64_t bit_ns);
+
+	/* Level of the input pins of port (0 = A ... 3 = D); out holds PORTx */
+	uint8_t (*pin_in)(void *ctx, int port, uint8_t out, uint64_t now_ns);
+
+	/* PORTx or DDRx changed */
+	void (*pin_out)(void *ctx, int port, uint8_t value, uint64_t now_ns);
+
+	/* ADC result (0..1023) for a single ended channel */
+	uint16_t (*adc_in)(void *ctx, int channel, uint64_t now_ns);
+
+	/* Local time reached the horizon. Blocks until the host lets the board
+	   run again. wake_ns is the earliest time the board needs to run:
+	   now_ns while it is busy, the end of a delay or the next timer event
+	   while it waits, UINT64_MAX if only input from outside can wake it. */
+	void (*yield)(void *ctx, uint64_t now_ns, uint64_t wake_ns);
+
+	/* Diagnostics from the simulated chip */
+	void (*log)(void *ctx, const char *msg);
+
+	/* hal_note() from the firmware at now_ns, for the host's statistics */
+	void (*note)(void *ctx, const char *msg, uint64_t now_ns);
+};
+
+/* Board side, exported by every firmware image as hal_board */
+struct hal_board_api {
+	void (*attach)(const struct hal_host *host);
+	void (*run)(void);                                      // firmware main(), never returns
+	void (*set_horizon)(uint64_t ns);
+	void (*uart_rx)(int port, uint8_t data, uint64_t at_ns); // in time order per port
+	uint64_t (*now)(void);
+	uint32_t (*f_cpu)(void);
+	uint16_t (*peek)(int reg);
+	const char *name;
+};
+
+/* Used by the AVR headers */
+volatile uint32_t *hal_io(int reg);
+volatile uint32_t *hal_io_lo(int reg);
+volatile uint32_t *hal_io_hi(int reg);
+void hal_set_f_cpu(uint32_t hz);
+void hal_register_isr(int vector, void (*handler)(void));
+void hal_sei(void);
+void hal_cli(void);
+uint8_t hal_irq_save(void);
+void hal_irq_restore(uint8_t state);
+void hal_delay_ns(uint64_t ns);
+void hal_sleep(void);
+void hal_wdt_reset(void);
+void hal_note(const char *msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HAL_H */
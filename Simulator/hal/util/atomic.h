@@ -0,0 +1,30 @@
+/*
+ * ATOMIC_BLOCK() for the simulator build.
+ */
+
+#ifndef HAL_UTIL_ATOMIC_H
+#define HAL_UTIL_ATOMIC_H
+
+#include "../hal.h"
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON      1
+#define NONATOMIC_RESTORESTATE 0
+#define NONATOMIC_FORCEOFF  2
+
+static inline uint8_t hal_atomic_enter(uint8_t type)
+{
+	uint8_t state = hal_irq_save();
+	return (type == ATOMIC_FORCEON) ? 1 : state;
+}
+
+static inline void hal_atomic_exit(const uint8_t *state)
+{
+	hal_irq_restore(*state);
+}
+
+#define ATOMIC_BLOCK(type) \
+	for (uint8_t hal_atomic_state __attribute__((__cleanup__(hal_atomic_exit))) = hal_atomic_enter(type), \
+	     hal_atomic_todo = 1; hal_atomic_todo; hal_atomic_todo = 0)
+
+#endif /* HAL_UTIL_ATOMIC_H */
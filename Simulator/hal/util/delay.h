@@ -0,0 +1,21 @@
+/*
+ * Busy-wait delays for the simulator build. They advance virtual time and
+ * cost nothing in wall-clock time.
+ */
+
+#ifndef HAL_UTIL_DELAY_H
+#define HAL_UTIL_DELAY_H
+
+#include "../hal.h"
+
+static inline void _delay_us(double us)
+{
+	hal_delay_ns((uint64_t)(us * 1000.0));
+}
+
+static inline void _delay_ms(double ms)
+{
+	hal_delay_ns((uint64_t)(ms * 1000000.0));
+}
+
+#endif /* HAL_UTIL_DELAY_H */
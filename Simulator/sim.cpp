@@ -0,0 +1,1469 @@
+/*
+ * Whole-system simulator: MainBoard, one to four readers (RFModule or
+ * RFReceiver), the XBee link between them, the ESP8266 and the web server,
+ * all in virtual time.
+ *
+ * Every firmware image runs unmodified on its own thread against the HAL in
+ * hal/. The boards take turns in short windows of virtual time; anything a
+ * board sends is delivered to the others through the event queue. A
+ * _delay_ms(1000) costs no wall-clock time, so minutes of operation run in
+ * seconds.
+ *
+ * Tags arrive at the readers at random. MainBoard reports what it did with
+ * each scan (hal_note()), so every arrival is followed to the commit of its
+ * own upload or to the place it was dropped. The report gives end-to-end
+ * scans per minute and the scan-to-database latency distribution.
+ */
+
+#include <dlfcn.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hal/hal.h"
+#include "../Common/frame.h"
+#include "../Common/mqtt.h"
+
+namespace {
+
+typedef uint64_t ns_t;
+
+const ns_t US = 1000;
+const ns_t MS = 1000 * US;
+const ns_t SEC = 1000 * MS;
+const ns_t FOREVER = UINT64_MAX;
+
+/******************************************************************* Options ********************************************************************/
+
+struct Options {
+	int readers = 1;
+	std::string reader = "rfmodule";        // rfreceiver, or local: MainBoard's own coil
+	std::string build = "build";
+	double duration = 300;                  // s of tag arrivals
+	double warmup = 8;                      // s before the first arrival
+	double drain = 30;                      // s allowed to finish after the last arrival
+	double gap = 10;                        // s mean idle time between tags, per reader
+	double dwell = 1.5;                     // s a tag stays in the field
+	std::vector<std::string> tags = { "2C00AC693E", "310037D93D", "6F005CAD60" };
+	std::string bus = "xbee";               // or wire
+	unsigned link_baud = 9600;              // XBee serial rate
+	double loss = 0;                        // per byte on the reader link
+	double corrupt = 0;
+	unsigned esp_baud = 9600;
+	double assoc = 1.5;                     // s after ESP boot until it has an IP
+	bool esp_up = false;                    // ESP8266 already booted and associated, MainBoard reset alone
+	double rtt = 80;                        // ms to the server and back
+	double server_ms = 20;                  // service time per request
+	std::string server;                     // host:port of a real server
+	double online = 0;                      // mean s between changes made on the web site, 0 = none
+	double window = 100;                    // us of virtual time per turn
+	unsigned seed = 1;
+	bool trace = false;
+	std::string tag_clock = "sampler";      // or carrier
+	int tag_depth = 48;                     // ADC7 counts the tag modulates the envelope by
+	int tag_noise = 2;                      // ADC7 counts of noise either way
+	struct Send { unsigned addr; std::string payload; double at; };
+	std::vector<Send> sends;                // command frames from a PC on the link
+	std::string link_log;                   // file for every byte the PC would hear
+};
+
+Options opt;
+std::mt19937_64 rng;
+
+double uniform()
+{
+	return std::uniform_real_distribution<double>(0, 1)(rng);
+}
+
+/******************************************************************* Events ********************************************************************/
+
+struct Event {
+	ns_t at;
+	uint64_t seq;
+	std::function<void()> fn;
+};
+
+struct Later {
+	bool operator()(const Event &a, const Event &b) const
+	{
+		return a.at != b.at ? a.at > b.at : a.seq > b.seq;
+	}
+};
+
+std::priority_queue<Event, std::vector<Event>, Later> events;
+uint64_t event_seq;
+ns_t sim_now;                               // start of the current window
+
+void at(ns_t t, std::function<void()> fn)
+{
+	events.push(Event{ t, event_seq++, std::move(fn) });
+}
+
+void trace(ns_t t, const char *fmt, ...)
+{
+	if (!opt.trace) return;
+	va_list ap;
+	va_start(ap, fmt);
+	std::printf("%10.6f  ", t / 1e9);
+	std::vprintf(fmt, ap);
+	std::printf("\n");
+	va_end(ap);
+}
+
+std::string printable(const std::string &s)
+{
+	std::string out;
+	for (unsigned char c : s) {
+		if (c == '\r') out += "\\r";
+		else if (c == '\n') out += "\\n";
+		else if (c < 0x20 || c >= 0x7F) {
+			char buf[8];
+			std::snprintf(buf, sizeof buf, "\\x%02X", c);
+			out += buf;
+		} else out += c;
+	}
+	return out;
+}
+
+/* A receiver more than ~4% off the sender's bit rate samples garbage */
+bool baud_mismatch(ns_t a, ns_t b)
+{
+	if (!a || !b) return true;
+	return std::fabs((double)a / b - 1) > 0.04;
+}
+
+ns_t char_time(unsigned baud)
+{
+	return 10 * SEC / baud;
+}
+
+/******************************************************************* LCD ********************************************************************/
+
+/* HD44780 in 4 bit mode on PORTA: D7..D4 on PA0..PA3, E on PA4, RS on PA5 */
+struct Lcd {
+	std::string name;
+	char ddram[0x80];
+	uint8_t addr = 0;
+	bool four_bit = false;
+	bool have_high = false;
+	uint8_t high = 0;
+	bool e = false;
+	unsigned gen = 0;
+	std::string shown;
+
+	Lcd() { std::memset(ddram, ' ', sizeof ddram); }
+
+	std::string line(int n) const
+	{
+		return std::string(ddram + (n ? 0x40 : 0), 20);
+	}
+
+	std::string text() const
+	{
+		std::string a = line(0), b = line(1);
+		a.erase(a.find_last_not_of(' ') + 1);
+		b.erase(b.find_last_not_of(' ') + 1);
+		return b.empty() ? a : a + " | " + b;
+	}
+
+	void pins(uint8_t porta, ns_t t)
+	{
+		bool now_e = porta & 0x10;
+		if (e && !now_e) strobe(porta, t);
+		e = now_e;
+	}
+
+	void strobe(uint8_t porta, ns_t t)
+	{
+		uint8_t nibble = (porta & 1) << 3 | (porta & 2) << 1 | (porta & 4) >> 1 | (porta & 8) >> 3;
+		bool rs = porta & 0x20;
+
+		if (!four_bit) {
+			execute(rs, nibble << 4, t);
+		} else if (!have_high) {
+			high = nibble;
+			have_high = true;
+		} else {
+			have_high = false;
+			execute(rs, high << 4 | nibble, t);
+		}
+	}
+
+	void execute(bool rs, uint8_t c, ns_t t)
+	{
+		if (rs) {
+			ddram[addr & 0x7F] = c;
+			addr = (addr == 0x27) ? 0x40 : (addr == 0x67) ? 0x00 : addr + 1;
+		} else if (c & 0x80) {
+			addr = c & 0x7F;
+			return;
+		} else if (c & 0x20) {
+			four_bit = !(c & 0x10);
+			have_high = false;
+			return;
+		} else if (c == 0x01) {
+			std::memset(ddram, ' ', sizeof ddram);
+			addr = 0;
+		} else if ((c & 0xFE) == 0x02) {
+			addr = 0;
+			return;
+		} else {
+			return;
+		}
+
+		// Report the screen once it has been stable for 20 ms
+		unsigned g = ++gen;
+		at(t + 20 * MS, [this, g, t]() {
+			if (g != gen || text() == shown) return;
+			shown = text();
+			trace(t, "%s lcd  \"%s\"", name.c_str(), shown.c_str());
+		});
+	}
+};
+
+/******************************************************************* Boards ********************************************************************/
+
+struct Board {
+	std::string name;
+	const hal_board_api *api = nullptr;
+	hal_host host;
+	sem_t go, done;
+	ns_t now = 0;
+	ns_t wake = 0;
+	ns_t bit_ns[2] = { 0, 0 };
+	Lcd lcd;
+
+	std::function<void(int port, uint8_t c, ns_t t)> on_tx;
+	std::function<uint8_t(int port, uint8_t out, ns_t t)> on_pin_in;
+	std::function<uint16_t(int channel, ns_t t)> on_adc;
+
+	/* Byte arrives at the board's USART; safe only while it is paused */
+	void rx(int port, uint8_t c, ns_t t)
+	{
+		api->uart_rx(port, c, t);
+		wake = std::min(wake, std::max(t, now));
+	}
+};
+
+std::vector<std::unique_ptr<Board>> boards;
+
+void host_uart_tx(void *ctx, int port, uint8_t data, uint64_t done_ns)
+{
+	Board *b = static_cast<Board *>(ctx);
+	if (b->on_tx) b->on_tx(port, data, done_ns);
+}
+
+void host_uart_config(void *ctx, int port, uint64_t bit_ns)
+{
+	static_cast<Board *>(ctx)->bit_ns[port] = bit_ns;
+}
+
+uint8_t host_pin_in(void *ctx, int port, uint8_t out, uint64_t now_ns)
+{
+	Board *b = static_cast<Board *>(ctx);
+	return b->on_pin_in ? b->on_pin_in(port, out, now_ns) : out;
+}
+
+void host_pin_out(void *ctx, int port, uint8_t value, uint64_t now_ns)
+{
+	Board *b = static_cast<Board *>(ctx);
+	if (port == 0) b->lcd.pins(value, now_ns);
+}
+
+uint16_t host_adc_in(void *ctx, int channel, uint64_t now_ns)
+{
+	Board *b = static_cast<Board *>(ctx);
+	return b->on_adc ? b->on_adc(channel, now_ns) : 0;
+}
+
+void host_yield(void *ctx, uint64_t now_ns, uint64_t wake_ns)
+{
+	Board *b = static_cast<Board *>(ctx);
+	b->now = now_ns;
+	b->wake = wake_ns;
+	sem_post(&b->done);
+	sem_wait(&b->go);
+}
+
+void host_log(void *ctx, const char *msg)
+{
+	Board *b = static_cast<Board *>(ctx);
+	std::fprintf(stderr, "%10.6f  %s: %s\n", b->now / 1e9, b->name.c_str(), msg);
+}
+
+/* MainBoard's scan_note(): "<what> <reader address> <tag>" */
+struct ScanNote {
+	ns_t t;
+	char what;
+	int addr;
+	std::string tag;
+};
+
+std::vector<ScanNote> notes;
+
+void host_note(void *ctx, const char *msg, uint64_t now_ns)
+{
+	char what, tag[11];
+	int addr;
+	if (std::sscanf(msg, "%c %d %10s", &what, &addr, tag) == 3) notes.push_back(ScanNote{ (ns_t)now_ns, what, addr, tag });
+}
+
+Board *load_board(const std::string &file, const std::string &name)
+{
+	std::string path = opt.build + "/" + file;
+	void *dl = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!dl) {
+		std::fprintf(stderr, "sim: %s\n", dlerror());
+		std::exit(2);
+	}
+
+	std::unique_ptr<Board> b(new Board);
+	b->name = name;
+	b->lcd.name = name;
+	b->api = static_cast<const hal_board_api *>(dlsym(dl, "hal_board"));
+	if (!b->api) {
+		std::fprintf(stderr, "sim: %s has no hal_board\n", path.c_str());
+		std::exit(2);
+	}
+	b->host = hal_host{ b.get(), host_uart_tx, host_uart_config, host_pin_in, host_pin_out,
+	                    host_adc_in, host_yield, host_log, host_note };
+	sem_init(&b->go, 0, 0);
+	sem_init(&b->done, 0, 0);
+	b->api->attach(&b->host);
+
+	Board *raw = b.get();
+	std::thread([raw]() {
+		sem_wait(&raw->go);
+		raw->api->run();
+	}).detach();
+
+	boards.push_back(std::move(b));
+	return raw;
+}
+
+/* Lets the board run up to horizon, returns when it yields */
+void run_board(Board *b, ns_t horizon)
+{
+	b->api->set_horizon(horizon);
+	sem_post(&b->go);
+
+	timespec limit;
+	clock_gettime(CLOCK_REALTIME, &limit);
+	limit.tv_sec += 10;
+	while (sem_timedwait(&b->done, &limit) != 0) {
+		if (errno == EINTR) continue;
+		std::fprintf(stderr, "sim: %s stopped calling the HAL at %.6f s (endless loop without I/O?)\n",
+		             b->name.c_str(), b->now / 1e9);
+		std::exit(3);
+	}
+}
+
+/******************************************************************* Web server ********************************************************************/
+
+struct Commit {
+	std::string tag;
+	char action;
+	ns_t t;
+};
+
+std::vector<Commit> commits;
+
+/* Blocking GET against a real server, returns the raw response */
+std::string forward(const std::string &request, double *seconds)
+{
+	std::string host = opt.server, port = "80";
+	size_t colon = host.rfind(':');
+	if (colon != std::string::npos) {
+		port = host.substr(colon + 1);
+		host = host.substr(0, colon);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	addrinfo hints = {}, *res = nullptr;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return "";
+
+	std::string response;
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0) {
+		std::string req = request + "Host: " + host + "\r\n\r\n";
+		if (write(fd, req.data(), req.size()) == (ssize_t)req.size()) {
+			char buf[4096];
+			ssize_t n;
+			while ((n = read(fd, buf, sizeof buf)) > 0) response.append(buf, n);
+		}
+	}
+	if (fd >= 0) close(fd);
+	freeaddrinfo(res);
+
+	*seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return response;
+}
+
+/* Same route as Webserver/flaskapp.py /add/<rfid>/<action>[/<version>].
+   Every --tags ID is in the database, surrendered at version 0. */
+struct Server {
+	struct Dog {
+		char status = 's';
+		unsigned version = 0;
+	};
+
+	std::vector<ns_t> workers = std::vector<ns_t>(5, 0);
+	std::map<std::string, Dog> dogs;
+	unsigned conflicts = 0;
+	unsigned web_changes = 0;
+	std::function<void(const std::string &, const Dog &, ns_t)> changed;    // the bridge's poll of the table
+
+	static std::string status_reply(const char *code, const Dog &d)
+	{
+		std::string body = std::string(1, d.status) + " " + std::to_string(d.version) + "\r\n";
+		return std::string("HTTP/1.0 ") + code + "\r\nContent-Type: text/html; charset=utf-8\r\nContent-Length: " +
+		       std::to_string(body.size()) + "\r\n\r\n" + body;
+	}
+
+	void handle(const std::string &request, ns_t t, std::function<void(std::string, ns_t)> reply)
+	{
+		std::string line = request.substr(0, request.find("\r\n"));
+		char rfid[32] = "", action = 0;
+		unsigned version = 0;
+		int n = std::sscanf(line.c_str(), "GET /add/%31[^/]/%c/%u HTTP/1.", rfid, &action, &version);
+
+		double service = opt.server_ms / 1e3;
+		auto w = std::min_element(workers.begin(), workers.end());
+		ns_t done = std::max(*w, t) + (ns_t)(service * SEC);
+
+		if (!opt.server.empty()) {
+			std::string response = forward(line + "\r\n", &service);
+			done = std::max(*w, t) + (ns_t)(service * SEC);
+			*w = done;
+			bool ok = response.compare(9, 3, "200") == 0;
+			char status = 0;
+			size_t body = response.find("\r\n\r\n");
+			if (body != std::string::npos && body + 4 < response.size()) status = response[body + 4];
+			std::string tag = rfid;
+			at(done, [=]() {
+				if (ok && n >= 2) record(tag, status, done);
+				reply(response, done);
+			});
+			return;
+		}
+		*w = done;
+
+		/* decided when the request is served, like the database would */
+		std::string tag = rfid;
+		at(done, [=]() {
+			std::string response;
+			auto d = dogs.find(tag);
+			if (n < 2) {
+				response = "HTTP/1.0 404 NOT FOUND\r\n\r\n";
+			} else if (action != 'a' && action != 's' && action != 't') {
+				response = "HTTP/1.0 400 BAD REQUEST\r\n\r\ninvalid action";
+			} else if (d == dogs.end()) {
+				response = "HTTP/1.0 404 NOT FOUND\r\n\r\nunknown rfid";
+			} else if (n == 3 && version != d->second.version) {
+				conflicts++;
+				trace(done, "server conflict %s v%u, at v%u", tag.c_str(), version, d->second.version);
+				response = status_reply("409 CONFLICT", d->second);
+			} else {
+				Dog &dog = d->second;
+				dog.status = action == 't' ? (dog.status == 'a' ? 's' : 'a') : action;
+				dog.version++;
+				record(tag, dog.status, done);
+				if (changed) changed(tag, dog, done);
+				response = status_reply("200 OK", dog);
+			}
+			reply(response, done);
+		});
+	}
+
+	void record(const std::string &tag, char status, ns_t t)
+	{
+		commits.push_back(Commit{ tag, status, t });
+		trace(t, "server commit %s %c", tag.c_str(), status);
+	}
+};
+
+Server server;
+
+/******************************************************************* MQTT broker ********************************************************************/
+
+void esp_ipd(int id, const std::string &data, ns_t t);
+
+/* Broker and Bridge/ in one, for MainBoard built with UPLINK_MQTT. A scan
+   published on dogs/scan/<client> goes to the server like the GET would,
+   its answer comes back on dogs/reply/<client>, and every change to a dog
+   goes out on dogs/status after the bridge's next poll of the table. */
+struct Broker {
+	struct Session {
+		mqtt_parser parser = {};
+		std::string client;
+		bool status = false;                // subscribed to dogs/status
+	};
+
+	const ns_t poll = 250 * MS;             // Bridge/ -p
+	std::map<int, Session> sessions;        // by ESP link ID
+	unsigned connects = 0, published = 0, replies = 0, pushes = 0;
+
+	Broker()
+	{
+		server.changed = [this](const std::string &tag, const Server::Dog &d, ns_t t) {
+			ns_t at = (t / poll + 1) * poll;
+			std::string payload = tag + " " + d.status + " " + std::to_string(d.version);
+			for (auto &s : sessions) {
+				if (!s.second.status) continue;
+				publish(s.first, "dogs/status", payload, at);
+				pushes++;
+			}
+		};
+	}
+
+	void open(int id) { sessions[id] = Session{}; }
+	void close(int id) { sessions.erase(id); }
+
+	/* data reaches the broker at t */
+	void receive(int id, const std::string &data, ns_t t)
+	{
+		auto s = sessions.find(id);
+		if (s == sessions.end()) return;
+		for (unsigned char c : data) {
+			if (mqtt_parse(&s->second.parser, c)) packet(id, s->second, t);
+		}
+	}
+
+	void send(int id, const uint8_t *p, size_t n, ns_t t)
+	{
+		esp_ipd(id, std::string((const char *)p, n), t + (ns_t)(opt.rtt * MS / 2));
+	}
+
+	void publish(int id, const std::string &topic, const std::string &payload, ns_t t)
+	{
+		uint8_t out[256];
+		size_t n = mqtt_publish(out, 0, 0, topic.c_str(), (const uint8_t *)payload.data(), payload.size());
+		trace(t, "mqtt -> %d %s \"%s\"", id, topic.c_str(), payload.c_str());
+		send(id, out, n, t);
+	}
+
+	void packet(int id, Session &s, ns_t t)
+	{
+		mqtt_parser &p = s.parser;
+		uint8_t out[16];
+
+		switch (p.header & 0xF0) {
+		case MQTT_CONNECT:
+			if (p.len >= 12) s.client.assign((const char *)p.body + 12, std::min<size_t>(p.len - 12, (p.body[10] << 8) | p.body[11]));
+			connects++;
+			trace(t, "mqtt <- %d CONNECT %s", id, s.client.c_str());
+			send(id, out, mqtt_connack(out, 0), t);
+			break;
+
+		case MQTT_SUBSCRIBE & 0xF0: {
+			std::string filter((const char *)p.body + 4, std::min<size_t>(p.len - 4, (p.body[2] << 8) | p.body[3]));
+			if (filter == "dogs/status") s.status = true;
+			size_t n = mqtt_header(out, MQTT_SUBACK, 3);
+			out[n++] = p.body[0];
+			out[n++] = p.body[1];
+			out[n++] = 0;
+			send(id, out, n, t);
+			break;
+		}
+
+		case MQTT_PUBLISH: {
+			const char *topic;
+			const uint8_t *payload;
+			uint16_t topic_len, len, packet_id;
+			if (!mqtt_publish_parts(&p, &topic, &topic_len, &payload, &len, &packet_id)) break;
+			if (p.header & MQTT_QOS1) send(id, out, mqtt_ack(out, MQTT_PUBACK, packet_id), t);
+			if (std::string(topic, topic_len) != "dogs/scan/" + s.client) break;
+			published++;
+			bridge(id, s.client, std::string((const char *)payload, len), t);
+			break;
+		}
+
+		case MQTT_PINGREQ:
+			send(id, out, mqtt_empty(out, MQTT_PINGRESP), t);
+			break;
+		}
+	}
+
+	/* "<rfid> <action>[ <version>]" as the GET it stands for */
+	void bridge(int id, const std::string &client, const std::string &scan, ns_t t)
+	{
+		char rfid[16] = "", action = 0;
+		unsigned version = 0;
+		int n = std::sscanf(scan.c_str(), "%15s %c %u", rfid, &action, &version);
+		trace(t, "mqtt <- %d dogs/scan/%s \"%s\"", id, client.c_str(), scan.c_str());
+		if (n < 2) return;
+
+		std::string request = std::string("GET /add/") + rfid + "/" + action + (n == 3 ? "/" + std::to_string(version) : "") + " HTTP/1.0\r\n";
+		std::string tag = rfid;
+		server.handle(request, t, [this, id, client, tag](std::string response, ns_t done) {
+			auto s = sessions.find(id);
+			if (s == sessions.end() || s->second.client != client) return;
+			int code = response.size() >= 12 ? std::atoi(response.c_str() + 9) : 500;
+			std::string status = "- 0";
+			size_t body = response.find("\r\n\r\n");
+			if ((code == 200 || code == 409) && body != std::string::npos) status = response.substr(body + 4, response.find('\r', body + 4) - body - 4);
+			publish(id, "dogs/reply/" + client, tag + " " + std::to_string(code) + " " + status, done);
+			replies++;
+		});
+	}
+};
+
+Broker broker;
+
+/******************************************************************* ESP8266 ********************************************************************/
+
+/* AT firmware as far as MainBoard uses it: echo until ATE0, AT+RST,
+   AT+CIPSTATUS, AT+CIPSTART, AT+CIPSEND and the +IPD/CLOSED reply */
+struct Esp {
+	Board *mb = nullptr;
+	ns_t char_ns = char_time(9600);
+	ns_t out_free = 0;
+	ns_t ready_at = 400 * MS;
+	ns_t ip_at = 0;
+	bool echo = true;
+	std::string line;
+	bool mux = false;                       // AT+CIPMUX=1: link IDs 0..4
+	bool linked[5] = {};
+	int port[5] = {};                       // of each link, MQTT_PORT goes to the broker
+	bool was_linked = false;
+	unsigned send_left = 0;
+	int send_id = 0;
+	ns_t busy_until = 0;                    // sending data, commands get "busy s..."
+	std::string data;
+	unsigned requests = 0;
+	unsigned most_linked = 0;
+	unsigned connects = 0;
+	uint64_t bytes_up = 0, bytes_down = 0;  // TCP payload both ways
+
+	Esp() { ip_at = ready_at + (ns_t)(opt.assoc * SEC); }
+
+	bool garbled() const { return baud_mismatch(mb->bit_ns[1], char_ns / 10); }
+
+	void send(const std::string &s, ns_t t)
+	{
+		for (unsigned char c : s) {
+			out_free = std::max(out_free, t) + char_ns;
+			if (garbled()) c = rng();
+			ns_t when = out_free;
+			Board *b = mb;
+			at(when, [b, c, when]() { b->rx(1, c, when); });
+		}
+	}
+
+	void reply(const std::string &s, ns_t t)
+	{
+		trace(t, "esp  -> \"%s\"", printable(s).c_str());
+		send(s, t);
+	}
+
+	void receive(uint8_t c, ns_t t)
+	{
+		if (t < ready_at) return;                   // booting
+		if (garbled()) c = rng();
+
+		if (send_left) {
+			data += c;
+			if (--send_left == 0) submit(t);
+			return;
+		}
+		if (echo) send(std::string(1, c), t);
+		if (c == '\n') {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			command(line, t);
+			line.clear();
+		} else if (line.size() < 256) {
+			line += c;
+		}
+	}
+
+	bool any_linked() const
+	{
+		return std::any_of(std::begin(linked), std::end(linked), [](bool l) { return l; });
+	}
+
+	/* "<id>," in multiple connection mode, nothing in single */
+	std::string prefix(int id) const
+	{
+		return mux ? std::to_string(id) + "," : "";
+	}
+
+	/* Link ID argument of a command in multiple connection mode, -1 if it
+	   is missing or out of range. args points past the '='. */
+	int link_id(const std::string &cmd, size_t args, size_t *rest) const
+	{
+		*rest = args;
+		if (!mux) return 0;
+		if (args + 1 >= cmd.size() || cmd[args] < '0' || cmd[args] > '4' || cmd[args + 1] != ',') return -1;
+		*rest = args + 2;
+		return cmd[args] - '0';
+	}
+
+	void command(const std::string &cmd, ns_t t)
+	{
+		trace(t, "esp  <- \"%s\"", printable(cmd).c_str());
+
+		if (t < busy_until && !cmd.empty()) {
+			reply("busy s...\r\n", t);
+			return;
+		}
+
+		size_t rest;
+		if (cmd == "AT") {
+			reply("\r\nOK\r\n", t);
+		} else if (cmd == "AT+RST") {
+			reply("\r\nOK\r\n", t);
+			std::string noise;
+			for (int i = 0; i < 40; i++) noise += (char)rng();     // boot log at 74880 baud
+			send(noise, t + 30 * MS);
+			ready_at = t + 400 * MS;
+			ip_at = ready_at + (ns_t)(opt.assoc * SEC);
+			echo = true;
+			mux = false;
+			std::fill(std::begin(linked), std::end(linked), false);
+			was_linked = false;
+			at(ready_at, [this]() { reply("\r\nready\r\n", ready_at); });
+		} else if (cmd == "ATE0" || cmd == "ATE1") {
+			echo = cmd == "ATE1";
+			reply("\r\nOK\r\n", t);
+		} else if (cmd == "AT+CIPMUX=0" || cmd == "AT+CIPMUX=1") {
+			if (any_linked()) {
+				reply("link is builded\r\n\r\nERROR\r\n", t);
+			} else {
+				mux = cmd.back() == '1';
+				reply("\r\nOK\r\n", t);
+			}
+		} else if (cmd == "AT+CIPSTATUS") {
+			const char *status = t < ip_at ? "5" : any_linked() ? "3" : was_linked ? "4" : "2";
+			reply(std::string("STATUS:") + status + "\r\n\r\nOK\r\n", t);
+		} else if (cmd.compare(0, 12, "AT+CIPSTART=") == 0) {
+			int id = link_id(cmd, 12, &rest);
+			if (t < ip_at || id < 0) {
+				reply("\r\nERROR\r\n", t);
+			} else if (linked[id]) {
+				reply("ALREADY CONNECTED\r\n\r\nERROR\r\n", t);
+			} else {
+				ns_t up = t + (ns_t)(opt.rtt * MS);
+				int p = std::atoi(cmd.c_str() + cmd.rfind(',') + 1);
+				at(up, [this, up, id, p]() {
+					linked[id] = true;
+					port[id] = p;
+					connects++;
+					if (p == MQTT_PORT) broker.open(id);
+					most_linked = std::max(most_linked, (unsigned)std::count(std::begin(linked), std::end(linked), true));
+					reply(prefix(id) + "CONNECT\r\n\r\nOK\r\n", up);
+				});
+			}
+		} else if (cmd.compare(0, 11, "AT+CIPSEND=") == 0) {
+			int id = link_id(cmd, 11, &rest);
+			int n = std::atoi(cmd.c_str() + rest);
+			if (id < 0 || !linked[id]) {
+				reply("link is not valid\r\n\r\nERROR\r\n", t);
+			} else if (n <= 0 || n > 2048) {
+				reply("\r\nERROR\r\n", t);
+			} else {
+				send_left = n;
+				send_id = id;
+				data.clear();
+				reply("\r\nOK\r\n> ", t);
+			}
+		} else if (cmd == "AT+CIPCLOSE" || cmd.compare(0, 12, "AT+CIPCLOSE=") == 0) {
+			int id = (cmd.size() > 12) ? std::atoi(cmd.c_str() + 12) : 0;
+			if (id < 0 || id > 4 || !linked[id]) {
+				reply("\r\nERROR\r\n", t);
+			} else {
+				linked[id] = false;
+				was_linked = true;
+				if (port[id] == MQTT_PORT) broker.close(id);
+				reply(prefix(id) + "CLOSED\r\n\r\nOK\r\n", t);
+			}
+		} else if (!cmd.empty()) {
+			reply("\r\nERROR\r\n", t);
+		}
+	}
+
+	void submit(ns_t t)
+	{
+		int id = send_id;
+		trace(t, "esp  => %d \"%s\"", id, printable(data).c_str());
+		reply("\r\nRecv " + std::to_string(data.size()) + " bytes\r\n", t);
+		bytes_up += data.size();
+
+		ns_t half = (ns_t)(opt.rtt * MS / 2);
+		ns_t acked = t + 2 * half;
+		busy_until = acked;
+		at(acked, [this, acked]() { reply("\r\nSEND OK\r\n", acked); });
+		if (port[id] == MQTT_PORT) {
+			broker.receive(id, data, t + half);
+			return;
+		}
+		requests++;
+		server.handle(data, t + half, [this, half, id](std::string response, ns_t done) {
+			ns_t back = done + half;
+			at(back, [this, response, back, id]() {
+				if (!linked[id]) return;
+				ipd(id, response, back);
+				reply(prefix(id) + "CLOSED\r\n", back);
+				linked[id] = false;
+				was_linked = true;
+			});
+		});
+	}
+
+	void ipd(int id, const std::string &data, ns_t t)
+	{
+		std::string head = mux ? "+IPD," + std::to_string(id) + "," : "+IPD,";
+		reply("\r\n" + head + std::to_string(data.size()) + ":" + data, t);
+		bytes_down += data.size();
+	}
+};
+
+Esp esp;
+
+void esp_ipd(int id, const std::string &data, ns_t t)
+{
+	at(t, [id, data, t]() {
+		if (esp.linked[id] && esp.port[id] == MQTT_PORT) esp.ipd(id, data, t);
+	});
+}
+
+/******************************************************************* Reader link ********************************************************************/
+
+struct LinkStats {
+	unsigned sent = 0, lost = 0, corrupted = 0, collisions = 0, garbled = 0;
+};
+
+LinkStats link_stats;
+Board *mainboard;
+FILE *link_log;
+
+/* Per-byte loss and corruption on the way into MainBoard USART0 */
+void deliver(uint8_t c, ns_t t, bool garble)
+{
+	link_stats.sent++;
+	if (link_log) std::fputc(c, link_log);
+	if (uniform() < opt.loss) {
+		link_stats.lost++;
+		return;
+	}
+	if (garble) {
+		link_stats.garbled++;
+		c = rng();
+	} else if (uniform() < opt.corrupt) {
+		link_stats.corrupted++;
+		c ^= 1 << (rng() % 8);
+	}
+	at(t, [c, t]() { mainboard->rx(0, c, t); });
+}
+
+/* XBee pair per reader: bytes are collected until the line has been
+   quiet for 3 character times (RO), sent as one packet over the shared
+   channel and written out to MainBoard at the radio's serial rate */
+struct Xbee {
+	Board *reader;
+	std::string packet;
+	unsigned gen = 0;
+};
+
+std::vector<Xbee> xbees;
+ns_t air_free, xbee_out_free;
+
+void xbee_flush(Xbee &x, ns_t t)
+{
+	std::string p = x.packet;
+	x.packet.clear();
+
+	ns_t start = std::max(t, air_free);
+	air_free = start + 1500 * US + p.size() * 32 * US;         // headers, ack and 250 kbit/s payload
+	ns_t c = char_time(opt.link_baud);
+	bool out_garbled = baud_mismatch(mainboard->bit_ns[0], c / 10);
+
+	for (unsigned char b : p) {
+		xbee_out_free = std::max(xbee_out_free, air_free) + c;
+		deliver(b, xbee_out_free, out_garbled);
+	}
+}
+
+void xbee_tx(Xbee &x, uint8_t c, ns_t t)
+{
+	ns_t ct = char_time(opt.link_baud);
+	if (baud_mismatch(x.reader->bit_ns[0], ct / 10)) c = rng();
+	x.packet += c;
+	unsigned g = ++x.gen;
+	Xbee *px = &x;
+	at(t + 3 * ct, [px, g, t, ct]() {
+		if (g == px->gen && !px->packet.empty()) xbee_flush(*px, t + 3 * ct);
+	});
+}
+
+/* Plain wire: every reader's TX tied to MainBoard RX, bytes that overlap
+   on the line destroy each other */
+struct WireByte {
+	uint8_t c;
+	ns_t start, end;
+	bool collided = false;
+	bool garbled = false;
+};
+
+std::shared_ptr<WireByte> wire_last;
+
+void wire_tx(Board *r, uint8_t c, ns_t t)
+{
+	auto w = std::make_shared<WireByte>();
+	w->c = c;
+	w->end = t;
+	w->start = t - r->bit_ns[0] * 10;
+	w->garbled = baud_mismatch(mainboard->bit_ns[0], r->bit_ns[0]);
+	if (wire_last && wire_last->end > w->start) {
+		wire_last->collided = w->collided = true;
+		link_stats.collisions++;
+	}
+	wire_last = w;
+	at(t, [w]() {
+		uint8_t c = w->collided ? (uint8_t)(w->c ^ rng()) : w->c;
+		deliver(c, w->end, w->garbled);
+	});
+}
+
+/* A PC on the link (Tools/linkshell, Tools/rfcapture): each --send frame
+   reaches every board at the link rate, and --link-log gets what its
+   radio would hear, the readers' frames and MainBoard's answers */
+void pc_send(const Options::Send &s, uint8_t seq)
+{
+	uint8_t frame[FRAME_MAX_SIZE];
+	uint8_t n = frame_encode(frame, s.addr, FRAME_COMMAND, seq, (const uint8_t *)s.payload.data(), s.payload.size());
+	ns_t ct = char_time(opt.link_baud);
+	ns_t t = (ns_t)(s.at * SEC);
+
+	for (uint8_t i = 0; i < n; i++) {
+		t += ct;
+		uint8_t c = frame[i];
+		at(t, [c, t]() {
+			for (auto &b : boards) b->rx(0, c, t);
+		});
+	}
+}
+
+/******************************************************************* Tags ********************************************************************/
+
+/* Furthest a scan got, in this order */
+enum Outcome { NOT_READ, DEDUPED, DROPPED, UNANSWERED, COMMITTED };
+
+struct Arrival {
+	int reader;
+	std::string tag;
+	ns_t t;
+	ns_t until;
+	Outcome outcome = NOT_READ;
+	int queued = 0;                         // scans of it in MainBoard's reader queue
+};
+
+std::deque<Arrival> arrivals;              // stable addresses, readers point into it
+
+struct Reader {
+	Board *board;
+	int index;
+	const Arrival *current = nullptr;       // tag in the field, if any
+
+	// RFReceiver tag model
+	uint64_t frame = 0;                     // 64 bit EM4100 frame, MSB first
+	unsigned bit = 0;
+	ns_t last_sample = 0;
+};
+
+std::vector<Reader> readers;
+
+bool in_field(const Reader &r, ns_t t)
+{
+	return r.current && r.current->t <= t && t < r.current->until;
+}
+
+uint64_t em4100_frame(const std::string &hex)
+{
+	uint64_t f = 0x1FF;                                         // 9 header ones
+	unsigned cols = 0;
+	for (char h : hex) {
+		unsigned n = std::stoul(std::string(1, h), nullptr, 16);
+		unsigned parity = __builtin_popcount(n) & 1;
+		f = f << 5 | n << 1 | parity;
+		cols ^= n;
+	}
+	f = f << 5 | cols << 1;                                     // column parity, stop bit 0
+	return f;
+}
+
+/* The external 125 kHz module on RFModule: STX, 10 ID digits, 2 checksum
+   digits, CR LF, ETX at 9600 baud about 60 ms after the tag shows up */
+void module_packet(Reader &r, const std::string &tag, ns_t t)
+{
+	unsigned sum = 0;
+	for (int i = 0; i < 10; i += 2) sum ^= std::stoul(tag.substr(i, 2), nullptr, 16);
+	char check[3];
+	std::snprintf(check, sizeof check, "%02X", sum);
+	std::string p = "\x02" + tag + check + "\r\n\x03";
+
+	ns_t c = char_time(9600);
+	bool garbled = baud_mismatch(r.board->bit_ns[0], c / 10);
+	ns_t when = t + 60 * MS;
+	Board *b = r.board;
+	for (unsigned char ch : p) {
+		when += c;
+		uint8_t out = garbled ? (uint8_t)rng() : ch;
+		ns_t w = when;
+		at(w, [b, out, w]() { b->rx(0, out, w); });
+	}
+}
+
+uint8_t receiver_pins(Reader &r, int port, uint8_t out, ns_t t)
+{
+	if (port != 3) return out;
+
+	bool carrier = r.board->api->peek(HAL_TCCR2A) & 0x40;      // COM2A0
+	int level;
+	if (!carrier || !in_field(r, t)) {
+		level = rng() & 1;
+	} else if (opt.tag_clock == "carrier") {
+		// Tag runs on its own clock: 64 carrier periods per bit
+		level = r.frame >> (63 - (t - r.current->t) / (512 * US) % 64) & 1;
+	} else {
+		// One bit per sample, as if the sampling were locked to the tag
+		if (t - r.last_sample >= 100 * US) {
+			r.bit = (r.bit + 1) % 64;
+			r.last_sample = t;
+		}
+		level = r.frame >> (63 - r.bit) & 1;
+	}
+	return (out & ~0x04) | level << 2;
+}
+
+/* Envelope before the slicer: 600 counts empty, 540 loaded by a tag, plus
+   or minus half of --tag-depth for the bit being sent, plus uniform noise
+   of up to --tag-noise. In sampler mode the tag bit clock is the
+   firmware's 501 us sample period. */
+uint16_t receiver_adc(Reader &r, int channel, ns_t t)
+{
+	if (channel != 7) return 0;
+	bool carrier = r.board->api->peek(HAL_TCCR2A) & 0x40;
+	int noise = (int)(rng() % (2 * opt.tag_noise + 1)) - opt.tag_noise;
+	if (!carrier) return rng() % 4;
+	if (!in_field(r, t)) return 600 + noise;
+
+	ns_t period = (opt.tag_clock == "carrier") ? 512 * US : 501 * US;
+	int level = r.frame >> (63 - (t - r.current->t) / period % 64) & 1;
+	return 540 + (level ? opt.tag_depth : -opt.tag_depth) / 2 + noise;
+}
+
+double exponential(double mean)
+{
+	return std::exponential_distribution<double>(1.0 / mean)(rng);
+}
+
+void next_arrival(int i, ns_t t)
+{
+	if (t >= (ns_t)(opt.duration * SEC)) return;
+
+	Arrival a;
+	a.reader = i;
+	a.tag = opt.tags[rng() % opt.tags.size()];
+	a.t = t;
+	a.until = t + (ns_t)(opt.dwell * SEC);
+	arrivals.push_back(a);
+	size_t k = arrivals.size() - 1;
+
+	at(t, [i, k, t]() {
+		Reader &r = readers[i];
+		const Arrival &a = arrivals[k];
+		r.current = &arrivals[k];
+		r.frame = em4100_frame(a.tag);
+		r.bit = 0;
+		trace(t, "%s tag  %s arrives", r.board->name.c_str(), a.tag.c_str());
+		if (opt.reader == "rfmodule") module_packet(r, a.tag, t);
+	});
+	at(a.until, [i, k]() {
+		if (readers[i].current == &arrivals[k]) readers[i].current = nullptr;
+	});
+
+	ns_t next = a.until + (ns_t)(exponential(opt.gap) * SEC);
+	at(t, [i, next]() { next_arrival(i, next); });
+}
+
+/******************************************************************* Report ********************************************************************/
+
+/* --online: a dog adopted or returned on the web site, or edited on the
+   admin page. Not a scan, so not a commit either. */
+void web_change(ns_t t)
+{
+	if (t >= (ns_t)(opt.duration * SEC)) return;
+
+	auto d = server.dogs.begin();
+	std::advance(d, rng() % server.dogs.size());
+	Server::Dog &dog = d->second;
+	dog.status = dog.status == 'a' ? 's' : 'a';
+	dog.version++;
+	server.web_changes++;
+	trace(t, "web change %s %c v%u", d->first.c_str(), dog.status, dog.version);
+	if (server.changed) server.changed(d->first, dog, t);
+
+	ns_t next = t + (ns_t)(exponential(opt.online) * SEC);
+	at(next, [next]() { web_change(next); });
+}
+
+ns_t mainboard_ready;
+
+double percentile(std::vector<double> v, double p)
+{
+	if (v.empty()) return NAN;
+	std::sort(v.begin(), v.end());
+	size_t i = (size_t)std::ceil(p * v.size());
+	return v[std::min(v.size() - 1, i ? i - 1 : 0)];
+}
+
+struct Match {
+	std::vector<double> latency;            // arrival to the commit of its upload, s
+	unsigned outcomes[COMMITTED + 1] = {};
+	unsigned extra = 0;                     // commits of no upload in flight (a retry done twice)
+	bool settled = true;                    // nothing queued or in flight any more
+};
+
+/* Replays MainBoard's notes and the server's commits in time order. A
+   note for a read goes to the reader's last arrival of that tag, a scan
+   taken from the queue to its oldest arrival with one queued, and a
+   commit to the upload in flight for the tag (there is at most one, the
+   status cache holds more scans of it back). */
+Match match()
+{
+	struct Upload {
+		Arrival *a;
+		bool committed;
+	};
+	std::map<std::string, std::deque<Upload>> in_flight;
+	Match m;
+
+	for (Arrival &a : arrivals) {
+		a.outcome = NOT_READ;
+		a.queued = 0;
+	}
+	auto reached = [](Arrival *a, Outcome o) { if (a && o > a->outcome) a->outcome = o; };
+	auto reader = [](int addr) { return opt.reader == "local" ? addr : addr - 1; };
+
+	auto commit = [&](const Commit &c) {
+		auto &q = in_flight[c.tag];
+		auto u = std::find_if(q.begin(), q.end(), [](const Upload &u) { return !u.committed; });
+		if (u == q.end()) {
+			m.extra++;
+			return;
+		}
+		u->committed = true;
+		if (!u->a) return;                  // a scan from before the first arrival, can't happen
+		reached(u->a, COMMITTED);
+		m.latency.push_back((c.t - u->a->t) / 1e9);
+	};
+
+	size_t c = 0;
+	for (const ScanNote &n : notes) {
+		for (; c < commits.size() && commits[c].t <= n.t; c++) commit(commits[c]);
+
+		Arrival *a = nullptr;
+		if (n.what == 'q' || n.what == 'r' || n.what == 'o') {
+			for (Arrival &x : arrivals) {
+				if (x.reader == reader(n.addr) && x.tag == n.tag && x.t <= n.t) a = &x;
+			}
+		} else if (n.what != 'f') {
+			for (Arrival &x : arrivals) {
+				if (x.reader == reader(n.addr) && x.tag == n.tag && x.queued > 0) {
+					a = &x;
+					a->queued--;
+					break;
+				}
+			}
+		}
+
+		switch (n.what) {
+		case 'q': if (a) a->queued++; break;
+		case 'r': case 'i': reached(a, DEDUPED); break;
+		case 'o': case 'p': reached(a, DROPPED); break;
+		case 'u':
+			reached(a, UNANSWERED);
+			in_flight[n.tag].push_back(Upload{ a, false });
+			break;
+		case 'f': {
+			auto &q = in_flight[n.tag];
+			if (!q.empty()) q.pop_front();
+			break;
+		}
+		}
+	}
+	for (; c < commits.size(); c++) commit(commits[c]);
+
+	for (Arrival &a : arrivals) {
+		m.outcomes[a.outcome]++;
+		if (a.queued > 0) m.settled = false;
+	}
+	for (auto &q : in_flight) {
+		if (!q.second.empty()) m.settled = false;
+	}
+	return m;
+}
+
+void report(ns_t end, double wall)
+{
+	Match m = match();
+	const std::vector<double> &latency = m.latency;
+	double minutes = (opt.duration - opt.warmup) / 60;
+
+	std::printf("readers            %d x %s, %s link at %u baud\n", opt.readers, opt.reader.c_str(),
+	            opt.bus.c_str(), opt.link_baud);
+	std::printf("simulated          %.1f s in %.2f s wall (%.0fx)\n", end / 1e9, wall, end / 1e9 / wall);
+	if (mainboard_ready) std::printf("MainBoard ready    %.2f s\n", mainboard_ready / 1e9);
+	else std::printf("MainBoard ready    never\n");
+	std::printf("arrivals           %zu (%.1f/min)\n", arrivals.size(), arrivals.size() / minutes);
+	std::printf("committed          %zu (%.1f scans/min)\n", latency.size(), latency.size() / minutes);
+	std::printf("lost               %zu: %u not read, %u deduped, %u dropped, %u unanswered\n",
+	            arrivals.size() - latency.size(), m.outcomes[NOT_READ], m.outcomes[DEDUPED], m.outcomes[DROPPED],
+	            m.outcomes[UNANSWERED]);
+	std::printf("extra commits      %u\n", m.extra);
+	std::printf("scan-to-db p50     %.3f s\n", percentile(latency, 0.50));
+	std::printf("scan-to-db p99     %.3f s\n", percentile(latency, 0.99));
+	std::printf("http requests      %u, %u conflicts, at most %u connections open\n", esp.requests, server.conflicts, esp.most_linked);
+	if (broker.connects) {
+		std::printf("mqtt               %u scans, %u replies, %u status pushes, %u sessions\n", broker.published,
+		            broker.replies, broker.pushes, broker.connects);
+	}
+	if (opt.online) std::printf("web changes        %u\n", server.web_changes);
+	std::printf("server traffic     %u connections, %llu bytes up, %llu down\n", esp.connects,
+	            (unsigned long long)esp.bytes_up, (unsigned long long)esp.bytes_down);
+	std::printf("link bytes         %u sent, %u lost, %u corrupted, %u garbled, %u collisions\n",
+	            link_stats.sent, link_stats.lost, link_stats.corrupted, link_stats.garbled, link_stats.collisions);
+	for (auto &b : boards) {
+		std::printf("%-18s \"%s\"\n", (b->name + " lcd").c_str(), b->lcd.text().c_str());
+	}
+}
+
+/******************************************************************* Main ********************************************************************/
+
+void usage()
+{
+	std::fprintf(stderr,
+		"usage: sim [options]\n"
+		"  --readers N          readers on the link, 1..4 (1)\n"
+		"  --reader TYPE        rfmodule, rfreceiver or local (rfmodule)\n"
+		"  --duration S         seconds of tag arrivals (300)\n"
+		"  --warmup S           seconds before the first tag (8)\n"
+		"  --drain S            seconds allowed to finish afterwards (30)\n"
+		"  --gap S              mean seconds between tags per reader (10)\n"
+		"  --dwell S            seconds a tag stays in the field (1.5)\n"
+		"  --tags ID,ID,...     tag IDs to present (the three demo cards)\n"
+		"  --bus TYPE           xbee or wire (xbee)\n"
+		"  --link-baud B        XBee serial rate (9600)\n"
+		"  --loss P             per byte loss on the reader link (0)\n"
+		"  --corrupt P          per byte bit error on the reader link (0)\n"
+		"  --esp-baud B         ESP8266 serial rate (9600)\n"
+		"  --assoc S            seconds until the ESP8266 has an IP (1.5)\n"
+		"  --esp-up             ESP8266 already up and associated, echo off\n"
+		"  --rtt MS             round trip to the server (80)\n"
+		"  --server-ms MS       server time per request (20)\n"
+		"  --server HOST:PORT   forward requests to a real server\n"
+		"  --online S           mean seconds between status changes on the web site (none)\n"
+		"  --window US          virtual time per board turn (100)\n"
+		"  --tag-clock MODE     sampler or carrier, RFReceiver tag timing (sampler)\n"
+		"  --tag-depth N        ADC counts of tag modulation on the envelope (48)\n"
+		"  --tag-noise N        ADC counts of noise on the envelope, either way (2)\n"
+		"  --send A:HEX@S       command frame to board A at S seconds, e.g. 1:6362@2\n"
+		"  --link-log FILE      write every byte on the reader link to FILE\n"
+		"  --seed N             random seed (1)\n"
+		"  --build DIR          firmware images (build)\n"
+		"  --trace              print LCD, AT and server traffic\n");
+	std::exit(2);
+}
+
+void parse(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string a = argv[i];
+		if (a == "--trace") {
+			opt.trace = true;
+			continue;
+		}
+		if (a == "--esp-up") {
+			opt.esp_up = true;
+			continue;
+		}
+		if (i + 1 >= argc) usage();
+		std::string v = argv[++i];
+
+		if (a == "--readers") opt.readers = std::atoi(v.c_str());
+		else if (a == "--reader") opt.reader = v;
+		else if (a == "--duration") opt.duration = std::atof(v.c_str());
+		else if (a == "--warmup") opt.warmup = std::atof(v.c_str());
+		else if (a == "--drain") opt.drain = std::atof(v.c_str());
+		else if (a == "--gap") opt.gap = std::atof(v.c_str());
+		else if (a == "--dwell") opt.dwell = std::atof(v.c_str());
+		else if (a == "--bus") opt.bus = v;
+		else if (a == "--link-baud") opt.link_baud = std::atoi(v.c_str());
+		else if (a == "--loss") opt.loss = std::atof(v.c_str());
+		else if (a == "--corrupt") opt.corrupt = std::atof(v.c_str());
+		else if (a == "--esp-baud") opt.esp_baud = std::atoi(v.c_str());
+		else if (a == "--assoc") opt.assoc = std::atof(v.c_str());
+		else if (a == "--rtt") opt.rtt = std::atof(v.c_str());
+		else if (a == "--server-ms") opt.server_ms = std::atof(v.c_str());
+		else if (a == "--server") opt.server = v;
+		else if (a == "--online") opt.online = std::atof(v.c_str());
+		else if (a == "--window") opt.window = std::atof(v.c_str());
+		else if (a == "--tag-clock") opt.tag_clock = v;
+		else if (a == "--tag-depth") opt.tag_depth = std::atoi(v.c_str());
+		else if (a == "--tag-noise") opt.tag_noise = std::atoi(v.c_str());
+		else if (a == "--seed") opt.seed = std::atoi(v.c_str());
+		else if (a == "--build") opt.build = v;
+		else if (a == "--link-log") opt.link_log = v;
+		else if (a == "--send") {
+			size_t colon = v.find(':'), at = v.find('@');
+			if (colon == std::string::npos || at == std::string::npos || at < colon || (at - colon - 1) % 2) usage();
+			Options::Send s{ (unsigned)std::atoi(v.c_str()), "", std::atof(v.c_str() + at + 1) };
+			for (size_t i = colon + 1; i < at; i += 2) {
+				int hi = hex_value(v[i]), lo = hex_value(v[i + 1]);
+				if (hi < 0 || lo < 0) usage();
+				s.payload += (char)(hi << 4 | lo);
+			}
+			if (s.payload.empty() || s.payload.size() > FRAME_MAX_PAYLOAD) usage();
+			opt.sends.push_back(s);
+		}
+		else if (a == "--tags") {
+			opt.tags.clear();
+			size_t p = 0;
+			while (p <= v.size()) {
+				size_t q = v.find(',', p);
+				if (q == std::string::npos) q = v.size();
+				opt.tags.push_back(v.substr(p, q - p));
+				p = q + 1;
+			}
+		}
+		else usage();
+	}
+
+	bool ok = opt.readers >= 1 && opt.readers <= 4 && opt.duration > opt.warmup && opt.window > 0 &&
+	          (opt.reader == "rfmodule" || opt.reader == "rfreceiver" || (opt.reader == "local" && opt.readers == 1)) &&
+	          (opt.bus == "xbee" || opt.bus == "wire") &&
+	          (opt.tag_clock == "sampler" || opt.tag_clock == "carrier") &&
+	          opt.link_baud && opt.esp_baud && opt.tag_depth >= 0 && opt.tag_noise >= 0 && !opt.tags.empty();
+	for (const std::string &t : opt.tags) {
+		ok = ok && t.size() == 10 && t.find_first_not_of("0123456789ABCDEF") == std::string::npos;
+	}
+	if (!ok) usage();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	parse(argc, argv);
+	rng.seed(opt.seed);
+	for (const std::string &t : opt.tags) server.dogs[t] = Server::Dog{};
+
+	mainboard = load_board("mainboard.so", "MainBoard");
+	esp.mb = mainboard;
+	esp.char_ns = char_time(opt.esp_baud);
+	if (opt.esp_up) {
+		esp.ready_at = esp.ip_at = 0;
+		esp.echo = false;
+	}
+	mainboard->on_tx = [](int port, uint8_t c, ns_t t) {
+		if (port == 1) esp.receive(c, t);
+		else if (link_log) std::fputc(c, link_log);
+	};
+
+	readers.reserve(opt.readers);
+	xbees.reserve(opt.readers);
+	if (opt.reader == "local") {
+		// MainBoard built with LOCAL_READER decodes the envelope itself
+		readers.push_back(Reader{ mainboard, 0 });
+		Reader *r = &readers.back();
+		mainboard->on_adc = [r](int channel, ns_t t) { return receiver_adc(*r, channel, t); };
+	}
+	for (int i = 0; i < opt.readers && opt.reader != "local"; i++) {
+		std::string n = std::to_string(i + 1);
+		std::string name = (opt.reader == "rfmodule" ? "RFModule" : "RFReceiver") + n;
+		Board *b = load_board(opt.reader + "-" + n + ".so", name);
+		readers.push_back(Reader{ b, i });
+		xbees.push_back(Xbee{ b });
+
+		Xbee *x = &xbees.back();
+		b->on_tx = [b, x](int port, uint8_t c, ns_t t) {
+			if (port != 0) return;
+			if (opt.bus == "xbee") xbee_tx(*x, c, t);
+			else wire_tx(b, c, t);
+		};
+		if (opt.reader == "rfreceiver") {
+			Reader *r = &readers.back();
+			b->on_pin_in = [r](int port, uint8_t out, ns_t t) { return receiver_pins(*r, port, out, t); };
+			b->on_adc = [r](int channel, ns_t t) { return receiver_adc(*r, channel, t); };
+		}
+	}
+
+	for (int i = 0; i < opt.readers; i++) {
+		next_arrival(i, (ns_t)(opt.warmup * SEC + exponential(opt.gap) * SEC * 0.5));
+	}
+	for (size_t i = 0; i < opt.sends.size(); i++) pc_send(opt.sends[i], i);
+	if (opt.online > 0) {
+		ns_t first = (ns_t)((opt.warmup + exponential(opt.online)) * SEC);
+		at(first, [first]() { web_change(first); });
+	}
+	if (!opt.link_log.empty() && !(link_log = std::fopen(opt.link_log.c_str(), "wb"))) {
+		std::perror(opt.link_log.c_str());
+		return 2;
+	}
+
+	auto wall = std::chrono::steady_clock::now();
+	ns_t window = (ns_t)(opt.window * US);
+	ns_t stop = (ns_t)(opt.duration * SEC);
+	ns_t drain_end = (ns_t)((opt.duration + opt.drain) * SEC);
+
+	while (sim_now < drain_end) {
+		// Skip ahead over stretches where no board and no event is due
+		ns_t next = events.empty() ? FOREVER : events.top().at;
+		for (auto &b : boards) next = std::min(next, b->wake);
+		if (next == FOREVER) break;
+		if (next > sim_now) sim_now = next - next % window;
+
+		ns_t end = sim_now + window;
+		while (!events.empty() && events.top().at < end) {
+			Event e = events.top();
+			events.pop();
+			e.fn();
+		}
+		for (auto &b : boards) {
+			if (b->wake < end) run_board(b.get(), end);
+		}
+
+		if (!mainboard_ready && mainboard->lcd.line(0).compare(0, 13, "Ready to Scan") == 0) {
+			mainboard_ready = mainboard->now;
+		}
+		sim_now = end;
+		if (sim_now >= stop + (ns_t)(opt.dwell * SEC) + 2 * SEC && (sim_now % SEC) < window && match().settled) break;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+	report(sim_now, seconds);
+	std::fflush(stdout);
+	if (link_log) std::fclose(link_log);
+	std::_Exit(0);
+}
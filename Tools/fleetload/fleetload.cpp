@@ -0,0 +1,453 @@
+/*
+ * Load generator for the web server's /add route: N MainBoards uploading
+ * scans at once, with the fleet growing step by step.
+ *
+ *   fleetload [options] --server 127.0.0.1:5000 --db /tmp/dogs.db
+ *
+ * Each emulated board sends what MainBoard's wifi_task sends, the way it
+ * sends it:
+ *
+ *   - one request per connection, HTTP/1.0, the request line and a blank
+ *     line and nothing else (no Host header, the ESP8266 sends what it is
+ *     given);
+ *   - one upload at a time, the next scans wait in a queue of
+ *     UPLOAD_QUEUE and are dropped when it is full;
+ *   - /add/<rfid>/t for a tag it has no fresh status for, /add/<rfid>/a or
+ *     /s with the version when it has one (MainBoard's status cache),
+ *     corrected from the body of a 409;
+ *   - /add/----------/b once at boot, the warm-up upload.
+ *
+ * Scans come in bursts (a few dogs brought to the desk one after another)
+ * separated by random think times. Every step runs for --step seconds
+ * with more boards and prints one line: events offered and answered per
+ * second, scan-to-reply latency percentiles (the queue wait included,
+ * like MainBoard's up_ms), 409s, server errors, timeouts and, with --db,
+ * how often the database's write lock was held.
+ */
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const int UPLOAD_QUEUE = 8;                 // MainBoard's, uploads waiting for the ESP8266
+const unsigned NO_VERSION = 0xFFFF;
+
+/******************************************************************* Options ********************************************************************/
+
+struct Options {
+	std::string server = "127.0.0.1:80";
+	std::string db;                         // tags from its dogs table, and the lock probe
+	std::vector<std::string> tags;
+	std::vector<int> fleet = { 1, 2, 4, 8, 16, 32, 64 };
+	double step = 30;                       // s per fleet size
+	double gap = 20;                        // s mean think time between bursts, per board
+	double burst = 3;                       // mean scans per burst
+	double spacing = 3;                     // s between scans in a burst: the result shows for 2 s, then the next dog
+	double at_ms = 60;                      // AT+CIPSTART and AT+CIPSEND before the request goes out
+	double link_ms = 1000;                  // MainBoard's WIFI_LINK_MS, wait for connect and for the reply
+	double ttl = 120;                       // MainBoard's STATUS_TTL_S
+	char intake = 0;                        // 'a' or 's': boards built with INTAKE
+	double probe_ms = 10;                   // lock probe period, 0 = off
+	unsigned seed = 1;
+};
+
+Options opt;
+
+double since(Clock::time_point t)
+{
+	return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+/******************************************************************* Results ********************************************************************/
+
+/* One per step; the boards add to the current one */
+struct Step {
+	int boards = 0;
+	unsigned offered = 0;                   // scans made
+	unsigned answered = 0;                  // 200 or 409
+	unsigned conflicts = 0;                 // 409
+	unsigned server_errors = 0;             // 5xx, "database is locked" shows up as 500
+	unsigned other = 0;                     // 4xx, an rfid not in the database
+	unsigned failed = 0;                    // no connection or no reply within link_ms
+	unsigned dropped = 0;                   // upload queue full
+	std::vector<double> latency;            // s, scan to reply
+	std::vector<double> service;            // s, request out to close
+	unsigned probes = 0;
+	unsigned locked = 0;
+};
+
+std::mutex results_lock;
+std::vector<Step> steps;
+std::atomic<bool> stopping(false);
+
+Step &current()
+{
+	return steps.back();
+}
+
+/******************************************************************* HTTP ********************************************************************/
+
+addrinfo *server_addr;
+
+/* GETs path the way the ESP8266 does, returns the HTTP status (0 when
+   there was no answer within link_ms) and the body. *seconds is the time
+   from the request going out to the connection closing. */
+int upload(const std::string &path, std::string *body, double *seconds)
+{
+	std::string request = "GET " + path + " HTTP/1.0\r\n\r\n";
+
+	int fd = socket(server_addr->ai_family, server_addr->ai_socktype | SOCK_NONBLOCK, server_addr->ai_protocol);
+	if (fd < 0) return 0;
+
+	auto start = Clock::now();
+	auto left = [&]() { return std::max(0, (int)(opt.link_ms - since(start) * 1000)); };
+	std::string response;
+
+	bool connected = connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == 0;
+	if (!connected && errno == EINPROGRESS) {
+		pollfd p = { fd, POLLOUT, 0 };
+		int err = 0;
+		socklen_t len = sizeof err;
+		connected = poll(&p, 1, left()) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+	}
+
+	/* CIPSTART answered, now AT+CIPSEND and its prompt */
+	if (connected && opt.at_ms > 0) std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(opt.at_ms));
+	start = Clock::now();
+
+	if (connected && write(fd, request.data(), request.size()) == (ssize_t)request.size()) {
+		while (true) {
+			pollfd p = { fd, POLLIN, 0 };
+			if (poll(&p, 1, left()) != 1) {
+				response.clear();           // timed out, MainBoard counts it as failed
+				break;
+			}
+			char buf[1024];
+			ssize_t n = read(fd, buf, sizeof buf);
+			if (n <= 0) break;              // CLOSED
+			response.append(buf, n);
+		}
+	}
+	close(fd);
+	if (seconds) *seconds = since(start);
+
+	int code = 0;
+	if (response.compare(0, 7, "HTTP/1.") == 0 && response.size() >= 12) code = std::atoi(response.c_str() + 9);
+	size_t b = response.find("\r\n\r\n");
+	if (body) *body = (b == std::string::npos) ? "" : response.substr(b + 4);
+	return code;
+}
+
+/******************************************************************* Boards ********************************************************************/
+
+/* MainBoard's status cache entry */
+struct Status {
+	char status = 0;
+	unsigned version = NO_VERSION;
+	Clock::time_point checked;
+};
+
+void board(int id)
+{
+	std::mt19937_64 rng(opt.seed * 1000003ULL + id);
+	auto uniform = [&]() { return std::uniform_real_distribution<double>(0, 1)(rng); };
+	auto exponential = [&](double mean) { return std::exponential_distribution<double>(1 / mean)(rng); };
+
+	std::map<std::string, Status> cache;
+	std::deque<std::pair<std::string, Clock::time_point>> queue;
+
+	/* warm-up upload, not counted */
+	upload("/add/----------/b", NULL, NULL);
+
+	auto next_scan = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(exponential(opt.gap)));
+	int burst_left = 0;
+
+	while (!stopping) {
+		/* scans due by now go into the upload queue */
+		auto now = Clock::now();
+		while (next_scan <= now) {
+			const std::string &tag = opt.tags[rng() % opt.tags.size()];
+			{
+				std::lock_guard<std::mutex> g(results_lock);
+				current().offered++;
+				if (queue.size() >= UPLOAD_QUEUE) current().dropped++;
+			}
+			if (queue.size() < UPLOAD_QUEUE) queue.emplace_back(tag, next_scan);
+
+			if (burst_left == 0) {          // geometric, mean opt.burst
+				burst_left = 1;
+				while (uniform() > 1 / opt.burst) burst_left++;
+			}
+			double wait = (--burst_left > 0) ? opt.spacing * (0.5 + uniform()) : exponential(opt.gap);
+			next_scan += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(wait));
+		}
+
+		if (queue.empty()) {
+			std::this_thread::sleep_until(std::min(next_scan, now + std::chrono::milliseconds(100)));
+			continue;
+		}
+
+		std::string tag = queue.front().first;
+		auto scanned = queue.front().second;
+		queue.pop_front();
+
+		/* scan_task: opposite of a fresh status with its version, else toggle */
+		Status &e = cache[tag];
+		char action = 't';
+		unsigned version = e.version;
+		if (opt.intake) {
+			action = opt.intake;
+			version = NO_VERSION;
+		} else if (e.status != 0 && e.version != NO_VERSION && since(e.checked) < opt.ttl) {
+			action = (e.status == 'a') ? 's' : 'a';
+		}
+
+		std::string path = "/add/" + tag.substr(0, 10) + "/" + action;
+		if (version != NO_VERSION) path += "/" + std::to_string(version);
+
+		std::string body;
+		double service;
+		int code = upload(path, &body, &service);
+
+		/* upload_done */
+		if ((code == 200 || code == 409) && body.size() >= 3 && (body[0] == 'a' || body[0] == 's') && body[1] == ' ') {
+			e.status = body[0];
+			e.version = std::strtoul(body.c_str() + 2, NULL, 10);
+			e.checked = Clock::now();
+		}
+		if (code == 404) cache.erase(tag);
+
+		std::lock_guard<std::mutex> g(results_lock);
+		Step &s = current();
+		if (code == 200 || code == 409) {
+			s.answered++;
+			s.latency.push_back(since(scanned));
+			s.service.push_back(service);
+			if (code == 409) s.conflicts++;
+		} else if (code >= 500) {
+			s.server_errors++;
+		} else if (code != 0) {
+			s.other++;
+		} else {
+			s.failed++;
+		}
+	}
+}
+
+/******************************************************************* Database ********************************************************************/
+
+/* The tags in the dogs table as /add takes them. rfid is an INTEGER column:
+   a tag of only digits is stored as a number and still found by its text,
+   but one like 12E4567890 was read as an exponent and stored as a REAL, or
+   an INTEGER longer than a tag, and can't be sent back. Those are left out
+   so that their 404s don't count against the server. */
+std::vector<std::string> database_tags(const std::string &file)
+{
+	std::vector<std::string> tags;
+	sqlite3 *db;
+	if (sqlite3_open_v2(file.c_str(), &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		std::fprintf(stderr, "fleetload: %s: %s\n", file.c_str(), sqlite3_errmsg(db));
+		std::exit(2);
+	}
+	sqlite3_stmt *s;
+	const char *sql = "SELECT DISTINCT CAST(rfid AS TEXT) FROM dogs"
+		" WHERE typeof(rfid) != 'real' AND length(CAST(rfid AS TEXT)) <= 10";
+	if (sqlite3_prepare_v2(db, sql, -1, &s, NULL) == SQLITE_OK) {
+		while (sqlite3_step(s) == SQLITE_ROW) tags.push_back((const char *)sqlite3_column_text(s, 0));
+		sqlite3_finalize(s);
+	}
+	sqlite3_close(db);
+	return tags;
+}
+
+/* Tries to take the write lock without waiting, every probe_ms. The share
+   of tries that find it taken is how much of the time some request was
+   writing. The probe holds the lock for a moment itself when it gets it. */
+void lock_probe()
+{
+	sqlite3 *db;
+	if (sqlite3_open_v2(opt.db.c_str(), &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) return;
+	sqlite3_busy_timeout(db, 0);
+
+	while (!stopping) {
+		bool busy = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK;
+		if (!busy) sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		{
+			std::lock_guard<std::mutex> g(results_lock);
+			current().probes++;
+			if (busy) current().locked++;
+		}
+		std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(opt.probe_ms));
+	}
+	sqlite3_close(db);
+}
+
+/******************************************************************* Report ********************************************************************/
+
+double percentile(std::vector<double> v, double p)
+{
+	if (v.empty()) return 0;
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, (size_t)(p / 100 * v.size()))];
+}
+
+void print_header()
+{
+	std::printf("%6s %9s %9s %8s %8s %8s %8s %8s %6s %6s %6s %6s %7s\n", "boards", "offered/s", "answer/s",
+		"p50_ms", "p95_ms", "p99_ms", "max_ms", "srv_p99", "409", "5xx", "fail", "drop", "locked");
+}
+
+void print_step(const Step &s)
+{
+	char locked[16] = "-";
+	if (s.probes) std::snprintf(locked, sizeof locked, "%.1f%%", 100.0 * s.locked / s.probes);
+	std::printf("%6d %9.2f %9.2f %8.0f %8.0f %8.0f %8.0f %8.0f %6u %6u %6u %6u %7s\n", s.boards,
+		s.offered / opt.step, s.answered / opt.step,
+		percentile(s.latency, 50) * 1000, percentile(s.latency, 95) * 1000, percentile(s.latency, 99) * 1000,
+		percentile(s.latency, 100) * 1000, percentile(s.service, 99) * 1000,
+		s.conflicts, s.server_errors, s.failed, s.dropped, locked);
+	if (s.other) std::printf("       %u answers other than 200, 409 or 5xx (rfid not in the database?)\n", s.other);
+	std::fflush(stdout);
+}
+
+/******************************************************************* Main ********************************************************************/
+
+[[noreturn]] void usage()
+{
+	std::fprintf(stderr,
+		"usage: fleetload [options]\n"
+		"  --server HOST:PORT   web server (127.0.0.1:80)\n"
+		"  --db FILE            take the tags from its dogs table and watch its write lock\n"
+		"  --tags A,B,...       tags to scan, instead of --db\n"
+		"  --fleet 1,2,4,...    boards in each step (1,2,4,8,16,32,64)\n"
+		"  --step S             seconds per step (30)\n"
+		"  --gap S              mean think time between bursts, per board (20)\n"
+		"  --burst N            mean scans per burst (3)\n"
+		"  --spacing S          seconds between scans in a burst (3)\n"
+		"  --at-ms MS           AT command time before each request (60)\n"
+		"  --link-ms MS         connect and reply timeout, MainBoard's link_ms (1000)\n"
+		"  --ttl S              status cache lifetime, MainBoard's ttl (120)\n"
+		"  --intake a|s         boards built as intake stations\n"
+		"  --probe-ms MS        lock probe period, 0 = off (10)\n"
+		"  --seed N\n");
+	std::exit(2);
+}
+
+std::vector<std::string> split(const std::string &v)
+{
+	std::vector<std::string> out;
+	size_t p = 0;
+	while (p <= v.size()) {
+		size_t q = v.find(',', p);
+		if (q == std::string::npos) q = v.size();
+		if (q > p) out.push_back(v.substr(p, q - p));
+		p = q + 1;
+	}
+	return out;
+}
+
+void parse(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++) {
+		std::string a = argv[i];
+		if (i + 1 >= argc) usage();
+		std::string v = argv[++i];
+
+		if (a == "--server") opt.server = v;
+		else if (a == "--db") opt.db = v;
+		else if (a == "--tags") opt.tags = split(v);
+		else if (a == "--fleet") {
+			opt.fleet.clear();
+			for (const std::string &n : split(v)) opt.fleet.push_back(std::atoi(n.c_str()));
+		}
+		else if (a == "--step") opt.step = std::atof(v.c_str());
+		else if (a == "--gap") opt.gap = std::atof(v.c_str());
+		else if (a == "--burst") opt.burst = std::max(1.0, std::atof(v.c_str()));
+		else if (a == "--spacing") opt.spacing = std::atof(v.c_str());
+		else if (a == "--at-ms") opt.at_ms = std::atof(v.c_str());
+		else if (a == "--link-ms") opt.link_ms = std::atof(v.c_str());
+		else if (a == "--ttl") opt.ttl = std::atof(v.c_str());
+		else if (a == "--intake") opt.intake = v[0];
+		else if (a == "--probe-ms") opt.probe_ms = std::atof(v.c_str());
+		else if (a == "--seed") opt.seed = std::atoi(v.c_str());
+		else usage();
+	}
+
+	if (opt.intake && opt.intake != 'a' && opt.intake != 's') usage();
+	if (!opt.db.empty() && opt.tags.empty()) opt.tags = database_tags(opt.db);
+	if (opt.tags.empty()) {
+		std::fprintf(stderr, "fleetload: no tags, give --db or --tags\n");
+		std::exit(2);
+	}
+	if (opt.fleet.empty() || !std::is_sorted(opt.fleet.begin(), opt.fleet.end())) usage();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	parse(argc, argv);
+
+	std::string host = opt.server, port = "80";
+	size_t colon = host.rfind(':');
+	if (colon != std::string::npos) {
+		port = host.substr(colon + 1);
+		host = host.substr(0, colon);
+	}
+	addrinfo hints = {};
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &server_addr) != 0) {
+		std::fprintf(stderr, "fleetload: can't resolve %s\n", host.c_str());
+		return 2;
+	}
+
+	std::printf("%zu tags, %.1f scans/min offered per board\n", opt.tags.size(),
+		60 * opt.burst / (opt.gap + (opt.burst - 1) * opt.spacing));
+	print_header();
+
+	std::vector<std::thread> boards;
+	std::thread probe;
+	steps.emplace_back();
+
+	for (size_t i = 0; i < opt.fleet.size(); i++) {
+		{
+			std::lock_guard<std::mutex> g(results_lock);
+			if (i > 0) steps.emplace_back();
+			current().boards = opt.fleet[i];
+		}
+		while ((int)boards.size() < opt.fleet[i]) boards.emplace_back(board, (int)boards.size());
+		if (!opt.db.empty() && opt.probe_ms > 0 && !probe.joinable()) probe = std::thread(lock_probe);
+
+		std::this_thread::sleep_for(std::chrono::duration<double>(opt.step));
+
+		std::lock_guard<std::mutex> g(results_lock);
+		print_step(current());
+	}
+
+	stopping = true;
+	for (std::thread &t : boards) t.join();
+	if (probe.joinable()) probe.join();
+	freeaddrinfo(server_addr);
+	return 0;
+}
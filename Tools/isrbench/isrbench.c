@@ -0,0 +1,649 @@
+/*
+ * ISR cycle and latency benchmark for the firmware images, run in simavr.
+ *
+ *   isrbench [-v] firmware.elf scenario.stim
+ *
+ * The scenario file feeds scripted UART bytes, reader frames, pin levels
+ * and ADC voltages into the simulated chip and sets the budgets. For every
+ * interrupt vector the run records how often it ran, its cycles from entry
+ * to reti (nested interrupts included) and the latency from the flag being
+ * raised to the handler starting. With a loop symbol it also records the
+ * interval between calls of that function, the main loop jitter, or with a
+ * vector name the interval between entries of that handler.
+ *
+ * Exits 1 if a budget is exceeded, 2 on a usage or scenario error.
+ */
+
+#include <ctype.h>
+#include <elf.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_interrupts.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_adc.h>
+
+#include "../../Common/frame.h"
+
+#define MAX_VECTORS     64
+#define MAX_BUDGETS     32
+
+/******************************************************************* Vectors ********************************************************************/
+
+/* ATmega644PA, same numbering as Simulator/hal/hal.h */
+static const char *vector_names[] = {
+	"RESET", "INT0_vect", "INT1_vect", "INT2_vect",
+	"PCINT0_vect", "PCINT1_vect", "PCINT2_vect", "PCINT3_vect",
+	"WDT_vect",
+	"TIMER2_COMPA_vect", "TIMER2_COMPB_vect", "TIMER2_OVF_vect",
+	"TIMER1_CAPT_vect", "TIMER1_COMPA_vect", "TIMER1_COMPB_vect", "TIMER1_OVF_vect",
+	"TIMER0_COMPA_vect", "TIMER0_COMPB_vect", "TIMER0_OVF_vect",
+	"SPI_STC_vect",
+	"USART0_RX_vect", "USART0_UDRE_vect", "USART0_TX_vect",
+	"ANALOG_COMP_vect", "ADC_vect", "EE_READY_vect", "TWI_vect", "SPM_READY_vect",
+	"USART1_RX_vect", "USART1_UDRE_vect", "USART1_TX_vect",
+};
+
+#define NAMED_VECTORS (sizeof vector_names / sizeof vector_names[0])
+
+static int vector_number(const char *name)
+{
+	for (unsigned i = 1; i < NAMED_VECTORS; i++) {
+		if (strcmp(name, vector_names[i]) == 0) return i;
+	}
+	return -1;
+}
+
+struct vector_stats {
+	avr_cycle_count_t raised;               // pending since, 0 = not pending
+	avr_cycle_count_t entered;
+	unsigned long count;
+	avr_cycle_count_t min, max, total;
+	avr_cycle_count_t max_latency;
+};
+
+static struct vector_stats stats[MAX_VECTORS];
+static avr_t *avr;
+
+static void on_pending(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	struct vector_stats *s = param;
+	(void)irq;
+	if (value && !s->raised) s->raised = avr->cycle;
+	if (!value) s->raised = 0;
+}
+
+static void on_running(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	struct vector_stats *s = param;
+	(void)irq;
+
+	if (value) {
+		s->entered = avr->cycle;
+		if (s->raised) {
+			avr_cycle_count_t latency = avr->cycle - s->raised;
+			if (latency > s->max_latency) s->max_latency = latency;
+			s->raised = 0;
+		}
+		return;
+	}
+
+	if (!s->entered) return;
+	avr_cycle_count_t cycles = avr->cycle - s->entered;
+	s->entered = 0;
+	if (!s->count || cycles < s->min) s->min = cycles;
+	if (cycles > s->max) s->max = cycles;
+	s->total += cycles;
+	s->count++;
+}
+
+/******************************************************************* Scenario ********************************************************************/
+
+enum stim_kind { STIM_UART, STIM_PIN, STIM_ADC };
+
+struct stim {
+	avr_cycle_count_t at;
+	uint8_t kind;
+	uint8_t unit;                           // USART number, port letter or ADC channel
+	uint8_t pin;
+	uint32_t value;                         // byte, level or millivolts
+};
+
+enum budget_kind { BUDGET_CYCLES, BUDGET_LATENCY, BUDGET_BAUD, BUDGET_JITTER };
+
+struct budget {
+	uint8_t kind;
+	int vector;
+	unsigned long limit;
+	int line;
+};
+
+static struct {
+	char mcu[32];
+	uint32_t freq;
+	double seconds;
+	char loop[64];
+	double loop_from, loop_to;              // window for the jitter measurement
+	struct stim *stims;
+	size_t count, size;
+	struct budget budgets[MAX_BUDGETS];
+	unsigned nbudgets;
+} scn = { .mcu = "atmega644p", .freq = 8000000UL, .seconds = 1.0, .loop_to = 1e9 };
+
+static const char *scn_file;
+static int scn_line;
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "%s:%d: ", scn_file, scn_line);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+	exit(2);
+}
+
+static void add(double seconds, uint8_t kind, uint8_t unit, uint8_t pin, uint32_t value)
+{
+	if (scn.count == scn.size) {
+		scn.size = scn.size ? scn.size * 2 : 256;
+		scn.stims = realloc(scn.stims, scn.size * sizeof *scn.stims);
+		if (!scn.stims) fail("out of memory");
+	}
+	scn.stims[scn.count++] = (struct stim){ (avr_cycle_count_t)(seconds * scn.freq + 0.5), kind, unit, pin, value };
+}
+
+/* "250us", "20ms", "1.5s" */
+static double parse_time(const char *s)
+{
+	char *end;
+	double v = strtod(s, &end);
+	if (end == s) fail("bad time '%s'", s);
+	if (strcmp(end, "us") == 0) return v / 1e6;
+	if (strcmp(end, "ms") == 0) return v / 1e3;
+	if (strcmp(end, "s") == 0) return v;
+	fail("time '%s' needs a unit (us, ms, s)", s);
+	return 0;
+}
+
+static unsigned long parse_number(const char *s)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 0);
+	if (end == s || *end) fail("bad number '%s'", s);
+	return v;
+}
+
+/* Splits a line into words; "quoted text" keeps spaces and takes \r \n \t \\ \" \xNN */
+static int split(char *line, char *words[], int max)
+{
+	int n = 0;
+	char *p = line;
+
+	while (*p && n < max) {
+		while (isspace((unsigned char)*p)) p++;
+		if (!*p || *p == '#') break;
+
+		if (*p == '"') {
+			char *out = ++p;
+			words[n++] = out - 1;               // keep the quote as a marker
+			*(out - 1) = '"';
+			char *w = out;
+			while (*p && *p != '"') {
+				if (*p == '\\' && p[1]) {
+					p++;
+					switch (*p) {
+						case 'r': *w++ = '\r'; break;
+						case 'n': *w++ = '\n'; break;
+						case 't': *w++ = '\t'; break;
+						case 'x': *w++ = (char)strtoul((char[3]){ p[1], p[2], 0 }, NULL, 16); p += 2; break;
+						default: *w++ = *p; break;
+					}
+					p++;
+				} else {
+					*w++ = *p++;
+				}
+			}
+			if (*p != '"') fail("unterminated string");
+			p++;
+			*w = 0;
+			continue;
+		}
+
+		words[n++] = p;
+		while (*p && !isspace((unsigned char)*p)) p++;
+		if (*p) *p++ = 0;
+	}
+	return n;
+}
+
+/* Common tail of a stimulus line: at T [every P repeat N] */
+struct when {
+	double at, every;
+	unsigned long repeat;
+};
+
+static int parse_when(char *w[], int n, int i, struct when *when)
+{
+	when->at = 0;
+	when->every = 0;
+	when->repeat = 1;
+	while (i + 1 < n) {
+		if (strcmp(w[i], "at") == 0) when->at = parse_time(w[i + 1]);
+		else if (strcmp(w[i], "every") == 0) when->every = parse_time(w[i + 1]);
+		else if (strcmp(w[i], "repeat") == 0) when->repeat = parse_number(w[i + 1]);
+		else break;
+		i += 2;
+	}
+	return i;
+}
+
+static void need_every(const struct when *when)
+{
+	if (when->repeat > 1 && when->every <= 0) fail("repeat needs every");
+}
+
+/* Bytes at full line rate, 10 bit times each */
+static void add_bytes(const struct when *when, unsigned uart, unsigned long baud, const uint8_t *data, size_t len)
+{
+	double byte = 10.0 / baud;
+	need_every(when);
+	for (unsigned long r = 0; r < when->repeat; r++) {
+		for (size_t i = 0; i < len; i++) {
+			add(when->at + r * when->every + (i + 1) * byte, STIM_UART, uart, 0, data[i]);
+		}
+	}
+}
+
+/* uart N BAUD <when> "text" | hex XX XX ... */
+static void parse_uart(char *w[], int n)
+{
+	if (n < 4) fail("uart N BAUD [at T] [every P repeat N] \"text\" | hex ...");
+	unsigned uart = parse_number(w[1]);
+	unsigned long baud = parse_number(w[2]);
+	struct when when;
+	int i = parse_when(w, n, 3, &when);
+
+	uint8_t data[512];
+	size_t len = 0;
+	if (i < n && w[i][0] == '"') {
+		len = strlen(w[i] + 1);
+		if (len > sizeof data) fail("string too long");
+		memcpy(data, w[i] + 1, len);
+	} else if (i < n && strcmp(w[i], "hex") == 0) {
+		for (i++; i < n && len < sizeof data; i++) {
+			char *end;
+			unsigned long v = strtoul(w[i], &end, 16);
+			if (end == w[i] || *end || v > 0xFF) fail("bad hex byte '%s'", w[i]);
+			data[len++] = v;
+		}
+	} else {
+		fail("uart needs \"text\" or hex bytes");
+	}
+	add_bytes(&when, uart, baud, data, len);
+}
+
+/* frame N BAUD <when> addr A seq S tag XXXXXXXXXX: a scan frame as a reader sends it */
+static void parse_frame(char *w[], int n)
+{
+	if (n < 4) fail("frame N BAUD [at T] [every P repeat N] addr A seq S tag ID");
+	unsigned uart = parse_number(w[1]);
+	unsigned long baud = parse_number(w[2]);
+	struct when when;
+	int i = parse_when(w, n, 3, &when);
+
+	unsigned addr = 1, seq = 0;
+	uint8_t tag[TAG_BYTES] = { 0 };
+	for (; i + 1 < n; i += 2) {
+		if (strcmp(w[i], "addr") == 0) addr = parse_number(w[i + 1]);
+		else if (strcmp(w[i], "seq") == 0) seq = parse_number(w[i + 1]);
+		else if (strcmp(w[i], "tag") == 0) {
+			if (strlen(w[i + 1]) != 10 || !tag_from_hex(w[i + 1], tag)) fail("tag needs 10 hex digits");
+		} else fail("unknown frame field '%s'", w[i]);
+	}
+
+	// Every repeat is a new scan, so the sequence number moves on
+	need_every(&when);
+	struct when once = when;
+	once.repeat = 1;
+	for (unsigned long r = 0; r < when.repeat; r++) {
+		uint8_t frame[FRAME_MAX_SIZE];
+		uint8_t len = frame_encode(frame, addr, FRAME_SCAN, (seq + r) & 0xFF, tag, TAG_BYTES);
+		once.at = when.at + r * when.every;
+		add_bytes(&once, uart, baud, frame, len);
+	}
+}
+
+/* pin D2 <when> level 0|1 | bits 0110... period P */
+static void parse_pin(char *w[], int n)
+{
+	if (n < 3 || strlen(w[1]) != 2 || !isalpha((unsigned char)w[1][0]) || !isdigit((unsigned char)w[1][1])) {
+		fail("pin Xn [at T] [every P repeat N] level L | bits B period P");
+	}
+	uint8_t port = toupper((unsigned char)w[1][0]), pin = w[1][1] - '0';
+	struct when when;
+	int i = parse_when(w, n, 2, &when);
+
+	if (i + 1 < n && strcmp(w[i], "level") == 0) {
+		need_every(&when);
+		for (unsigned long r = 0; r < when.repeat; r++) {
+			add(when.at + r * when.every, STIM_PIN, port, pin, parse_number(w[i + 1]) != 0);
+		}
+	} else if (i + 3 < n && strcmp(w[i], "bits") == 0 && strcmp(w[i + 2], "period") == 0) {
+		const char *bits = w[i + 1];
+		double period = parse_time(w[i + 3]);
+		size_t len = strlen(bits);
+		double every = when.every > 0 ? when.every : len * period;
+		for (unsigned long r = 0; r < when.repeat; r++) {
+			for (size_t b = 0; b < len; b++) {
+				if (bits[b] != '0' && bits[b] != '1') fail("bits are 0 or 1");
+				add(when.at + r * every + b * period, STIM_PIN, port, pin, bits[b] == '1');
+			}
+		}
+	} else {
+		fail("pin needs level or bits ... period");
+	}
+}
+
+/* adc CH <when> mv V */
+static void parse_adc(char *w[], int n)
+{
+	if (n < 4) fail("adc CH [at T] [every P repeat N] mv V");
+	unsigned ch = parse_number(w[1]);
+	struct when when;
+	int i = parse_when(w, n, 2, &when);
+	if (i + 1 >= n || strcmp(w[i], "mv") != 0) fail("adc needs mv V");
+	need_every(&when);
+	for (unsigned long r = 0; r < when.repeat; r++) {
+		add(when.at + r * when.every, STIM_ADC, ch, 0, parse_number(w[i + 1]));
+	}
+}
+
+/* budget cycles|latency|baud VECTOR N, budget jitter N */
+static void parse_budget(char *w[], int n)
+{
+	if (scn.nbudgets == MAX_BUDGETS) fail("too many budgets");
+	struct budget *b = &scn.budgets[scn.nbudgets];
+	b->line = scn_line;
+
+	if (n == 3 && strcmp(w[1], "jitter") == 0) {
+		b->kind = BUDGET_JITTER;
+		b->vector = -1;
+		b->limit = parse_number(w[2]);
+	} else if (n == 4) {
+		if (strcmp(w[1], "cycles") == 0) b->kind = BUDGET_CYCLES;
+		else if (strcmp(w[1], "latency") == 0) b->kind = BUDGET_LATENCY;
+		else if (strcmp(w[1], "baud") == 0) b->kind = BUDGET_BAUD;
+		else fail("unknown budget '%s'", w[1]);
+		b->vector = vector_number(w[2]);
+		if (b->vector < 0) fail("unknown vector '%s'", w[2]);
+		b->limit = parse_number(w[3]);
+	} else {
+		fail("budget cycles|latency|baud VECTOR N or budget jitter N");
+	}
+	scn.nbudgets++;
+}
+
+/* loop SYMBOL|VECTOR [from T] [to T] */
+static void parse_loop(char *w[], int n)
+{
+	if (n < 2 || n % 2) fail("loop SYMBOL|VECTOR [from T] [to T]");
+	snprintf(scn.loop, sizeof scn.loop, "%s", w[1]);
+	for (int i = 2; i < n; i += 2) {
+		if (strcmp(w[i], "from") == 0) scn.loop_from = parse_time(w[i + 1]);
+		else if (strcmp(w[i], "to") == 0) scn.loop_to = parse_time(w[i + 1]);
+		else fail("unknown loop field '%s'", w[i]);
+	}
+}
+
+static int by_time(const void *a, const void *b)
+{
+	const struct stim *x = a, *y = b;
+	return (x->at > y->at) - (x->at < y->at);
+}
+
+static void load_scenario(const char *file)
+{
+	FILE *f = fopen(file, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		exit(2);
+	}
+	scn_file = file;
+
+	char line[1024];
+	while (fgets(line, sizeof line, f)) {
+		scn_line++;
+		char *w[300];
+		int n = split(line, w, 300);
+		if (!n) continue;
+
+		if (strcmp(w[0], "mcu") == 0 && n == 2) snprintf(scn.mcu, sizeof scn.mcu, "%s", w[1]);
+		else if (strcmp(w[0], "freq") == 0 && n == 2) scn.freq = parse_number(w[1]);
+		else if (strcmp(w[0], "time") == 0 && n == 2) scn.seconds = parse_time(w[1]);
+		else if (strcmp(w[0], "loop") == 0) parse_loop(w, n);
+		else if (strcmp(w[0], "uart") == 0) parse_uart(w, n);
+		else if (strcmp(w[0], "frame") == 0) parse_frame(w, n);
+		else if (strcmp(w[0], "pin") == 0) parse_pin(w, n);
+		else if (strcmp(w[0], "adc") == 0) parse_adc(w, n);
+		else if (strcmp(w[0], "budget") == 0) parse_budget(w, n);
+		else fail("unknown command '%s'", w[0]);
+	}
+	fclose(f);
+	qsort(scn.stims, scn.count, sizeof *scn.stims, by_time);
+}
+
+/******************************************************************* ELF symbols ********************************************************************/
+
+/* Flash address of a function, simavr's pc is a byte address as well */
+static long symbol_address(const char *file, const char *name)
+{
+	FILE *f = fopen(file, "rb");
+	if (!f) return -1;
+
+	long found = -1;
+	Elf32_Ehdr eh;
+	if (fread(&eh, sizeof eh, 1, f) == 1 && memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0 &&
+	    eh.e_ident[EI_CLASS] == ELFCLASS32 && eh.e_shentsize == sizeof(Elf32_Shdr)) {
+		Elf32_Shdr *sh = calloc(eh.e_shnum, sizeof *sh);
+		fseek(f, eh.e_shoff, SEEK_SET);
+		if (sh && fread(sh, sizeof *sh, eh.e_shnum, f) == eh.e_shnum) {
+			for (unsigned i = 0; i < eh.e_shnum && found < 0; i++) {
+				if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh.e_shnum) continue;
+				Elf32_Shdr *st = &sh[sh[i].sh_link];
+				char *strs = malloc(st->sh_size);
+				Elf32_Sym *syms = malloc(sh[i].sh_size);
+				fseek(f, st->sh_offset, SEEK_SET);
+				size_t ok = fread(strs, 1, st->sh_size, f) == st->sh_size;
+				fseek(f, sh[i].sh_offset, SEEK_SET);
+				ok = ok && fread(syms, 1, sh[i].sh_size, f) == sh[i].sh_size;
+				for (size_t k = 0; ok && k < sh[i].sh_size / sizeof *syms; k++) {
+					if (ELF32_ST_TYPE(syms[k].st_info) == STT_FUNC && syms[k].st_name < st->sh_size &&
+					    strcmp(strs + syms[k].st_name, name) == 0) {
+						found = syms[k].st_value;
+						break;
+					}
+				}
+				free(strs);
+				free(syms);
+			}
+		}
+		free(sh);
+	}
+	fclose(f);
+	return found;
+}
+
+/******************************************************************* Run ********************************************************************/
+
+static size_t next_stim;
+
+static avr_cycle_count_t feed(avr_t *a, avr_cycle_count_t when, void *param)
+{
+	(void)when;
+	(void)param;
+
+	while (next_stim < scn.count && scn.stims[next_stim].at <= a->cycle) {
+		struct stim *s = &scn.stims[next_stim++];
+		avr_irq_t *irq = NULL;
+		switch (s->kind) {
+			case STIM_UART: irq = avr_io_getirq(a, AVR_IOCTL_UART_GETIRQ('0' + s->unit), UART_IRQ_INPUT); break;
+			case STIM_PIN:  irq = avr_io_getirq(a, AVR_IOCTL_IOPORT_GETIRQ(s->unit), s->pin); break;
+			case STIM_ADC:  irq = avr_io_getirq(a, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0 + s->unit); break;
+		}
+		if (irq) avr_raise_irq(irq, s->value);
+	}
+	return next_stim < scn.count ? scn.stims[next_stim].at : 0;
+}
+
+static void quiet_uart(char n)
+{
+	uint32_t flags = 0;
+	if (avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS(n), &flags) == 0) {
+		flags &= ~AVR_UART_FLAG_STDIO;
+		avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS(n), &flags);
+	}
+}
+
+static const char *name_of(int v)
+{
+	static char buf[16];
+	if (v > 0 && v < (int)NAMED_VECTORS) return vector_names[v];
+	snprintf(buf, sizeof buf, "vector %d", v);
+	return buf;
+}
+
+/* Highest baud at which the handler keeps up with back to back bytes */
+static unsigned long max_baud(const struct vector_stats *s)
+{
+	avr_cycle_count_t per_byte = s->max + s->max_latency;
+	return per_byte ? (unsigned long)((uint64_t)scn.freq * 10 / per_byte) : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int verbose = 0;
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		verbose = 1;
+		argv++;
+		argc--;
+	}
+	if (argc != 3) {
+		fprintf(stderr, "usage: isrbench [-v] firmware.elf scenario.stim\n");
+		return 2;
+	}
+	load_scenario(argv[2]);
+
+	elf_firmware_t fw;
+	memset(&fw, 0, sizeof fw);
+	if (elf_read_firmware(argv[1], &fw) != 0) {
+		fprintf(stderr, "%s: can't load firmware\n", argv[1]);
+		return 2;
+	}
+	avr = avr_make_mcu_by_name(scn.mcu);
+	if (!avr) {
+		fprintf(stderr, "simavr has no core '%s' (try mcu atmega644 in the scenario)\n", scn.mcu);
+		return 2;
+	}
+	avr_init(avr);
+	fw.frequency = scn.freq;
+	avr_load_firmware(avr, &fw);
+	avr->avcc = avr->aref = 5000;
+	avr->log = verbose ? LOG_WARNING : LOG_ERROR;
+	quiet_uart('0');
+	quiet_uart('1');
+
+	for (int v = 1; v < MAX_VECTORS; v++) {
+		avr_irq_t *irq = avr_get_interrupt_irq(avr, v);
+		if (!irq) continue;
+		avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING, on_pending, &stats[v]);
+		avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, on_running, &stats[v]);
+	}
+
+	long loop = -1;
+	if (scn.loop[0]) {
+		char handler[16];                   // avr-gcc names an ISR __vector_N
+		int v = vector_number(scn.loop);
+		snprintf(handler, sizeof handler, "__vector_%d", v);
+		loop = symbol_address(argv[1], v > 0 ? handler : scn.loop);
+		if (loop < 0) {
+			fprintf(stderr, "%s: no function '%s'\n", argv[1], scn.loop);
+			return 2;
+		}
+	}
+
+	if (scn.count) avr_cycle_timer_register(avr, scn.stims[0].at + 1, feed, NULL);
+
+	avr_cycle_count_t end = (avr_cycle_count_t)(scn.seconds * scn.freq);
+	avr_cycle_count_t loop_from = (avr_cycle_count_t)(scn.loop_from * scn.freq);
+	avr_cycle_count_t loop_to = (avr_cycle_count_t)(scn.loop_to * scn.freq);
+	avr_cycle_count_t last_pass = 0, min_pass = 0, max_pass = 0;
+	unsigned long passes = 0;
+	int state = cpu_Running;
+
+	while (avr->cycle < end) {
+		state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed) break;
+		if (loop >= 0 && avr->pc == (avr_flashaddr_t)loop && avr->cycle >= loop_from && avr->cycle <= loop_to) {
+			if (last_pass) {
+				avr_cycle_count_t d = avr->cycle - last_pass;
+				if (!passes || d < min_pass) min_pass = d;
+				if (d > max_pass) max_pass = d;
+				passes++;
+			}
+			last_pass = avr->cycle;
+		}
+	}
+	if (state == cpu_Crashed) {
+		fprintf(stderr, "%s crashed at pc 0x%04x after %llu cycles\n", argv[1], (unsigned)avr->pc,
+		        (unsigned long long)avr->cycle);
+		return 1;
+	}
+
+	printf("%s, %s at %lu Hz, %.3f s, %zu stimulus events\n\n", argv[1], scn.mcu,
+	       (unsigned long)scn.freq, (double)avr->cycle / scn.freq, next_stim);
+	printf("%-20s %8s %7s %7s %7s %9s %9s\n", "vector", "count", "min", "avg", "max", "latency", "max baud");
+	for (int v = 1; v < MAX_VECTORS; v++) {
+		struct vector_stats *s = &stats[v];
+		if (!s->count) continue;
+		printf("%-20s %8lu %7llu %7llu %7llu %9llu %9lu\n", name_of(v), s->count,
+		       (unsigned long long)s->min, (unsigned long long)(s->total / s->count),
+		       (unsigned long long)s->max, (unsigned long long)s->max_latency, max_baud(s));
+	}
+	if (loop >= 0) {
+		printf("\nloop %s: %lu passes, interval %llu..%llu cycles, jitter %llu\n", scn.loop, passes,
+		       (unsigned long long)min_pass, (unsigned long long)max_pass,
+		       (unsigned long long)(max_pass - min_pass));
+	}
+
+	int over = 0;
+	printf("\n");
+	for (unsigned i = 0; i < scn.nbudgets; i++) {
+		struct budget *b = &scn.budgets[i];
+		struct vector_stats *s = b->vector >= 0 ? &stats[b->vector] : NULL;
+		unsigned long got = 0;
+		const char *what = "";
+		int ok;
+
+		switch (b->kind) {
+			case BUDGET_CYCLES:  got = s->max; what = "cycles"; ok = got <= b->limit; break;
+			case BUDGET_LATENCY: got = s->max_latency; what = "latency"; ok = got <= b->limit; break;
+			case BUDGET_BAUD:    got = max_baud(s); what = "baud"; ok = s->count && got >= b->limit; break;
+			default:             got = max_pass - min_pass; what = "jitter"; ok = passes && got <= b->limit; break;
+		}
+		if (s && !s->count) ok = 0;                 // a budget on a vector that never ran proves nothing
+		printf("%-4s %-8s %-20s %9lu %s %lu\n", ok ? "ok" : "FAIL", what,
+		       s ? name_of(b->vector) : scn.loop, got, b->kind == BUDGET_BAUD ? ">=" : "<=", b->limit);
+		over |= !ok;
+	}
+	return over;
+}
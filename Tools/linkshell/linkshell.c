@@ -0,0 +1,541 @@
+/*
+ * Query shell for the boards' counters and tunables, over the reader link.
+ *
+ *   linkshell [-b baud] [-a addr] /dev/ttyUSB0
+ *
+ * The PC joins the link like another reader would (an XBee on a USB
+ * adapter, or a USB serial adapter on the wired bus) and sends
+ * FRAME_COMMAND frames to one board at a time. Commands come from stdin,
+ * one per line:
+ *
+ *   board N            talk to reader N, 0 is MainBoard
+ *   list               every counter and tunable with its value
+ *   get NAME
+ *   set NAME VALUE     tunables only, the board refuses anything else
+ *   mem                RAM usage (Common/memstat.h)
+ *   prof start|stop    sampling profiler (Common/profile.h), start clears it
+ *   prof [ELF [N]]     the histogram; with the board's ELF file, the N
+ *                      functions with the most samples
+ *   help, quit
+ *
+ * Names come from the board itself (Common/telemetry.h), so the shell
+ * works with any firmware that has a telemetry table.
+ *
+ * Exits 1 if a command in a script failed, 2 on a usage or port error.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../Common/frame.h"
+
+/* Board side constants, kept in step with Common/telemetry.h,
+   Common/memstat.h and Common/profile.h (those need the AVR headers) */
+#define TELEMETRY_GET       'g'
+#define TELEMETRY_SET       's'
+#define TELEMETRY_NAME      9
+#define TELEMETRY_WRITABLE  0x01
+#define TELEMETRY_REFUSED   0x80
+#define TELEMETRY_END       0xFF
+#define MEMSTAT_CMD         'm'
+#define PROFILE_CMD         'p'
+#define PROFILE_START       '+'
+#define PROFILE_STOP        '-'
+#define PROFILE_STATE       's'
+#define PROFILE_READ_CMD    'r'
+#define PROFILE_READ        6
+
+#define REPLY_MS            300         // per try, a reply is one frame at 9600 baud plus the board's loop
+#define TRIES               3           // RFReceiver only hears commands while awake
+#define MAX_VARS            64
+#define TOP_FUNCTIONS       20
+
+struct var {
+	char name[TELEMETRY_NAME + 1];
+	unsigned flags;
+	unsigned long value;
+};
+
+static int port = -1;
+static unsigned board;
+static uint8_t seq;
+
+static struct var vars[MAX_VARS];
+static int nvars = -1;                  // -1 = not fetched from this board yet
+
+/******************************************************************* Serial port ********************************************************************/
+
+static speed_t baud_constant(long baud)
+{
+	switch (baud) {
+		case 2400: return B2400;
+		case 4800: return B4800;
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		default: return 0;
+	}
+}
+
+static int open_port(const char *path, long baud)
+{
+	speed_t speed = baud_constant(baud);
+	if (speed == 0) {
+		fprintf(stderr, "linkshell: unsupported baud rate %ld\n", baud);
+		return -1;
+	}
+
+	int fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "linkshell: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct termios t;
+	if (tcgetattr(fd, &t) != 0) {
+		fprintf(stderr, "linkshell: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	cfmakeraw(&t);                      // 8N1, like the boards' UCSRnC
+	t.c_cflag |= CLOCAL | CREAD;
+	t.c_cc[VMIN] = 0;
+	t.c_cc[VTIME] = 0;
+	cfsetispeed(&t, speed);
+	cfsetospeed(&t, speed);
+	tcsetattr(fd, TCSANOW, &t);
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/******************************************************************* Link ********************************************************************/
+
+/* Sends payload to the current board and waits for its FRAME_TELEMETRY
+   answer starting with reply[0..match-1]. Other traffic on the link (scans,
+   other readers) is skipped. Returns the answer's length, -1 if none came. */
+static int transact(const uint8_t payload[], uint8_t len, const uint8_t reply[], int match, uint8_t answer[FRAME_MAX_PAYLOAD])
+{
+	uint8_t frame[FRAME_MAX_SIZE];
+
+	for (int attempt = 0; attempt < TRIES; attempt++) {
+		uint8_t n = frame_encode(frame, board, FRAME_COMMAND, seq++, payload, len);
+		if (write(port, frame, n) != n) return -1;
+
+		struct frame_parser parser = {0};
+		long deadline = now_ms() + REPLY_MS;
+
+		for (long left; (left = deadline - now_ms()) > 0; ) {
+			struct pollfd p = { .fd = port, .events = POLLIN };
+			if (poll(&p, 1, left) <= 0) break;
+
+			uint8_t buf[64];
+			ssize_t got = read(port, buf, sizeof buf);
+			for (ssize_t i = 0; i < got; i++) {
+				if (!frame_parse(&parser, buf[i])) continue;
+				if (parser.type != FRAME_TELEMETRY || parser.addr != board) continue;
+				if (parser.len < match || memcmp(parser.payload, reply, match) != 0) continue;
+
+				memcpy(answer, parser.payload, parser.len);
+				return parser.len;
+			}
+		}
+	}
+	return -1;
+}
+
+static unsigned long be32(const uint8_t b[4])
+{
+	return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16) | ((unsigned long)b[2] << 8) | b[3];
+}
+
+/* 'g' | index | flags | value | name, see Common/telemetry.h. Returns 1 for
+   a variable, 0 past the end of the table, -1 if the board didn't answer. */
+static int parse_var(const uint8_t a[], int len, struct var *v)
+{
+	if (len >= 3 && a[2] == TELEMETRY_END) return 0;
+	if (len < 7) return -1;
+
+	int name_len = len - 7;
+	if (name_len > TELEMETRY_NAME) name_len = TELEMETRY_NAME;
+	memcpy(v->name, a + 7, name_len);
+	v->name[name_len] = 0;
+	v->flags = a[2];
+	v->value = be32(a + 3);
+	return 1;
+}
+
+static int fetch(uint8_t index, struct var *v)
+{
+	uint8_t cmd[] = {TELEMETRY_GET, index};
+	uint8_t answer[FRAME_MAX_PAYLOAD];
+	int len = transact(cmd, sizeof cmd, cmd, 2, answer);
+	return (len < 0) ? -1 : parse_var(answer, len, v);
+}
+
+/* Walks the board's table once, later commands use the cached names */
+static int load_vars(void)
+{
+	if (nvars >= 0) return 0;
+
+	for (int i = 0; i < MAX_VARS; i++) {
+		int r = fetch(i, &vars[i]);
+		if (r < 0) {
+			fprintf(stderr, "board %u: no answer\n", board);
+			return -1;
+		}
+		if (r == 0) {
+			nvars = i;
+			return 0;
+		}
+	}
+	nvars = MAX_VARS;
+	return 0;
+}
+
+static int find_var(const char *name)
+{
+	if (load_vars() != 0) return -1;
+	for (int i = 0; i < nvars; i++) {
+		if (strcmp(vars[i].name, name) == 0) return i;
+	}
+	fprintf(stderr, "board %u: no variable %s (try list)\n", board, name);
+	return -1;
+}
+
+static void print_var(const struct var *v)
+{
+	printf("%-10s %10lu%s\n", v->name, v->value, (v->flags & TELEMETRY_WRITABLE) ? "  tunable" : "");
+}
+
+/******************************************************************* Commands ********************************************************************/
+
+static int cmd_list(void)
+{
+	if (load_vars() != 0) return -1;
+
+	for (int i = 0; i < nvars; i++) {
+		if (fetch(i, &vars[i]) != 1) {
+			fprintf(stderr, "board %u: no answer\n", board);
+			return -1;
+		}
+		print_var(&vars[i]);
+	}
+	return 0;
+}
+
+static int cmd_get(const char *name)
+{
+	int i = find_var(name);
+	if (i < 0) return -1;
+	if (fetch(i, &vars[i]) != 1) {
+		fprintf(stderr, "board %u: no answer\n", board);
+		return -1;
+	}
+	print_var(&vars[i]);
+	return 0;
+}
+
+static int cmd_set(const char *name, const char *text)
+{
+	char *end;
+	unsigned long value = strtoul(text, &end, 0);
+	if (*text == 0 || *end != 0 || value > 0xFFFFFFFFUL) {
+		fprintf(stderr, "set: %s is not a number\n", text);
+		return -1;
+	}
+
+	int i = find_var(name);
+	if (i < 0) return -1;
+
+	uint8_t cmd[] = {TELEMETRY_SET, i, value >> 24, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF};
+	uint8_t reply[] = {TELEMETRY_GET, i};
+	uint8_t answer[FRAME_MAX_PAYLOAD];
+	int len = transact(cmd, sizeof cmd, reply, 2, answer);
+	if (len < 0 || parse_var(answer, len, &vars[i]) != 1) {
+		fprintf(stderr, "board %u: no answer\n", board);
+		return -1;
+	}
+
+	print_var(&vars[i]);
+	if (vars[i].flags & TELEMETRY_REFUSED) {
+		fprintf(stderr, "set: refused, %s\n", (vars[i].flags & TELEMETRY_WRITABLE) ? "out of range" : "not a tunable");
+		return -1;
+	}
+	return 0;
+}
+
+/* 'm' | static | free now | never touched | peaks, 16 bit each */
+static int cmd_mem(void)
+{
+	uint8_t cmd[] = {MEMSTAT_CMD};
+	uint8_t answer[FRAME_MAX_PAYLOAD];
+	int len = transact(cmd, sizeof cmd, cmd, 1, answer);
+	if (len < 7) {
+		fprintf(stderr, "board %u: no answer\n", board);
+		return -1;
+	}
+
+	static const char *labels[] = {"static", "free", "untouched"};
+	for (int i = 0; 1 + 2 * i + 1 < len; i++) {
+		unsigned v = (answer[1 + 2 * i] << 8) | answer[2 + 2 * i];
+		if (i < 3) printf("%-10s %10u\n", labels[i], v);
+		else printf("peak %-5d %10u\n", i - 3, v);
+	}
+	return 0;
+}
+
+/******************************************************************* Profiler ********************************************************************/
+
+struct function {
+	unsigned long start, end;           // flash byte addresses
+	const char *name;
+	double samples;
+};
+
+static int by_start(const void *a, const void *b)
+{
+	const struct function *x = a, *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+static int by_samples(const void *a, const void *b)
+{
+	const struct function *x = a, *y = b;
+	return (x->samples < y->samples) - (x->samples > y->samples);
+}
+
+/* Functions in an AVR ELF file, sorted by address. Returns their number,
+   -1 if the file can't be read. The names stay allocated. */
+static int load_functions(const char *file, struct function **out)
+{
+	FILE *f = fopen(file, "rb");
+	if (!f) {
+		fprintf(stderr, "prof: %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	int n = -1;
+	Elf32_Ehdr eh;
+	if (fread(&eh, sizeof eh, 1, f) == 1 && memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0 &&
+	    eh.e_ident[EI_CLASS] == ELFCLASS32 && eh.e_shentsize == sizeof(Elf32_Shdr)) {
+		Elf32_Shdr *sh = calloc(eh.e_shnum, sizeof *sh);
+		fseek(f, eh.e_shoff, SEEK_SET);
+		if (sh && fread(sh, sizeof *sh, eh.e_shnum, f) == eh.e_shnum) {
+			for (unsigned i = 0; i < eh.e_shnum && n < 0; i++) {
+				if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh.e_shnum) continue;
+				Elf32_Shdr *st = &sh[sh[i].sh_link];
+				char *strs = malloc(st->sh_size);
+				Elf32_Sym *syms = malloc(sh[i].sh_size);
+				size_t count = sh[i].sh_size / sizeof *syms;
+				struct function *fn = calloc(count + 1, sizeof *fn);
+				fseek(f, st->sh_offset, SEEK_SET);
+				size_t ok = fread(strs, 1, st->sh_size, f) == st->sh_size;
+				fseek(f, sh[i].sh_offset, SEEK_SET);
+				ok = ok && fread(syms, 1, sh[i].sh_size, f) == sh[i].sh_size;
+				n = 0;
+				for (size_t k = 0; ok && k < count; k++) {
+					if (ELF32_ST_TYPE(syms[k].st_info) != STT_FUNC || syms[k].st_size == 0) continue;
+					if (syms[k].st_value >= 0x800000 || syms[k].st_name >= st->sh_size) continue;     // RAM and EEPROM sit above flash
+					fn[n].start = syms[k].st_value;
+					fn[n].end = syms[k].st_value + syms[k].st_size;
+					fn[n].name = strs + syms[k].st_name;
+					n++;
+				}
+				free(syms);
+				qsort(fn, n, sizeof *fn, by_start);
+				*out = fn;
+			}
+		}
+		free(sh);
+	}
+	fclose(f);
+	if (n < 0) fprintf(stderr, "prof: %s: no symbol table\n", file);
+	return n;
+}
+
+/* 'p' 's' | running | shift | bins */
+static int prof_state(uint8_t op, unsigned *shift, unsigned *bins)
+{
+	uint8_t cmd[] = {PROFILE_CMD, op};
+	uint8_t reply[] = {PROFILE_CMD, PROFILE_STATE};
+	uint8_t answer[FRAME_MAX_PAYLOAD];
+	int len = transact(cmd, sizeof cmd, reply, 2, answer);
+	if (len < 6) {
+		fprintf(stderr, "board %u: no answer (built without PROFILE?)\n", board);
+		return -1;
+	}
+	*shift = answer[3];
+	*bins = (answer[4] << 8) | answer[5];
+	printf("profiler   %s, %u bins of %u bytes\n", answer[2] ? "running" : "stopped", *bins, 2u << *shift);
+	return 0;
+}
+
+/* Bin counts, split between the functions a bin overlaps by the bytes
+   each has in it */
+static int cmd_prof(int argc, char **argv)
+{
+	unsigned shift, bins;
+
+	if (argc == 2 && strcmp(argv[1], "start") == 0) return prof_state(PROFILE_START, &shift, &bins);
+	if (argc == 2 && strcmp(argv[1], "stop") == 0) return prof_state(PROFILE_STOP, &shift, &bins);
+
+	struct function *fn = NULL;
+	int nfn = 0;
+	int top = (argc > 2) ? atoi(argv[2]) : TOP_FUNCTIONS;
+	if (argc > 1 && (nfn = load_functions(argv[1], &fn)) < 0) return -1;
+
+	if (prof_state(PROFILE_STATE, &shift, &bins) != 0) {
+		free(fn);
+		return -1;
+	}
+
+	unsigned long *count = calloc(bins, sizeof *count);
+	unsigned long total = 0;
+	for (unsigned i = 0; i < bins; i += PROFILE_READ) {
+		uint8_t cmd[] = {PROFILE_CMD, PROFILE_READ_CMD, i};
+		uint8_t answer[FRAME_MAX_PAYLOAD];
+		int len = transact(cmd, sizeof cmd, cmd, 3, answer);
+		if (len < 3) {
+			fprintf(stderr, "board %u: no answer\n", board);
+			free(count);
+			free(fn);
+			return -1;
+		}
+		for (unsigned k = 0; 3 + 2 * k + 1 < (unsigned)len && i + k < bins; k++) {
+			count[i + k] = (answer[3 + 2 * k] << 8) | answer[4 + 2 * k];
+			total += count[i + k];
+		}
+	}
+	printf("samples    %lu\n", total);
+
+	unsigned long width = 2ul << shift;
+	if (nfn == 0) {
+		for (unsigned i = 0; i < bins; i++) {
+			if (count[i] == 0) continue;
+			printf("0x%05lx-0x%05lx %8lu %5.1f%%%s\n", i * width, (i + 1) * width - 1, count[i],
+				total ? 100.0 * count[i] / total : 0.0, count[i] == 0xFFFF ? "  full" : "");
+		}
+	} else {
+		double unnamed = 0;
+		for (unsigned i = 0; i < bins; i++) {
+			if (count[i] == 0) continue;
+			unsigned long lo = i * width, hi = lo + width;
+			double left = count[i];
+			for (int k = 0; k < nfn && fn[k].start < hi; k++) {
+				unsigned long a = fn[k].start > lo ? fn[k].start : lo;
+				unsigned long b = fn[k].end < hi ? fn[k].end : hi;
+				if (a >= b) continue;
+				double share = count[i] * (double)(b - a) / width;
+				fn[k].samples += share;
+				left -= share;
+			}
+			if (left > 0.5) unnamed += left;
+		}
+		qsort(fn, nfn, sizeof *fn, by_samples);
+		for (int k = 0; k < nfn && k < top && fn[k].samples >= 0.5; k++) {
+			printf("%8.0f %5.1f%%  %s\n", fn[k].samples, total ? 100.0 * fn[k].samples / total : 0.0, fn[k].name);
+		}
+		if (unnamed >= 0.5) printf("%8.0f %5.1f%%  (between functions)\n", unnamed, total ? 100.0 * unnamed / total : 0.0);
+	}
+
+	free(count);
+	free(fn);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: linkshell [-b baud] [-a addr] port\n"
+		"commands: board N, list, get NAME, set NAME VALUE, mem, prof start|stop, prof [ELF [N]],\n"
+		"          help, quit\n");
+}
+
+/* Returns 0 on success, -1 on failure, 1 to quit */
+static int run(char *line)
+{
+	char *argv[4];
+	int argc = 0;
+
+	for (char *tok = strtok(line, " \t\r\n"); tok != NULL && argc < 4; tok = strtok(NULL, " \t\r\n")) {
+		argv[argc++] = tok;
+	}
+	if (argc == 0 || argv[0][0] == '#') return 0;
+
+	if (strcmp(argv[0], "quit") == 0 || strcmp(argv[0], "exit") == 0) return 1;
+	if (strcmp(argv[0], "help") == 0) {
+		usage();
+		return 0;
+	}
+	if (strcmp(argv[0], "board") == 0 && argc == 2) {
+		board = strtoul(argv[1], NULL, 0) & 0xFF;
+		nvars = -1;
+		return 0;
+	}
+	if (strcmp(argv[0], "list") == 0 && argc == 1) return cmd_list();
+	if (strcmp(argv[0], "get") == 0 && argc == 2) return cmd_get(argv[1]);
+	if (strcmp(argv[0], "set") == 0 && argc == 3) return cmd_set(argv[1], argv[2]);
+	if (strcmp(argv[0], "mem") == 0 && argc == 1) return cmd_mem();
+	if (strcmp(argv[0], "prof") == 0) return cmd_prof(argc, argv);
+
+	fprintf(stderr, "%s: unknown command or wrong arguments\n", argv[0]);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	long baud = 9600;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:a:h")) != -1) {
+		switch (opt) {
+			case 'b': baud = strtol(optarg, NULL, 10); break;
+			case 'a': board = strtoul(optarg, NULL, 0) & 0xFF; break;
+			default: usage(); return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+		return 2;
+	}
+
+	port = open_port(argv[optind], baud);
+	if (port < 0) return 2;
+
+	bool interactive = isatty(STDIN_FILENO);
+	int rc = 0;
+	char line[256];
+
+	while (1) {
+		if (interactive) {
+			printf("board %u> ", board);
+			fflush(stdout);
+		}
+		if (fgets(line, sizeof line, stdin) == NULL) break;
+
+		int r = run(line);
+		if (r > 0) break;
+		if (r < 0) rc = 1;
+		fflush(stdout);
+	}
+
+	close(port);
+	return interactive ? 0 : rc;
+}
@@ -0,0 +1,340 @@
+/*
+ * Small MQTT 3.1.1 broker to test the uplink without installing one:
+ * MainBoard built with UPLINK_MQTT, Bridge/ and whatever else talks MQTT.
+ *
+ *   mqttbroker [-p PORT] [-v]
+ *
+ * QoS 0 and 1, + and # in filters, clean sessions only: nothing is kept
+ * for a client after it has gone, no retained messages, no wills. A QoS 1
+ * PUBLISH is acknowledged once it has been queued to every subscriber and
+ * goes to each at the lower of the two QoS; their PUBACKs are taken and
+ * nothing is sent again. A client that says nothing for one and a half
+ * times its keep-alive is dropped, as the spec asks.
+ *
+ * One thread, epoll, non-blocking sockets.
+ */
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define MQTT_MAX_PACKET 4096
+#include "../../Common/mqtt.h"
+
+namespace {
+
+typedef uint64_t ns_t;
+
+const ns_t SEC = 1000000000;
+
+struct Options {
+	int port = MQTT_PORT;
+	bool verbose = false;
+};
+
+Options opt;
+
+ns_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ns_t)ts.tv_sec * SEC + ts.tv_nsec;
+}
+
+/******************************************************************* Clients ********************************************************************/
+
+struct Filter {
+	std::string topic;
+	uint8_t qos;
+};
+
+struct Client {
+	int fd;
+	std::string id;                         // empty until CONNECT
+	mqtt_parser parser = {};
+	std::string out;                        // not written yet
+	std::vector<Filter> filters;
+	uint16_t next_id = 0;
+	ns_t keepalive = 0;
+	ns_t heard = 0;                         // last packet in
+};
+
+std::map<int, std::unique_ptr<Client>> clients;
+int epfd = -1;
+
+void drop(Client &c, const char *why)
+{
+	int fd = c.fd;
+	if (opt.verbose) std::fprintf(stderr, "mqttbroker: %s %s\n", c.id.empty() ? "(no CONNECT)" : c.id.c_str(), why);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+	clients.erase(fd);                      // c is gone after this
+}
+
+/* Writes what it can, the rest when the socket says EPOLLOUT */
+bool flush(Client &c)
+{
+	while (!c.out.empty()) {
+		ssize_t n = write(c.fd, c.out.data(), c.out.size());
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) break;
+		if (n <= 0) return false;
+		c.out.erase(0, n);
+	}
+	epoll_event ev = {};
+	ev.events = EPOLLIN | (c.out.empty() ? 0 : EPOLLOUT);
+	ev.data.fd = c.fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+	return true;
+}
+
+void queue(Client &c, const uint8_t *p, size_t n)
+{
+	c.out.append((const char *)p, n);
+}
+
+/* "a/+/c" and "a/#" against a topic */
+bool matches(const std::string &filter, const std::string &topic)
+{
+	size_t f = 0, t = 0;
+	while (f < filter.size()) {
+		if (filter[f] == '#') return true;
+		size_t fe = filter.find('/', f), te = topic.find('/', t);
+		if (fe == std::string::npos) fe = filter.size();
+		if (te == std::string::npos) te = topic.size();
+		if (t > topic.size()) return false;
+		if (filter.compare(f, fe - f, "+") != 0 && filter.compare(f, fe - f, topic, t, te - t) != 0) return false;
+		f = fe + 1;
+		t = te + 1;
+		if (f > filter.size()) return t > topic.size();
+	}
+	return t > topic.size();
+}
+
+void route(const std::string &topic, const uint8_t *payload, uint16_t len, uint8_t qos)
+{
+	std::vector<uint8_t> out(5 + 2 + topic.size() + 2 + len);
+	for (auto &entry : clients) {
+		Client &c = *entry.second;
+		uint8_t best = 0xFF;
+		for (const Filter &f : c.filters) {
+			if (matches(f.topic, topic)) best = (best == 0xFF) ? f.qos : std::max(best, f.qos);
+		}
+		if (best == 0xFF) continue;
+
+		uint8_t q = std::min(best, qos);
+		if (q && ++c.next_id == 0) c.next_id = 1;
+		size_t n = mqtt_publish(out.data(), q ? MQTT_QOS1 : 0, c.next_id, topic.c_str(), payload, len);
+		queue(c, out.data(), n);
+	}
+}
+
+/******************************************************************* Packets ********************************************************************/
+
+/* False if the client is to be dropped */
+bool packet(Client &c)
+{
+	mqtt_parser &p = c.parser;
+	uint8_t out[8];
+	uint8_t type = p.header & 0xF0;
+
+	if (c.id.empty() && type != MQTT_CONNECT) return false;
+
+	switch (type) {
+		case MQTT_CONNECT: {
+			if (!c.id.empty() || p.len < 12 || std::memcmp(p.body, "\0\4MQTT", 6) != 0) return false;
+			uint16_t keepalive = (p.body[8] << 8) | p.body[9];
+			uint16_t id_len = (p.body[10] << 8) | p.body[11];
+			if (12u + id_len > p.len) return false;
+			c.id = id_len ? std::string((const char *)p.body + 12, id_len) : "client" + std::to_string(c.fd);
+			c.keepalive = keepalive * SEC;
+
+			/* a second connection with the same ID takes over */
+			for (auto &entry : clients) {
+				Client &o = *entry.second;
+				if (&o != &c && o.id == c.id) {
+					o.out.clear();
+					shutdown(o.fd, SHUT_RDWR);
+				}
+			}
+			queue(c, out, mqtt_connack(out, p.body[6] == 4 ? 0 : 1));
+			if (opt.verbose) std::printf("%s connected\n", c.id.c_str());
+			return p.body[6] == 4;
+		}
+
+		case MQTT_SUBSCRIBE & 0xF0: {
+			if (p.header != MQTT_SUBSCRIBE || p.len < 2) return false;
+			std::string ack;
+			ack += (char)p.body[0];
+			ack += (char)p.body[1];
+			for (uint32_t i = 2; i + 2 < p.len; ) {
+				uint16_t len = (p.body[i] << 8) | p.body[i + 1];
+				if (i + 2 + len + 1 > p.len) return false;
+				std::string topic((const char *)p.body + i + 2, len);
+				uint8_t qos = std::min<uint8_t>(p.body[i + 2 + len] & 3, 1);
+				c.filters.erase(std::remove_if(c.filters.begin(), c.filters.end(),
+					[&](const Filter &f) { return f.topic == topic; }), c.filters.end());
+				c.filters.push_back(Filter{ topic, qos });
+				ack += (char)qos;
+				i += 2 + len + 1;
+				if (opt.verbose) std::printf("%s subscribed to %s\n", c.id.c_str(), topic.c_str());
+			}
+			uint8_t head[5];
+			queue(c, head, mqtt_header(head, MQTT_SUBACK, ack.size()));
+			c.out += ack;
+			return true;
+		}
+
+		case MQTT_PUBLISH: {
+			const char *topic;
+			const uint8_t *payload;
+			uint16_t topic_len, len, id;
+			if ((p.header & 0x06) == 0x06 || !mqtt_publish_parts(&p, &topic, &topic_len, &payload, &len, &id)) return false;
+			if (p.header & 0x04) return false;  // QoS 2 is not offered
+			std::string t(topic, topic_len);
+			if (opt.verbose) std::printf("%s -> %s \"%.*s\"\n", c.id.c_str(), t.c_str(), (int)len, (const char *)payload);
+			route(t, payload, len, (p.header & MQTT_QOS1) ? 1 : 0);
+			if (p.header & MQTT_QOS1) queue(c, out, mqtt_ack(out, MQTT_PUBACK, id));
+			return true;
+		}
+
+		case MQTT_PUBACK:
+		return true;
+
+		case MQTT_PINGREQ:
+		queue(c, out, mqtt_empty(out, MQTT_PINGRESP));
+		return true;
+
+		case MQTT_DISCONNECT:
+		return false;
+	}
+	return false;                           // anything else isn't expected from a client
+}
+
+/******************************************************************* Main ********************************************************************/
+
+[[noreturn]] void usage()
+{
+	std::fprintf(stderr,
+		"usage: mqttbroker [options]\n"
+		"  -p PORT   listen on this port (1883)\n"
+		"  -v        print connections, subscriptions and every message\n");
+	std::exit(2);
+}
+
+int listen_on(int port)
+{
+	int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1, zero = 0;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof zero);
+
+	sockaddr_in6 addr = {};
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	if (bind(fd, (sockaddr *)&addr, sizeof addr) != 0 || listen(fd, 64) != 0) {
+		std::perror("mqttbroker: listen");
+		std::exit(1);
+	}
+	return fd;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	while ((c = getopt(argc, argv, "p:vh")) != -1) {
+		switch (c) {
+			case 'p': opt.port = std::atoi(optarg); break;
+			case 'v': opt.verbose = true; break;
+			default: usage();
+		}
+	}
+	if (optind != argc) usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	int server = listen_on(opt.port);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = server;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, server, &ev);
+	std::fprintf(stderr, "mqttbroker: listening on %d\n", opt.port);
+
+	for (;;) {
+		epoll_event events[64];
+		int n = epoll_wait(epfd, events, 64, 1000);
+		ns_t t = now_ns();
+
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == server) {
+				int cfd;
+				while ((cfd = accept4(server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					int one = 1;
+					setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+					auto client = std::make_unique<Client>();
+					client->fd = cfd;
+					client->heard = t;
+					ev.events = EPOLLIN;
+					ev.data.fd = cfd;
+					epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev);
+					clients[cfd] = std::move(client);
+				}
+				continue;
+			}
+
+			auto found = clients.find(fd);
+			if (found == clients.end()) continue;
+			Client &cl = *found->second;
+
+			if (events[i].events & EPOLLIN) {
+				uint8_t buf[4096];
+				ssize_t r = read(fd, buf, sizeof buf);
+				if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+					drop(cl, "closed");
+					continue;
+				}
+				bool ok = true;
+				for (ssize_t j = 0; j < r && ok; j++) {
+					if (mqtt_parse(&cl.parser, buf[j])) {
+						cl.heard = t;
+						ok = packet(cl);
+					}
+				}
+				if (!ok) {
+					flush(cl);                  // a refusing CONNACK goes out first
+					drop(cl, "dropped");
+					continue;
+				}
+			}
+		}
+
+		/* everything queued in this pass, to every client */
+		std::vector<Client *> gone;
+		for (auto &entry : clients) {
+			Client &cl = *entry.second;
+			if (!flush(cl)) gone.push_back(&cl);
+			else if (cl.keepalive && t - cl.heard > cl.keepalive * 3 / 2) gone.push_back(&cl);
+		}
+		for (Client *cl : gone) drop(*cl, "timed out or gone");
+	}
+}
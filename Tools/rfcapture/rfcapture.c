@@ -0,0 +1,508 @@
+/*
+ * Records RFReceiver's raw sample stream into a capture file.
+ *
+ *   rfcapture [-b baud] [-a addr] [-m bits|adc] [-t s] /dev/ttyUSB0 out.rfc
+ *   rfcapture -i link.bin [-a addr] out.rfc
+ *   rfcapture -d [-v] in.rfc
+ *
+ * The first form switches capture on at reader addr over the link (the PC
+ * on an XBee or the wired bus, like Tools/linkshell), records until -t
+ * seconds have passed or ^C, and switches it off again. The second reads
+ * bytes recorded off the link instead, e.g. the simulator's --link-log.
+ * The third prints a file: its settings and bursts, with -v the samples.
+ *
+ * The frames are described in RFReceiver's Raw Capture section, the file
+ * format in README.md.
+ *
+ * Exits 1 if the reader never answered or nothing was recorded, 2 on a
+ * usage, port or file error.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../Common/frame.h"
+
+/* Kept in step with RFReceiver/RFReceiver/main.c */
+#define CAPTURE_CMD         'c'
+#define CAPTURE_BITS        'b'
+#define CAPTURE_ADC         'a'
+#define CAPTURE_START       'S'
+#define CAPTURE_STOP        'E'
+
+#define REPLY_MS            300
+#define WAIT_S              30          // for the reader to wake up, a tag has to come near it
+#define RUN_MAX             (1 << 20)   // bytes of samples in one data record at most
+
+/******************************************************************* File format ********************************************************************/
+
+/* Little endian throughout, see README.md */
+#define RFC_MAGIC           "RFC1"
+#define RFC_HEADER          32
+
+#define REC_START           'S'         // index, board ms
+#define REC_STOP            'E'         // index
+#define REC_DATA            'D'         // index, count, samples
+#define REC_LOST            'L'         // index, count
+
+struct settings {
+	uint8_t mode;
+	uint8_t reader;
+	uint16_t f_cpu_khz;
+	uint16_t sample_top;
+	uint16_t sample_prescale;
+	uint8_t carrier_top;
+	uint16_t overruns;
+	uint64_t started;                   // unix time, 0 if not recorded live
+};
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | ((uint32_t)get16(p + 2) << 16); }
+static uint32_t be32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3]; }
+
+static uint32_t sample_ns(const struct settings *s)
+{
+	if (s->f_cpu_khz == 0) return 0;
+	return (uint64_t)(s->sample_top + 1) * s->sample_prescale * 1000000 / s->f_cpu_khz;
+}
+
+static uint32_t carrier_hz(const struct settings *s)
+{
+	return (uint32_t)s->f_cpu_khz * 1000 / (2 * (s->carrier_top + 1));
+}
+
+static void header_encode(uint8_t h[RFC_HEADER], const struct settings *s)
+{
+	memset(h, 0, RFC_HEADER);
+	memcpy(h, RFC_MAGIC, 4);
+	h[4] = s->mode;
+	h[5] = s->reader;
+	put16(h + 6, s->f_cpu_khz);
+	put16(h + 8, s->sample_top);
+	put16(h + 10, s->sample_prescale);
+	h[12] = s->carrier_top;
+	put32(h + 16, sample_ns(s));
+	put32(h + 20, carrier_hz(s));
+	put32(h + 24, s->started);
+	put32(h + 28, s->started >> 32);
+}
+
+/******************************************************************* Recorder ********************************************************************/
+
+/* Chunks from the board are joined into one data record for as long as
+   their indexes run on without a gap */
+struct recorder {
+	FILE *f;
+	const char *path;
+	struct settings s;
+	bool have_settings;
+
+	bool in_burst;
+	uint32_t expected;                  // index the next chunk should start at
+	uint32_t run_index;
+	uint32_t run_count;
+	uint8_t *run;
+	size_t run_bytes;
+
+	unsigned frames, bursts, gaps;
+	unsigned long samples, lost;
+};
+
+static void record(struct recorder *r, uint8_t type, uint32_t a, uint32_t b, int words)
+{
+	uint8_t rec[9] = {type};
+	put32(rec + 1, a);
+	put32(rec + 5, b);
+	fwrite(rec, 1, 1 + 4 * words, r->f);
+}
+
+static void flush_run(struct recorder *r)
+{
+	if (r->run_count == 0) return;
+
+	size_t bytes = (r->s.mode == CAPTURE_BITS) ? (r->run_count + 7) / 8 : r->run_count;
+	record(r, REC_DATA, r->run_index, r->run_count, 2);
+	fwrite(r->run, 1, bytes, r->f);
+	r->samples += r->run_count;
+	r->run_count = 0;
+	r->run_bytes = 0;
+}
+
+static void chunk(struct recorder *r, uint8_t kind, uint32_t index, const uint8_t *data, uint8_t len)
+{
+	r->frames++;
+
+	if (kind == CAPTURE_START) {
+		flush_run(r);
+		record(r, REC_START, index, (len >= 4) ? be32(data) : 0, 2);
+		r->in_burst = true;
+		r->expected = index;
+		r->bursts++;
+		return;
+	}
+	if (kind == CAPTURE_STOP) {
+		if (r->run_count != 0 && index >= r->run_index && index - r->run_index < r->run_count) {
+			r->run_count = index - r->run_index;        // the last byte was only part filled
+		}
+		flush_run(r);
+		record(r, REC_STOP, index, 0, 1);
+		r->in_burst = false;
+		r->expected = index;
+		return;
+	}
+	if (kind != CAPTURE_BITS && kind != CAPTURE_ADC) return;
+
+	if (!r->have_settings && r->s.mode == 0) r->s.mode = kind;
+	if (kind != r->s.mode) return;                      // mode switched without a reply seen
+
+	if (index != r->expected || r->run_bytes + len > RUN_MAX) {
+		flush_run(r);
+		if (index > r->expected) {
+			record(r, REC_LOST, r->expected, index - r->expected, 2);
+			r->lost += index - r->expected;
+			r->gaps++;
+		}
+	}
+	if (r->run_count == 0) r->run_index = index;
+	memcpy(r->run + r->run_bytes, data, len);
+	r->run_bytes += len;
+
+	uint32_t n = (kind == CAPTURE_BITS) ? 8 * len : len;
+	r->run_count += n;
+	r->expected = index + n;
+}
+
+/* 'c' | mode | F_CPU kHz | TOP | prescaler | carrier TOP | overruns */
+static bool settings_reply(struct settings *s, const uint8_t *p, uint8_t len)
+{
+	if (len < 11 || p[0] != CAPTURE_CMD) return false;
+	s->mode = p[1];
+	s->f_cpu_khz = (p[2] << 8) | p[3];
+	s->sample_top = (p[4] << 8) | p[5];
+	s->sample_prescale = (p[6] << 8) | p[7];
+	s->carrier_top = p[8];
+	s->overruns = (p[9] << 8) | p[10];
+	return true;
+}
+
+/* Feeds link bytes in, returns true when a settings reply came by */
+static bool feed(struct recorder *r, struct frame_parser *parser, const uint8_t *buf, size_t n)
+{
+	bool reply = false;
+
+	for (size_t i = 0; i < n; i++) {
+		if (!frame_parse(parser, buf[i])) continue;
+		if (parser->addr != r->s.reader) continue;
+
+		if (parser->type == FRAME_CAPTURE && parser->len >= 5) {
+			chunk(r, parser->payload[0], be32(parser->payload + 1), parser->payload + 5, parser->len - 5);
+		}
+		if (parser->type == FRAME_TELEMETRY) {
+			struct settings s = r->s;
+			if (settings_reply(&s, parser->payload, parser->len) && s.mode != 0) {
+				r->s = s;
+				r->have_settings = true;
+				reply = true;
+			}
+		}
+	}
+	return reply;
+}
+
+static int recorder_open(struct recorder *r, const char *path, uint8_t reader)
+{
+	memset(r, 0, sizeof *r);
+	r->path = path;
+	r->s.reader = reader;
+	r->run = malloc(RUN_MAX + FRAME_MAX_PAYLOAD);
+	r->f = fopen(path, "wb");
+	if (r->f == NULL || r->run == NULL) {
+		fprintf(stderr, "rfcapture: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	uint8_t h[RFC_HEADER];
+	header_encode(h, &r->s);            // rewritten with the settings at the end
+	fwrite(h, 1, sizeof h, r->f);
+	return 0;
+}
+
+static int recorder_close(struct recorder *r)
+{
+	flush_run(r);
+
+	uint8_t h[RFC_HEADER];
+	header_encode(h, &r->s);
+	fseek(r->f, 0, SEEK_SET);
+	fwrite(h, 1, sizeof h, r->f);
+	if (fclose(r->f) != 0) {
+		fprintf(stderr, "rfcapture: %s: %s\n", r->path, strerror(errno));
+		return 2;
+	}
+	free(r->run);
+
+	fprintf(stderr, "%s: %u frames, %u bursts, %lu samples, %lu lost in %u gaps, %u overruns on the board\n",
+	        r->path, r->frames, r->bursts, r->samples, r->lost, r->gaps, r->s.overruns);
+	if (!r->have_settings) fprintf(stderr, "%s: no settings reply seen, timing fields are 0\n", r->path);
+	return (r->samples == 0) ? 1 : 0;
+}
+
+/******************************************************************* Live capture ********************************************************************/
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static speed_t baud_constant(long baud)
+{
+	switch (baud) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+#ifdef B76800
+		case 76800: return B76800;
+#endif
+		default: return 0;
+	}
+}
+
+static int open_port(const char *path, long baud)
+{
+	speed_t speed = baud_constant(baud);
+	if (speed == 0) {
+		fprintf(stderr, "rfcapture: unsupported baud rate %ld\n", baud);
+		return -1;
+	}
+
+	int fd = open(path, O_RDWR | O_NOCTTY);
+	struct termios t;
+	if (fd < 0 || tcgetattr(fd, &t) != 0) {
+		fprintf(stderr, "rfcapture: %s: %s\n", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	cfmakeraw(&t);
+	t.c_cflag |= CLOCAL | CREAD;
+	t.c_cc[VMIN] = 0;
+	t.c_cc[VTIME] = 0;
+	cfsetispeed(&t, speed);
+	cfsetospeed(&t, speed);
+	tcsetattr(fd, TCSANOW, &t);
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void send_mode(int fd, uint8_t reader, uint8_t mode, uint8_t seq)
+{
+	uint8_t payload[] = {CAPTURE_CMD, mode};
+	uint8_t frame[FRAME_MAX_SIZE];
+	uint8_t n = frame_encode(frame, reader, FRAME_COMMAND, seq, payload, sizeof payload);
+	if (write(fd, frame, n) != n) perror("rfcapture: write");
+}
+
+static int live(const char *port_path, long baud, uint8_t reader, uint8_t mode, double seconds, const char *out)
+{
+	int fd = open_port(port_path, baud);
+	if (fd < 0) return 2;
+
+	struct recorder r;
+	if (recorder_open(&r, out, reader) != 0) return 2;
+	r.s.started = time(NULL);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	struct frame_parser parser = {0};
+	uint8_t seq = 0;
+	long wait_until = now_ms() + WAIT_S * 1000L;
+	long end = 0;
+	long next_try = 0;
+
+	fprintf(stderr, "waiting for reader %u, hold a tag near it\n", reader);
+	while (!stop) {
+		long now = now_ms();
+		if (end == 0 && now >= wait_until) break;
+		if (end != 0 && seconds > 0 && now >= end) break;
+		if (end == 0 && now >= next_try) {
+			send_mode(fd, reader, mode, seq++);
+			next_try = now + REPLY_MS;
+		}
+
+		struct pollfd p = { .fd = fd, .events = POLLIN };
+		if (poll(&p, 1, 50) <= 0) continue;
+
+		uint8_t buf[256];
+		ssize_t got = read(fd, buf, sizeof buf);
+		if (got <= 0) continue;
+		if (feed(&r, &parser, buf, got) && end == 0) {
+			fprintf(stderr, "recording, %.1f us per sample, carrier %u Hz\n", sample_ns(&r.s) / 1000.0, carrier_hz(&r.s));
+			end = now + (long)(seconds * 1000);
+		}
+	}
+
+	/* Off again; the stop marker and the last chunks come in meanwhile */
+	for (int i = 0; i < 3; i++) {
+		send_mode(fd, reader, 0, seq++);
+		long until = now_ms() + REPLY_MS;
+		for (long left; (left = until - now_ms()) > 0; ) {
+			struct pollfd p = { .fd = fd, .events = POLLIN };
+			if (poll(&p, 1, left) <= 0) break;
+			uint8_t buf[256];
+			ssize_t got = read(fd, buf, sizeof buf);
+			if (got > 0) feed(&r, &parser, buf, got);
+		}
+	}
+	close(fd);
+
+	if (end == 0) fprintf(stderr, "reader %u never answered\n", reader);
+	return recorder_close(&r);
+}
+
+static int convert(const char *log, uint8_t reader, const char *out)
+{
+	FILE *in = fopen(log, "rb");
+	if (in == NULL) {
+		fprintf(stderr, "rfcapture: %s: %s\n", log, strerror(errno));
+		return 2;
+	}
+
+	struct recorder r;
+	if (recorder_open(&r, out, reader) != 0) return 2;
+
+	struct frame_parser parser = {0};
+	uint8_t buf[4096];
+	size_t got;
+	while ((got = fread(buf, 1, sizeof buf, in)) > 0) {
+		feed(&r, &parser, buf, got);
+	}
+	fclose(in);
+	return recorder_close(&r);
+}
+
+/******************************************************************* Dump ********************************************************************/
+
+static int dump(const char *path, bool verbose)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t h[RFC_HEADER];
+	if (f == NULL || fread(h, 1, sizeof h, f) != sizeof h || memcmp(h, RFC_MAGIC, 4) != 0) {
+		fprintf(stderr, "rfcapture: %s: not a capture file\n", path);
+		if (f) fclose(f);
+		return 2;
+	}
+
+	uint8_t mode = h[4];
+	uint64_t started = get32(h + 24) | ((uint64_t)get32(h + 28) << 32);
+	printf("reader %u, %s, F_CPU %u kHz, TOP %u /%u = %.3f us per sample, carrier %u Hz (TOP %u)\n",
+	       h[5], (mode == CAPTURE_BITS) ? "sliced bits" : (mode == CAPTURE_ADC) ? "ADC >> 2" : "unknown mode",
+	       get16(h + 6), get16(h + 8), get16(h + 10), get32(h + 16) / 1000.0, get32(h + 20), h[12]);
+	if (started) {
+		time_t t = started;
+		printf("recorded %s", ctime(&t));
+	}
+
+	int type;
+	uint8_t w[8];
+	while ((type = fgetc(f)) != EOF) {
+		int words = (type == REC_STOP) ? 1 : 2;
+		if (fread(w, 4, words, f) != (size_t)words) break;
+		uint32_t a = get32(w), b = get32(w + 4);
+
+		switch (type) {
+			case REC_START: printf("start      %10u  board %u ms\n", a, b); break;
+			case REC_STOP:  printf("stop       %10u\n", a); break;
+			case REC_LOST:  printf("lost       %10u  %u samples\n", a, b); break;
+			case REC_DATA: {
+				size_t bytes = (mode == CAPTURE_BITS) ? (b + 7) / 8 : b;
+				printf("data       %10u  %u samples\n", a, b);
+				for (size_t i = 0; i < bytes; i++) {
+					int c = fgetc(f);
+					if (!verbose || c == EOF) continue;
+					if (mode == CAPTURE_BITS) {
+						for (int k = 7; k >= 0 && i * 8 + 7 - k < b; k--) putchar((c >> k) & 1 ? '1' : '0');
+						if (i % 8 == 7 || i + 1 == bytes) putchar('\n');
+					} else {
+						printf("%4d%s", c, (i % 16 == 15 || i + 1 == bytes) ? "\n" : "");
+					}
+				}
+				break;
+			}
+			default:
+			fprintf(stderr, "rfcapture: %s: bad record '%c'\n", path, type);
+			fclose(f);
+			return 2;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: rfcapture [-b baud] [-a addr] [-m bits|adc] [-t s] port out.rfc\n"
+		"       rfcapture -i link.bin [-a addr] out.rfc\n"
+		"       rfcapture -d [-v] in.rfc\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	long baud = 9600;
+	uint8_t reader = 1;
+	uint8_t mode = CAPTURE_BITS;
+	double seconds = 0;
+	const char *log = NULL;
+	bool show = false, verbose = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:a:m:t:i:dvh")) != -1) {
+		switch (opt) {
+			case 'b': baud = strtol(optarg, NULL, 10); break;
+			case 'a': reader = strtoul(optarg, NULL, 0); break;
+			case 'm':
+			if (strcmp(optarg, "bits") == 0) mode = CAPTURE_BITS;
+			else if (strcmp(optarg, "adc") == 0) mode = CAPTURE_ADC;
+			else usage();
+			break;
+			case 't': seconds = atof(optarg); break;
+			case 'i': log = optarg; break;
+			case 'd': show = true; break;
+			case 'v': verbose = true; break;
+			default: usage();
+		}
+	}
+
+	if (show) {
+		if (optind != argc - 1) usage();
+		return dump(argv[optind], verbose);
+	}
+	if (log != NULL) {
+		if (optind != argc - 1) usage();
+		return convert(log, reader, argv[optind]);
+	}
+	if (optind != argc - 2) usage();
+	return live(argv[optind], baud, reader, mode, seconds, argv[optind + 1]);
+}
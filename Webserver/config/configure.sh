@@ -1,13 +1,14 @@
 #!/bin/bash 
 apt-get update
 apt-get install apache2
-apt-get install libapache2-mod-wsgi
-apt-get install python-pip
-pip install flask
+apt-get install libapache2-mod-wsgi-py3
+apt-get install python3-pip
+pip3 install 'flask>=2.0'
+pip3 install pillow
 ln -sT ~/Senior-Design/webserver /var/www/html/flaskapp
 cp apache.conf /etc/apache2/sites-enabled/000-default.conf
 mkdir /data
-python create_database.py
+python3 create_database.py
 chown www-data /data /data/dogs.db
 apachectl restart
 echo "done configuting system"
@@ -1,9 +1,15 @@
-from flask import Flask, render_template, abort, g, redirect, url_for, request
+from flask import Flask, render_template, abort, g, redirect, url_for, request, send_from_directory
 from datetime import datetime, timedelta
+from PIL import Image, ImageOps
+import hashlib
+import os
 import sqlite3
+import threading
 import flask_login
 
-DATABASE = '/data/dogs.db'
+DATABASE = os.environ.get('DOGS_DB', '/data/dogs.db')     # another file for a local test instance
+PHOTOS = os.environ.get('DOGS_PHOTOS', '/data/photos')      # uploaded originals, looked up before static/
+THUMBNAILS = os.environ.get('DOGS_THUMBNAILS', '/data/thumbnails')
 
 login_manager = flask_login.LoginManager()
 
@@ -62,13 +68,7 @@ def logout():
 @flask_login.login_required
 def admin():
     if request.method == 'GET':
-        cur = get_db_connection().cursor()
-        matrix = [[]]
-        for row in cur.execute('SELECT rfid, adopted, image FROM dogs'):
-            if len(matrix[-1]) == 3:
-                matrix.append([row])
-            else:
-                matrix[-1].append(row)
+        matrix = adoption_grid(get_db_connection())[1]
         name = flask_login.current_user.id
         return render_template('admin.html', name = name, matrix = matrix)
 
@@ -76,19 +76,58 @@ def admin():
     new_rfid = request.form['new_rfid']
     connection = get_db_connection()
     cur = connection.cursor()
-    cur.execute('UPDATE dogs SET rfid=? WHERE rfid=?', (new_rfid, original_rfid))
+    cur.execute('UPDATE dogs SET rfid=?, version=version+1 WHERE rfid=?', (new_rfid, original_rfid))
     cur.close()
     connection.commit()
     return redirect(url_for("admin"))
 
 
+def connect():
+    database = sqlite3.connect(DATABASE, detect_types=sqlite3.PARSE_DECLTYPES)
+    database.execute('PRAGMA synchronous=NORMAL')   # enough with WAL, a power cut can lose the last commit but not corrupt
+    upgrade_schema(database)
+    return database
+
+
 def get_db_connection():
     database = getattr(g, '_database', None)
     if database is None:
-        database = g._database = sqlite3.connect(DATABASE, detect_types=sqlite3.PARSE_DECLTYPES)
+        database = g._database = connect()
     return database
 
 
+schema_checked = False
+schema_lock = threading.Lock()
+
+def upgrade_schema(database):
+    """Brings a database made by an older init_database.py up to date, once
+    per process: the version column, WAL so page views don't wait for scans
+    being written, an index on rfid, and the change counter."""
+    global schema_checked
+    with schema_lock:
+        if schema_checked:
+            return
+        columns = [row[1] for row in database.execute('PRAGMA table_info(dogs)')]
+        if 'version' not in columns:
+            database.execute('ALTER TABLE dogs ADD COLUMN version INTEGER NOT NULL DEFAULT 0')
+        database.execute('PRAGMA journal_mode=WAL')
+        database.executescript(SCHEMA_ADDITIONS)
+        database.commit()
+        schema_checked = True
+
+
+# Every write to dogs, from /add, the admin page or Gateway/, bumps
+# changes.n, so a cached page can be checked with one row read.
+SCHEMA_ADDITIONS = '''
+CREATE INDEX IF NOT EXISTS dogs_rfid ON dogs (rfid);
+CREATE TABLE IF NOT EXISTS changes (n INTEGER NOT NULL);
+INSERT INTO changes (n) SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM changes);
+CREATE TRIGGER IF NOT EXISTS dogs_updated AFTER UPDATE ON dogs BEGIN UPDATE changes SET n = n + 1; END;
+CREATE TRIGGER IF NOT EXISTS dogs_inserted AFTER INSERT ON dogs BEGIN UPDATE changes SET n = n + 1; END;
+CREATE TRIGGER IF NOT EXISTS dogs_deleted AFTER DELETE ON dogs BEGIN UPDATE changes SET n = n + 1; END;
+'''
+
+
 @app.teardown_appcontext
 def close_database_connection(exception):
     database = getattr(g, '_database', None)
@@ -106,35 +145,284 @@ def about_page():
     return render_template('about.html')
 
 
+# The grid of cards, three to a row, is only rebuilt after the table has
+# changed, and the adopt page is kept rendered as well. A photo can also be
+# replaced on disk without a write to the table, so the cache is keyed on
+# the mtimes of the grid's photos and of the directories they are looked up
+# in besides changes.n. A view between two scans is one read of changes.n
+# and a stat per photo.
+grid_cache = {'n': None, 'matrix': None, 'photos': (), 'version': None, 'page': None}
+grid_lock = threading.Lock()
+
+def photo_times(paths):
+    times = []
+    for path in paths:
+        try:
+            times.append(os.stat(path).st_mtime_ns)
+        except OSError:
+            times.append(None)
+    return tuple(times)
+
+
+def adoption_grid(database):
+    """(version, matrix) for the current table and photos."""
+    n = database.execute('SELECT n FROM changes').fetchone()[0]
+    with grid_lock:
+        cached = dict(grid_cache)
+    matrix, photos = cached['matrix'], cached['photos']
+    if cached['n'] != n:
+        matrix = [[]]
+        for row in database.execute('SELECT rfid, adopted, image FROM dogs'):
+            if len(matrix[-1]) == 3:
+                matrix.append([row])
+            else:
+                matrix[-1].append(row)
+        images = [image for matrix_row in matrix for _, _, image in matrix_row] + ['adopted']
+        photos = (PHOTOS, app.static_folder) + tuple(filter(None, map(find_photo, images)))
+    times = photo_times(photos)
+    latest = 'grid-%d-%s' % (n, hashlib.sha1(repr(times).encode()).hexdigest()[:12])
+    if latest != cached['version']:
+        with grid_lock:
+            grid_cache.update(n=n, matrix=matrix, photos=photos, version=latest, page=None)
+    return latest, matrix
+
+
 @app.route('/adopt.html')
 def adopt_page():
-    cur = get_db_connection().cursor()
-    matrix = [[]]
-    for row in cur.execute('SELECT rfid, adopted, image FROM dogs'):
-        if len(matrix[-1]) == 3:
-            matrix.append([row])
-        else:
-            matrix[-1].append(row)
-    cur.close()
-    return render_template('adopt.html', matrix=matrix)
+    version, matrix = adoption_grid(get_db_connection())
+    with grid_lock:
+        page = grid_cache['page'] if grid_cache['version'] == version else None
+    if page is None:
+        page = render_template('adopt.html', matrix=matrix)
+        with grid_lock:
+            if grid_cache['version'] == version:
+                grid_cache['page'] = page
+    # Revalidated on every view, so a reload with nothing changed is a 304.
+    response = app.make_response(page)
+    response.set_etag(version)
+    response.cache_control.no_cache = True
+    return response.make_conditional(request)
 
 
-@app.route('/add/<rfid>/<action>')
-def add_entry(rfid, action):
-    adopted = None
-    if action == 'a':
-        adopted = 1
-    elif action == 's':
-        adopted = 0
-    else:
-        abort(400, 'invalid action')
+# The cards show thumbnails instead of the originals, which run to 700 KB.
+# A thumbnail's name is the photo's name and a hash of its content, so a
+# URL never changes what it points to and browsers keep it for a year
+# without asking again. A thumbnail is made when its photo is uploaded, or
+# otherwise on the first request for it, and kept in THUMBNAILS.
+THUMBNAIL_SIZE = (640, 480)         # a card at twice its size on screen
+THUMBNAIL_QUALITY = 75
+THUMBNAIL_MAX_AGE = 365 * 24 * 3600
+PHOTO_EXTENSIONS = ('', '.jpg', '.jpeg', '.png')    # dogs.image may leave it out
+
+thumbnail_names = {}                # image -> (path, mtime, size, thumbnail name)
+thumbnail_lock = threading.Lock()
+
+def find_photo(image):
+    """Path of the original for a dogs.image value, None if there is none."""
+    if not image or os.path.basename(image) != image or image.startswith('.'):
+        return None
+    for directory in (PHOTOS, app.static_folder):
+        for extension in PHOTO_EXTENSIONS:
+            path = os.path.join(directory, image + extension)
+            if os.path.isfile(path):
+                return path
+    return None
+
+
+def thumbnail_name(image):
+    """'<image>-<hash>.jpg' for the photo as it is now, None without one.
+    The photo is only read again after its size or time changes."""
+    path = find_photo(image)
+    if path is None:
+        return None
+    stat = os.stat(path)
+    with thumbnail_lock:
+        cached = thumbnail_names.get(image)
+    if cached is not None and cached[:3] == (path, stat.st_mtime_ns, stat.st_size):
+        return cached[3]
+    digest = hashlib.sha1(repr((THUMBNAIL_SIZE, THUMBNAIL_QUALITY)).encode())
+    with open(path, 'rb') as photo:
+        for block in iter(lambda: photo.read(65536), b''):
+            digest.update(block)
+    name = '%s-%s.jpg' % (image, digest.hexdigest()[:16])
+    with thumbnail_lock:
+        thumbnail_names[image] = (path, stat.st_mtime_ns, stat.st_size, name)
+    return name
+
+
+def make_thumbnail(image, name):
+    """Writes THUMBNAILS/name from the photo unless it's there already,
+    under a temporary name first so that no request sees half a file."""
+    target = os.path.join(THUMBNAILS, name)
+    if os.path.isfile(target):
+        return
+    os.makedirs(THUMBNAILS, exist_ok=True)
+    with Image.open(find_photo(image)) as photo:
+        thumbnail = ImageOps.exif_transpose(photo).convert('RGB')
+    thumbnail.thumbnail(THUMBNAIL_SIZE, Image.LANCZOS)
+    temporary = '%s.%d.%d' % (target, os.getpid(), threading.get_ident())
+    thumbnail.save(temporary, 'JPEG', quality=THUMBNAIL_QUALITY, optimize=True, progressive=True)
+    os.replace(temporary, target)
+
+
+@app.template_global()
+def thumbnail_url(image):
+    name = thumbnail_name(image)
+    return url_for('thumbnail', name=name) if name else None
+
+
+@app.route('/thumbnails/<name>')
+def thumbnail(name):
+    image = name.rpartition('-')[0]
+    if name != thumbnail_name(image):   # an old hash, or no such photo
+        abort(404)
+    make_thumbnail(image, name)
+    response = send_from_directory(THUMBNAILS, name, max_age=THUMBNAIL_MAX_AGE, etag=name)
+    response.cache_control.public = True
+    response.cache_control.immutable = True
+    return response
+
+
+@app.route('/photo', methods=['POST'])
+@flask_login.login_required
+def upload_photo():
+    """A new photo for one dog from the admin page, kept in PHOTOS as
+    <rfid>.<extension>. The thumbnail is made here so that the first view
+    of the grid doesn't wait for it."""
+    rfid = request.form['rfid']
+    photo = request.files.get('photo')
+    extension = os.path.splitext(photo.filename)[1].lower() if photo else ''
+    if extension not in PHOTO_EXTENSIONS[1:] or os.path.basename(rfid) != rfid or rfid.startswith('.'):
+        abort(400, 'a .jpg or .png photo is needed')
+    image = rfid + extension
+    os.makedirs(PHOTOS, exist_ok=True)
+    temporary = os.path.join(PHOTOS, '.upload.%d.%d' % (os.getpid(), threading.get_ident()))
+    photo.save(temporary)
+    try:
+        with Image.open(temporary) as check:
+            check.verify()
+    except Exception:
+        os.remove(temporary)
+        abort(400, 'not an image')
+    os.replace(temporary, os.path.join(PHOTOS, image))
+    make_thumbnail(image, thumbnail_name(image))
+
     connection = get_db_connection()
-    cur = connection.cursor()
-    cur.execute('UPDATE dogs SET adopted=? WHERE rfid=?', (adopted, rfid))
-    cur.close()
+    connection.execute('UPDATE dogs SET image=? WHERE rfid=?', (image, rfid))
     connection.commit()
-    return 'OK\r\n'
+    return redirect(url_for('admin'))
+
+
+def status_reply(row, code=200):
+    """Body the readers parse: 'a' or 's', a space and the record version."""
+    adopted, version = row
+    return '%s %d\r\n' % ('a' if adopted else 's', version), code
 
 
+class ScanWriter(object):
+    """Applies the scans from /add on one thread with its own connection.
+    Scans that arrive while a transaction is being committed wait for the
+    next one and all go in together, so a burst from many readers costs one
+    commit instead of one each, and request threads never queue on the
+    database lock against each other."""
+
+    BATCH = 64                  # most scans in one transaction
+    TIMEOUT = 10                # s a request waits for its scan to be written
+
+    def __init__(self):
+        self.pending = []
+        self.wakeup = threading.Condition()
+        self.thread = None
+
+    def submit(self, rfid, action, version):
+        """Returns (row, code) as apply_scan() does, or None if it wasn't written in time."""
+        scan = {'args': (rfid, action, version), 'done': threading.Event(), 'result': None}
+        with self.wakeup:
+            # started in the process that serves requests, and again if it died
+            if self.thread is None or not self.thread.is_alive():
+                self.thread = threading.Thread(target=self.run, name='scan writer')
+                self.thread.daemon = True
+                self.thread.start()
+            self.pending.append(scan)
+            self.wakeup.notify()
+        scan['done'].wait(self.TIMEOUT)
+        return scan['result']
+
+    def run(self):
+        database = None
+        while True:
+            with self.wakeup:
+                while not self.pending:
+                    self.wakeup.wait()
+                batch, self.pending = self.pending[:self.BATCH], self.pending[self.BATCH:]
+            try:
+                if database is None:
+                    database = connect()
+                    database.isolation_level = None     # BEGIN and COMMIT below
+                if not self.write(database, batch) and len(batch) > 1:
+                    # one bad scan fails alone, the others go in by themselves
+                    for scan in batch:
+                        self.write(database, [scan])
+            except Exception:
+                app.logger.exception('scan writer: database unavailable')
+                database = None     # connected again for the next batch
+            for scan in batch:
+                scan['done'].set()
+
+    def write(self, database, batch):
+        """Applies batch in one transaction. False if a scan in it failed
+        and it was rolled back, raises if the transaction can't start."""
+        cur = database.cursor()
+        cur.execute('BEGIN IMMEDIATE')
+        try:
+            results = [apply_scan(cur, *scan['args']) for scan in batch]
+            cur.execute('COMMIT')
+        except Exception:
+            app.logger.exception('scan writer: %d scan(s) not written', len(batch))
+            cur.execute('ROLLBACK')
+            return False
+        for scan, result in zip(batch, results):
+            scan['result'] = result
+        return True
+
+scan_writer = ScanWriter()
+
+
+def apply_scan(cur, rfid, action, version):
+    """One scan inside the writer's transaction: (row, code), row None for
+    an unknown rfid."""
+    row = cur.execute('SELECT adopted, version FROM dogs WHERE rfid=?', (rfid,)).fetchone()
+    if row is None:
+        return None, 404
+    if version is not None and version != row[1]:
+        return row, 409
+
+    if action == 't':
+        adopted = 0 if row[0] else 1
+    else:
+        adopted = 1 if action == 'a' else 0
+    cur.execute('UPDATE dogs SET adopted=?, version=version+1 WHERE rfid=? AND version=?', (adopted, rfid, row[1]))
+    if cur.rowcount == 0:       # changed since the SELECT
+        return cur.execute('SELECT adopted, version FROM dogs WHERE rfid=?', (rfid,)).fetchone(), 409
+    return (adopted, row[1] + 1), 200
+
+
+# The server owns the status. action is 'a', 's' or 't' (toggle); with a
+# version the change only goes through if the record is still at that
+# version, otherwise the reply is 409 with the current status, so a reader
+# working from an old copy gets corrected instead of overwriting.
+@app.route('/add/<rfid>/<action>')
+@app.route('/add/<rfid>/<action>/<int:version>')
+def add_entry(rfid, action, version=None):
+    if action not in ('a', 's', 't'):
+        abort(400, 'invalid action')
+    result = scan_writer.submit(rfid, action, version)
+    if result is None:
+        abort(503, 'database busy')
+    row, code = result
+    if row is None:
+        abort(404, 'unknown rfid')
+    return status_reply(row, code)
+
 if __name__ == '__main__':
     app.run('0.0.0.0',80)
\ No newline at end of file